@@ -0,0 +1,84 @@
+#ifndef __INCLUDE_BATCH__
+#define __INCLUDE_BATCH__
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include "emulator.hpp"
+
+//プログラムから決めるメモリの大きさの最小値
+const uint32_t BATCH_DEFAULT_MEMORY_SIZE = 1024 * 1024;
+const uint32_t BATCH_DEFAULT_ESP = 0x7c00;
+
+//マニフェストの1行分
+//memory_sizeとentryが0なら、bin/emuと同じようにプログラムから決める
+typedef struct{
+    std::string program;
+    uint64_t memory_size;
+    uint32_t entry;
+    uint32_t esp;
+} BatchJob;
+
+//1回分の実行結果
+typedef struct{
+    //プログラムを読み込めなかったらfalse(他の値は無効)
+    bool loaded;
+    StopReason reason;
+    uint64_t instruction_count;
+    uint64_t cycle_count;
+    uint64_t wall_time_ns;
+    uint32_t eip;
+    uint32_t registers[REGISTERS_COUNT];
+    uint32_t fault_address;
+    //コンソール出力のバイト数とFNV-1aハッシュ(出力の比較用)
+    uint64_t output_size;
+    uint64_t output_hash;
+} BatchResult;
+
+//マニフェストのプログラムをスレッドプールで並列に実行する
+//ワーカーはそれぞれジョブのキューを持ち、自分の分が無くなったら他のワーカーのキューの反対側から盗む
+class batch_runner{
+private:
+    typedef struct{
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    } WorkerQueue;
+    
+    std::vector<BatchJob> jobs;
+    std::vector<BatchResult> results;
+    WorkerQueue *queues;
+    size_t queue_count;
+    
+    uint64_t max_instructions;
+    bool use_jit;
+    //NULLなら全部の命令を1サイクル
+    const CycleTable *cycle_table;
+    
+    bool _pop(size_t worker, size_t &job);
+    bool _steal(size_t worker, size_t &job);
+    void _worker(size_t worker);
+    void _run_job(size_t index);
+    bool _run_image(const BatchJob &job, const program_image &image, BatchResult &result);
+
+public:
+    batch_runner();
+    ~batch_runner();
+    
+    //1行に "program [memory_size [entry [esp]]]"。#から行末まではコメント
+    bool load_manifest(const char *filename);
+    void add(const BatchJob &job);
+    //run()が終わるまで呼び出し側で持っておく
+    void set_cycle_table(const CycleTable *table);
+    
+    //threadsが0ならCPUの数だけ
+    void run(unsigned threads, uint64_t max_instructions = UINT64_MAX, bool use_jit = false);
+    
+    const std::vector<BatchResult> &get_results();
+    //マニフェストの順に1行ずつ結果を書く
+    void write_results(FILE *out);
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __INCLUDE_CLOCK__
+#define __INCLUDE_CLOCK__
+
+#include <cstdint>
+
+//ゲストの仮想時間で、1サイクルのナノ秒(100MHzのCPUとみなす)
+const uint64_t NS_PER_CYCLE = 10;
+const uint64_t NS_PER_SECOND = 1000ULL * 1000 * 1000;
+const int CYCLE_TABLE_SIZE = 256;
+
+//オペコードごとの1命令のサイクル数。0x0Fに続くオペコードはtwo_byte
+//REPのストリング命令は1回繰り返すごとに足す
+typedef struct{
+    uint8_t one_byte[CYCLE_TABLE_SIZE];
+    uint8_t two_byte[CYCLE_TABLE_SIZE];
+} CycleTable;
+
+//全部の命令をcyclesにする
+void init_cycle_table(CycleTable &table, uint8_t cycles = 1);
+//1行に "opcode cycles" か "0f opcode cycles"(16進)。#から行末まではコメント。書かなかった命令は1
+bool load_cycle_table(const char *filename, CycleTable &table);
+
+//ゲストの仮想時間(ナノ秒)
+//実行した命令のサイクル数から求めるので、ホストの速さに関係なく同じプログラムは同じ時刻に同じことをする
+//hltなどで実行せずに待った時間はadvance()で足す
+class virtual_clock{
+private:
+    const uint64_t *cycle_count;
+    uint64_t skipped;
+
+public:
+    virtual_clock(const uint64_t *cycle_count){
+        this->cycle_count = cycle_count;
+        skipped = 0;
+    }
+    
+    uint64_t now() const{
+        return *cycle_count * NS_PER_CYCLE + skipped;
+    }
+    
+    void advance(uint64_t ns){
+        skipped += ns;
+    }
+    
+    //advance()で足した時間の合計(スナップショット用)
+    uint64_t get_skipped() const{
+        return skipped;
+    }
+    void set_skipped(uint64_t ns){
+        skipped = ns;
+    }
+    
+    //時刻timeに達するサイクル数(cycle_countの値)
+    uint64_t cycle_at(uint64_t time) const{
+        if(time <= skipped) return 0;
+        return (time - skipped + NS_PER_CYCLE - 1) / NS_PER_CYCLE;
+    }
+};
+
+#endif
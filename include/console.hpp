@@ -0,0 +1,66 @@
+#ifndef __INCLUDE_CONSOLE__
+#define __INCLUDE_CONSOLE__
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//コンソールの出力先
+enum ConsoleSink{
+    CONSOLE_STDOUT,
+    CONSOLE_FILE,
+    //メモリに溜めてホストから読む
+    CONSOLE_MEMORY,
+    CONSOLE_DISCARD
+};
+
+const size_t CONSOLE_BUFFER_SIZE = 4096;
+
+//ゲストのコンソール出力
+//出力はリングバッファに溜めて、改行・バッファが一杯・run()の終わりでまとめて書き出す
+//シリアルポート(uart)とBIOSのテレタイプ出力が書く
+class console{
+private:
+    ConsoleSink sink;
+    int fd;
+    FILE *file;
+    
+    char buffer[CONSOLE_BUFFER_SIZE];
+    size_t head;
+    size_t count;
+    
+    //CONSOLE_MEMORYの出力
+    std::vector<char> captured;
+    
+    //今の文字色(BIOSの色番号)。-1なら端末の既定の色
+    int attribute;
+    
+    void _put(char ch);
+    void _put_string(const char *str, size_t n);
+    void _reset_attribute();
+
+public:
+    console();
+    ~console();
+    
+    //CONSOLE_FILEのときはfilenameに書く
+    bool set_sink(ConsoleSink sink, const char *filename = NULL);
+    ConsoleSink get_sink();
+    
+    //そのまま1バイト出力する
+    void write(uint8_t ch);
+    //BIOSの色番号colorで1文字出力する。色のエスケープシーケンスは色が変わったときだけ出す
+    void write_color(uint8_t ch, uint8_t color);
+    //溜まっている出力を書き出す
+    void flush();
+    //色を既定に戻してから書き出す(run()の終わり)
+    void finish();
+    
+    //CONSOLE_MEMORYで溜めた出力。次に出力するまで有効
+    const char *get_output();
+    size_t get_output_size();
+    void clear_output();
+};
+
+#endif
@@ -5,14 +5,124 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
-
-const int bios_to_terminal[] = {30, 34 ,32, 36, 31, 35, 33, 37};
+#include <setjmp.h>
+#include <signal.h>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <mutex>
+#include "guest_memory.hpp"
+#include "modrm.hpp"
+#include "clock.hpp"
+#include "pic.hpp"
+#include "pit.hpp"
+#include "uart.hpp"
 
 const int INSTRUCTION_NUM = 256;
 const uint32_t CARRY_FLAG = 1;
 const uint32_t ZERO_FLAG = (1 << 6);
 const uint32_t SIGN_FLAG = (1 << 7);
+const uint32_t INTERRUPT_FLAG = (1 << 9);
+const uint32_t DIRECTION_FLAG = (1 << 10);
 const uint32_t OVERFLOW_FLAG = (1 << 11);
+//popfd/iretで書き換えられるフラグ(TFは無い)
+const uint32_t WRITABLE_FLAGS = 0x00000ED5;
+
+//割り込み: IDTのゲート(8バイト)の種類と、積むCSの値(セグメントは無いので固定)
+const uint8_t GATE_INTERRUPT32 = 0x0E;
+const uint8_t GATE_TRAP32 = 0x0F;
+const uint32_t GATE_PRESENT = (1 << 15);
+const uint32_t INTERRUPT_CODE_SEGMENT = 0x08;
+//cpuidのリーフ0のベンダー名と、リーフ1の値(Pentium相当のファミリー5。機能はTSCだけ)
+const char CPUID_VENDOR[] = "x86emu-guest";
+const uint32_t CPUID_SIGNATURE = 0x00000500;
+const uint32_t CPUID_FEATURE_TSC = (1 << 4);
+//UARTの受信割り込みが有効な間、入力のfdを見に行く間隔(仮想時間のナノ秒)
+const uint64_t INTERRUPT_POLL_INTERVAL = 1000 * 1000;
+
+//フラグの遅延評価: 最後にフラグを変更した演算
+enum FlagsOp{
+    //eflagsの値がそのまま正しい
+    FLAGS_NONE,
+    FLAGS_ADD32,
+    FLAGS_SUB32,
+    FLAGS_SUB8,
+    FLAGS_INC32,
+    FLAGS_DEC32,
+    //and/or/xor/test: CF=OF=0
+    FLAGS_LOGIC32,
+    FLAGS_LOGIC8
+};
+
+//デコード済み命令キャッシュ
+const uint32_t DECODE_PAGE_SHIFT = 12;
+const uint32_t DECODE_PAGE_SIZE = (1 << DECODE_PAGE_SHIFT);
+const uint32_t MAX_INSTRUCTION_LENGTH = 15;
+const uint32_t MAX_BLOCK_LENGTH = 64;
+
+//code_mapはアドレス空間全体分を確保し、その直後に書き込みのあったページのマップを置く
+const uint64_t CODE_MAP_SIZE = GUEST_ADDRESS_SPACE >> 3;
+const uint32_t DIRTY_PAGE_SHIFT = GUEST_PAGE_SHIFT;
+const uint32_t DIRTY_PAGE_SIZE = (1 << DIRTY_PAGE_SHIFT);
+const uint64_t DIRTY_MAP_SIZE = (GUEST_ADDRESS_SPACE >> DIRTY_PAGE_SHIFT) + 1;
+
+//この回数実行されたブロックをJITで翻訳する
+const uint32_t JIT_THRESHOLD = 64;
+const size_t JIT_CACHE_SIZE = 4 * 1024 * 1024;
+
+//メモリにもデバイスにも何も書かないループが、この回数同じ状態で先頭に戻ってきたら待ちに入る
+const uint32_t IDLE_LOOP_THRESHOLD = 8;
+
+//命令フォーマット(オペコードに続くバイト列)
+const uint8_t FORMAT_MODRM = (1 << 0);
+const uint8_t FORMAT_IMM8 = (1 << 1);
+const uint8_t FORMAT_IMM32 = (1 << 2);
+//基本ブロックの終端になる命令
+const uint8_t FORMAT_BRANCH = (1 << 3);
+//0x66プレフィックスに対応している命令
+const uint8_t FORMAT_OPERAND_SIZE = (1 << 4);
+//F6/F7: ModRMのregが0(test)のときだけ即値が続く
+const uint8_t FORMAT_GROUP3 = (1 << 5);
+//REP/REPE/REPNEプレフィックスに対応しているストリング命令
+const uint8_t FORMAT_STRING = (1 << 6);
+//LOCKプレフィックスに対応している命令(メモリのオペランドのときだけ)
+const uint8_t FORMAT_LOCK = (1 << 7);
+
+//Instruction.prefix
+const uint8_t PREFIX_OPERAND_SIZE = (1 << 0);
+//0x0Fで始まる2バイトのオペコード
+const uint8_t PREFIX_TWO_BYTE = (1 << 1);
+//F3(rep/repe)とF2(repne)
+const uint8_t PREFIX_REP = (1 << 2);
+const uint8_t PREFIX_REPNE = (1 << 3);
+//ブレークポイントで止める命令(JITは翻訳しない)
+const uint8_t PREFIX_BREAKPOINT = (1 << 4);
+//F0(lock)。読み書きはホストのアトミック命令で行う(JITは翻訳しない)
+const uint8_t PREFIX_LOCK = (1 << 5);
+
+//_run_blocks()/_step_block()に組み込む処理
+const uint32_t RUN_PROFILE = (1 << 0);
+const uint32_t RUN_TRACE = (1 << 1);
+
+//run()が戻った理由
+enum StopReason{
+    //eipが0になった
+    STOP_HALT,
+    //指定した命令数を実行した
+    STOP_BUDGET,
+    //run_until()のアドレスに到達した
+    STOP_BREAKPOINT,
+    STOP_UNIMPLEMENTED,
+    STOP_FAULT,
+    //div/idivの0除算・オーバーフロー
+    STOP_DIVIDE_ERROR,
+    //hltか進まないループで待っているが、起こすデバイスが無い
+    STOP_IDLE,
+    //割り込みのゲートが無い(実機ならトリプルフォールト)
+    STOP_SHUTDOWN,
+    //request_stop()で止めた
+    STOP_INTERRUPT
+};
 
 enum Register{
     EAX,
@@ -35,6 +145,8 @@ enum Register{
     BH = BL + 4
 };
 
+static_assert(MODRM_ZERO_REGISTER == REGISTERS_COUNT, "zero register must follow the registers");
+
 typedef struct{
     uint8_t mod;
     union {
@@ -44,55 +156,349 @@ typedef struct{
     uint8_t rm;
     
     uint8_t sib;
+    //disp8も符号拡張してdisp32に入れる
     union{
         int8_t disp8;
         uint32_t disp32;
     };
+    
+    //メモリのアドレス: registers[base] + (registers[index] << scale) + disp32
+    uint8_t base;
+    uint8_t index;
+    uint8_t scale;
 } ModRM;
 
+class emulator;
+class jit;
+class console;
+class uart;
+class pic;
+class pit;
+class io_bus;
+class profiler;
+class tracer;
+class program_image;
+
+typedef void (*InstructionHandler)(emulator *emu, const struct Instruction &inst);
+
+//1命令分のデコード結果
+typedef struct Instruction{
+    InstructionHandler handler;
+    ModRM modrm;
+    //imm8は符号拡張して格納
+    uint32_t imm;
+    uint8_t opecode;
+    uint8_t prefix;
+    //instruction_formatsの値(間接分岐ならFORMAT_BRANCHが足される)
+    uint8_t format;
+    //プレフィックスを含む
+    uint8_t length;
+} Instruction;
+
+//JITで翻訳したコードに渡すゲストの状態
+typedef struct{
+    uint32_t *registers;
+    uint32_t *eflags;
+    uint8_t *memory;
+    uint8_t *code_map;
+    //コードへの書き込みで途中で抜けたら1
+    uint32_t side_exit;
+    //メモリを触る命令の前に、ブロックの何番目の命令かを入れる(フォールトした命令を求める)
+    uint32_t instruction;
+} JitContext;
+
+//戻り値は次のeip
+typedef uint32_t (*JitFunction)(JitContext *context);
+
+//基本ブロック: 分岐命令で終わる命令列
+typedef struct Block{
+    uint32_t address;
+    //命令数とバイト数
+    uint32_t length;
+    uint32_t size;
+    Instruction *instructions;
+    //直接分岐の行き先(0:分岐先, 1:次の命令)と、つないだブロック
+    uint32_t successor_address[2];
+    struct Block *successors[2];
+    
+    uint32_t exec_count;
+    JitFunction native;
+    bool native_failed;
+    //メモリへの書き込みもoutも無い(アイドルループの判定用)
+    bool pure;
+    //全部の命令のサイクル数(REPの繰り返しの分は含まない)
+    uint32_t cycles;
+} Block;
+
+typedef struct{
+    Instruction instructions[DECODE_PAGE_SIZE];
+    Block *blocks[DECODE_PAGE_SIZE];
+} DecodedPage;
+
+//同じゲストのメモリで動くvCPU(emulator)の集まり
+//メモリと、命令のあるバイトのマップ(code_mapとdirty_map)を共有する。最後のvCPUが消えたら解放する
+typedef struct{
+    guest_memory *guest;
+    uint8_t *code_map;
+    //cpusとnext_indexはlockを取って触る
+    std::mutex lock;
+    std::vector<emulator *> cpus;
+    std::atomic<uint32_t> cpu_count;
+    uint32_t next_index;
+} CpuGroup;
+
+//snapshot()で保存したゲストの状態
+typedef struct{
+    //0はsnapshot()以外で作った状態
+    uint64_t id;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t registers[REGISTERS_COUNT];
+    uint64_t instruction_count;
+    //仮想時間、IDTと割り込みまわりのデバイスの状態を持っているか
+    //(トレースから作った状態は持たず、restore()しても今の値のまま)
+    bool has_devices;
+    uint64_t cycle_count;
+    //hltなどで待った時間(virtual_clock::advance()の合計)
+    uint64_t skipped_time;
+    uint64_t interrupt_count;
+    uint32_t idt_base;
+    uint16_t idt_limit;
+    PicChip pic_chips[2];
+    PitChannel pit_channels[PIT_CHANNELS];
+    UartState uart_state;
+    //触っていないページは持たない
+    sparse_buffer memory;
+} Snapshot;
+
 class emulator{
 friend class EmulatorTest;
+friend class EmulatorBench;
 private:
+    guest_memory *guest;
+    //guestの先頭。ゲストのアドレスをそのまま足してアクセスする
     uint8_t *memory;
+    uint64_t memory_size;
     uint32_t eip;
     uint32_t eflags;
-    uint32_t registers[REGISTERS_COUNT];
-    void (emulator::*instructions[INSTRUCTION_NUM])();
+    //末尾はアドレス計算用の常に0のレジスタ(MODRM_ZERO_REGISTER)
+    uint32_t registers[REGISTERS_COUNT + 1];
+    
+    //flags_opが FLAGS_NONE 以外なら、フラグはこの演算から求める
+    FlagsOp flags_op;
+    uint32_t flags_v1;
+    uint32_t flags_v2;
+    uint32_t flags_result;
+    
+    //実行した命令数
+    uint64_t instruction_count;
+    //実行した命令のサイクル数。仮想時間はここから求める
+    uint64_t cycle_count;
+    CycleTable cycle_table;
+    //cycle_tableの最大値(タイマーの期限までに実行できる命令数の見積もり用)
+    uint32_t max_cycles;
+    InstructionHandler instructions[INSTRUCTION_NUM];
+    uint8_t instruction_formats[INSTRUCTION_NUM];
+    //0x0Fに続くオペコード
+    InstructionHandler instructions_0f[INSTRUCTION_NUM];
+    uint8_t instruction_formats_0f[INSTRUCTION_NUM];
+    
+    //ページ数はメモリの大きさに合わせる。4GiBでも触ったページの分しか実メモリを使わない
+    DecodedPage **decoded_pages;
+    uint32_t decoded_page_count;
+    //作ったDecodedPageの番号(全部をなめずに済むように)
+    std::vector<uint32_t> decoded_page_list;
+    //命令が占めているバイトのビットマップ(書き込み時の無効化判定用)
+    uint8_t *code_map;
+    //ページごとに、最後のsnapshot()/restore()から書き込みがあれば1
+    uint8_t *dirty_map;
+    //dirty_mapがどのスナップショットからの差分か
+    uint64_t dirty_base;
+    uint64_t decode_cache_hits;
+    uint64_t decode_cache_misses;
+    
+    Block *current_block;
+    //current_blockの実行中の命令(途中で止まったら、その手前までを数える)
+    const Instruction *current_instruction;
+    //翻訳したコードで実行中のブロック(フォールトしたら、jit_context.instructionの命令で止まったことにする)
+    Block *native_block;
+    const Instruction *block_end;
+    bool blocks_stale;
+    uint64_t block_count;
+    uint64_t block_chain_hits;
+    
+    io_bus *bus;
+    profiler *profile;
+    tracer *trace;
+    //トレースする命令の実行中だけtraceと同じ
+    tracer *trace_writes;
+    console *console_device;
+    uart *serial;
+    pic *interrupt_controller;
+    pit *timer;
+    virtual_clock *clock;
+    
+    //lidtで設定する。limitが0ならIDTは無い
+    uint32_t idt_base;
+    uint16_t idt_limit;
+    //_run_blocks()はinstruction_countがこの値になったら、タイマーと割り込みを見る
+    //(命令数の上限かタイマーの期限の早い方。0にすると次のブロックの境目で見る)
+    //request_stop()が別のスレッドから0にするのでatomic(読み書きはrelaxedなら普通のmovになる)
+    std::atomic<uint64_t> event_check;
+    uint64_t run_limit;
+    uint64_t interrupt_count;
     
+    //request_stop()の要求と、待っているところを起こすパイプ
+    std::atomic<bool> stop_requested;
+    int stop_pipe[2];
+    //デコードした命令をブレークポイントの命令に差し替えるアドレス
+    std::set<uint32_t> breakpoints;
+    
+    CpuGroup *group;
+    //cpuidで見せるvCPUの番号(groupの中で作った順)
+    uint32_t cpu_index;
+    //他のvCPUが命令のあるところに書いた範囲(group->lockを取って触る)。次のブロックの境目でキャッシュから外す
+    std::vector<std::pair<uint32_t, uint32_t> > remote_writes;
+    std::atomic<bool> code_changed;
+    
+    jit *jit_compiler;
+    JitContext jit_context;
+    uint32_t jit_threshold;
+    
+    //アイドルループの判定: 先頭のアドレスと、前回そこに来たときの状態
+    uint32_t idle_address;
+    uint32_t idle_registers[REGISTERS_COUNT];
+    uint32_t idle_eflags;
+    uint64_t idle_version;
+    uint32_t idle_iterations;
+    //最後に起きたときのデバイスの状態
+    uint64_t woken_version;
+    uint64_t idle_waits;
+    
+    //メモリ外へのアクセスで戻ってくる場所と、アクセスしたアドレス
+    sigjmp_buf fault_jmp;
+    StopReason stop_reason;
+    uint32_t fault_address;
+    
+    void _init(CpuGroup *group, uint32_t init_eip, uint32_t init_esp);
+    static CpuGroup *_create_group(guest_memory *guest);
     void _init_instructions();
     
+    //メンバ関数のハンドラを普通の関数ポインタから呼べるようにする
+    template<void (emulator::*handler)(const Instruction &inst)>
+    static void _handler(emulator *emu, const Instruction &inst){
+        (emu->*handler)(inst);
+    }
+    //REPのストリング命令は、繰り返した回数だけサイクルを足す
+    template<void (emulator::*handler)(const Instruction &inst)>
+    static void _string_handler(emulator *emu, const Instruction &inst){
+        uint32_t count = emu->registers[ECX];
+        (emu->*handler)(inst);
+        if(inst.prefix & (PREFIX_REP | PREFIX_REPNE)) emu->_count_repeats(inst, count - emu->registers[ECX]);
+    }
+    
+    Instruction *_fetch_instruction(uint32_t address);
+    bool _decode(uint32_t address, Instruction &inst);
+    //このvCPUのキャッシュから外し、同じメモリの他のvCPUにも伝える
+    void _invalidate_code(uint32_t address, uint32_t size);
+    void _invalidate_decoded(uint32_t address, uint32_t size);
+    //他のvCPUが書き換えた命令をキャッシュから外す
+    void _sync_code();
+    
+    static void _install_fault_handler();
+    static void _fault_handler(int sig, siginfo_t *info, void *context);
+    [[noreturn]] void _stop(StopReason reason);
+    [[noreturn]] void _raise_fault(uint32_t address);
+    void _save_native_registers(const ucontext_t *context);
+    void _recover_fault(StopReason reason);
+    
+    bool _exec_instruction();
+    uint32_t _get_cycles(const Instruction &inst);
+    //blockの先頭からexecuted命令分のサイクル数
+    uint64_t _count_cycles(const Block *block, uint32_t executed);
+    void _count_repeats(const Instruction &inst, uint32_t repeated);
+    
+    Block *_lookup_block(uint32_t address);
+    Block *_build_block(uint32_t address);
+    Block *_next_block(Block *block);
+    void _exec_block(Block *block);
+    template<uint32_t hooks>
+    void _step_block(Block *block, uint64_t remaining, uint32_t until);
+    StopReason _run(uint64_t max_instructions, uint32_t until);
+    template<uint32_t hooks>
+    StopReason _run_blocks(uint64_t max_instructions, uint32_t until);
+    void _flush_blocks();
+    bool _is_pure(const Instruction &inst);
+    bool _is_idle_loop(Block *block);
+    //デバイスの状態が変わるかタイマーの期限までホストのスレッドを止める。起こすものが無ければfalse
+    bool _wait_event();
+    //タイマーとUARTの割り込みをPICへ伝える
+    void _update_interrupts();
+    //割り込みを受け付けたらtrue(eipが変わる)
+    bool _service_events();
+    //次のブロックの境目でタイマーと割り込みを見る
+    void _recheck_events(){
+        event_check.store(0, std::memory_order_relaxed);
+    }
+    void _clear_stop_request();
+    bool _has_gate(uint8_t vector);
+    void _interrupt(uint8_t vector);
+    void _compile_block(Block *block);
+    void _flush_native();
+    
     uint8_t _get_code8(uint32_t index);
     int8_t _get_sign_code8(uint32_t index);
     uint32_t _get_code32(uint32_t index);
     int32_t _get_sign_code32(uint32_t index);
     
-    void _parse_modrm(ModRM &modrm);
-    void _set_rm32(ModRM &modrm, uint32_t value);
-    void _set_rm8(ModRM &modrm, uint8_t value);
+    void _parse_modrm(ModRM &modrm, uint32_t address, uint32_t &index);
+    void _set_rm32(const ModRM &modrm, uint32_t value);
+    void _set_rm8(const ModRM &modrm, uint8_t value);
     
     void _set_register32(Register reg, uint32_t value);
     void _set_register8(Register reg, uint8_t value);
+    void _save_state(Snapshot &state);
+    void _mark_dirty(uint32_t address, uint32_t size);
+    bool _has_code(uint32_t address, uint32_t size);
     void _set_memory8(uint32_t address, uint8_t value);
+    void _set_memory16(uint32_t address, uint16_t value);
     void _set_memory32(uint32_t address, uint32_t value);
+    //アトミックな命令で書いた後に、_set_memory*()と同じ記録と無効化をする
+    void _locked_write(uint32_t address, uint32_t value, uint32_t size);
     uint8_t _get_memory8(uint32_t address);
+    uint16_t _get_memory16(uint32_t address);
     uint32_t _get_memory32(uint32_t address);
     
     uint32_t _get_register32(Register reg);
     uint8_t _get_register8(Register reg);
     
-    uint32_t _calc_memory_address(ModRM &modrm);
+    uint32_t _calc_memory_address(const ModRM &modrm);
     
-    uint32_t _get_r32(ModRM &modrm);
-    uint8_t _get_r8(ModRM &modrm);
-    void _set_r32(ModRM &modrm, uint32_t value);
-    void _set_r8(ModRM &modrm, uint8_t value);
-    uint32_t _get_rm32(ModRM &modrm);
-    uint8_t _get_rm8(ModRM &modrm);
+    uint32_t _get_r32(const ModRM &modrm);
+    uint8_t _get_r8(const ModRM &modrm);
+    void _set_r32(const ModRM &modrm, uint32_t value);
+    void _set_r8(const ModRM &modrm, uint8_t value);
+    uint32_t _get_rm32(const ModRM &modrm);
+    uint16_t _get_rm16(const ModRM &modrm);
+    uint8_t _get_rm8(const ModRM &modrm);
     
     void _push32(uint32_t value);
     uint32_t _pop32();
     
-    void _update_eflags_sub(uint32_t v1, uint32_t v2, uint64_t result);
+    void _update_eflags_add(uint32_t v1, uint32_t v2, uint32_t result);
+    void _update_eflags_sub(uint32_t v1, uint32_t v2, uint32_t result);
+    void _update_eflags_sub8(uint8_t v1, uint8_t v2, uint8_t result);
+    void _update_eflags_inc(uint32_t v1, uint32_t result);
+    void _update_eflags_dec(uint32_t v1, uint32_t result);
+    void _update_eflags_logic(uint32_t result);
+    void _update_eflags_logic8(uint8_t result);
+    //CF/OFだけを決める命令(mul/imul、シフト)用
+    void _update_eflags_carry_overflow(bool carry, bool overflow);
+    //group1(add, or, adc, sbb, and, sub, xor, cmp)の演算。フラグも更新する
+    uint32_t _alu32(uint8_t op, uint32_t v1, uint32_t v2);
+    //cmps/scasの比較(sizeは1, 2, 4バイト)
+    void _compare_string(uint32_t v1, uint32_t v2, uint32_t size);
+    void _materialize_eflags();
     
     void _set_carry(int flag);
     void _set_zero(int flag);
@@ -103,79 +509,219 @@ private:
     bool _is_zero();
     bool _is_sign();
     bool _is_overflow();
-    
-    uint8_t _io_in8(uint16_t address);
-    void _io_out8(uint16_t address, uint8_t value);
-    
+
+
 public:
-    emulator(uint32_t memory_size, uint32_t init_eip, uint32_t init_esp);
+    //memory_sizeをGUEST_ADDRESS_SPACEにすると、32bitのアドレス空間全体を疎に使う
+    emulator(uint64_t memory_size, uint32_t init_eip, uint32_t init_esp);
+    emulator(const memory_image &image, uint32_t init_eip, uint32_t init_esp);
+    //cpuと同じメモリで動くvCPUを作る。レジスタ・デバイス・デコードのキャッシュは別々に持つ
+    //それぞれのvCPUのrun()は別のスレッドから同時に呼べる
+    emulator(emulator &cpu, uint32_t init_eip, uint32_t init_esp);
     ~emulator();
     
     void dump_registers();
+    void dump_statistics();
     
-    void load_program(const char *filename, uint32_t size);
+    //フラットバイナリは0x7c00に置く。ELFはセグメントのアドレスに置く(eipは変えない)
+    bool load_program(const char *filename);
+    bool load_image(const program_image &image);
     bool exec();
+    StopReason run(uint64_t max_instructions = UINT64_MAX);
+    StopReason run_until(uint32_t address, uint64_t max_instructions = UINT64_MAX);
+    uint64_t get_instruction_count();
+    //実行した命令のサイクル数(hltなどで待った時間は含まない)
+    uint64_t get_cycle_count();
+    //NULLなら全部の命令を1サイクルにする
+    void set_cycle_table(const CycleTable *table);
+    
+    //デバッガ用。run()/exec()の外で呼ぶ
+    void set_register32(Register reg, uint32_t value);
+    void set_eip(uint32_t value);
+    uint32_t get_eflags();
+    void set_eflags(uint32_t value);
+    //メモリの外にかかればfalse
+    bool read_memory(uint32_t address, void *buffer, uint32_t size);
+    bool write_memory(uint32_t address, const void *buffer, uint32_t size);
+    //addressの命令を実行する前にSTOP_BREAKPOINTで止める(デコードした命令を差し替えるので、実行中の確認は無い)
+    void add_breakpoint(uint32_t address);
+    void remove_breakpoint(uint32_t address);
+    //実行中のrun()/run_until()を次のブロックの境目でSTOP_INTERRUPTで止める
+    //別のスレッドから呼べる。run()の外で呼べば次のrun()がすぐに止まる
+    void request_stop();
+    uint32_t get_eip();
+    //cpuidのEBX[31:24]で見せる番号。最初のvCPUが0
+    uint32_t get_cpu_index();
+    console *get_console();
+    //COM1(0x3F8)。入力は既定では読まない(set_input_fd()かpush_input()で渡す)
+    uart *get_uart();
+    //独自のデバイスはここにつなぐ
+    io_bus *get_io_bus();
+    //PIC(0x20, 0xA0)。独自のデバイスの割り込みはここへ上げる
+    //IRQ0はPIT(0x40〜0x43)、IRQ4はUART。割り込みはrun()/run_until()の中でだけ受け付ける
+    pic *get_pic();
+    
+    //プロファイラを使う。止めると結果も捨てる
+    void set_profile(bool enable);
+    profiler *get_profiler();
+    //run()/run_until()で実行する命令をtraceに記録してfilenameに書く。traceの解放は呼び出し側で行う
+    bool start_trace(tracer *trace, const char *filename);
+    void stop_trace();
+    uint32_t get_register32(Register reg);
+    //STOP_FAULTで止まったときにアクセスしたアドレス
+    uint32_t get_fault_address();
+    void set_jit(bool enable, uint32_t threshold = JIT_THRESHOLD);
+    
+    //今の状態を保存する。戻り値はdeleteで解放する
+    //メモリを他のvCPUと共有している間は使えない(NULL, false)
+    Snapshot *snapshot();
+    //snapshotの状態に戻す。直前のsnapshot()/restore()と同じものなら書き込んだページだけをコピーする
+    bool restore(const Snapshot *snapshot);
 
 private:
     //instructions
-    void _mov_r32_imm32();
-    void _short_jump();
-    void _near_jump();
+    void _mov_r32_imm32(const Instruction &inst);
+    void _short_jump(const Instruction &inst);
+    void _near_jump(const Instruction &inst);
     
     //mov with ModRM
-    void _mov_rm32_imm32();
-    void _mov_rm32_r32();
-    void _mov_r32_rm32();
+    void _mov_rm32_imm32(const Instruction &inst);
+    void _mov_rm32_r32(const Instruction &inst);
+    void _mov_r32_rm32(const Instruction &inst);
+    
+    void _add_rm32_r32(const Instruction &inst);
+    //opecode >> 3 がgroup1の演算
+    void _alu_rm32_r32(const Instruction &inst);
+    void _alu_r32_rm32(const Instruction &inst);
+    void _alu_eax_imm32(const Instruction &inst);
+    void _alu_rm32_imm(const Instruction &inst);
+    
+    void _code_83(const Instruction &inst);
+    void _sub_rm32_imm8(const Instruction &inst);
+    void _add_rm32_imm8(const Instruction &inst);
+    
+    void _code_f7(const Instruction &inst);
+    void _test_rm32_imm32(const Instruction &inst);
+    void _not_rm32(const Instruction &inst);
+    void _neg_rm32(const Instruction &inst);
+    void _mul_rm32(const Instruction &inst);
+    void _imul_rm32(const Instruction &inst);
+    void _div_rm32(const Instruction &inst);
+    void _idiv_rm32(const Instruction &inst);
+    [[noreturn]] void _divide_error(const Instruction &inst);
+    
+    void _imul_r32_rm32(const Instruction &inst);
+    void _imul_r32_rm32_imm(const Instruction &inst);
+    
+    //C0/C1/D0-D3: rol, ror, shl, shr, sar
+    void _code_shift(const Instruction &inst);
+    
+    void _code_ff(const Instruction &inst);
+    void _code_0f_01(const Instruction &inst);
+    void _rdtsc(const Instruction &inst);
+    void _cpuid(const Instruction &inst);
+    //0F AE: lfence, mfence, sfence
+    void _fence(const Instruction &inst);
+    void _breakpoint(const Instruction &inst);
+    void _inc_rm32(const Instruction &inst);
+    void _dec_rm32(const Instruction &inst);
+    void _call_rm32(const Instruction &inst);
+    void _jmp_rm32(const Instruction &inst);
+    void _push_rm32(const Instruction &inst);
     
-    void _add_rm32_r32();
+    void _push_r32(const Instruction &inst);
+    void _push_imm8(const Instruction &inst);
+    void _push_imm32(const Instruction &inst);
+    void _pop_r32(const Instruction &inst);
     
-    void _code_83();
-    void _sub_rm32_imm8(ModRM &modrm);
-    void _add_rm32_imm8(ModRM &modrm);
+    void _call_rel32(const Instruction &inst);
+    void _ret(const Instruction &inst);
     
-    void _code_ff();
-    void _inc_rm32(ModRM &modrm);
+    void _leave(const Instruction &inst);
     
-    void _push_r32();
-    void _push_imm8();
-    void _push_imm32();
-    void _pop_r32();
+    void _cmp_r32_rm32(const Instruction &inst);
+    void _cmp_rm32_imm8(const Instruction &inst);
+    void _cmp_rm8_r8(const Instruction &inst);
     
-    void _call_rel32();
-    void _ret();
+    void _test_rm8_r8(const Instruction &inst);
+    void _test_rm32_r32(const Instruction &inst);
+    void _test_al_imm8(const Instruction &inst);
+    void _test_eax_imm32(const Instruction &inst);
     
-    void _leave();
+    void _jc(const Instruction &inst);
+    void _jz(const Instruction &inst);
+    void _js(const Instruction &inst);
+    void _jo(const Instruction &inst);
+    void _jnc(const Instruction &inst);
+    void _jnz(const Instruction &inst);
+    void _jns(const Instruction &inst);
+    void _jno(const Instruction &inst);
     
-    void _cmp_r32_rm32();
-    void _cmp_rm32_imm8(ModRM &modrm);
+    void _jbe(const Instruction &inst);
+    void _ja(const Instruction &inst);
+    void _jl(const Instruction &inst);
+    void _jge(const Instruction &inst);
+    void _jle(const Instruction &inst);
+    void _jg(const Instruction &inst);
     
-    void _jc();
-    void _jz();
-    void _js();
-    void _jo();
-    void _jnc();
-    void _jnz();
-    void _jns();
-    void _jno();
+    void _in(const Instruction &inst);
+    void _out(const Instruction &inst);
     
-    void _jl();
-    void _jle();
+    //アトミックな命令。メモリへのxchg, cmpxchg, xaddはLOCKが無くてもアトミックに行う
+    void _xchg_rm8_r8(const Instruction &inst);
+    void _xchg_rm32_r32(const Instruction &inst);
+    void _xchg_eax_r32(const Instruction &inst);
+    void _cmpxchg_rm32_r32(const Instruction &inst);
+    void _xadd_rm32_r32(const Instruction &inst);
+    //LOCKのついた演算(add, or, and, sub, xor, inc, dec, not, neg)
+    void _lock_rm32(const Instruction &inst);
     
-    void _in_al_dx();
-    void _out_dx_al();
+    //ストリング命令
+    uint32_t _get_string(uint32_t address, uint32_t size);
+    void _set_string(uint32_t address, uint32_t value, uint32_t size);
+    bool _string_range(uint32_t address, uint32_t count, uint32_t size, int32_t step, uint64_t &start, uint64_t &length);
+    bool _rep_movs_bulk(uint32_t size, int32_t step);
+    bool _rep_stos_bulk(uint32_t size, int32_t step);
+    bool _rep_cmps_bulk(const Instruction &inst, uint32_t size, int32_t step);
+    bool _rep_scas_bulk(const Instruction &inst, uint32_t size, int32_t step);
+    void _movs(const Instruction &inst);
+    void _cmps(const Instruction &inst);
+    void _stos(const Instruction &inst);
+    void _lods(const Instruction &inst);
+    void _scas(const Instruction &inst);
+    void _cld(const Instruction &inst);
+    void _std(const Instruction &inst);
+    void _cli(const Instruction &inst);
+    void _sti(const Instruction &inst);
+    void _pushfd(const Instruction &inst);
+    void _popfd(const Instruction &inst);
+    void _iret(const Instruction &inst);
     
-    void _mov_r8_imm8();
-    void _cmp_al_imm8();
-    void _mov_rm8_r8();
-    void _mov_r8_rm8();
-    void _inc_r32();
+    void _mov_r8_imm8(const Instruction &inst);
+    void _cmp_al_imm8(const Instruction &inst);
+    void _mov_rm8_r8(const Instruction &inst);
+    void _mov_r8_rm8(const Instruction &inst);
+    void _mov_rm8_imm8(const Instruction &inst);
+    void _mov_al_moffs8(const Instruction &inst);
+    void _mov_eax_moffs32(const Instruction &inst);
+    void _mov_moffs8_al(const Instruction &inst);
+    void _mov_moffs32_eax(const Instruction &inst);
+    void _movzx_r32_rm8(const Instruction &inst);
+    void _movzx_r32_rm16(const Instruction &inst);
+    void _movsx_r32_rm8(const Instruction &inst);
+    void _movsx_r32_rm16(const Instruction &inst);
+    void _lea_r32_m32(const Instruction &inst);
+    void _inc_r32(const Instruction &inst);
+    void _dec_r32(const Instruction &inst);
+    void _nop(const Instruction &inst);
+    void _cdq(const Instruction &inst);
     
     //software interrupt
-    void _swi();
+    void _swi(const Instruction &inst);
+    void _hlt(const Instruction &inst);
     
     //bios video functions
     void _bios_video();
-    void _put_string(const char *str, size_t n);
     void _bios_video_teletype();
 };
 
@@ -0,0 +1,73 @@
+#ifndef __INCLUDE_GDB_STUB__
+#define __INCLUDE_GDB_STUB__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <set>
+#include "emulator.hpp"
+
+//gに返すレジスタ(i386: eax〜edi, eip, eflags, cs, ss, ds, es, fs, gs)
+const uint32_t GDB_REGISTER_COUNT = 16;
+const uint32_t GDB_EIP = 8;
+const uint32_t GDB_EFLAGS = 9;
+const uint32_t GDB_CS = 10;
+//セグメントは無いので、cs以外はこの値を見せる
+const uint32_t GDB_DATA_SEGMENT = 0x10;
+//m/Mで一度に扱うバイト数(qSupportedのPacketSizeに合わせる)
+const uint32_t GDB_PACKET_SIZE = 0x4000;
+
+//GDBのリモートシリアルプロトコル(RSP)のサーバ
+//1つの接続だけを受け付け、その間はエミュレータを占有する
+//ブレークポイントはemulator::add_breakpoint()(デコードした命令の差し替え)なので、当たらなければ速さは変わらない
+class gdb_stub{
+private:
+    emulator *emu;
+    int listen_fd;
+    int fd;
+    bool ack;
+    //受信したがまだ処理していないバイト
+    char buffer[4096];
+    size_t buffer_head;
+    size_t buffer_size;
+    //実行中にCtrl-C(0x03)を待つスレッドを止めるパイプ
+    int watch_pipe[2];
+    std::string last_stop;
+    //GDBが入れたブレークポイント(続けるときに今のeipのものを飛ばす)
+    std::set<uint32_t> breakpoints;
+    //GDBがkで終わらせた(Dや切断ならゲストは続ける)
+    bool killed;
+    
+    bool _read_byte(char &c);
+    bool _receive(std::string &packet);
+    bool _send(const std::string &packet);
+    
+    std::string _stop_reply(StopReason reason);
+    std::string _read_registers();
+    bool _write_registers(const char *hex);
+    std::string _read_register(uint32_t index);
+    bool _write_register(uint32_t index, uint32_t value);
+    std::string _read_memory(const char *args);
+    std::string _write_memory(const char *args);
+    std::string _breakpoint(const char *args, bool insert);
+    std::string _resume(const char *args, bool step);
+    void _watch();
+    
+    //戻り値がfalseなら接続を終える
+    bool _handle(const std::string &packet);
+
+public:
+    gdb_stub(emulator *emu);
+    ~gdb_stub();
+    
+    //":1234"や"127.0.0.1:1234"ならTCP(ホストを省けばループバック)、それ以外はUnixドメインソケットのパス
+    bool listen(const char *address);
+    //接続を1つ受け付け、切断(D, k)するまで応える
+    bool serve();
+    //接続済みのfdで応える。fdは呼び出し側で閉じる
+    void serve(int fd);
+    //最後の接続がkで終わった
+    bool is_killed();
+};
+
+#endif
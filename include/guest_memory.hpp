@@ -0,0 +1,116 @@
+#ifndef __INCLUDE_GUEST_MEMORY__
+#define __INCLUDE_GUEST_MEMORY__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//32bitのアドレス空間全体
+const uint64_t GUEST_ADDRESS_SPACE = (1ULL << 32);
+//アドレス空間の末尾をまたぐアクセス用のガード
+const uint64_t GUEST_GUARD_SIZE = 64 * 1024;
+//touched_pages()のページの大きさ
+const uint32_t GUEST_PAGE_SHIFT = 12;
+const uint32_t GUEST_PAGE_SIZE = (1 << GUEST_PAGE_SHIFT);
+
+//複数のゲストで共有する初期状態のメモリ(memfd)
+//ゲストはこれをMAP_PRIVATEでマップするので、書き込んだページだけがコピーされる
+//ゲストを作った後でイメージを書き換えると、まだ書き込んでいないページには反映されてしまうので注意
+class memory_image{
+private:
+    int fd;
+    uint8_t *data;
+    size_t mapped_size;
+    uint32_t size;
+
+public:
+    memory_image(uint32_t size);
+    ~memory_image();
+    
+    //ファイルの先頭からsizeバイトをaddressに読み込む
+    bool load(const char *filename, uint32_t address, uint32_t size);
+    uint8_t *get_data();
+    uint32_t get_size() const;
+    int get_fd() const;
+};
+
+//ゲストのメモリ
+//アドレス空間全体とガードをPROT_NONEで予約して、先頭のsizeバイトだけ読み書きできるようにする
+//範囲外へのアクセスはホストのSIGSEGVになるので、アクセスごとの範囲チェックは要らない
+//実メモリは触ったページにだけ割り当てられるので、sizeをGUEST_ADDRESS_SPACEにすれば4GiB全体を疎に使える
+//書き込んだページは、emulatorのdirty_mapと、そこから移したwritten_mapで覚えておく
+//(実メモリがあるかどうかは、スワップアウトされると書き込んだページでも分からない)
+class guest_memory{
+private:
+    uint8_t *base;
+    uint64_t size;
+    size_t reserved_size;
+    //reset_dirty()より前に書き込みのあったページ
+    uint8_t *written_map;
+    //書き込みを記録しているマップ(emulatorのdirty_map)。無ければNULL
+    uint8_t *dirty_map;
+    //ファイルをマップした範囲
+    std::vector<std::pair<uint64_t, uint64_t> > file_ranges;
+    
+    void _reserve();
+    //written_mapとdirty_mapの大きさ
+    uint64_t _page_map_size();
+
+public:
+    guest_memory(uint64_t size);
+    //imageをコピーオンライトでマップする。ゲストを作った後はimageを破棄しても良い
+    guest_memory(const memory_image &image);
+    ~guest_memory();
+    
+    uint8_t *get_base();
+    uint64_t get_size();
+    //ホストのアドレスがこのメモリの予約範囲内か
+    bool contains(const void *host_address);
+    //fdのoffsetからsizeバイトをaddressにコピーオンライトでマップする(ページ境界に揃っていること)
+    bool map_file(uint64_t address, uint64_t size, int fd, uint64_t offset);
+    //書き込んだページを1ページ1バイトで記録してもらうマップ((size >> GUEST_PAGE_SHIFT) + 1バイト)
+    void track_writes(uint8_t *dirty_map);
+    //dirty_mapのページを書き込んだページとして覚えてから、dirty_mapを0にする
+    void reset_dirty();
+    //内容があるかもしれないページの番号。他のページは0
+    void touched_pages(std::vector<uint32_t> &pages);
+    
+    //ゼロで埋まった領域を確保する。実メモリは触ったページにだけ割り当てられる
+    static void *reserve(size_t size, int prot);
+    static void release(void *address, size_t size);
+    //1ページ1バイトのマップで、0でないページの番号をpagesに足す
+    static void marked_pages(const uint8_t *map, uint64_t count, std::vector<uint32_t> &pages);
+};
+
+//0で始まり、書き込んだページにだけ実メモリを使うバッファ
+//スナップショットなど、疎なゲストのメモリの写しに使う
+//書き込みはwrite()で行い、書き込んだページを覚えておく
+class sparse_buffer{
+private:
+    uint8_t *base;
+    uint64_t length;
+    uint8_t *written_map;
+    
+    uint64_t _page_count() const;
+
+public:
+    sparse_buffer();
+    //書き込んだページだけコピーする
+    sparse_buffer(const sparse_buffer &other);
+    sparse_buffer &operator=(const sparse_buffer &other);
+    ~sparse_buffer();
+    
+    //sizeバイトの0にする
+    void assign(uint64_t size);
+    uint64_t size() const;
+    const uint8_t *data() const;
+    const uint8_t &operator[](uint64_t index) const{
+        return base[index];
+    }
+    //addressからsizeバイトを書く(範囲はsize()以内であること)
+    void write(uint64_t address, const void *data, uint64_t size);
+    //書き込んだページの番号。他のページは0
+    void touched_pages(std::vector<uint32_t> &pages) const;
+};
+
+#endif
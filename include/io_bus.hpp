@@ -0,0 +1,83 @@
+#ifndef __INCLUDE_IO_BUS__
+#define __INCLUDE_IO_BUS__
+
+#include <cstdint>
+#include <cstddef>
+
+const uint32_t IO_PORT_COUNT = 0x10000;
+//0番はどのデバイスもつながっていないポート用
+const uint32_t IO_MAX_DEVICES = 256;
+
+//ポートI/Oを受け持つデバイス
+//portは実際のポート番号。16/32bitは指定しなければ8bitのアクセスに分けて処理する
+class io_device{
+public:
+    virtual ~io_device(){}
+    
+    virtual uint8_t in8(uint16_t port) = 0;
+    virtual void out8(uint16_t port, uint8_t value) = 0;
+    
+    virtual uint16_t in16(uint16_t port);
+    virtual uint32_t in32(uint16_t port);
+    virtual void out16(uint16_t port, uint16_t value);
+    virtual void out32(uint16_t port, uint32_t value);
+    
+    //ゲストから見える状態が変わるたびに増える値(ポーリングしているループが進めるかの判定用)
+    virtual uint64_t get_version(){
+        return 0;
+    }
+    //状態が変わるときに読めるようになるfd。無ければ-1
+    virtual int get_event_fd(){
+        return -1;
+    }
+};
+
+//ポート番号からデバイスを引く表を持ち、1回の表引きで振り分ける
+//複数バイトのアクセスは先頭のポートのデバイスが受け持つ
+class io_bus{
+private:
+    io_device *devices[IO_MAX_DEVICES];
+    uint32_t device_count;
+    uint8_t *port_map;
+    int wake_fd;
+
+public:
+    io_bus();
+    ~io_bus();
+    
+    //firstからcount個のポートにdeviceをつなぐ。使用中のポートがあればfalse
+    //deviceの解放は呼び出し側で行う
+    bool attach(io_device *device, uint16_t first, uint32_t count);
+    void detach(io_device *device);
+    io_device *get_device(uint16_t port);
+    
+    //つないでいる全デバイスのget_version()の和
+    uint64_t get_version();
+    //どれかのデバイスの状態が変わりうるか、timeoutナノ秒(負なら無し)経つまで待つ
+    //待てるデバイスもtimeoutも無ければすぐにfalse
+    //ignore_readyなら、今すでに読めるfdは起こす理由にしない(読まれずに残っている入力など)
+    bool wait(bool ignore_ready, int64_t timeout = -1);
+    //wait()はこのfdが読めるときも戻る。デバイスではないので、これだけでは待てることにならない
+    void set_wake_fd(int fd);
+    
+    uint8_t in8(uint16_t port){
+        return devices[port_map[port]]->in8(port);
+    }
+    uint16_t in16(uint16_t port){
+        return devices[port_map[port]]->in16(port);
+    }
+    uint32_t in32(uint16_t port){
+        return devices[port_map[port]]->in32(port);
+    }
+    void out8(uint16_t port, uint8_t value){
+        devices[port_map[port]]->out8(port, value);
+    }
+    void out16(uint16_t port, uint16_t value){
+        devices[port_map[port]]->out16(port, value);
+    }
+    void out32(uint16_t port, uint32_t value){
+        devices[port_map[port]]->out32(port, value);
+    }
+};
+
+#endif
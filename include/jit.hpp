@@ -0,0 +1,95 @@
+#ifndef __INCLUDE_JIT__
+#define __INCLUDE_JIT__
+
+#include <cstdint>
+#include <cstddef>
+#include "emulator.hpp"
+
+//x86-64向けのブロック単位JITコンパイラ
+//
+//翻訳したコードの中ではゲストのレジスタをホストのレジスタに載せておく
+//  EAX..EDI -> r8d..r15d
+//  rsi : ゲストメモリの先頭
+//  rbx : code_map(コードへの書き込み検出用)。直後にdirty_mapが続く
+//  edi : eflags
+//  rbp : JitContext
+//  rax, rcx, rdx : 作業用
+//戻り値は次に実行するeip
+//
+//翻訳できる命令(ほかの命令を含むブロックはインタプリタで実行する)
+//  mov(88, 89, 8A, 8B, A1, A3, B0+r, B8+r, C6, C7), lea, movzx, movsx, nop
+//  add, or, and, sub, xor, cmp, test(85) : 32bit(01〜3D, 81, 83)
+//  cmp, test : 8bit(38, 3C, 84)
+//  inc, dec, not, neg, imul(69, 6B, 0F AF), shl, shr, sar(回数が即値か1)
+//  push(レジスタ, 即値, rm32), pop(レジスタ), leave
+//  jmp, call(相対), ret, Jcc(パリティ以外)
+//8bitのレジスタはAL..BLだけ(ホストでREXを付けるとAH..BHは指せない)
+//プレフィックス(0x0Fを除く)、16bitの演算、rol/ror、回数がCLのシフト、mul/div、ストリング命令、間接分岐、入出力は未対応
+class jit{
+private:
+    uint8_t *cache;
+    size_t cache_size;
+    size_t used;
+    
+    //翻訳中の書き込み位置
+    uint8_t *p;
+    uint8_t *limit;
+    uint8_t *epilogue;
+    bool overflow;
+    //翻訳中の命令のブロック内の番号と、それをJitContextへ書いたか
+    uint32_t current_index;
+    bool index_stored;
+    
+    void _emit8(uint8_t value);
+    void _emit32(uint32_t value);
+    
+    void _emit_rex(bool w, uint8_t reg, uint8_t rm);
+    void _emit_modrm(uint8_t mod, uint8_t reg, uint8_t rm);
+    
+    void _emit_prologue();
+    void _emit_epilogue();
+    void _emit_exit(uint32_t next_eip);
+    
+    void _emit_mov_imm(uint8_t host, uint32_t imm);
+    void _emit_op_reg(uint8_t opecode, uint8_t dst, uint8_t src);
+    void _emit_op_imm(uint8_t ext, uint8_t dst, uint32_t imm);
+    void _emit_load(uint8_t host);
+    void _emit_store(uint8_t host);
+    void _emit_store_imm(uint32_t imm);
+    void _emit_load8(uint8_t host);
+    void _emit_store8(uint8_t host);
+    void _emit_store8_imm(uint8_t imm);
+    void _emit_address(const ModRM &modrm);
+    void _emit_store_index();
+    void _emit_check_code(uint32_t eip, uint32_t size);
+    void _emit_update_eflags(uint32_t mask);
+    void _emit_shift_imm(uint8_t ext, uint8_t dst, uint8_t count);
+    void _emit_unary(uint8_t opecode, uint8_t ext, uint8_t dst);
+    void _emit_load_operand(const ModRM &modrm, uint32_t eip, bool write);
+    void _emit_alu(const Instruction &inst, uint32_t eip);
+    bool _emit_shift(const Instruction &inst, uint32_t eip);
+    void _emit_imul(const Instruction &inst);
+    
+    void _emit_push_imm(uint32_t imm, uint32_t eip);
+    void _emit_push(uint8_t host, uint32_t eip);
+    void _emit_pop(uint8_t host);
+    void _emit_jcc(uint8_t cc, uint32_t target, uint32_t next);
+    
+    bool _emit_instruction(const Instruction &inst, uint32_t eip);
+    bool _emit_instruction_0f(const Instruction &inst, uint32_t eip);
+
+public:
+    uint64_t compiled_count;
+    uint64_t flush_count;
+    
+    jit(size_t cache_size);
+    ~jit();
+    
+    //ブロックを翻訳する。未対応の命令があればNULL
+    //キャッシュが足りなければNULLを返してfull()がtrueになる
+    JitFunction compile(const Block &block);
+    bool full();
+    void flush();
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef __INCLUDE_LOADER__
+#define __INCLUDE_LOADER__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+class guest_memory;
+
+//フラットバイナリを置くアドレス
+const uint32_t PROGRAM_LOAD_ADDRESS = 0x7c00;
+
+//ファイルのoffsetからfile_sizeバイトをaddressに置く。memory_sizeまでの残りは0
+typedef struct{
+    uint32_t address;
+    uint32_t offset;
+    uint32_t file_size;
+    uint32_t memory_size;
+} ProgramSegment;
+
+//ゲストのプログラム(フラットバイナリか32bitのELF実行ファイル)
+//ファイルはmmapしておき、ゲストのメモリへはページ単位でそのまま重ねてマップする
+//ページ境界が合わない部分だけコピーする
+class program_image{
+private:
+    int fd;
+    uint8_t *data;
+    size_t file_size;
+    bool elf;
+    uint32_t entry;
+    std::vector<ProgramSegment> segments;
+    
+    bool _parse_elf();
+    void _close();
+
+public:
+    program_image();
+    ~program_image();
+    
+    //ELFでなければフラットバイナリとしてload_addressに置く
+    bool open(const char *filename, uint32_t load_address = PROGRAM_LOAD_ADDRESS);
+    bool is_elf() const;
+    uint32_t get_entry() const;
+    //プログラムが使うメモリの末尾(ここまでのメモリが要る)
+    uint64_t get_end() const;
+    const std::vector<ProgramSegment> &get_segments() const;
+    
+    //ゲストのメモリに置く
+    //bssは書き込みのあったページだけ0にする(書いていないページは0のまま)
+    //マップしたページはファイルと共有されるので、実行中にファイルを書き換えないこと
+    bool map(guest_memory &guest) const;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef __INCLUDE_MODRM__
+#define __INCLUDE_MODRM__
+
+#include <cstdint>
+
+//ModR/MとSIBの1バイトごとのアドレスの形を、コンパイル時に表にしておく
+//デコード時に表を引いて base, index, scale, disp に直しておけば、実行時は
+//  registers[base] + (registers[index] << scale) + disp
+//の形だけでアドレスが求まる(使わないレジスタは常に0のMODRM_ZERO_REGISTERを指す)
+
+//emulator::registersの末尾に置く、常に0のレジスタ
+const uint8_t MODRM_ZERO_REGISTER = 8;
+
+typedef struct{
+    //ModRMとSIBのバイト数。ディスプレースメントはこの後ろに続く
+    uint8_t length;
+    uint8_t has_sib;
+    //ディスプレースメントのバイト数(0, 1, 4)
+    uint8_t disp_size;
+    //SIBが無いときのベース
+    uint8_t base;
+} ModRMForm;
+
+typedef struct{
+    uint8_t base;
+    uint8_t index;
+    uint8_t scale;
+    //mod == 00, base == 101 のときだけ付くdisp32
+    uint8_t disp_size;
+} SIBForm;
+
+constexpr uint8_t modrm_disp_size(uint8_t mod, uint8_t rm){
+    return (mod == 1) ? 1 : (mod == 2 || (mod == 0 && rm == 5)) ? 4 : 0;
+}
+
+constexpr uint8_t modrm_has_sib(uint8_t mod, uint8_t rm){
+    return (mod != 3 && rm == 4) ? 1 : 0;
+}
+
+//code: ModRMのバイト
+constexpr ModRMForm modrm_form(uint8_t code){
+    return ModRMForm{
+        static_cast<uint8_t>(1 + modrm_has_sib(code >> 6, code & 7)),
+        modrm_has_sib(code >> 6, code & 7),
+        modrm_disp_size(code >> 6, code & 7),
+        static_cast<uint8_t>(((code >> 6) == 0 && (code & 7) == 5) || modrm_has_sib(code >> 6, code & 7) ? MODRM_ZERO_REGISTER : (code & 7))
+    };
+}
+
+//i: (mod == 00なら0x100) | SIBのバイト
+constexpr SIBForm sib_form(uint16_t i){
+    return SIBForm{
+        static_cast<uint8_t>((i & 0x100) && (i & 7) == 5 ? MODRM_ZERO_REGISTER : (i & 7)),
+        static_cast<uint8_t>(((i >> 3) & 7) == 4 ? MODRM_ZERO_REGISTER : ((i >> 3) & 7)),
+        static_cast<uint8_t>((i >> 6) & 3),
+        static_cast<uint8_t>((i & 0x100) && (i & 7) == 5 ? 4 : 0)
+    };
+}
+
+//0, 1, ..., N-1 を並べてform()を展開する
+template<int... I>
+struct modrm_index_list{};
+
+template<int N, int... I>
+struct make_modrm_index_list : make_modrm_index_list<N - 1, N - 1, I...>{};
+
+template<int... I>
+struct make_modrm_index_list<0, I...>{
+    typedef modrm_index_list<I...> type;
+};
+
+template<typename List>
+struct modrm_form_table;
+
+template<int... I>
+struct modrm_form_table<modrm_index_list<I...> >{
+    static constexpr ModRMForm forms[sizeof...(I)] = {modrm_form(I)...};
+};
+
+template<int... I>
+constexpr ModRMForm modrm_form_table<modrm_index_list<I...> >::forms[sizeof...(I)];
+
+template<typename List>
+struct sib_form_table;
+
+template<int... I>
+struct sib_form_table<modrm_index_list<I...> >{
+    static constexpr SIBForm forms[sizeof...(I)] = {sib_form(I)...};
+};
+
+template<int... I>
+constexpr SIBForm sib_form_table<modrm_index_list<I...> >::forms[sizeof...(I)];
+
+//modrm_forms::forms[ModRM], sib_forms::forms[(mod == 00 ? 0x100 : 0) | SIB]
+typedef modrm_form_table<make_modrm_index_list<256>::type> modrm_forms;
+typedef sib_form_table<make_modrm_index_list<512>::type> sib_forms;
+
+//[esp+disp8]: ModRM, SIB, disp8
+static_assert(modrm_forms::forms[0x44].length == 2 && modrm_forms::forms[0x44].disp_size == 1, "modrm table");
+//[disp32]
+static_assert(modrm_forms::forms[0x05].disp_size == 4 && modrm_forms::forms[0x05].base == MODRM_ZERO_REGISTER, "modrm table");
+//[edx*4+disp32]
+static_assert(sib_forms::forms[0x195].disp_size == 4 && sib_forms::forms[0x195].index == 2, "sib table");
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef __INCLUDE_PIC__
+#define __INCLUDE_PIC__
+
+#include <cstdint>
+#include "io_bus.hpp"
+
+//8259のマスタとスレーブ
+const uint16_t PIC_MASTER_PORT = 0x20;
+const uint16_t PIC_SLAVE_PORT = 0xA0;
+const uint32_t PIC_PORT_COUNT = 2;
+//スレーブをつなぐマスタのIRQ
+const uint8_t PIC_CASCADE_IRQ = 2;
+const uint32_t PIC_IRQ_COUNT = 16;
+
+const uint8_t PIC_ICW1_ICW4 = (1 << 0);
+const uint8_t PIC_ICW1_SINGLE = (1 << 1);
+const uint8_t PIC_ICW1_INIT = (1 << 4);
+const uint8_t PIC_ICW4_AUTO_EOI = (1 << 1);
+//OCW2
+const uint8_t PIC_EOI = 0x20;
+const uint8_t PIC_SPECIFIC_EOI = 0x60;
+//OCW3
+const uint8_t PIC_OCW3 = 0x08;
+const uint8_t PIC_READ_IRR = 0x0A;
+const uint8_t PIC_READ_ISR = 0x0B;
+
+typedef struct{
+    //割り込みの要求(エッジで立てたもの)と、レベルで要求している線
+    uint8_t irr;
+    uint8_t levels;
+    //処理中(EOIを待っている)
+    uint8_t isr;
+    uint8_t imr;
+    uint8_t vector_base;
+    //初期化中なら次に待っているICWの番号(2〜4)、0なら初期化済み
+    uint8_t init_step;
+    bool need_icw4;
+    bool single;
+    bool auto_eoi;
+    bool read_isr;
+} PicChip;
+
+//プログラマブル割り込みコントローラ(カスケードした2個)
+//優先度は固定(IRQ番号が小さいほど高い)。回転と特殊マスクモードは無い
+//初期状態はBIOSが設定した後と同じで、ベクタは0x08と0x70、マスクは無し
+class pic : public io_device{
+private:
+    PicChip chips[2];
+    
+    static int _highest(uint8_t bits);
+    //chips[index]が出す割り込みのIRQ(0〜7)。処理中の同じか高い優先度があれば出さない。無ければ-1
+    int _pending(int index);
+    uint8_t _requests(int index);
+    void _command(PicChip &chip, uint8_t value);
+    void _data(PicChip &chip, uint8_t value);
+
+public:
+    pic();
+    
+    //エッジの割り込み(PITなど)
+    void raise(uint8_t irq);
+    //レベルの割り込み(UARTなど)。下げるまで要求し続ける
+    void set_level(uint8_t irq, bool level);
+    //CPUに割り込みを要求している
+    bool has_interrupt();
+    //割り込みを受け付けてベクタを返す(INTA)
+    uint8_t acknowledge();
+    //スナップショット用。マスタとスレーブの2個分(初期化の途中も含む)
+    void save_state(PicChip *state);
+    void restore_state(const PicChip *state);
+    
+    uint8_t in8(uint16_t port);
+    void out8(uint16_t port, uint8_t value);
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __INCLUDE_PIT__
+#define __INCLUDE_PIT__
+
+#include <cstdint>
+#include "io_bus.hpp"
+
+class virtual_clock;
+
+//8253/8254
+const uint16_t PIT_PORT = 0x40;
+const uint8_t PIT_IRQ = 0;
+const uint32_t PIT_PORT_COUNT = 4;
+const uint16_t PIT_COMMAND = 3;
+const uint32_t PIT_CHANNELS = 3;
+//カウンタに入るクロック(Hz)
+const uint64_t PIT_FREQUENCY = 1193182;
+//タイマーが無いときのget_deadline()
+const uint64_t PIT_NO_DEADLINE = UINT64_MAX;
+
+typedef struct{
+    uint8_t mode;
+    //1:下位, 2:上位, 3:下位→上位
+    uint8_t access;
+    //0は65536
+    uint32_t reload;
+    //書き込み途中の下位バイト
+    uint8_t low;
+    bool write_high;
+    bool read_high;
+    //カウンタラッチで固定した値
+    bool latched;
+    uint16_t latch;
+    
+    //カウントを始めたtick。armedでなければ止まっている
+    bool armed;
+    uint64_t start;
+    //次に出力が立ち上がる(割り込みを出す)tick
+    uint64_t next_fire;
+} PitChannel;
+
+//プログラマブル・インターバル・タイマー
+//時間はvirtual_clockの仮想時間なので、タイマーの割り込みは命令数で決まる
+//チャネル0はモード0(ワンショット)、2と3(周期)でIRQ0を出す。チャネル1, 2は数えるだけ
+class pit : public io_device{
+private:
+    virtual_clock *clock;
+    PitChannel channels[PIT_CHANNELS];
+    
+    uint64_t _ticks();
+    uint16_t _count(const PitChannel &channel, uint64_t now);
+    void _command(uint8_t value);
+
+public:
+    pit(virtual_clock *clock);
+    
+    //今までに出た割り込みがあればtrue(何回分でも1回にまとめる)
+    bool update();
+    //次にIRQ0を出す仮想時刻(ナノ秒)
+    uint64_t get_deadline();
+    //スナップショット用。PIT_CHANNELS個分。tickは仮想時間からなので、時計と一緒に戻すこと
+    void save_state(PitChannel *state);
+    void restore_state(const PitChannel *state);
+    
+    uint8_t in8(uint16_t port);
+    void out8(uint16_t port, uint8_t value);
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef __INCLUDE_PROFILER__
+#define __INCLUDE_PROFILER__
+
+#include <cstdio>
+#include <cstdint>
+#include <map>
+#include <string>
+#include "guest_memory.hpp"
+
+//呼び出し文脈の木の節。関数(callの行き先)ごとに作る
+typedef struct ProfileNode{
+    uint32_t address;
+    struct ProfileNode *parent;
+    std::map<uint32_t, struct ProfileNode *> children;
+    //この関数の中で実行した命令数(呼び出し先の分は含まない)
+    uint64_t self_count;
+} ProfileNode;
+
+//ゲストのプロファイラ
+//命令ごとにアドレス・オペコード別の実行回数を数え、call/retで影のコールスタックをたどる
+class profiler{
+private:
+    uint64_t memory_size;
+    uint64_t *address_counts;
+    //数えたことのあるアドレスのページ(1ページ1バイト)
+    uint8_t *counted_pages;
+    uint64_t opcode_counts[256];
+    
+    ProfileNode *root;
+    ProfileNode *current;
+    
+    //アドレス -> シンボル名
+    std::map<uint32_t, std::string> symbols;
+    
+    void _delete_node(ProfileNode *node);
+    void _write_folded(FILE *out, ProfileNode *node, std::string &stack);
+    bool _load_elf_symbols(FILE *file);
+    bool _load_map_symbols(FILE *file);
+
+public:
+    //entryは最初に実行する関数のアドレス
+    profiler(uint64_t memory_size, uint32_t entry);
+    ~profiler();
+    
+    //1命令実行するたびに呼ぶ
+    void count(uint32_t address, uint8_t opecode){
+        if(address < memory_size){
+            address_counts[address]++;
+            counted_pages[address >> GUEST_PAGE_SHIFT] = 1;
+        }
+        opcode_counts[opecode]++;
+        current->self_count++;
+    }
+    void call(uint32_t target);
+    void ret();
+    
+    //ELF(32bit)のシンボルテーブルか、nm形式("address [type] name")のマップファイルを読む
+    bool load_symbols(const char *filename);
+    //addressを含む関数の名前。シンボルが無ければアドレスの16進表記
+    std::string symbol_name(uint32_t address);
+    
+    uint64_t get_address_count(uint32_t address);
+    uint64_t get_opcode_count(uint8_t opecode);
+    
+    //flamegraph.pl等で読めるfolded形式("a;b;c count")で書く
+    void write_folded(FILE *out);
+    //実行回数の多いアドレスとオペコードを書く
+    void write_report(FILE *out, uint32_t top);
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef __INCLUDE_TRACE__
+#define __INCLUDE_TRACE__
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include "emulator.hpp"
+
+const char TRACE_MAGIC[8] = {'X', '8', '6', 'T', 'R', 'A', 'C', 'E'};
+//2: メモリの大きさを8バイトにした(4GiBのゲスト)
+const uint32_t TRACE_VERSION = 2;
+//リングバッファの既定の要素数(2の累乗)
+const uint32_t TRACE_RING_SIZE = 64 * 1024;
+
+//トレースファイル中の記録の種類(タグの下位2bit)
+const uint8_t TRACE_TAG_INSTRUCTION = 0;
+const uint8_t TRACE_TAG_WRITE = 1;
+//命令の記録: eipが直前の命令の次ではない / 命令番号が連続していない / eflagsが変わった
+const uint8_t TRACE_TAG_EIP = (1 << 2);
+const uint8_t TRACE_TAG_INDEX = (1 << 3);
+const uint8_t TRACE_TAG_EFLAGS = (1 << 4);
+
+//リングバッファの1要素
+//命令の記録はその命令のメモリへの書き込みの後に入る
+typedef struct{
+    uint8_t type;
+    //命令長か書き込みのバイト数
+    uint8_t size;
+    uint8_t code[MAX_INSTRUCTION_LENGTH];
+    //命令のアドレスか書き込み先
+    uint32_t address;
+    uint32_t value;
+    uint64_t index;
+    //命令を実行した後のレジスタ
+    uint32_t eflags;
+    uint32_t registers[REGISTERS_COUNT];
+} TraceEntry;
+
+//命令実行のトレースを圧縮して書き出す
+//エミュレータのスレッドがリングバッファに記録し、裏のスレッドがgzipで圧縮してファイルに書く
+//set_enabled()はどのスレッドから呼んでもよい
+class tracer{
+private:
+    TraceEntry *ring;
+    uint32_t ring_size;
+    //headは書き込み側、tailは読み出し側だけが進める
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    
+    gzFile file;
+    std::thread writer;
+    std::atomic<bool> running;
+    std::atomic<bool> enabled;
+    
+    //トレースするアドレス範囲[first, last]。空なら全部
+    std::vector<std::pair<uint32_t, uint32_t> > ranges;
+    
+    //記録中の命令
+    TraceEntry pending;
+    
+    //書き出し側が最後に書いた状態(差分の基準)
+    uint32_t last_eip;
+    uint64_t last_index;
+    uint32_t last_eflags;
+    uint32_t last_registers[REGISTERS_COUNT];
+    std::vector<uint8_t> encoded;
+    
+    TraceEntry *_reserve();
+    void _commit();
+    void _write_loop();
+    void _encode(const TraceEntry &entry);
+    bool _flush_encoded();
+
+public:
+    //ring_sizeは2の累乗に切り上げる
+    tracer(uint32_t ring_size = TRACE_RING_SIZE);
+    ~tracer();
+    
+    //範囲はopen()の前に指定する
+    void add_range(uint32_t first, uint32_t last);
+    //filenameにinitialの状態を書いて、書き出しのスレッドを始める
+    bool open(const char *filename, const Snapshot *initial);
+    //残りを書き出してファイルを閉じる
+    void close();
+    bool is_open();
+    
+    void set_enabled(bool enable){
+        enabled.store(enable, std::memory_order_relaxed);
+    }
+    bool is_enabled(){
+        return enabled.load(std::memory_order_relaxed);
+    }
+    //[address, address + size)のどこかをトレースするか
+    bool covers(uint32_t address, uint32_t size);
+    
+    //エミュレータから呼ぶ: 命令の実行前、メモリへの書き込み、実行後
+    void begin(uint64_t index, uint32_t eip, const uint8_t *code, uint8_t length);
+    void write(uint32_t address, uint32_t value, uint8_t size);
+    void end(const uint32_t *registers, uint32_t eflags);
+};
+
+//トレース中の1命令分
+typedef struct{
+    uint32_t address;
+    uint32_t value;
+    uint8_t size;
+} TraceWrite;
+
+typedef struct{
+    uint64_t index;
+    uint32_t eip;
+    uint8_t length;
+    uint8_t code[MAX_INSTRUCTION_LENGTH];
+    //実行した後のレジスタ
+    uint32_t eflags;
+    uint32_t registers[REGISTERS_COUNT];
+    std::vector<TraceWrite> writes;
+} TraceEvent;
+
+//トレースファイルを読む
+class trace_reader{
+private:
+    gzFile file;
+    Snapshot initial;
+    
+    uint32_t next_eip;
+    uint64_t next_index;
+    uint32_t eflags;
+    uint32_t registers[REGISTERS_COUNT];
+    
+    bool _read(void *buffer, uint32_t size);
+    bool _read_header();
+
+public:
+    trace_reader();
+    ~trace_reader();
+    
+    bool open(const char *filename);
+    void close();
+    //トレースを始めたときの状態
+    const Snapshot *get_initial();
+    
+    //次の命令を読む。終わりならfalse
+    bool next(TraceEvent &event);
+    //最初から読み直して、index番目の命令を実行する直前の状態をstateに作る
+    //アドレス範囲を絞ったトレースでは、範囲外の命令によるメモリへの書き込みは反映されない
+    bool replay(uint64_t index, Snapshot &state);
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef __INCLUDE_UART__
+#define __INCLUDE_UART__
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include "io_bus.hpp"
+
+class console;
+
+//COM1
+const uint16_t UART_PORT = 0x03F8;
+const uint8_t UART_IRQ = 4;
+const uint32_t UART_PORT_COUNT = 8;
+//16550の受信FIFOの段数
+const size_t UART_FIFO_SIZE = 16;
+
+//レジスタ(UART_PORTからの位置)
+//LCRのDLABが1の間は、0と1は分周値(DLL, DLM)になる
+const uint16_t UART_DATA = 0;
+const uint16_t UART_IER = 1;
+//読むとIIR、書くとFCR
+const uint16_t UART_IIR = 2;
+const uint16_t UART_LCR = 3;
+const uint16_t UART_MCR = 4;
+const uint16_t UART_LSR = 5;
+const uint16_t UART_MSR = 6;
+const uint16_t UART_SCR = 7;
+
+const uint8_t UART_IER_RECEIVE = (1 << 0);
+const uint8_t UART_IER_TRANSMIT = (1 << 1);
+//IIR: 割り込みの要因
+const uint8_t UART_IIR_NONE = 0x01;
+const uint8_t UART_IIR_TRANSMIT = 0x02;
+const uint8_t UART_IIR_RECEIVE = 0x04;
+const uint8_t UART_IIR_FIFO_ENABLED = 0xC0;
+const uint8_t UART_FCR_ENABLE = (1 << 0);
+const uint8_t UART_FCR_CLEAR_RECEIVE = (1 << 1);
+const uint8_t UART_LCR_DLAB = (1 << 7);
+const uint8_t UART_LSR_DATA_READY = (1 << 0);
+const uint8_t UART_LSR_THR_EMPTY = (1 << 5);
+const uint8_t UART_LSR_TRANSMITTER_EMPTY = (1 << 6);
+//CTS, DSR, DCD
+const uint8_t UART_MSR_CONNECTED = 0xB0;
+
+//スナップショット用のゲストから見える状態
+//push_input()の残りとinput_fdはホスト側の入力なので含まない
+typedef struct{
+    std::deque<uint8_t> fifo;
+    uint8_t ier;
+    uint8_t fcr;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint16_t divisor;
+    bool transmit_interrupt;
+} UartState;
+
+//16550互換のシリアルポート
+//送信はすぐにconsoleへ書くので、送信側は常に空いている
+//受信はFIFOに溜め、空になったらホストのfdから読めるだけ(ブロックせずに)補充する
+//fdを使わないとき(ヘッドレス)はpush_input()で入力を渡す
+class uart : public io_device{
+private:
+    console *output;
+    int input_fd;
+    //input_fdがEOFに達した
+    bool input_closed;
+    //push_input()で渡されてFIFOに入りきらない分
+    std::deque<uint8_t> pending;
+    std::deque<uint8_t> fifo;
+    //FIFOの中身が変わるたびに増やす
+    uint64_t version;
+    
+    uint8_t ier;
+    uint8_t fcr;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint16_t divisor;
+    //送信の割り込み(THRが空いた)がIIRで読まれていない
+    bool transmit_interrupt;
+    
+    void _fill();
+    uint8_t _read_data();
+    uint8_t _read_iir();
+
+public:
+    uart(console *output);
+    
+    //入力を読むfd。-1なら読まない(run()中は閉じないこと)
+    void set_input_fd(int fd);
+    //ヘッドレスのときの入力。run()の合間に呼ぶ
+    void push_input(const void *data, size_t size);
+    //FIFOとpush_input()の残りの合計
+    size_t get_input_size();
+    
+    //受信データか送信の空きで割り込みを要求している
+    bool get_interrupt();
+    //受信割り込みが有効で、input_fdに入力が来うる(定期的にget_interrupt()で見に行く)
+    bool needs_polling();
+    
+    void save_state(UartState &state);
+    void restore_state(const UartState &state);
+    
+    uint8_t in8(uint16_t port);
+    void out8(uint16_t port, uint8_t value);
+    uint64_t get_version();
+    //FIFOに空きがある間はinput_fdで起こす
+    int get_event_fd();
+};
+
+#endif
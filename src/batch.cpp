@@ -0,0 +1,205 @@
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "batch.hpp"
+#include "console.hpp"
+#include "loader.hpp"
+
+static const char *batch_reason_names[] = {
+    "halt",
+    "budget",
+    "breakpoint",
+    "unimplemented",
+    "fault",
+    "divide_error",
+    "idle",
+    "shutdown",
+    "interrupted"
+};
+
+batch_runner::batch_runner(){
+    queues = NULL;
+    queue_count = 0;
+    max_instructions = UINT64_MAX;
+    use_jit = false;
+    cycle_table = NULL;
+}
+
+batch_runner::~batch_runner(){
+    delete[] queues;
+}
+
+bool batch_runner::load_manifest(const char *filename){
+    FILE *manifest = fopen(filename, "r");
+    if(manifest == NULL){
+        fprintf(stderr, "error : failed to read manifest file.\n");
+        return false;
+    }
+    
+    char line[1024];
+    int line_number = 0;
+    bool ok = true;
+    while(fgets(line, sizeof(line), manifest) != NULL){
+        line_number++;
+        
+        char *comment = strchr(line, '#');
+        if(comment != NULL) *comment = '\0';
+        
+        char program[1024];
+        char memory_size[32], entry[32], esp[32];
+        int n = sscanf(line, "%1023s %31s %31s %31s", program, memory_size, entry, esp);
+        if(n <= 0) continue;
+        
+        BatchJob job;
+        job.program = program;
+        job.memory_size = n >= 2 ? strtoull(memory_size, NULL, 0) : 0;
+        job.entry = n >= 3 ? strtoul(entry, NULL, 0) : 0;
+        job.esp = n >= 4 ? strtoul(esp, NULL, 0) : BATCH_DEFAULT_ESP;
+        if((n >= 2 && job.memory_size == 0) || job.memory_size > GUEST_ADDRESS_SPACE){
+            fprintf(stderr, "error : invalid memory size in manifest line %d.\n", line_number);
+            ok = false;
+            continue;
+        }
+        add(job);
+    }
+    
+    fclose(manifest);
+    return ok;
+}
+
+void batch_runner::add(const BatchJob &job){
+    jobs.push_back(job);
+}
+
+void batch_runner::set_cycle_table(const CycleTable *table){
+    cycle_table = table;
+}
+
+void batch_runner::run(unsigned threads, uint64_t max_instructions, bool use_jit){
+    this->max_instructions = max_instructions;
+    this->use_jit = use_jit;
+    
+    if(threads == 0) threads = std::thread::hardware_concurrency();
+    if(threads == 0) threads = 1;
+    if(threads > jobs.size()) threads = jobs.size() > 0 ? jobs.size() : 1;
+    
+    results.assign(jobs.size(), BatchResult());
+    
+    //最初は順番に配っておく
+    delete[] queues;
+    queue_count = threads;
+    queues = new WorkerQueue[queue_count];
+    for(size_t i = 0; i < jobs.size(); i++){
+        queues[i % queue_count].jobs.push_back(i);
+    }
+    
+    std::vector<std::thread> workers;
+    for(size_t i = 1; i < queue_count; i++){
+        workers.push_back(std::thread(&batch_runner::_worker, this, i));
+    }
+    _worker(0);
+    for(size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+//自分のキューは後ろから取る
+bool batch_runner::_pop(size_t worker, size_t &job){
+    WorkerQueue &queue = queues[worker];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    
+    if(queue.jobs.empty()) return false;
+    job = queue.jobs.back();
+    queue.jobs.pop_back();
+    return true;
+}
+
+//他のワーカーのキューは前から盗む
+bool batch_runner::_steal(size_t worker, size_t &job){
+    for(size_t i = 1; i < queue_count; i++){
+        WorkerQueue &queue = queues[(worker + i) % queue_count];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        
+        if(queue.jobs.empty()) continue;
+        job = queue.jobs.front();
+        queue.jobs.pop_front();
+        return true;
+    }
+    return false;
+}
+
+//実行中に増えるジョブは無いので、どこからも取れなくなったら終わり
+void batch_runner::_worker(size_t worker){
+    size_t job;
+    while(_pop(worker, job) || _steal(worker, job)){
+        _run_job(job);
+    }
+}
+
+void batch_runner::_run_job(size_t index){
+    const BatchJob &job = jobs[index];
+    BatchResult &result = results[index];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    program_image image;
+    result.loaded = image.open(job.program.c_str()) && _run_image(job, image, result);
+    
+    result.wall_time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+//エントリポイントとメモリの大きさは、マニフェストに無ければbin/emuと同じようにimageから決める
+bool batch_runner::_run_image(const BatchJob &job, const program_image &image, BatchResult &result){
+    uint32_t entry = (job.entry != 0) ? job.entry : image.get_entry();
+    uint64_t memory_size = job.memory_size;
+    if(memory_size == 0){
+        uint64_t end = (image.get_end() + GUEST_PAGE_SIZE - 1) & ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+        memory_size = std::max(end, (uint64_t)BATCH_DEFAULT_MEMORY_SIZE);
+    }
+    
+    emulator emu(memory_size, entry, job.esp);
+    emu.set_jit(use_jit);
+    emu.set_cycle_table(cycle_table);
+    emu.get_console()->set_sink(CONSOLE_MEMORY);
+    if(!emu.load_image(image)) return false;
+    
+    result.reason = emu.run(max_instructions);
+    result.instruction_count = emu.get_instruction_count();
+    result.cycle_count = emu.get_cycle_count();
+    result.eip = emu.get_eip();
+    for(int i = 0; i < REGISTERS_COUNT; i++){
+        result.registers[i] = emu.get_register32(static_cast<Register>(i));
+    }
+    result.fault_address = emu.get_fault_address();
+    
+    const char *output = emu.get_console()->get_output();
+    result.output_size = emu.get_console()->get_output_size();
+    result.output_hash = 0xcbf29ce484222325ULL;
+    for(uint64_t i = 0; i < result.output_size; i++){
+        result.output_hash = (result.output_hash ^ (uint8_t)output[i]) * 0x100000001b3ULL;
+    }
+    return true;
+}
+
+const std::vector<BatchResult> &batch_runner::get_results(){
+    return results;
+}
+
+void batch_runner::write_results(FILE *out){
+    fprintf(out, "#index reason instructions cycles wall_us eip eax ecx edx ebx esp ebp esi edi fault_address output_size output_hash program\n");
+    for(size_t i = 0; i < results.size(); i++){
+        const BatchResult &result = results[i];
+        
+        if(!result.loaded){
+            fprintf(out, "%zu error - - %llu - - - - - - - - - - - - %s\n",
+                i, (unsigned long long)(result.wall_time_ns / 1000), jobs[i].program.c_str());
+            continue;
+        }
+        
+        fprintf(out, "%zu %s %llu %llu %llu %08x", i, batch_reason_names[result.reason],
+            (unsigned long long)result.instruction_count, (unsigned long long)result.cycle_count,
+            (unsigned long long)(result.wall_time_ns / 1000), result.eip);
+        for(int r = 0; r < REGISTERS_COUNT; r++){
+            fprintf(out, " %08x", result.registers[r]);
+        }
+        fprintf(out, " %08x %llu %016llx %s\n", result.fault_address, (unsigned long long)result.output_size,
+            (unsigned long long)result.output_hash, jobs[i].program.c_str());
+    }
+}
@@ -0,0 +1,354 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "emulator.hpp"
+
+//make bench から渡される
+#ifndef RESULT_FILE
+#define RESULT_FILE "bin/bench_result.json"
+#endif
+
+//1つの計測を何回繰り返して最小値を取るか
+static const int BENCH_REPEAT = 5;
+static const uint64_t BENCH_ITERATIONS = 10 * 1000 * 1000;
+//ゲストのループの回数(1回5命令)
+static const uint32_t BENCH_GUEST_LOOPS = 2 * 1000 * 1000;
+
+typedef struct{
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    //ゲストのプログラムを実行したときだけ
+    double mips;
+} BenchResult;
+
+//ModRMの形ごとの計測に使う
+typedef struct{
+    const char *name;
+    uint8_t code[6];
+    //_calc_memory_address()で計算できる形か
+    bool has_address;
+} ModRMCase;
+
+static const ModRMCase modrm_cases[] = {
+    {"mod0_reg",    {0x03},                               true},   //[ebx]
+    {"mod0_disp32", {0x05, 0x00, 0x90, 0x00, 0x00},       true},   //[0x9000]
+    {"mod0_sib",    {0x04, 0x1B},                         true},   //[ebx+ebx]
+    {"mod1_disp8",  {0x43, 0x10},                         true},   //[ebx+0x10]
+    {"mod1_sib",    {0x44, 0x1B, 0x10},                   true},   //[ebx+ebx+0x10]
+    {"mod2_disp32", {0x83, 0x10, 0x00, 0x00, 0x00},       true},   //[ebx+0x10]
+    {"mod2_sib",    {0x84, 0x1B, 0x10, 0x00, 0x00, 0x00}, true},   //[ebx+ebx+0x10]
+    {"mod3_reg",    {0xC3},                               false}   //ebx
+};
+
+//emulatorの内部の処理を1つずつ計測する
+class EmulatorBench{
+private:
+    std::vector<BenchResult> results;
+    //計算結果を捨てられないようにここへ足す
+    volatile uint32_t sink;
+    
+    //body(n)でn回実行した時間を測り、一番速かった回を残す
+    template<typename Body>
+    void _measure(const std::string &name, uint64_t iterations, Body body){
+        double best = 0;
+        for(int i = 0; i < BENCH_REPEAT; i++){
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            body(iterations);
+            double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if(i == 0 || ns < best) best = ns;
+        }
+        _add(name, iterations, best / iterations, 0);
+    }
+    
+    void _add(const std::string &name, uint64_t iterations, double ns_per_op, double mips){
+        BenchResult result;
+        result.name = name;
+        result.iterations = iterations;
+        result.ns_per_op = ns_per_op;
+        result.mips = mips;
+        results.push_back(result);
+        
+        if(mips > 0) printf("%-32s %10.2f ns/op %10.2f MIPS\n", name.c_str(), ns_per_op, mips);
+        else printf("%-32s %10.2f ns/op\n", name.c_str(), ns_per_op);
+    }
+    
+    static void _write_code(emulator &emu, uint32_t address, const uint8_t *code, uint32_t size){
+        for(uint32_t i = 0; i < size; i++) emu._set_memory8(address + i, code[i]);
+    }
+
+public:
+    EmulatorBench(){
+        sink = 0;
+    }
+    
+    //デコード済みの命令をハンドラの表から呼ぶ
+    void bench_dispatch(){
+        const uint8_t program[] = {
+            0xB8, 0x01, 0x00, 0x00, 0x00,   //mov eax, 1
+            0x41,                           //inc ecx
+            0x01, 0xC8,                     //add eax, ecx
+            0x3B, 0xC1,                     //cmp eax, ecx
+            0x89, 0xC2                      //mov edx, eax
+        };
+        const uint32_t count = 5;
+        
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        _write_code(emu, 0x7c00, program, sizeof(program));
+        
+        Instruction insts[count];
+        uint32_t address = 0x7c00;
+        for(uint32_t i = 0; i < count; i++){
+            emu._decode(address, insts[i]);
+            address += insts[i].length;
+        }
+        
+        _measure("dispatch", BENCH_ITERATIONS, [&](uint64_t n){
+            for(uint64_t i = 0; i < n; i += count){
+                for(uint32_t j = 0; j < count; j++) insts[j].handler(&emu, insts[j]);
+            }
+            sink += emu.registers[EDX];
+        });
+        
+        //命令のフェッチ(デコードキャッシュ)を含む1命令の実行
+        const uint8_t loop[] = {
+            0x41,           //inc ecx
+            0xEB, 0xFD      //jmp 0x7c00
+        };
+        _write_code(emu, 0x7c00, loop, sizeof(loop));
+        emu.eip = 0x7c00;
+        
+        _measure("exec_instruction", BENCH_ITERATIONS, [&](uint64_t n){
+            for(uint64_t i = 0; i < n; i++) emu._exec_instruction();
+            sink += emu.registers[ECX];
+        });
+    }
+    
+    void bench_modrm(){
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        emu.registers[EBX] = 0x9000;
+        
+        for(uint32_t i = 0; i < sizeof(modrm_cases) / sizeof(modrm_cases[0]); i++){
+            const ModRMCase &form = modrm_cases[i];
+            _write_code(emu, 0x8000, form.code, sizeof(form.code));
+            
+            ModRM modrm;
+            _measure(std::string("parse_modrm/") + form.name, BENCH_ITERATIONS, [&](uint64_t n){
+                for(uint64_t j = 0; j < n; j++){
+                    uint32_t index = 0;
+                    emu._parse_modrm(modrm, 0x8000, index);
+                    sink += index;
+                }
+            });
+            
+            if(!form.has_address) continue;
+            _measure(std::string("calc_memory_address/") + form.name, BENCH_ITERATIONS, [&](uint64_t n){
+                uint32_t total = 0;
+                for(uint64_t j = 0; j < n; j++) total += emu._calc_memory_address(modrm);
+                sink += total;
+            });
+        }
+    }
+    
+    //64KiBの範囲を4バイトずつ読み書きする
+    void bench_memory(){
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        
+        _measure("get_memory32", BENCH_ITERATIONS, [&](uint64_t n){
+            uint32_t total = 0;
+            for(uint64_t i = 0; i < n; i++) total += emu._get_memory32(0x10000 + ((i * 4) & 0xFFFC));
+            sink += total;
+        });
+        _measure("set_memory32", BENCH_ITERATIONS, [&](uint64_t n){
+            for(uint64_t i = 0; i < n; i++) emu._set_memory32(0x10000 + ((i * 4) & 0xFFFC), i);
+            sink += emu._get_memory32(0x10000);
+        });
+        
+        //rep movsbで64KiBをコピーする(ホストのmemcpyと比べる)
+        const uint8_t movs[] = {0xF3, 0xA4};   //rep movsb
+        _write_code(emu, 0x7c00, movs, sizeof(movs));
+        Instruction inst;
+        emu._decode(0x7c00, inst);
+        
+        _measure("rep_movsb_64k", BENCH_ITERATIONS / 1000, [&](uint64_t n){
+            for(uint64_t i = 0; i < n; i++){
+                emu.registers[ESI] = 0x10000;
+                emu.registers[EDI] = 0x20000;
+                emu.registers[ECX] = 0x10000;
+                inst.handler(&emu, inst);
+            }
+            sink += emu.registers[EDI];
+        });
+        std::vector<uint8_t> src(0x10000), dst(0x10000);
+        _measure("host_memcpy_64k", BENCH_ITERATIONS / 1000, [&](uint64_t n){
+            for(uint64_t i = 0; i < n; i++){
+                memcpy(&dst[0], &src[0], dst.size());
+                asm volatile("" : : "r"(&dst[0]) : "memory");
+            }
+            sink += dst[0];
+        });
+    }
+    
+    void bench_stack(){
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        
+        _measure("push32_pop32", BENCH_ITERATIONS, [&](uint64_t n){
+            uint32_t total = 0;
+            for(uint64_t i = 0; i < n; i++){
+                emu._push32(i);
+                total += emu._pop32();
+            }
+            sink += total;
+        });
+    }
+    
+    //フラグは記録するだけのときと、eflagsまで求めるときを分けて測る
+    void bench_flags(){
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        
+        _measure("update_eflags_sub", BENCH_ITERATIONS, [&](uint64_t n){
+            for(uint64_t i = 0; i < n; i++){
+                uint32_t v1 = i;
+                emu._update_eflags_sub(v1, 5, v1 - 5);
+            }
+            sink += emu.flags_result;
+        });
+        _measure("materialize_eflags", BENCH_ITERATIONS, [&](uint64_t n){
+            for(uint64_t i = 0; i < n; i++){
+                uint32_t v1 = i;
+                emu._update_eflags_sub(v1, 5, v1 - 5);
+                emu._materialize_eflags();
+            }
+            sink += emu.eflags;
+        });
+    }
+    
+    //直前の比較の結果が毎回変わる条件分岐
+    void bench_jcc(){
+        const struct{
+            const char *name;
+            uint8_t opecode;
+        } jccs[] = {
+            {"jcc/jz", 0x74},
+            {"jcc/jl", 0x7C},
+            {"jcc/jle", 0x7E}
+        };
+        
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        for(uint32_t i = 0; i < sizeof(jccs) / sizeof(jccs[0]); i++){
+            const uint8_t code[] = {jccs[i].opecode, 0x02};
+            _write_code(emu, 0x7c00, code, sizeof(code));
+            
+            Instruction inst;
+            emu._decode(0x7c00, inst);
+            
+            _measure(jccs[i].name, BENCH_ITERATIONS, [&](uint64_t n){
+                uint32_t total = 0;
+                for(uint64_t j = 0; j < n; j++){
+                    uint32_t v1 = j & 7;
+                    emu._update_eflags_sub(v1, 4, v1 - 4);
+                    emu.eip = 0x7c02;
+                    inst.handler(&emu, inst);
+                    total += emu.eip;
+                }
+                sink += total;
+            });
+        }
+    }
+    
+    //ゲストのループをexec()/run()/JITで実行してMIPSを求める
+    void bench_guest(){
+        const uint8_t program[] = {
+            0xB9, 0x00, 0x00, 0x00, 0x00,   //mov ecx, 0
+            0xB8, 0x00, 0x00, 0x00, 0x00,   //mov eax, 0
+            0xBA,                           //mov edx, BENCH_GUEST_LOOPS
+            (uint8_t)BENCH_GUEST_LOOPS, (uint8_t)(BENCH_GUEST_LOOPS >> 8),
+            (uint8_t)(BENCH_GUEST_LOOPS >> 16), (uint8_t)(BENCH_GUEST_LOOPS >> 24),
+            0xBB, 0x00, 0x00, 0x01, 0x00,   //mov ebx, 0x10000
+            0x01, 0xC8,                     //add eax, ecx
+            0x89, 0x03,                     //mov [ebx], eax
+            0x41,                           //inc ecx
+            0x3B, 0xCA,                     //cmp ecx, edx
+            0x7C, 0xF7,                     //jl 0x7c14
+            0xE9                            //jmp 0
+        };
+        const char *names[] = {"guest/exec", "guest/run", "guest/jit"};
+        
+        for(int mode = 0; mode < 3; mode++){
+            double best = 0;
+            uint64_t count = 0;
+            
+            for(int i = 0; i < BENCH_REPEAT; i++){
+                emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+                _write_code(emu, 0x7c00, program, sizeof(program));
+                uint32_t end = 0x7c00 + sizeof(program) + 4;
+                emu._set_memory32(end - 4, 0 - end);
+                if(mode == 2) emu.set_jit(true);
+                
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                if(mode == 0){
+                    while(emu.exec());
+                }
+                else{
+                    emu.run();
+                }
+                double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+                
+                if(i == 0 || ns < best) best = ns;
+                count = emu.get_instruction_count();
+                sink += emu.registers[EAX];
+            }
+            _add(names[mode], count, best / count, count / best * 1000);
+        }
+    }
+    
+    //commitは比較のために結果に書いておくだけ
+    bool write_json(const char *filename, const char *commit){
+        FILE *out = fopen(filename, "w");
+        if(out == NULL){
+            fprintf(stderr, "error : failed to open result file.\n");
+            return false;
+        }
+        
+        fprintf(out, "{\n");
+        fprintf(out, "  \"commit\": \"%s\",\n", commit);
+        fprintf(out, "  \"compiler\": \"%s\",\n", __VERSION__);
+        fprintf(out, "  \"time\": %lld,\n", (long long)time(NULL));
+        fprintf(out, "  \"repeat\": %d,\n", BENCH_REPEAT);
+        fprintf(out, "  \"results\": [\n");
+        for(uint32_t i = 0; i < results.size(); i++){
+            const BenchResult &result = results[i];
+            fprintf(out, "    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.4f",
+                result.name.c_str(), (unsigned long long)result.iterations, result.ns_per_op);
+            if(result.mips > 0) fprintf(out, ", \"mips\": %.2f", result.mips);
+            fprintf(out, "}%s\n", (i + 1 < results.size()) ? "," : "");
+        }
+        fprintf(out, "  ]\n");
+        fprintf(out, "}\n");
+        
+        fclose(out);
+        return true;
+    }
+};
+
+int main(int argc, char *argv[]){
+    //emu_bench [result_file [commit]]
+    const char *filename = (argc > 1) ? argv[1] : RESULT_FILE;
+    const char *commit = (argc > 2) ? argv[2] : "unknown";
+    
+    EmulatorBench bench;
+    bench.bench_dispatch();
+    bench.bench_modrm();
+    bench.bench_memory();
+    bench.bench_stack();
+    bench.bench_flags();
+    bench.bench_jcc();
+    bench.bench_guest();
+    
+    if(!bench.write_json(filename, commit)) return -1;
+    printf("result : %s\n", filename);
+    return 0;
+}
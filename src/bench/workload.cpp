@@ -0,0 +1,210 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "emulator.hpp"
+
+//emu_workload : ゲストのプログラム集を実行してMIPSを測り、基準より遅くなっていないか調べる
+//  emu_workload [-r repeat] [-t threshold_percent] [-b baseline] [-w] corpus
+//  -w は今回の結果を基準として書く
+//結果が違う・止まり方がおかしい・基準よりthreshold%以上遅いときは0以外で終わる
+
+//make workload から渡される
+#ifndef BASELINE_FILE
+#define BASELINE_FILE "bin/workload_baseline.txt"
+#endif
+
+static const uint32_t WORKLOAD_MEMORY_SIZE = 1024 * 1024;
+static const uint32_t WORKLOAD_ENTRY = 0x7c00;
+static const uint32_t WORKLOAD_ESP = 0x7c00;
+//暴走したときの上限
+static const uint64_t WORKLOAD_MAX_INSTRUCTIONS = 10ULL * 1000 * 1000 * 1000;
+
+static const char *mode_names[] = {"interp", "jit"};
+
+typedef struct{
+    std::string name;
+    std::string program;
+    uint32_t expected;
+} Workload;
+
+typedef struct{
+    StopReason reason;
+    uint32_t eax;
+    uint64_t instruction_count;
+    //一番速かった回
+    double seconds;
+} WorkloadResult;
+
+static void usage(const char *name){
+    fprintf(stderr, "usage : %s [-r repeat] [-t threshold_percent] [-b baseline] [-w] corpus\n", name);
+    exit(-1);
+}
+
+//1行に「name program expected_eax」。#から後はコメント
+static bool load_corpus(const char *filename, std::vector<Workload> &workloads){
+    FILE *file = fopen(filename, "r");
+    if(file == NULL){
+        fprintf(stderr, "error : failed to read corpus file.\n");
+        return false;
+    }
+    
+    char line[1024];
+    while(fgets(line, sizeof(line), file) != NULL){
+        char *comment = strchr(line, '#');
+        if(comment != NULL) *comment = '\0';
+        
+        char name[256], program[768];
+        unsigned int expected;
+        int n = sscanf(line, "%255s %767s %i", name, program, &expected);
+        if(n <= 0) continue;
+        if(n != 3){
+            fprintf(stderr, "error : invalid corpus line. %s\n", line);
+            fclose(file);
+            return false;
+        }
+        
+        Workload workload;
+        workload.name = name;
+        workload.program = program;
+        workload.expected = expected;
+        workloads.push_back(workload);
+    }
+    fclose(file);
+    return true;
+}
+
+//1行に「name mode mips」
+static std::map<std::string, double> load_baseline(const char *filename){
+    std::map<std::string, double> baseline;
+    FILE *file = fopen(filename, "r");
+    if(file == NULL) return baseline;
+    
+    char line[512];
+    while(fgets(line, sizeof(line), file) != NULL){
+        char name[256], mode[32];
+        double mips;
+        if(line[0] == '#') continue;
+        if(sscanf(line, "%255s %31s %lf", name, mode, &mips) == 3){
+            baseline[std::string(name) + " " + mode] = mips;
+        }
+    }
+    fclose(file);
+    return baseline;
+}
+
+static bool run_workload(const Workload &workload, bool use_jit, int repeat, WorkloadResult &result){
+    for(int i = 0; i < repeat; i++){
+        emulator emu(WORKLOAD_MEMORY_SIZE, WORKLOAD_ENTRY, WORKLOAD_ESP);
+        if(!emu.load_program(workload.program.c_str())) return false;
+        if(use_jit) emu.set_jit(true);
+        
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        StopReason reason = emu.run(WORKLOAD_MAX_INSTRUCTIONS);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        
+        if(i == 0 || seconds < result.seconds) result.seconds = seconds;
+        result.reason = reason;
+        result.eax = emu.get_register32(EAX);
+        result.instruction_count = emu.get_instruction_count();
+        if(reason != STOP_HALT) break;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]){
+    int repeat = 5;
+    double threshold = 10;
+    const char *baseline_file = BASELINE_FILE;
+    bool write_baseline = false;
+    
+    int opt;
+    while((opt = getopt(argc, argv, "r:t:b:w")) != -1){
+        switch(opt){
+            case 'r':
+                repeat = atoi(optarg);
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            case 'b':
+                baseline_file = optarg;
+                break;
+            case 'w':
+                write_baseline = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind + 1 != argc || repeat < 1) usage(argv[0]);
+    
+    std::vector<Workload> workloads;
+    if(!load_corpus(argv[optind], workloads)) return -1;
+    std::map<std::string, double> baseline = load_baseline(baseline_file);
+    
+    FILE *out = NULL;
+    if(write_baseline){
+        out = fopen(baseline_file, "w");
+        if(out == NULL){
+            fprintf(stderr, "error : failed to open baseline file.\n");
+            return -1;
+        }
+        fprintf(out, "#name mode mips\n");
+    }
+    
+    int failures = 0;
+    printf("%-12s %-6s %12s %10s %10s %10s  %s\n", "#name", "mode", "instructions", "time_ms", "MIPS", "baseline", "status");
+    for(uint32_t i = 0; i < workloads.size(); i++){
+        const Workload &workload = workloads[i];
+        
+        for(int mode = 0; mode < 2; mode++){
+            WorkloadResult result;
+            if(!run_workload(workload, mode == 1, repeat, result)){
+                printf("%-12s %-6s error\n", workload.name.c_str(), mode_names[mode]);
+                failures++;
+                continue;
+            }
+            
+            double mips = result.instruction_count / result.seconds / 1e6;
+            std::string key = workload.name + " " + mode_names[mode];
+            std::map<std::string, double>::iterator it = baseline.find(key);
+            
+            const char *status = "ok";
+            if(result.reason != STOP_HALT){
+                status = "not halted";
+            }
+            else if(result.eax != workload.expected){
+                status = "wrong result";
+            }
+            else if(!write_baseline && it != baseline.end() && mips < it->second * (1 - threshold / 100)){
+                status = "regression";
+            }
+            if(strcmp(status, "ok") != 0) failures++;
+            
+            printf("%-12s %-6s %12llu %10.2f %10.2f", workload.name.c_str(), mode_names[mode],
+                (unsigned long long)result.instruction_count, result.seconds * 1000, mips);
+            if(it != baseline.end()) printf(" %10.2f", it->second);
+            else printf(" %10s", "-");
+            printf("  %s", status);
+            if(result.eax != workload.expected) printf(" (eax=%08x, expected %08x)", result.eax, workload.expected);
+            printf("\n");
+            
+            if(out != NULL) fprintf(out, "%s %s %.2f\n", workload.name.c_str(), mode_names[mode], mips);
+        }
+    }
+    
+    if(out != NULL){
+        fclose(out);
+        printf("baseline : %s\n", baseline_file);
+    }
+    if(failures > 0){
+        fprintf(stderr, "error : %d workload run(s) failed.\n", failures);
+        return 1;
+    }
+    return 0;
+}
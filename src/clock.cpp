@@ -0,0 +1,47 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "clock.hpp"
+
+void init_cycle_table(CycleTable &table, uint8_t cycles){
+    memset(table.one_byte, cycles, sizeof(table.one_byte));
+    memset(table.two_byte, cycles, sizeof(table.two_byte));
+}
+
+bool load_cycle_table(const char *filename, CycleTable &table){
+    FILE *file = fopen(filename, "r");
+    if(file == NULL){
+        fprintf(stderr, "error : failed to read cycle table file.\n");
+        return false;
+    }
+    
+    init_cycle_table(table);
+    char line[256];
+    int line_number = 0;
+    bool ok = true;
+    while(fgets(line, sizeof(line), file) != NULL){
+        line_number++;
+        
+        char *comment = strchr(line, '#');
+        if(comment != NULL) *comment = '\0';
+        
+        char fields[3][32];
+        int n = sscanf(line, "%31s %31s %31s", fields[0], fields[1], fields[2]);
+        if(n <= 0) continue;
+        
+        bool two_byte = (n == 3);
+        unsigned long opcode = strtoul(fields[two_byte ? 1 : 0], NULL, 16);
+        unsigned long cycles = strtoul(fields[n - 1], NULL, 0);
+        if(n < 2 || (two_byte && strtoul(fields[0], NULL, 16) != 0x0F) || opcode >= CYCLE_TABLE_SIZE || cycles == 0 || cycles > 255){
+            fprintf(stderr, "error : invalid cycle table line %d.\n", line_number);
+            ok = false;
+            continue;
+        }
+        
+        if(two_byte) table.two_byte[opcode] = cycles;
+        else table.one_byte[opcode] = cycles;
+    }
+    
+    fclose(file);
+    return ok;
+}
@@ -0,0 +1,136 @@
+#include <cerrno>
+#include <unistd.h>
+#include "console.hpp"
+
+const int bios_to_terminal[] = {30, 34 ,32, 36, 31, 35, 33, 37};
+
+console::console(){
+    sink = CONSOLE_STDOUT;
+    fd = STDOUT_FILENO;
+    file = NULL;
+    head = 0;
+    count = 0;
+    attribute = -1;
+}
+
+console::~console(){
+    finish();
+    if(file != NULL) fclose(file);
+}
+
+bool console::set_sink(ConsoleSink sink, const char *filename){
+    finish();
+    
+    FILE *next = NULL;
+    if(sink == CONSOLE_FILE){
+        next = fopen(filename, "wb");
+        if(next == NULL){
+            fprintf(stderr, "error : failed to open console output file.\n");
+            return false;
+        }
+    }
+    
+    if(file != NULL) fclose(file);
+    file = next;
+    fd = file != NULL ? fileno(file) : STDOUT_FILENO;
+    this->sink = sink;
+    return true;
+}
+
+ConsoleSink console::get_sink(){
+    return sink;
+}
+
+void console::write(uint8_t ch){
+    if(attribute != -1) _reset_attribute();
+    _put(ch);
+    
+    //端末には行単位で見えるようにする
+    if(ch == '\n' && sink == CONSOLE_STDOUT) flush();
+}
+
+void console::write_color(uint8_t ch, uint8_t color){
+    color &= 0x0F;
+    if(attribute != color){
+        char buf[16];
+        uint8_t terminal_color = bios_to_terminal[color & 0x07];
+        uint8_t bright = (color & 0x08) >> 3;
+        
+        int len = sprintf(buf, "\x1b[%d;%dm", bright, terminal_color);
+        _put_string(buf, len);
+        attribute = color;
+    }
+    _put(ch);
+    
+    if(ch == '\n' && sink == CONSOLE_STDOUT) flush();
+}
+
+void console::finish(){
+    if(attribute != -1) _reset_attribute();
+    flush();
+}
+
+void console::flush(){
+    if(count == 0) return;
+    
+    //stdioに残っている分を先に出す
+    if(sink == CONSOLE_STDOUT) fflush(stdout);
+    
+    //折り返している場合は2回に分けて書く
+    while(count > 0){
+        size_t n = head + count > CONSOLE_BUFFER_SIZE ? CONSOLE_BUFFER_SIZE - head : count;
+        ssize_t written = ::write(fd, buffer + head, n);
+        if(written < 0){
+            if(errno == EINTR) continue;
+            //書けなかった分は次の機会に回す
+            return;
+        }
+        
+        head = (head + written) % CONSOLE_BUFFER_SIZE;
+        count -= written;
+    }
+    head = 0;
+}
+
+const char *console::get_output(){
+    return captured.data();
+}
+
+size_t console::get_output_size(){
+    return captured.size();
+}
+
+void console::clear_output(){
+    captured.clear();
+}
+
+void console::_put(char ch){
+    switch(sink){
+        case CONSOLE_MEMORY:
+            captured.push_back(ch);
+            return;
+        case CONSOLE_DISCARD:
+            return;
+        default:
+            break;
+    }
+    
+    if(count == CONSOLE_BUFFER_SIZE){
+        flush();
+        //書き出せなかったら捨てる
+        if(count == CONSOLE_BUFFER_SIZE) return;
+    }
+    buffer[(head + count) % CONSOLE_BUFFER_SIZE] = ch;
+    count++;
+}
+
+void console::_put_string(const char *str, size_t n){
+    for(size_t i = 0; i < n; i++){
+        _put(str[i]);
+    }
+}
+
+void console::_reset_attribute(){
+    attribute = -1;
+    _put_string("\x1b[0m", 4);
+}
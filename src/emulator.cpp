@@ -1,73 +1,487 @@
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "emulator.hpp"
+#include "jit.hpp"
+#include "console.hpp"
+#include "uart.hpp"
+#include "pic.hpp"
+#include "pit.hpp"
+#include "clock.hpp"
+#include "io_bus.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "loader.hpp"
 
-emulator::emulator(uint32_t memory_size, uint32_t init_eip, uint32_t init_esp){
-    for(int i = 0; i < REGISTERS_COUNT; i++) registers[i] = 0;
-    memory = new uint8_t[memory_size]();
+//このスレッドで実行中のエミュレータ(シグナルハンドラから参照する)
+static thread_local emulator *current_emulator = NULL;
+static struct sigaction previous_segv_action;
+//スナップショットの通し番号(0は無し)
+static std::atomic<uint64_t> snapshot_count(0);
+
+emulator::emulator(uint64_t memory_size, uint32_t init_eip, uint32_t init_esp){
+    _init(_create_group(new guest_memory(memory_size)), init_eip, init_esp);
+}
+
+//imageの内容から始める。メモリはimageと共有され、書き込んだページだけコピーされる
+emulator::emulator(const memory_image &image, uint32_t init_eip, uint32_t init_esp){
+    _init(_create_group(new guest_memory(image)), init_eip, init_esp);
+}
+
+emulator::emulator(emulator &cpu, uint32_t init_eip, uint32_t init_esp){
+    _init(cpu.group, init_eip, init_esp);
+}
+
+//JITの書き込みチェックは範囲を見ないので、code_mapはアドレス空間全体分を用意しておく
+CpuGroup *emulator::_create_group(guest_memory *guest){
+    CpuGroup *group = new CpuGroup();
+    group->guest = guest;
+    group->code_map = static_cast<uint8_t *>(guest_memory::reserve(CODE_MAP_SIZE + DIRTY_MAP_SIZE, PROT_READ | PROT_WRITE));
+    guest->track_writes(group->code_map + CODE_MAP_SIZE);
+    group->cpu_count = 0;
+    group->next_index = 0;
+    return group;
+}
+
+void emulator::_init(CpuGroup *group, uint32_t init_eip, uint32_t init_esp){
+    _install_fault_handler();
+    
+    this->group = group;
+    {
+        std::lock_guard<std::mutex> locked(group->lock);
+        group->cpus.push_back(this);
+        group->cpu_count = group->cpus.size();
+        cpu_index = group->next_index++;
+    }
+    remote_writes.clear();
+    code_changed = false;
+    
+    guest = group->guest;
+    for(int i = 0; i <= REGISTERS_COUNT; i++) registers[i] = 0;
+    memory = guest->get_base();
+    memory_size = guest->get_size();
     eip = init_eip;
     registers[ESP] = init_esp;
     eflags = 0;
+    flags_op = FLAGS_NONE;
+    instruction_count = 0;
+    cycle_count = 0;
+    init_cycle_table(cycle_table);
+    max_cycles = 1;
+    
+    decoded_page_count = (memory_size + DECODE_PAGE_SIZE - 1) >> DECODE_PAGE_SHIFT;
+    decoded_pages = static_cast<DecodedPage **>(guest_memory::reserve((size_t)decoded_page_count * sizeof(DecodedPage *), PROT_READ | PROT_WRITE));
+    code_map = group->code_map;
+    dirty_map = code_map + CODE_MAP_SIZE;
+    dirty_base = 0;
+    decode_cache_hits = 0;
+    decode_cache_misses = 0;
+    
+    current_block = NULL;
+    current_instruction = NULL;
+    block_end = NULL;
+    blocks_stale = false;
+    block_count = 0;
+    block_chain_hits = 0;
+    
+    profile = NULL;
+    trace = NULL;
+    trace_writes = NULL;
+    bus = new io_bus();
+    console_device = new console();
+    serial = new uart(console_device);
+    bus->attach(serial, UART_PORT, UART_PORT_COUNT);
+    clock = new virtual_clock(&cycle_count);
+    interrupt_controller = new pic();
+    bus->attach(interrupt_controller, PIC_MASTER_PORT, PIC_PORT_COUNT);
+    bus->attach(interrupt_controller, PIC_SLAVE_PORT, PIC_PORT_COUNT);
+    timer = new pit(clock);
+    bus->attach(timer, PIT_PORT, PIT_PORT_COUNT);
+    
+    idt_base = 0;
+    idt_limit = 0;
+    _recheck_events();
+    run_limit = UINT64_MAX;
+    interrupt_count = 0;
+    
+    stop_requested = false;
+    if(pipe2(stop_pipe, O_NONBLOCK | O_CLOEXEC) != 0){
+        stop_pipe[0] = -1;
+        stop_pipe[1] = -1;
+    }
+    bus->set_wake_fd(stop_pipe[0]);
+    
+    jit_compiler = NULL;
+    jit_context.registers = registers;
+    jit_context.eflags = &eflags;
+    jit_context.memory = memory;
+    jit_context.code_map = code_map;
+    jit_context.side_exit = 0;
+    jit_context.instruction = 0;
+    native_block = NULL;
+    jit_threshold = JIT_THRESHOLD;
+    stop_reason = STOP_HALT;
+    fault_address = 0;
+    
+    idle_address = 0;
+    idle_iterations = 0;
+    woken_version = UINT64_MAX;
+    idle_waits = 0;
     
     _init_instructions();
 }
 
 emulator::~emulator(){
-    delete memory;
+    _flush_blocks();
+    delete jit_compiler;
+    delete timer;
+    delete interrupt_controller;
+    delete clock;
+    delete serial;
+    delete console_device;
+    delete bus;
+    delete profile;
+    if(stop_pipe[0] >= 0){
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+    }
+    for(uint32_t i = 0; i < decoded_page_list.size(); i++) delete decoded_pages[decoded_page_list[i]];
+    guest_memory::release(decoded_pages, (size_t)decoded_page_count * sizeof(DecodedPage *));
+    
+    bool last;
+    {
+        std::lock_guard<std::mutex> locked(group->lock);
+        group->cpus.erase(std::find(group->cpus.begin(), group->cpus.end(), this));
+        group->cpu_count = group->cpus.size();
+        last = group->cpus.empty();
+    }
+    if(last){
+        guest_memory::release(group->code_map, CODE_MAP_SIZE + DIRTY_MAP_SIZE);
+        delete group->guest;
+        delete group;
+    }
 }
 
 void emulator::_init_instructions(){
-    for (int i = 0; i < INSTRUCTION_NUM; i++) instructions[i] = 0;
+    for (int i = 0; i < INSTRUCTION_NUM; i++){
+        instructions[i] = 0;
+        instruction_formats[i] = 0;
+        instructions_0f[i] = 0;
+        instruction_formats_0f[i] = 0;
+    }
+    
+    //add, or, and, sub, xor, cmp (adc, sbbは未実装)
+    for(int op = 0; op < 8; op++){
+        if(op == 2 || op == 3) continue;
+        instructions[op * 8 + 0x01] = _handler<&emulator::_alu_rm32_r32>;
+        instructions[op * 8 + 0x03] = _handler<&emulator::_alu_r32_rm32>;
+        instructions[op * 8 + 0x05] = _handler<&emulator::_alu_eax_imm32>;
+    }
+    instructions[0x01] = _handler<&emulator::_add_rm32_r32>;
+    instructions[0x38] = _handler<&emulator::_cmp_rm8_r8>;
+    instructions[0x3B] = _handler<&emulator::_cmp_r32_rm32>;
+    instructions[0x3C] = _handler<&emulator::_cmp_al_imm8>;
+    for(int i = 0; i < 8; i++){
+        instructions[0x40 + i] = _handler<&emulator::_inc_r32>;
+        instructions[0x48 + i] = _handler<&emulator::_dec_r32>;
+        instructions[0x50 + i] = _handler<&emulator::_push_r32>;
+        instructions[0x58 + i] = _handler<&emulator::_pop_r32>;
+        instructions[0xB0 + i] = _handler<&emulator::_mov_r8_imm8>;
+        instructions[0xB8 + i] = _handler<&emulator::_mov_r32_imm32>;
+    }
+    instructions[0x6A] = _handler<&emulator::_push_imm8>;
+    instructions[0x68] = _handler<&emulator::_push_imm32>;
+    instructions[0x69] = _handler<&emulator::_imul_r32_rm32_imm>;
+    instructions[0x6B] = _handler<&emulator::_imul_r32_rm32_imm>;
+    
+    //Jccは短い形(70+cc)と長い形(0F 80+cc)で同じハンドラを使う(パリティは未実装)
+    InstructionHandler jcc[16] = {
+        _handler<&emulator::_jo>, _handler<&emulator::_jno>, _handler<&emulator::_jc>, _handler<&emulator::_jnc>,
+        _handler<&emulator::_jz>, _handler<&emulator::_jnz>, _handler<&emulator::_jbe>, _handler<&emulator::_ja>,
+        _handler<&emulator::_js>, _handler<&emulator::_jns>, NULL, NULL,
+        _handler<&emulator::_jl>, _handler<&emulator::_jge>, _handler<&emulator::_jle>, _handler<&emulator::_jg>
+    };
+    for(int i = 0; i < 16; i++){
+        instructions[0x70 + i] = jcc[i];
+        instructions_0f[0x80 + i] = jcc[i];
+    }
+    
+    //81は全部即値との演算
+    instructions[0x81] = _handler<&emulator::_alu_rm32_imm>;
+    instructions[0x83] = _handler<&emulator::_code_83>;
+    instructions[0x84] = _handler<&emulator::_test_rm8_r8>;
+    instructions[0x85] = _handler<&emulator::_test_rm32_r32>;
+    instructions[0x88] = _handler<&emulator::_mov_rm8_r8>;
+    instructions[0x89] = _handler<&emulator::_mov_rm32_r32>;
+    instructions[0x8A] = _handler<&emulator::_mov_r8_rm8>;
+    instructions[0x8B] = _handler<&emulator::_mov_r32_rm32>;
+    instructions[0x8D] = _handler<&emulator::_lea_r32_m32>;
+    instructions[0x86] = _handler<&emulator::_xchg_rm8_r8>;
+    instructions[0x87] = _handler<&emulator::_xchg_rm32_r32>;
+    instructions[0x90] = _handler<&emulator::_nop>;
+    for(int i = 1; i < 8; i++) instructions[0x90 + i] = _handler<&emulator::_xchg_eax_r32>;
+    instructions[0x99] = _handler<&emulator::_cdq>;
+    instructions[0xA0] = _handler<&emulator::_mov_al_moffs8>;
+    instructions[0xA1] = _handler<&emulator::_mov_eax_moffs32>;
+    instructions[0xA2] = _handler<&emulator::_mov_moffs8_al>;
+    instructions[0xA3] = _handler<&emulator::_mov_moffs32_eax>;
+    instructions[0xA8] = _handler<&emulator::_test_al_imm8>;
+    instructions[0xA9] = _handler<&emulator::_test_eax_imm32>;
+    for(int i = 0; i < 2; i++){
+        instructions[0xA4 + i] = _string_handler<&emulator::_movs>;
+        instructions[0xA6 + i] = _string_handler<&emulator::_cmps>;
+        instructions[0xAA + i] = _string_handler<&emulator::_stos>;
+        instructions[0xAC + i] = _string_handler<&emulator::_lods>;
+        instructions[0xAE + i] = _string_handler<&emulator::_scas>;
+    }
+    instructions[0xC0] = _handler<&emulator::_code_shift>;
+    instructions[0xC1] = _handler<&emulator::_code_shift>;
+    instructions[0xC3] = _handler<&emulator::_ret>;
+    instructions[0xC6] = _handler<&emulator::_mov_rm8_imm8>;
+    instructions[0xC7] = _handler<&emulator::_mov_rm32_imm32>;
+    instructions[0xC9] = _handler<&emulator::_leave>;
+    instructions[0xCD] = _handler<&emulator::_swi>;
+    instructions[0x9C] = _handler<&emulator::_pushfd>;
+    instructions[0x9D] = _handler<&emulator::_popfd>;
+    instructions[0xCF] = _handler<&emulator::_iret>;
+    instructions[0xFA] = _handler<&emulator::_cli>;
+    instructions[0xFB] = _handler<&emulator::_sti>;
+    instructions[0xE8] = _handler<&emulator::_call_rel32>;
+    instructions[0xF4] = _handler<&emulator::_hlt>;
+    instructions[0xE9] = _handler<&emulator::_near_jump>;
+    instructions[0xEB] = _handler<&emulator::_short_jump>;
+    for(int i = 0; i < 2; i++){
+        instructions[0xE4 + i] = _handler<&emulator::_in>;
+        instructions[0xE6 + i] = _handler<&emulator::_out>;
+        instructions[0xEC + i] = _handler<&emulator::_in>;
+        instructions[0xEE + i] = _handler<&emulator::_out>;
+    }
+    for(int i = 0; i < 4; i++){
+        instructions[0xD0 + i] = _handler<&emulator::_code_shift>;
+    }
+    instructions[0xF7] = _handler<&emulator::_code_f7>;
+    instructions[0xFC] = _handler<&emulator::_cld>;
+    instructions[0xFD] = _handler<&emulator::_std>;
+    instructions[0xFF] = _handler<&emulator::_code_ff>;
     
-    instructions[0x01] = &emulator::_add_rm32_r32;
-    instructions[0x3B] = &emulator::_cmp_r32_rm32;
-    instructions[0x3C] = &emulator::_cmp_al_imm8;
+    instructions_0f[0x01] = _handler<&emulator::_code_0f_01>;
+    instructions_0f[0x31] = _handler<&emulator::_rdtsc>;
+    instructions_0f[0xA2] = _handler<&emulator::_cpuid>;
+    instructions_0f[0xAE] = _handler<&emulator::_fence>;
+    instructions_0f[0xB1] = _handler<&emulator::_cmpxchg_rm32_r32>;
+    instructions_0f[0xC1] = _handler<&emulator::_xadd_rm32_r32>;
+    instructions_0f[0xAF] = _handler<&emulator::_imul_r32_rm32>;
+    instructions_0f[0xB6] = _handler<&emulator::_movzx_r32_rm8>;
+    instructions_0f[0xB7] = _handler<&emulator::_movzx_r32_rm16>;
+    instructions_0f[0xBE] = _handler<&emulator::_movsx_r32_rm8>;
+    instructions_0f[0xBF] = _handler<&emulator::_movsx_r32_rm16>;
+    
+    //オペコードに続くModRM・即値の有無
+    for(int op = 0; op < 8; op++){
+        instruction_formats[op * 8 + 0x01] = FORMAT_MODRM;
+        instruction_formats[op * 8 + 0x03] = FORMAT_MODRM;
+        instruction_formats[op * 8 + 0x05] = FORMAT_IMM32;
+    }
+    instruction_formats[0x38] = FORMAT_MODRM;
+    instruction_formats[0x3C] = FORMAT_IMM8;
     for(int i = 0; i < 8; i++){
-        instructions[0x40 + i] = &emulator::_inc_r32;
-        instructions[0x50 + i] = &emulator::_push_r32;
-        instructions[0x58 + i] = &emulator::_pop_r32;
-        instructions[0xB0 + i] = &emulator::_mov_r8_imm8;
-        instructions[0xB8 + i] = &emulator::_mov_r32_imm32;
-    }
-    instructions[0x6A] = &emulator::_push_imm8;
-    instructions[0x68] = &emulator::_push_imm8;
-   
-    instructions[0x70] = &emulator::_jo;
-    instructions[0x71] = &emulator::_jno;
-    instructions[0x72] = &emulator::_jc;
-    instructions[0x73] = &emulator::_jnc;
-    instructions[0x74] = &emulator::_jz;
-    instructions[0x75] = &emulator::_jnz;
-    instructions[0x78] = &emulator::_js;
-    instructions[0x79] = &emulator::_jns;
-    instructions[0x7C] = &emulator::_jl;
-    instructions[0x7E] = &emulator::_jle;
-    
-    instructions[0x83] = &emulator::_code_83;
-    instructions[0x89] = &emulator::_mov_r8_rm8; //使ってないけど作っちゃったのでとりあえず
-    instructions[0x89] = &emulator::_mov_rm32_r32;
-    instructions[0x8A] = &emulator::_mov_r8_rm8;
-    instructions[0x8B] = &emulator::_mov_r32_rm32;
-    instructions[0xC3] = &emulator::_ret;
-    instructions[0xC7] = &emulator::_mov_rm32_imm32;
-    instructions[0xC9] = &emulator::_leave;
-    instructions[0xCD] = &emulator::_swi;
-    instructions[0xE8] = &emulator::_call_rel32;
-    instructions[0xE9] = &emulator::_near_jump;
-    instructions[0xEB] = &emulator::_short_jump;
-    instructions[0xEC] = &emulator::_in_al_dx;
-    instructions[0xEE] = &emulator::_out_dx_al;
-    instructions[0xFF] = &emulator::_code_ff;
+        instruction_formats[0xB0 + i] = FORMAT_IMM8;
+        instruction_formats[0xB8 + i] = FORMAT_IMM32;
+    }
+    instruction_formats[0x6A] = FORMAT_IMM8;
+    instruction_formats[0x68] = FORMAT_IMM32;
+    instruction_formats[0x69] = FORMAT_MODRM | FORMAT_IMM32;
+    instruction_formats[0x6B] = FORMAT_MODRM | FORMAT_IMM8;
+    for(int i = 0x70; i <= 0x7F; i++) instruction_formats[i] = FORMAT_IMM8 | FORMAT_BRANCH;
+    instruction_formats[0x81] = FORMAT_MODRM | FORMAT_IMM32 | FORMAT_LOCK;
+    instruction_formats[0x83] = FORMAT_MODRM | FORMAT_IMM8 | FORMAT_LOCK;
+    for(int i = 0x84; i <= 0x8B; i++) instruction_formats[i] = FORMAT_MODRM;
+    //LOCKを付けられる命令(adc, sbbは未実装)
+    for(int op = 0; op < 7; op++){
+        if(op == 2 || op == 3) continue;
+        instruction_formats[op * 8 + 0x01] |= FORMAT_LOCK;
+    }
+    instruction_formats[0x86] |= FORMAT_LOCK;
+    instruction_formats[0x87] |= FORMAT_LOCK;
+    instruction_formats[0x8D] = FORMAT_MODRM;
+    for(int i = 0xA0; i <= 0xA3; i++) instruction_formats[i] = FORMAT_IMM32;
+    instruction_formats[0xA8] = FORMAT_IMM8;
+    instruction_formats[0xA9] = FORMAT_IMM32;
+    //奇数のオペコードは0x66で2バイトずつになる
+    for(int i = 0xA4; i <= 0xAF; i++){
+        if(i == 0xA8 || i == 0xA9) continue;
+        instruction_formats[i] = FORMAT_STRING | ((i & 1) ? FORMAT_OPERAND_SIZE : 0);
+    }
+    instruction_formats[0xC0] = FORMAT_MODRM | FORMAT_IMM8;
+    instruction_formats[0xC1] = FORMAT_MODRM | FORMAT_IMM8;
+    instruction_formats[0xC6] = FORMAT_MODRM | FORMAT_IMM8;
+    instruction_formats[0xC7] = FORMAT_MODRM | FORMAT_IMM32;
+    for(int i = 0xD0; i <= 0xD3; i++) instruction_formats[i] = FORMAT_MODRM;
+    instruction_formats[0xC3] = FORMAT_BRANCH;
+    instruction_formats[0xCD] = FORMAT_IMM8 | FORMAT_BRANCH;
+    instruction_formats[0xCF] = FORMAT_BRANCH;
+    instruction_formats[0xE8] = FORMAT_IMM32 | FORMAT_BRANCH;
+    instruction_formats[0xE9] = FORMAT_IMM32 | FORMAT_BRANCH;
+    instruction_formats[0xEB] = FORMAT_IMM8 | FORMAT_BRANCH;
+    for(int i = 0xE4; i <= 0xE7; i++) instruction_formats[i] = FORMAT_IMM8 | FORMAT_OPERAND_SIZE;
+    for(int i = 0xEC; i <= 0xEF; i++) instruction_formats[i] = FORMAT_OPERAND_SIZE;
+    instruction_formats[0xF4] = FORMAT_BRANCH;
+    instruction_formats[0xF7] = FORMAT_MODRM | FORMAT_IMM32 | FORMAT_GROUP3 | FORMAT_LOCK;
+    instruction_formats[0xFF] = FORMAT_MODRM | FORMAT_LOCK;
+    
+    for(int i = 0x80; i <= 0x8F; i++) instruction_formats_0f[i] = FORMAT_IMM32 | FORMAT_BRANCH;
+    instruction_formats_0f[0x01] = FORMAT_MODRM;
+    //ブロックの最後に置いて、そこまでのサイクル数を読めるようにする
+    instruction_formats_0f[0x31] = FORMAT_BRANCH;
+    instruction_formats_0f[0xAE] = FORMAT_MODRM;
+    instruction_formats_0f[0xB1] = FORMAT_MODRM | FORMAT_LOCK;
+    instruction_formats_0f[0xC1] = FORMAT_MODRM | FORMAT_LOCK;
+    instruction_formats_0f[0xAF] = FORMAT_MODRM;
+    instruction_formats_0f[0xB6] = FORMAT_MODRM;
+    instruction_formats_0f[0xB7] = FORMAT_MODRM;
+    instruction_formats_0f[0xBE] = FORMAT_MODRM;
+    instruction_formats_0f[0xBF] = FORMAT_MODRM;
 };
 
-void emulator::load_program(const char *filename, uint32_t size){
-    FILE *binary;
+bool emulator::load_program(const char *filename){
+    program_image image;
+    if(!image.open(filename)) return false;
+    return load_image(image);
+}
+
+bool emulator::load_image(const program_image &image){
+    if(!image.map(*guest)) return false;
+    
+    //前に読み込んだプログラムをデコードしてあれば作り直す
+    const std::vector<ProgramSegment> &segments = image.get_segments();
+    for(size_t i = 0; i < segments.size(); i++){
+        const ProgramSegment &segment = segments[i];
+        if(segment.memory_size == 0) continue;
+        _mark_dirty(segment.address, segment.memory_size);
+        if(_has_code(segment.address, segment.memory_size)) _invalidate_code(segment.address, segment.memory_size);
+    }
+    return true;
+}
+
+void emulator::_save_state(Snapshot &state){
+    _materialize_eflags();
+    
+    state.eip = eip;
+    state.eflags = eflags;
+    memcpy(state.registers, registers, sizeof(state.registers));
+    state.instruction_count = instruction_count;
+    state.has_devices = true;
+    state.cycle_count = cycle_count;
+    state.skipped_time = clock->get_skipped();
+    state.interrupt_count = interrupt_count;
+    state.idt_base = idt_base;
+    state.idt_limit = idt_limit;
+    interrupt_controller->save_state(state.pic_chips);
+    timer->save_state(state.pit_channels);
+    serial->save_state(state.uart_state);
     
-    binary = fopen(filename, "rb");
-    if(binary == NULL){
-        fprintf(stderr, "error : failed to read program file.\n");
-        exit(-1);
+    //触ったページだけ写す
+    std::vector<uint32_t> pages;
+    guest->touched_pages(pages);
+    state.memory.assign(memory_size);
+    for(size_t i = 0; i < pages.size(); i++){
+        uint64_t address = (uint64_t)pages[i] << GUEST_PAGE_SHIFT;
+        state.memory.write(address, memory + address, std::min((uint64_t)GUEST_PAGE_SIZE, memory_size - address));
+    }
+}
+
+Snapshot *emulator::snapshot(){
+    //dirty_mapも共有しているので、差分がどのvCPUのものか分からない
+    if(group->cpu_count > 1){
+        fprintf(stderr, "error : cannot take a snapshot while the memory is shared with other vCPUs.\n");
+        return NULL;
     }
-    fread(memory + 0x7c00, 1, size, binary);
-    fclose(binary);
+    
+    Snapshot *snapshot = new Snapshot();
+    _save_state(*snapshot);
+    snapshot->id = ++snapshot_count;
+    
+    //ここから書き込んだページを記録する
+    guest->reset_dirty();
+    dirty_base = snapshot->id;
+    
+    return snapshot;
+}
+
+bool emulator::restore(const Snapshot *snapshot){
+    if(group->cpu_count > 1){
+        fprintf(stderr, "error : cannot restore a snapshot while the memory is shared with other vCPUs.\n");
+        return false;
+    }
+    if(snapshot->memory.size() != memory_size){
+        fprintf(stderr, "error : snapshot memory size does not match.\n");
+        return false;
+    }
+    
+    //別のスナップショットからの差分しか分からない場合は、今のメモリかsnapshotで触ったページを全部戻す
+    bool all = snapshot->id == 0 || snapshot->id != dirty_base;
+    uint32_t page_count = (memory_size + DIRTY_PAGE_SIZE - 1) >> DIRTY_PAGE_SHIFT;
+    uint8_t *restore_map = dirty_map;
+    std::vector<uint8_t> touched;
+    if(all){
+        std::vector<uint32_t> pages;
+        touched.assign(page_count + 8, 0);
+        guest->touched_pages(pages);
+        for(size_t i = 0; i < pages.size(); i++) touched[pages[i]] = 1;
+        snapshot->memory.touched_pages(pages);
+        for(size_t i = 0; i < pages.size(); i++) touched[pages[i]] = 1;
+        restore_map = touched.data();
+    }
+    
+    for(uint32_t page = 0; page < page_count; page++){
+        //書き込みの無いページは8ページまとめて飛ばす
+        if((page & 7) == 0 && page + 8 <= page_count){
+            uint64_t dirty;
+            memcpy(&dirty, restore_map + page, sizeof(dirty));
+            if(dirty == 0){
+                page += 7;
+                continue;
+            }
+        }
+        if(!restore_map[page]) continue;
+        
+        //ページをはみ出した書き込みは、はみ出した先のページにも印がある
+        uint32_t address = page << DIRTY_PAGE_SHIFT;
+        uint32_t size = DIRTY_PAGE_SIZE;
+        if(memory_size - address < size) size = memory_size - address;
+        if(_has_code(address, size)) _invalidate_code(address, size);
+        memcpy(memory + address, &snapshot->memory[address], size);
+        //戻したページも書き込んだページとして覚えさせる
+        dirty_map[page] = 1;
+    }
+    guest->reset_dirty();
+    dirty_base = snapshot->id;
+    
+    eip = snapshot->eip;
+    eflags = snapshot->eflags;
+    flags_op = FLAGS_NONE;
+    memcpy(registers, snapshot->registers, sizeof(snapshot->registers));
+    instruction_count = snapshot->instruction_count;
+    //RDTSCとタイマーの期限はスナップショットの時刻から続ける
+    //PITのカウントは仮想時間で数えているので、時計と一緒に戻す
+    if(snapshot->has_devices){
+        cycle_count = snapshot->cycle_count;
+        clock->set_skipped(snapshot->skipped_time);
+        interrupt_count = snapshot->interrupt_count;
+        idt_base = snapshot->idt_base;
+        idt_limit = snapshot->idt_limit;
+        interrupt_controller->restore_state(snapshot->pic_chips);
+        timer->restore_state(snapshot->pit_channels);
+        serial->restore_state(snapshot->uart_state);
+    }
+    _recheck_events();
+    
+    return true;
 }
 
 void emulator::dump_registers(){
@@ -91,22 +505,998 @@ void emulator::dump_registers(){
     fprintf(stderr, "\n");
 }
 
+void emulator::dump_statistics(){
+    uint64_t total = decode_cache_hits + decode_cache_misses;
+    
+    fprintf(stderr, "------[statistics]-----\n");
+    fprintf(stderr, "[instructions     ] %llu\n", (unsigned long long)instruction_count);
+    fprintf(stderr, "[cycles           ] %llu\n", (unsigned long long)cycle_count);
+    fprintf(stderr, "[decode cache hit ] %llu\n", (unsigned long long)decode_cache_hits);
+    fprintf(stderr, "[decode cache miss] %llu\n", (unsigned long long)decode_cache_misses);
+    fprintf(stderr, "[decode cache rate] %.2f%%\n", total ? (double)decode_cache_hits * 100 / total : 0.0);
+    fprintf(stderr, "[blocks           ] %llu\n", (unsigned long long)block_count);
+    fprintf(stderr, "[block chain hit  ] %llu\n", (unsigned long long)block_chain_hits);
+    if(jit_compiler != NULL){
+        fprintf(stderr, "[jit compiled     ] %llu\n", (unsigned long long)jit_compiler->compiled_count);
+        fprintf(stderr, "[jit flush        ] %llu\n", (unsigned long long)jit_compiler->flush_count);
+    }
+    fprintf(stderr, "[idle waits       ] %llu\n", (unsigned long long)idle_waits);
+    fprintf(stderr, "[interrupts       ] %llu\n", (unsigned long long)interrupt_count);
+    fprintf(stderr, "-----------------------\n");
+    fprintf(stderr, "\n");
+}
+
+//1命令実行する。停止するか未実装の命令、メモリ外へのアクセスならfalse
 bool emulator::exec(){
-    uint8_t code = _get_code8(0);
+    bool result;
+    
+    current_emulator = this;
+    if(sigsetjmp(fault_jmp, 0) == 0){
+        result = _exec_instruction();
+    }
+    else{
+        _recover_fault(stop_reason);
+        result = false;
+    }
+    current_emulator = NULL;
     
-    void (emulator::*ins)() = instructions[code];
-    if(ins == NULL){
-        fprintf(stderr, "error : not implemted instruction. code=0x%02x\n", code);
-        exit(-1);
+    return result;
+}
+
+bool emulator::_exec_instruction(){
+    if(code_changed) _sync_code();
+    Instruction *inst = _fetch_instruction(eip);
+    if(inst == NULL){
+        fprintf(stderr, "error : not implemted instruction. code=0x%02x\n", _get_code8(0));
+        return false;
     }
     
-    //fprintf(stderr, "[exec]code=0x%02x\n", code);
-    (this->*ins)();
+    //相対ジャンプ等は次の命令のアドレスを基準にするので先に進めておく
+    eip += inst->length;
+    inst->handler(this, *inst);
+    instruction_count++;
+    cycle_count += _get_cycles(*inst);
     
     if(eip == 0x00) return false;
     return true;
 }
 
+//停止するか、max_instructions命令実行するまで基本ブロック単位で実行する
+StopReason emulator::run(uint64_t max_instructions){
+    return _run(max_instructions, 0);
+}
+
+//eipがaddressに到達したところで止める
+StopReason emulator::run_until(uint32_t address, uint64_t max_instructions){
+    return _run(max_instructions, address);
+}
+
+uint64_t emulator::get_instruction_count(){
+    return instruction_count;
+}
+
+uint64_t emulator::get_cycle_count(){
+    return cycle_count;
+}
+
+//ブロックに覚えたサイクル数を作り直す
+void emulator::set_cycle_table(const CycleTable *table){
+    if(table != NULL) cycle_table = *table;
+    else init_cycle_table(cycle_table);
+    
+    max_cycles = 1;
+    for(int i = 0; i < CYCLE_TABLE_SIZE; i++){
+        max_cycles = std::max(max_cycles, (uint32_t)cycle_table.one_byte[i]);
+        max_cycles = std::max(max_cycles, (uint32_t)cycle_table.two_byte[i]);
+    }
+    blocks_stale = true;
+    _recheck_events();
+}
+
+void emulator::set_register32(Register reg, uint32_t value){
+    registers[reg] = value;
+}
+
+void emulator::set_eip(uint32_t value){
+    eip = value;
+}
+
+uint32_t emulator::get_eflags(){
+    _materialize_eflags();
+    return eflags;
+}
+
+void emulator::set_eflags(uint32_t value){
+    eflags = value;
+    flags_op = FLAGS_NONE;
+    _recheck_events();
+}
+
+bool emulator::read_memory(uint32_t address, void *buffer, uint32_t size){
+    if((uint64_t)address + size > memory_size) return false;
+    memcpy(buffer, memory + address, size);
+    return true;
+}
+
+//書き込んだところにデコードした命令があれば作り直す
+bool emulator::write_memory(uint32_t address, const void *buffer, uint32_t size){
+    if((uint64_t)address + size > memory_size) return false;
+    _mark_dirty(address, size);
+    memcpy(memory + address, buffer, size);
+    if(_has_code(address, size)) _invalidate_code(address, size);
+    return true;
+}
+
+void emulator::add_breakpoint(uint32_t address){
+    breakpoints.insert(address);
+    _invalidate_decoded(address, 1);
+}
+
+void emulator::remove_breakpoint(uint32_t address){
+    if(breakpoints.erase(address) == 0) return;
+    _invalidate_decoded(address, 1);
+}
+
+void emulator::request_stop(){
+    stop_requested = true;
+    event_check = 0;
+    //パイプが一杯で書けなくても、もう起こしてある
+    if(stop_pipe[1] >= 0){
+        ssize_t written = write(stop_pipe[1], "", 1);
+        (void)written;
+    }
+}
+
+uint32_t emulator::_get_cycles(const Instruction &inst){
+    return (inst.prefix & PREFIX_TWO_BYTE) ? cycle_table.two_byte[inst.opecode] : cycle_table.one_byte[inst.opecode];
+}
+
+uint64_t emulator::_count_cycles(const Block *block, uint32_t executed){
+    if(executed == block->length) return block->cycles;
+    
+    uint64_t cycles = 0;
+    for(uint32_t i = 0; i < executed; i++) cycles += _get_cycles(block->instructions[i]);
+    return cycles;
+}
+
+//1回目は命令の分として数えてある
+//1命令でmax_cyclesを超えるので、タイマーの期限の見積もりをやり直させる
+void emulator::_count_repeats(const Instruction &inst, uint32_t repeated){
+    if(repeated <= 1) return;
+    cycle_count += (uint64_t)(repeated - 1) * _get_cycles(inst);
+    _recheck_events();
+}
+
+uint32_t emulator::get_fault_address(){
+    return fault_address;
+}
+
+console *emulator::get_console(){
+    return console_device;
+}
+
+uart *emulator::get_uart(){
+    return serial;
+}
+
+io_bus *emulator::get_io_bus(){
+    return bus;
+}
+
+pic *emulator::get_pic(){
+    return interrupt_controller;
+}
+
+//プロファイルはrun()/run_until()で実行した分だけ数える
+void emulator::set_profile(bool enable){
+    if(enable && profile == NULL){
+        profile = new profiler(memory_size, eip);
+    }
+    else if(!enable && profile != NULL){
+        delete profile;
+        profile = NULL;
+    }
+}
+
+profiler *emulator::get_profiler(){
+    return profile;
+}
+
+//今の状態をfilenameに書いてからトレースを始める
+bool emulator::start_trace(tracer *trace, const char *filename){
+    if(this->trace != NULL){
+        fprintf(stderr, "error : trace is already started.\n");
+        return false;
+    }
+    
+    Snapshot initial;
+    _save_state(initial);
+    initial.id = 0;
+    if(!trace->open(filename, &initial)) return false;
+    
+    this->trace = trace;
+    return true;
+}
+
+void emulator::stop_trace(){
+    if(trace == NULL) return;
+    trace->close();
+    trace = NULL;
+}
+
+uint32_t emulator::get_eip(){
+    return eip;
+}
+
+uint32_t emulator::get_cpu_index(){
+    return cpu_index;
+}
+
+uint32_t emulator::get_register32(Register reg){
+    return registers[reg];
+}
+
+StopReason emulator::_run(uint64_t max_instructions, uint32_t until){
+    StopReason reason;
+    
+    //ゲストのメモリ外へのアクセスや未実装の命令は、_stop()でここへ戻ってくる
+    current_emulator = this;
+    if(sigsetjmp(fault_jmp, 0) == 0){
+        //プロファイルもトレースもしないときの実行ループには何も足さない
+        uint32_t hooks = (profile != NULL ? RUN_PROFILE : 0) | (trace != NULL ? RUN_TRACE : 0);
+        switch(hooks){
+            case 0:
+                reason = _run_blocks<0>(max_instructions, until);
+                break;
+            case RUN_PROFILE:
+                reason = _run_blocks<RUN_PROFILE>(max_instructions, until);
+                break;
+            case RUN_TRACE:
+                reason = _run_blocks<RUN_TRACE>(max_instructions, until);
+                break;
+            default:
+                reason = _run_blocks<RUN_PROFILE | RUN_TRACE>(max_instructions, until);
+                break;
+        }
+    }
+    else{
+        _recover_fault(stop_reason);
+        reason = stop_reason;
+    }
+    current_emulator = NULL;
+    
+    _materialize_eflags();
+    console_device->finish();
+    return reason;
+}
+
+//untilが0なら到達による停止はしない(0番地は停止なので先に止まる)
+//プロファイル中は全部のブロックを、トレース中はトレースする範囲のブロックを1命令ずつ実行する(JITも使わない)
+template<uint32_t hooks>
+StopReason emulator::_run_blocks(uint64_t max_instructions, uint32_t until){
+    uint64_t limit = instruction_count + max_instructions;
+    if(limit < instruction_count) limit = UINT64_MAX;
+    run_limit = limit;
+    _recheck_events();
+    
+    Block *block = NULL;
+    StopReason reason;
+    
+    while(true){
+        if(eip == 0x00){
+            reason = STOP_HALT;
+            break;
+        }
+        if(eip == until){
+            reason = STOP_BREAKPOINT;
+            break;
+        }
+        //命令数の上限かタイマーの期限に達したときだけ、割り込みを見る
+        if(instruction_count >= event_check.load(std::memory_order_relaxed)){
+            if(instruction_count >= limit){
+                reason = STOP_BUDGET;
+                break;
+            }
+            if(stop_requested){
+                _clear_stop_request();
+                reason = STOP_INTERRUPT;
+                break;
+            }
+            if(_service_events()){
+                block = NULL;
+                continue;
+            }
+        }
+        
+        if(blocks_stale){
+            _flush_blocks();
+            block = NULL;
+        }
+        
+        Block *previous = block;
+        block = (block != NULL) ? _next_block(block) : _lookup_block(eip);
+        if(block == NULL){
+            reason = STOP_UNIMPLEMENTED;
+            break;
+        }
+        
+        //後ろへの分岐で、何も書かないループが同じ状態のまま回っていれば待つ
+        if(!block->pure){
+            idle_address = 0;
+        }
+        else if(previous != NULL && block->address <= previous->address && _is_idle_loop(block)){
+            if(!_wait_event()){
+                reason = STOP_IDLE;
+                break;
+            }
+        }
+        
+        //命令数の上限かuntilがブロックの途中にあるときは1命令ずつ
+        uint64_t remaining = limit - instruction_count;
+        bool step = (hooks & RUN_PROFILE) || ((hooks & RUN_TRACE) && trace->covers(block->address, block->size));
+        if(step || remaining < block->length || until - block->address < block->size){
+            _step_block<hooks>(block, remaining, until);
+        }
+        else{
+            _exec_block(block);
+        }
+    }
+    
+    return reason;
+}
+
+void emulator::_install_fault_handler(){
+    static std::once_flag installed;
+    
+    std::call_once(installed, [](){
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = _fault_handler;
+        //ハンドラからsiglongjmpで抜けるので、SIGSEGVがブロックされたままにならないようにする
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_segv_action);
+    });
+}
+
+void emulator::_fault_handler(int sig, siginfo_t *info, void *context){
+    emulator *emu = current_emulator;
+    
+    if(emu != NULL && emu->guest->contains(info->si_addr)){
+        if(emu->native_block != NULL) emu->_save_native_registers(static_cast<const ucontext_t *>(context));
+        emu->_raise_fault(static_cast<uint8_t *>(info->si_addr) - emu->memory);
+    }
+    
+    //ゲストのメモリ以外はホスト側の不具合なので、元の動作に戻して落とす
+    sigaction(SIGSEGV, &previous_segv_action, NULL);
+}
+
+//命令の途中で、実行中のexec()/run()まで戻ってreasonで止める
+void emulator::_stop(StopReason reason){
+    stop_reason = reason;
+    siglongjmp(fault_jmp, 1);
+}
+
+void emulator::_raise_fault(uint32_t address){
+    fault_address = address;
+    _stop(STOP_FAULT);
+}
+
+//翻訳したコードはゲストのレジスタをr8d〜r15d、eflagsをediに載せている(jit.hpp)
+//フォールトした命令の直前の値なので、シグナルのときの値をそのまま書き戻す
+void emulator::_save_native_registers(const ucontext_t *context){
+    const greg_t *gregs = context->uc_mcontext.gregs;
+    const int host[REGISTERS_COUNT] = {REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15};
+    for(int i = 0; i < REGISTERS_COUNT; i++) registers[i] = (uint32_t)gregs[host[i]];
+    eflags = (uint32_t)gregs[REG_RDI];
+}
+
+//止まった命令の手前までを実行した命令として数える(eipはインタプリタと同じく止まった命令の次)
+//翻訳したコードで止まっても、インタプリタと同じレジスタ、eipと命令数になる
+void emulator::_recover_fault(StopReason reason){
+    if(reason == STOP_FAULT){
+        fprintf(stderr, "error : memory access out of range. address=0x%08x\n", fault_address);
+    }
+    if(current_block != NULL){
+        uint32_t executed = current_instruction - current_block->instructions;
+        instruction_count += executed;
+        cycle_count += _count_cycles(current_block, executed);
+    }
+    if(native_block != NULL){
+        uint32_t executed = jit_context.instruction;
+        eip = native_block->address;
+        for(uint32_t i = 0; i <= executed; i++) eip += native_block->instructions[i].length;
+        instruction_count += executed;
+        cycle_count += _count_cycles(native_block, executed);
+        native_block = NULL;
+    }
+    current_block = NULL;
+    block_end = NULL;
+    jit_context.side_exit = 0;
+    trace_writes = NULL;
+}
+
+void emulator::set_jit(bool enable, uint32_t threshold){
+    if(enable && jit_compiler == NULL){
+        jit_compiler = new jit(JIT_CACHE_SIZE);
+    }
+    else if(!enable && jit_compiler != NULL){
+        _flush_native();
+        delete jit_compiler;
+        jit_compiler = NULL;
+    }
+    jit_threshold = threshold;
+}
+
+void emulator::_exec_block(Block *block){
+    if(block->native == NULL && jit_compiler != NULL && !block->native_failed){
+        if(++block->exec_count >= jit_threshold) _compile_block(block);
+    }
+    
+    if(block->native != NULL){
+        //翻訳したコードはeflagsを直接読み書きする
+        _materialize_eflags();
+        native_block = block;
+        eip = block->native(&jit_context);
+        native_block = NULL;
+        
+        if(!jit_context.side_exit){
+            instruction_count += block->length;
+            cycle_count += block->cycles;
+            return;
+        }
+        
+        //コードへの書き込みはインタプリタで1命令実行して無効化させる
+        jit_context.side_exit = 0;
+        uint32_t address = block->address;
+        for(uint32_t i = 0; address != eip; i++){
+            address += block->instructions[i].length;
+            instruction_count++;
+            cycle_count += _get_cycles(block->instructions[i]);
+        }
+        _exec_instruction();
+        return;
+    }
+    
+    const Instruction *inst = block->instructions;
+    
+    current_block = block;
+    block_end = inst + block->length;
+    
+    //コードが書き換えられるとblock_endが縮められてここで抜ける
+    for(; inst < block_end; inst++){
+        current_instruction = inst;
+        eip += inst->length;
+        inst->handler(this, *inst);
+    }
+    
+    instruction_count += inst - block->instructions;
+    cycle_count += _count_cycles(block, inst - block->instructions);
+    current_block = NULL;
+}
+
+//remaining命令まで、またはeipがuntilになるまで実行する
+template<uint32_t hooks>
+void emulator::_step_block(Block *block, uint64_t remaining, uint32_t until){
+    const Instruction *inst = block->instructions;
+    
+    current_block = block;
+    block_end = inst + block->length;
+    
+    for(; inst < block_end && remaining > 0; inst++, remaining--){
+        if(eip == until) break;
+        
+        if(hooks & RUN_PROFILE) profile->count(eip, inst->opecode);
+        
+        //実行中の命令による書き込みは_set_memory*()で記録する
+        bool traced = (hooks & RUN_TRACE) && trace->covers(eip, inst->length);
+        if(traced){
+            trace->begin(instruction_count + (inst - block->instructions), eip, memory + eip, inst->length);
+            trace_writes = trace;
+        }
+        
+        current_instruction = inst;
+        eip += inst->length;
+        inst->handler(this, *inst);
+        
+        if(traced){
+            trace_writes = NULL;
+            _materialize_eflags();
+            trace->end(registers, eflags);
+        }
+        
+        if(hooks & RUN_PROFILE){
+            if(inst->opecode == 0xE8 || (inst->opecode == 0xFF && inst->modrm.reg_index == 2)) profile->call(eip);
+            else if(inst->opecode == 0xC3) profile->ret();
+        }
+    }
+    
+    instruction_count += inst - block->instructions;
+    cycle_count += _count_cycles(block, inst - block->instructions);
+    current_block = NULL;
+}
+
+//直接分岐の行き先なら、つないでおいたブロックへそのまま進む
+Block *emulator::_next_block(Block *block){
+    for(int i = 0; i < 2; i++){
+        if(eip != block->successor_address[i]) continue;
+        
+        if(block->successors[i] == NULL){
+            block->successors[i] = _lookup_block(eip);
+        }
+        else{
+            block_chain_hits++;
+        }
+        return block->successors[i];
+    }
+    
+    return _lookup_block(eip);
+}
+
+Block *emulator::_lookup_block(uint32_t address){
+    //メモリの外は_build_blockでフォールトにする
+    DecodedPage *page = (address >> DECODE_PAGE_SHIFT) < decoded_page_count ? decoded_pages[address >> DECODE_PAGE_SHIFT] : NULL;
+    if(page != NULL){
+        Block *block = page->blocks[address & (DECODE_PAGE_SIZE - 1)];
+        if(block != NULL) return block;
+    }
+    
+    return _build_block(address);
+}
+
+Block *emulator::_build_block(uint32_t address){
+    Instruction buf[MAX_BLOCK_LENGTH];
+    uint32_t length = 0;
+    uint32_t next = address;
+    
+    while(length < MAX_BLOCK_LENGTH){
+        Instruction *inst = _fetch_instruction(next);
+        if(inst == NULL){
+            //未実装命令の手前でブロックを切る。先頭なら実行できない
+            if(length > 0) break;
+            fprintf(stderr, "error : not implemted instruction. code=0x%02x\n", _get_memory8(next));
+            return NULL;
+        }
+        //ブレークポイントは必ずブロックの先頭に置き、止まったときに手前の命令数がずれないようにする
+        if(length > 0 && (inst->prefix & PREFIX_BREAKPOINT)) break;
+        
+        buf[length++] = *inst;
+        next += inst->length;
+        
+        if(inst->format & FORMAT_BRANCH) break;
+    }
+    
+    Block *block = new Block();
+    block->address = address;
+    block->length = length;
+    block->size = next - address;
+    block->instructions = new Instruction[length];
+    memcpy(block->instructions, buf, sizeof(Instruction) * length);
+    block->pure = true;
+    block->cycles = 0;
+    for(uint32_t i = 0; i < length; i++){
+        if(!_is_pure(buf[i])) block->pure = false;
+        block->cycles += _get_cycles(buf[i]);
+    }
+    
+    //行き先が決まっている分岐を覚えておく(0番地は停止なのでつながない)
+    const Instruction &last = buf[length - 1];
+    block->successor_address[0] = 0;
+    block->successor_address[1] = next;
+    switch((last.prefix & PREFIX_TWO_BYTE) ? 0x0F : last.opecode){
+        case 0x0F:
+            if(last.opecode >= 0x80 && last.opecode <= 0x8F){
+                block->successor_address[0] = next + last.imm;
+            }
+            break;
+        case 0xFF:
+            //行き先はレジスタ・メモリの値で決まる
+            block->successor_address[1] = 0;
+            break;
+        case 0xE8:
+        case 0xE9:
+        case 0xEB:
+            block->successor_address[0] = next + last.imm;
+            block->successor_address[1] = 0;
+            break;
+        case 0xC3:
+        case 0xCF:
+            block->successor_address[1] = 0;
+            break;
+        default:
+            if(last.opecode >= 0x70 && last.opecode <= 0x7F){
+                block->successor_address[0] = next + last.imm;
+            }
+            break;
+    }
+    
+    //先頭命令のデコードで必ずページは確保されている
+    decoded_pages[address >> DECODE_PAGE_SHIFT]->blocks[address & (DECODE_PAGE_SIZE - 1)] = block;
+    block_count++;
+    
+    return block;
+}
+
+//メモリ・スタックへの書き込みかoutをする命令はfalse
+//inはデバイスの状態を変えうるが、それはデバイスのget_version()で分かる
+bool emulator::_is_pure(const Instruction &inst){
+    if(inst.prefix & PREFIX_TWO_BYTE){
+        //sidtと、メモリへのcmpxchg, xaddは書く
+        if(inst.opecode == 0x01) return inst.modrm.opecode != 1;
+        if(inst.opecode == 0xB1 || inst.opecode == 0xC1) return inst.modrm.mod == 3;
+        return true;
+    }
+    
+    bool register_destination = (inst.format & FORMAT_MODRM) && inst.modrm.mod == 3;
+    switch(inst.opecode){
+        case 0x01: case 0x09: case 0x21: case 0x29: case 0x31:
+        case 0x86: case 0x87: case 0x88: case 0x89: case 0xC6: case 0xC7:
+        case 0xC0: case 0xC1: case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+            return register_destination;
+        case 0x81: case 0x83:
+            //cmpは書かない
+            return register_destination || inst.modrm.opecode == 7;
+        case 0xF7:
+            //testは書かない
+            return register_destination || inst.modrm.opecode == 0;
+        case 0xFF:
+            //inc, decとjmp。callとpushはスタックに書く
+            return (inst.modrm.opecode == 4) || (register_destination && inst.modrm.opecode <= 1);
+        case 0x68: case 0x6A: case 0x9C: case 0xE8: case 0xCD: case 0xF4:
+        case 0xA2: case 0xA3: case 0xA4: case 0xA5: case 0xAA: case 0xAB:
+        case 0xE6: case 0xE7: case 0xEE: case 0xEF:
+            return false;
+        default:
+            //push r32
+            return !(inst.opecode >= 0x50 && inst.opecode <= 0x57);
+    }
+}
+
+//blockに後ろへの分岐で来たときに呼ぶ
+//レジスタ・フラグ・デバイスの状態が同じまま何度も戻ってくるループは、何かが変わるまで先に進めない
+//他のvCPUがいれば、メモリを書き換えて抜けさせてくれるかもしれないので待たない
+bool emulator::_is_idle_loop(Block *block){
+    if(group->cpu_count.load(std::memory_order_relaxed) > 1) return false;
+    if(block->address != idle_address || memcmp(registers, idle_registers, sizeof(idle_registers)) != 0){
+        idle_address = block->address;
+        memcpy(idle_registers, registers, sizeof(idle_registers));
+        idle_iterations = 0;
+        return false;
+    }
+    
+    //レジスタが同じときだけフラグとデバイスを比べる
+    _materialize_eflags();
+    uint64_t version = bus->get_version();
+    if(idle_iterations == 0 || eflags != idle_eflags || version != idle_version){
+        idle_eflags = eflags;
+        idle_version = version;
+        idle_iterations = 1;
+        return false;
+    }
+    return ++idle_iterations >= IDLE_LOOP_THRESHOLD;
+}
+
+//前回起きてからゲストが何も読んでいなければ、読まれずに残っている入力では起きない
+//タイマーがあれば期限までの仮想時間を実時間で待ち、待った分だけ仮想時間を進める
+bool emulator::_wait_event(){
+    //待つ前にプロンプトを見せる
+    console_device->flush();
+    
+    uint64_t now = clock->now();
+    uint64_t deadline = timer->get_deadline();
+    int64_t timeout = -1;
+    if(deadline != PIT_NO_DEADLINE) timeout = (deadline > now) ? deadline - now : 0;
+    
+    uint64_t version = bus->get_version();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(!bus->wait(version == woken_version, timeout)) return false;
+    
+    uint64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    if(timeout >= 0 && waited > (uint64_t)timeout) waited = timeout;
+    clock->advance(waited);
+    
+    woken_version = version;
+    idle_address = 0;
+    idle_waits++;
+    _recheck_events();
+    return true;
+}
+
+void emulator::_update_interrupts(){
+    if(timer->update()) interrupt_controller->raise(PIT_IRQ);
+    interrupt_controller->set_level(UART_IRQ, serial->get_interrupt());
+}
+
+//タイマーを進め、割り込みを受け付けられれば受け付ける
+//次に見る命令数は、命令数の上限・タイマーの期限・UARTの入力を見に行く時刻の早い方
+bool emulator::_service_events(){
+    if(code_changed) _sync_code();
+    _update_interrupts();
+    
+    bool delivered = false;
+    if((eflags & INTERRUPT_FLAG) && interrupt_controller->has_interrupt()){
+        _interrupt(interrupt_controller->acknowledge());
+        delivered = true;
+    }
+    
+    uint64_t deadline = timer->get_deadline();
+    if(serial->needs_polling()){
+        uint64_t poll = clock->now() + INTERRUPT_POLL_INTERVAL;
+        if(poll < deadline) deadline = poll;
+    }
+    uint64_t check = run_limit;
+    if(deadline != PIT_NO_DEADLINE){
+        //1命令は多くてもmax_cyclesなので、期限より前に見る。まだ早ければそこで見積もり直す
+        uint64_t cycles = clock->cycle_at(deadline);
+        uint64_t at = instruction_count + 1;
+        if(cycles > cycle_count) at = instruction_count + std::max((cycles - cycle_count) / max_cycles, (uint64_t)1);
+        if(at < check) check = at;
+    }
+    //request_stop()や他のvCPUの0を上書きしたかもしれないので、書いてから要求を見る
+    event_check = check;
+    if(stop_requested || code_changed) event_check = 0;
+    return delivered;
+}
+
+void emulator::_clear_stop_request(){
+    stop_requested = false;
+    char buffer[16];
+    while(stop_pipe[0] >= 0 && read(stop_pipe[0], buffer, sizeof(buffer)) > 0);
+}
+
+bool emulator::_has_gate(uint8_t vector){
+    if((uint32_t)vector * 8 + 7 > idt_limit) return false;
+    return (_get_memory32(idt_base + vector * 8 + 4) & GATE_PRESENT) != 0;
+}
+
+//IDTのゲートからハンドラを呼ぶ。eflags, cs, eipを積む(割り込みゲートならIFを下ろす)
+void emulator::_interrupt(uint8_t vector){
+    uint32_t gate = idt_base + vector * 8;
+    uint8_t type = 0;
+    uint32_t low = 0;
+    uint32_t high = 0;
+    if((uint32_t)vector * 8 + 7 <= idt_limit){
+        low = _get_memory32(gate);
+        high = _get_memory32(gate + 4);
+        type = (high >> 8) & 0x1F;
+    }
+    if(!(high & GATE_PRESENT) || (type != GATE_INTERRUPT32 && type != GATE_TRAP32)){
+        fprintf(stderr, "error : no interrupt gate. vector=0x%02x\n", vector);
+        _stop(STOP_SHUTDOWN);
+    }
+    
+    _materialize_eflags();
+    _push32(eflags);
+    _push32(INTERRUPT_CODE_SEGMENT);
+    _push32(eip);
+    if(type == GATE_INTERRUPT32) eflags &= ~INTERRUPT_FLAG;
+    eip = (low & 0xFFFF) | (high & 0xFFFF0000);
+    interrupt_count++;
+}
+
+void emulator::_compile_block(Block *block){
+    block->native = jit_compiler->compile(*block);
+    
+    //キャッシュが一杯なら全部捨ててやり直す
+    if(block->native == NULL && jit_compiler->full()){
+        _flush_native();
+        block->native = jit_compiler->compile(*block);
+    }
+    
+    if(block->native == NULL) block->native_failed = true;
+}
+
+void emulator::_flush_native(){
+    for(uint32_t i = 0; i < decoded_page_list.size(); i++){
+        DecodedPage *page = decoded_pages[decoded_page_list[i]];
+        
+        for(uint32_t j = 0; j < DECODE_PAGE_SIZE; j++){
+            if(page->blocks[j] != NULL) page->blocks[j]->native = NULL;
+        }
+    }
+    if(jit_compiler != NULL) jit_compiler->flush();
+}
+
+void emulator::_flush_blocks(){
+    for(uint32_t i = 0; i < decoded_page_list.size(); i++){
+        DecodedPage *page = decoded_pages[decoded_page_list[i]];
+        
+        for(uint32_t j = 0; j < DECODE_PAGE_SIZE; j++){
+            Block *block = page->blocks[j];
+            if(block == NULL) continue;
+            
+            delete[] block->instructions;
+            delete block;
+            page->blocks[j] = NULL;
+        }
+    }
+    if(jit_compiler != NULL) jit_compiler->flush();
+    blocks_stale = false;
+}
+
+//addressの命令をキャッシュから取り出す
+//キャッシュに無ければデコードして登録する
+Instruction *emulator::_fetch_instruction(uint32_t address){
+    uint32_t page_index = address >> DECODE_PAGE_SHIFT;
+    uint32_t offset = address & (DECODE_PAGE_SIZE - 1);
+    
+    if(page_index >= decoded_page_count) _raise_fault(address);
+    
+    DecodedPage *page = decoded_pages[page_index];
+    if(page != NULL && page->instructions[offset].handler != NULL){
+        decode_cache_hits++;
+        return &page->instructions[offset];
+    }
+    
+    decode_cache_misses++;
+    
+    Instruction inst;
+    if(!_decode(address, inst)) return NULL;
+    
+    if(page == NULL){
+        page = new DecodedPage();
+        decoded_pages[page_index] = page;
+        decoded_page_list.push_back(page_index);
+    }
+    
+    //命令が占めるバイトと、その手前3バイトをマーク
+    //手前もマークしておくと、4バイト書き込みは先頭アドレスの1ビットだけ見れば良い
+    //code_mapは他のvCPUと共有しているので、同じバイトの他のビットを消さないようにアトミックに立てる
+    //アドレス空間の末尾で終わる命令もあるので、終わりは64ビットで求める
+    uint64_t start = address >= 3 ? address - 3 : 0;
+    for(uint64_t a = start; a < (uint64_t)address + inst.length; a++){
+        __atomic_fetch_or(&code_map[a >> 3], (uint8_t)(1 << (a & 7)), __ATOMIC_RELAXED);
+    }
+    
+    page->instructions[offset] = inst;
+    return &page->instructions[offset];
+}
+
+bool emulator::_decode(uint32_t address, Instruction &inst){
+    memset(&inst, 0, sizeof(Instruction));
+    
+    uint32_t index = 0;
+    while(true){
+        uint8_t code = _get_memory8(address + index);
+        if(code == 0x66){
+            inst.prefix |= PREFIX_OPERAND_SIZE;
+        }
+        //REPとREPNEは後に書いた方が有効
+        else if(code == 0xF3){
+            inst.prefix = (inst.prefix & ~PREFIX_REPNE) | PREFIX_REP;
+        }
+        else if(code == 0xF2){
+            inst.prefix = (inst.prefix & ~PREFIX_REP) | PREFIX_REPNE;
+        }
+        else if(code == 0xF0){
+            inst.prefix |= PREFIX_LOCK;
+        }
+        else{
+            break;
+        }
+        if(++index >= MAX_INSTRUCTION_LENGTH) return false;
+    }
+    
+    inst.opecode = _get_memory8(address + index);
+    index++;
+    
+    uint8_t format;
+    if(inst.opecode == 0x0F){
+        inst.prefix |= PREFIX_TWO_BYTE;
+        inst.opecode = _get_memory8(address + index);
+        inst.handler = instructions_0f[inst.opecode];
+        format = instruction_formats_0f[inst.opecode];
+        index++;
+    }
+    else{
+        inst.handler = instructions[inst.opecode];
+        format = instruction_formats[inst.opecode];
+    }
+    if(inst.handler == NULL) return false;
+    
+    //オペランドサイズを変えられるのは対応している命令だけ
+    if((inst.prefix & PREFIX_OPERAND_SIZE) && !(format & FORMAT_OPERAND_SIZE)) return false;
+    //REPはストリング命令以外では無視する(rep ret, pauseなど)
+    //0x0Fの命令ではF3/F2で別の命令(popcntなど)になるので未実装として扱う
+    if((inst.prefix & (PREFIX_REP | PREFIX_REPNE)) && !(format & FORMAT_STRING)){
+        if(inst.prefix & PREFIX_TWO_BYTE) return false;
+        inst.prefix &= ~(PREFIX_REP | PREFIX_REPNE);
+    }
+    
+    if(format & FORMAT_MODRM){
+        _parse_modrm(inst.modrm, address, index);
+    }
+    
+    //F7はtest(/0)だけが即値を持つ
+    if((format & FORMAT_GROUP3) && inst.modrm.reg_index != 0){
+        format &= ~(FORMAT_IMM8 | FORMAT_IMM32);
+    }
+    //FFのcall/jmp(/2〜/5)は間接分岐
+    if(inst.opecode == 0xFF && inst.modrm.reg_index >= 2 && inst.modrm.reg_index <= 5){
+        format |= FORMAT_BRANCH;
+    }
+    inst.format = format;
+    
+    //LOCKはメモリを読み書きする演算だけに付けられる(他は#UDなので未実装として扱う)
+    if(inst.prefix & PREFIX_LOCK){
+        if(!(format & FORMAT_LOCK) || inst.modrm.mod == 3) return false;
+        uint8_t op = inst.modrm.opecode;
+        if((inst.opecode == 0x81 || inst.opecode == 0x83) && op == 7) return false;
+        if(inst.opecode == 0xF7 && op != 2 && op != 3) return false;
+        if(inst.opecode == 0xFF && op > 1) return false;
+        //xchg, cmpxchg, xaddはLOCKが無くてもアトミックに行う
+        if(!(inst.prefix & PREFIX_TWO_BYTE) && inst.opecode != 0x86 && inst.opecode != 0x87){
+            inst.handler = _handler<&emulator::_lock_rm32>;
+        }
+    }
+    
+    if(format & FORMAT_IMM8){
+        inst.imm = static_cast<int8_t>(_get_memory8(address + index));
+        index += 1;
+    }
+    else if(format & FORMAT_IMM32){
+        inst.imm = _get_memory32(address + index);
+        index += 4;
+    }
+    
+    inst.length = index;
+    
+    //止めるだけの命令にする。長さは元の命令のまま(外すときに作り直す)
+    if(!breakpoints.empty() && breakpoints.count(address)){
+        inst.handler = _handler<&emulator::_breakpoint>;
+        inst.prefix |= PREFIX_BREAKPOINT;
+        inst.format |= FORMAT_BRANCH;
+    }
+    return true;
+}
+
+//addressからsizeバイトの書き込みで書き換わる命令をキャッシュから外す
+//code_mapは共有なので、ビットが立っていても命令をデコードしたのは他のvCPUかもしれない
+void emulator::_invalidate_code(uint32_t address, uint32_t size){
+    _invalidate_decoded(address, size);
+    if(group->cpu_count.load(std::memory_order_relaxed) <= 1) return;
+    
+    //他のvCPUは次のブロックの境目で外す
+    std::lock_guard<std::mutex> locked(group->lock);
+    for(size_t i = 0; i < group->cpus.size(); i++){
+        emulator *cpu = group->cpus[i];
+        if(cpu == this) continue;
+        cpu->remote_writes.push_back(std::make_pair(address, size));
+        cpu->code_changed = true;
+        cpu->_recheck_events();
+    }
+}
+
+void emulator::_sync_code(){
+    std::vector<std::pair<uint32_t, uint32_t> > writes;
+    {
+        std::lock_guard<std::mutex> locked(group->lock);
+        writes.swap(remote_writes);
+        code_changed = false;
+    }
+    for(size_t i = 0; i < writes.size(); i++) _invalidate_decoded(writes[i].first, writes[i].second);
+}
+
+void emulator::_invalidate_decoded(uint32_t address, uint32_t size){
+    uint64_t start = address >= MAX_INSTRUCTION_LENGTH - 1 ? address - (MAX_INSTRUCTION_LENGTH - 1) : 0;
+    
+    for(uint64_t a = start; a < (uint64_t)address + size; a++){
+        if((a >> DECODE_PAGE_SHIFT) >= decoded_page_count) break;
+        
+        DecodedPage *page = decoded_pages[a >> DECODE_PAGE_SHIFT];
+        if(page == NULL) continue;
+        
+        Instruction &inst = page->instructions[a & (DECODE_PAGE_SIZE - 1)];
+        if(inst.handler != NULL && a + inst.length > address){
+            inst.handler = NULL;
+            
+            //ブロックは実行中でも次の命令で抜けて、まとめて作り直す
+            blocks_stale = true;
+            if(current_block != NULL) block_end = current_block->instructions;
+        }
+    }
+}
+
 uint8_t emulator::_get_code8(uint32_t index){
     return memory[eip + index];
 }
@@ -115,47 +1505,130 @@ int8_t emulator::_get_sign_code8(uint32_t index){
     return memory[eip + index];
 }
 
-void emulator::_parse_modrm(ModRM &modrm){
-    uint8_t code = _get_code8(0);
+//addressから始まる命令のindexバイト目からModRMを読む。読んだ分だけindexを進める
+//アドレスの形(base, index, scale)と長さはmodrm.hppの表から引く
+void emulator::_parse_modrm(ModRM &modrm, uint32_t address, uint32_t &index){
+    uint8_t code = _get_memory8(address + index);
+    const ModRMForm &form = modrm_forms::forms[code];
     
-    memset(&modrm, 0, sizeof(ModRM));
-    modrm.mod = (code & 0xC0) >> 6;
-    modrm.opecode = (code & 0x38) >> 3;
+    modrm.mod = code >> 6;
+    modrm.opecode = (code >> 3) & 0x07;
     modrm.rm = code & 0x07;
+    modrm.sib = 0;
+    modrm.base = form.base;
+    modrm.index = MODRM_ZERO_REGISTER;
+    modrm.scale = 0;
     
-    eip++;
-    
-    //SIBがある場合はフェッチ
-    if(modrm.mod != 3 && modrm.rm == 4){
-        modrm.sib = _get_code8(0);
-        eip++;
+    uint32_t disp_size = form.disp_size;
+    if(form.has_sib){
+        modrm.sib = _get_memory8(address + index + 1);
+        const SIBForm &sib = sib_forms::forms[(modrm.mod == 0 ? 0x100 : 0) | modrm.sib];
+        modrm.base = sib.base;
+        modrm.index = sib.index;
+        modrm.scale = sib.scale;
+        disp_size += sib.disp_size;
     }
     
-    //ディスプレースメント 32bit
-    //(mod == 00, rm == 101)を見落としそうなので注意
-    if((modrm.mod == 0 && modrm.rm == 5) || modrm.mod == 2){
-        modrm.disp32 = _get_sign_code32(0);
-        eip += 4;
+    uint32_t disp_address = address + index + form.length;
+    if(disp_size == 4){
+        modrm.disp32 = _get_memory32(disp_address);
+    }
+    else if(disp_size == 1){
+        modrm.disp32 = static_cast<int8_t>(_get_memory8(disp_address));
     }
-    //ディスプレースメント 8bit
-    else if(modrm.mod == 1){
-        modrm.disp8 = _get_sign_code8(0);
-        eip++;
+    else{
+        modrm.disp32 = 0;
     }
     
-    //これ以外はレジスタか、メモリアドレスの間接指定(たぶん)
+    index += form.length + disp_size;
+}
+
+//フラグは演算の値だけ覚えておき、参照されたときに求める
+void emulator::_update_eflags_add(uint32_t v1, uint32_t v2, uint32_t result){
+    flags_op = FLAGS_ADD32;
+    flags_v1 = v1;
+    flags_v2 = v2;
+    flags_result = result;
+}
+
+void emulator::_update_eflags_sub(uint32_t v1, uint32_t v2, uint32_t result){
+    flags_op = FLAGS_SUB32;
+    flags_v1 = v1;
+    flags_v2 = v2;
+    flags_result = result;
+}
+
+void emulator::_update_eflags_sub8(uint8_t v1, uint8_t v2, uint8_t result){
+    flags_op = FLAGS_SUB8;
+    flags_v1 = v1;
+    flags_v2 = v2;
+    flags_result = result;
 }
 
-void emulator::_update_eflags_sub(uint32_t v1, uint32_t v2, uint64_t result){
-    int32_t sign1 = v1 >> 31;
-    int32_t sign2 = v2 >> 31;
+//incはCFを変えないので、直前のCFをv2に残しておく
+void emulator::_update_eflags_inc(uint32_t v1, uint32_t result){
+    uint32_t carry = _is_carry();
     
-    int signr = (result >> 31) & 1;
+    flags_op = FLAGS_INC32;
+    flags_v1 = v1;
+    flags_v2 = carry;
+    flags_result = result;
+}
+
+//decもCFを変えない
+void emulator::_update_eflags_dec(uint32_t v1, uint32_t result){
+    uint32_t carry = _is_carry();
     
-    _set_carry(result >> 32);
-    _set_zero(result == 0);
-    _set_sign(signr);
-    _set_overflow((sign1 != sign2) && (signr != signr));
+    flags_op = FLAGS_DEC32;
+    flags_v1 = v1;
+    flags_v2 = carry;
+    flags_result = result;
+}
+
+void emulator::_update_eflags_logic(uint32_t result){
+    flags_op = FLAGS_LOGIC32;
+    flags_result = result;
+}
+
+void emulator::_update_eflags_logic8(uint8_t result){
+    flags_op = FLAGS_LOGIC8;
+    flags_result = result;
+}
+
+//16bitは上位に寄せて32bitの減算として扱う(CF, ZF, SF, OFが同じになる)
+void emulator::_compare_string(uint32_t v1, uint32_t v2, uint32_t size){
+    if(size == 1){
+        _update_eflags_sub8(v1, v2, v1 - v2);
+    }
+    else if(size == 2){
+        _update_eflags_sub(v1 << 16, v2 << 16, (v1 - v2) << 16);
+    }
+    else{
+        _update_eflags_sub(v1, v2, v1 - v2);
+    }
+}
+
+//ZF/SFはそのまま残す
+void emulator::_update_eflags_carry_overflow(bool carry, bool overflow){
+    _materialize_eflags();
+    _set_carry(carry);
+    _set_overflow(overflow);
+}
+
+//遅延しているフラグをeflagsに書き出す
+void emulator::_materialize_eflags(){
+    if(flags_op == FLAGS_NONE) return;
+    
+    bool carry = _is_carry();
+    bool zero = _is_zero();
+    bool sign = _is_sign();
+    bool overflow = _is_overflow();
+    
+    flags_op = FLAGS_NONE;
+    _set_carry(carry);
+    _set_zero(zero);
+    _set_sign(sign);
+    _set_overflow(overflow);
 }
 
 void emulator::_set_carry(int flag){
@@ -195,25 +1668,65 @@ void emulator::_set_overflow(int flag){
 }
 
 bool emulator::_is_carry(){
-    return((eflags & CARRY_FLAG) != 0);
+    switch(flags_op){
+        case FLAGS_ADD32:
+            return(flags_result < flags_v1);
+        case FLAGS_SUB32:
+        case FLAGS_SUB8:
+            return(flags_v1 < flags_v2);
+        case FLAGS_INC32:
+        case FLAGS_DEC32:
+            return(flags_v2 != 0);
+        case FLAGS_LOGIC32:
+        case FLAGS_LOGIC8:
+            return(false);
+        default:
+            return((eflags & CARRY_FLAG) != 0);
+    }
 }
 bool emulator::_is_zero(){
-    return((eflags & ZERO_FLAG) != 0);
+    switch(flags_op){
+        case FLAGS_NONE:
+            return((eflags & ZERO_FLAG) != 0);
+        default:
+            return(flags_result == 0);
+    }
 }
 bool emulator::_is_sign(){
-    return((eflags & SIGN_FLAG) != 0);
+    switch(flags_op){
+        case FLAGS_NONE:
+            return((eflags & SIGN_FLAG) != 0);
+        case FLAGS_SUB8:
+        case FLAGS_LOGIC8:
+            return((flags_result >> 7) & 1);
+        default:
+            return(flags_result >> 31);
+    }
 }
 bool emulator::_is_overflow(){
-    return((eflags & OVERFLOW_FLAG) != 0);
+    //符号が同じ値の加算、符号が異なる値の減算で、結果の符号がv1と変わったらオーバーフロー
+    switch(flags_op){
+        case FLAGS_ADD32:
+            return((~(flags_v1 ^ flags_v2) & (flags_v1 ^ flags_result)) >> 31);
+        case FLAGS_SUB32:
+            return(((flags_v1 ^ flags_v2) & (flags_v1 ^ flags_result)) >> 31);
+        case FLAGS_SUB8:
+            return((((flags_v1 ^ flags_v2) & (flags_v1 ^ flags_result)) >> 7) & 1);
+        case FLAGS_INC32:
+            return(flags_result == 0x80000000);
+        case FLAGS_DEC32:
+            return(flags_result == 0x7FFFFFFF);
+        case FLAGS_LOGIC32:
+        case FLAGS_LOGIC8:
+            return(false);
+        default:
+            return((eflags & OVERFLOW_FLAG) != 0);
+    }
 }
 
 
 uint32_t emulator::_get_code32(uint32_t index){
-    uint32_t ret = 0;
-    for(int i = 0; i < 4; i++){
-        ret += (uint32_t)_get_code8(index + i) << (i * 8);
-    }
-    return ret;
+    return _get_memory32(eip + index);
 }
 
 int32_t emulator::_get_sign_code32(uint32_t index){
@@ -221,7 +1734,7 @@ int32_t emulator::_get_sign_code32(uint32_t index){
 }
 
 //ModR/Mで指定されたレジスタ・メモリに値を格納する
-void emulator::_set_rm32(ModRM &modrm, uint32_t value){
+void emulator::_set_rm32(const ModRM &modrm, uint32_t value){
     //レジスタ指定
     if(modrm.mod == 3){
         _set_register32(static_cast<Register>(modrm.rm), value);
@@ -233,7 +1746,7 @@ void emulator::_set_rm32(ModRM &modrm, uint32_t value){
         _set_memory32(address, value);
     }
 }
-void emulator::_set_rm8(ModRM &modrm, uint8_t value){
+void emulator::_set_rm8(const ModRM &modrm, uint8_t value){
     //レジスタ指定
     if(modrm.mod == 3){
         _set_register8(static_cast<Register>(modrm.rm), value);
@@ -262,13 +1775,66 @@ void emulator::_set_register8(Register reg, uint8_t value){
     }
 }
 
+//ホストもリトルエンディアンなので、16/32bitは1回のコピーで読み書きする
+//範囲外はガードに当たってSIGSEGVになる
+//code_mapは命令の手前3バイトもマークしてあるので、先頭アドレスの1ビットで書き込む範囲全体を判定できる
+//命令の無効化は書いた後で行う(他のvCPUが書く前の内容をデコードし直さないように)
+//書き込むページをdirty_mapに記録する
+//次のページへはみ出す書き込みは両方のページを記録する(snapshot()はページ単位で写すので)
+void emulator::_mark_dirty(uint32_t address, uint32_t size){
+    uint64_t last = ((uint64_t)address + size - 1) >> DIRTY_PAGE_SHIFT;
+    for(uint64_t page = address >> DIRTY_PAGE_SHIFT; page <= last; page++){
+        dirty_map[page] = 1;
+    }
+}
+
+//addressからsizeバイトに命令があるか(code_mapの8ビットずつ見る)
+//rep movs/stosの大きな範囲は、code_mapを8バイトずつまとめて見る
+bool emulator::_has_code(uint32_t address, uint32_t size){
+    uint64_t i = address >> 3;
+    uint64_t last = ((uint64_t)address + size - 1) >> 3;
+    for(; i + 8 <= last + 1; i += 8){
+        uint64_t bits;
+        memcpy(&bits, code_map + i, 8);
+        if(bits != 0) return true;
+    }
+    for(; i <= last; i++){
+        if(code_map[i] != 0) return true;
+    }
+    return false;
+}
+
 void emulator::_set_memory8(uint32_t address, uint8_t value){
+    bool code = code_map[address >> 3] & (1 << (address & 7));
+    dirty_map[address >> DIRTY_PAGE_SHIFT] = 1;
+    if(trace_writes != NULL) trace_writes->write(address, value, 1);
     memory[address] = value;
+    if(code) _invalidate_code(address, 1);
+}
+
+void emulator::_set_memory16(uint32_t address, uint16_t value){
+    bool code = code_map[address >> 3] & (1 << (address & 7));
+    dirty_map[address >> DIRTY_PAGE_SHIFT] = 1;
+    dirty_map[((uint64_t)address + 1) >> DIRTY_PAGE_SHIFT] = 1;
+    if(trace_writes != NULL) trace_writes->write(address, value, 2);
+    memcpy(memory + address, &value, 2);
+    if(code) _invalidate_code(address, 2);
 }
 
 void emulator::_set_memory32(uint32_t address, uint32_t value){
-    for(int i = 0; i < 4; i++){
-        _set_memory8(address + i, (value >> (i * 8)) & 0xFF);
+    bool code = code_map[address >> 3] & (1 << (address & 7));
+    dirty_map[address >> DIRTY_PAGE_SHIFT] = 1;
+    dirty_map[((uint64_t)address + 3) >> DIRTY_PAGE_SHIFT] = 1;
+    if(trace_writes != NULL) trace_writes->write(address, value, 4);
+    memcpy(memory + address, &value, 4);
+    if(code) _invalidate_code(address, 4);
+}
+
+void emulator::_locked_write(uint32_t address, uint32_t value, uint32_t size){
+    _mark_dirty(address, size);
+    if(trace_writes != NULL) trace_writes->write(address, value, size);
+    if(code_map[address >> 3] & (1 << (address & 7))){
+        _invalidate_code(address, size);
     }
 }
 
@@ -276,11 +1842,15 @@ uint8_t emulator::_get_memory8(uint32_t address){
     return(memory[address]);
 }
 
+uint16_t emulator::_get_memory16(uint32_t address){
+    uint16_t value;
+    memcpy(&value, memory + address, 2);
+    return(value);
+}
+
 uint32_t emulator::_get_memory32(uint32_t address){
-    uint32_t value = 0;
-    for(int i = 0; i < 4; i++){
-        value += (uint32_t)_get_memory8(address + i) << (i * 8);
-    }
+    uint32_t value;
+    memcpy(&value, memory + address, 4);
     return(value);
 }
 
@@ -297,229 +1867,503 @@ uint8_t emulator::_get_register8(Register reg){
         return registers[reg] & 0x000000FF;
     }
     
-    //AL, CL, DL, BLの場合
-    //8-15bitを取り出し
-    return (registers[reg - 4] >> 8) & 0x000000FF;
+    //AL, CL, DL, BLの場合
+    //8-15bitを取り出し
+    return (registers[reg - 4] >> 8) & 0x000000FF;
+}
+
+uint32_t emulator::_get_r32(const ModRM &modrm){
+    return(_get_register32(static_cast<Register>(modrm.reg_index)));
+}
+
+uint8_t emulator::_get_r8(const ModRM &modrm){
+    return(_get_register8(static_cast<Register>(modrm.reg_index)));
+}
+
+void emulator::_set_r32(const ModRM &modrm, uint32_t value){
+    _set_register32(static_cast<Register>(modrm.reg_index), value);
+}
+
+void emulator::_set_r8(const ModRM &modrm, uint8_t value){
+    _set_register8(static_cast<Register>(modrm.reg_index), value);
+}
+
+uint32_t emulator::_get_rm32(const ModRM &modrm){
+    if(modrm.mod == 3){
+        return(_get_register32(static_cast<Register>(modrm.rm)));
+    }
+    else{
+        uint32_t address = _calc_memory_address(modrm);
+        return(_get_memory32(address));
+    }
+}
+
+uint16_t emulator::_get_rm16(const ModRM &modrm){
+    if(modrm.mod == 3){
+        return(_get_register32(static_cast<Register>(modrm.rm)) & 0xFFFF);
+    }
+    else{
+        uint32_t address = _calc_memory_address(modrm);
+        return(_get_memory16(address));
+    }
+}
+
+uint8_t emulator::_get_rm8(const ModRM &modrm){
+    if(modrm.mod == 3){
+        return(_get_register8(static_cast<Register>(modrm.rm)));
+    }
+    else{
+        uint32_t address = _calc_memory_address(modrm);
+        return(_get_memory8(address));
+    }
+}
+
+//形はデコード時に決めてあるので分岐しない(mod == 3では呼ばない)
+uint32_t emulator::_calc_memory_address(const ModRM &modrm){
+    return registers[modrm.base] + (registers[modrm.index] << modrm.scale) + modrm.disp32;
+}
+
+void emulator::_mov_r32_imm32(const Instruction &inst){
+    uint8_t reg = inst.opecode - 0xB8;
+    registers[reg] = inst.imm;
+}
+void emulator::_short_jump(const Instruction &inst){
+    eip += inst.imm;
+}
+
+void emulator::_near_jump(const Instruction &inst){
+    eip += inst.imm;
+}
+
+void emulator::_mov_rm32_imm32(const Instruction &inst){
+    _set_rm32(inst.modrm, inst.imm);
+}
+
+void emulator::_mov_rm32_r32(const Instruction &inst){
+    uint32_t value = _get_r32(inst.modrm);
+    _set_rm32(inst.modrm, value);
+}
+
+
+void emulator::_mov_r32_rm32(const Instruction &inst){
+    uint32_t value = _get_rm32(inst.modrm);
+    _set_r32(inst.modrm, value);
+}
+
+void emulator::_add_rm32_r32(const Instruction &inst){
+    uint32_t rm32 = _get_rm32(inst.modrm);
+    uint32_t r32 = _get_r32(inst.modrm);
+    uint32_t result = rm32 + r32;
+    
+    _set_rm32(inst.modrm, result);
+    
+    _update_eflags_add(rm32, r32, result);
+}
+
+uint32_t emulator::_alu32(uint8_t op, uint32_t v1, uint32_t v2){
+    uint32_t result;
+    switch(op){
+        case 0:
+            result = v1 + v2;
+            _update_eflags_add(v1, v2, result);
+            break;
+        case 1:
+            result = v1 | v2;
+            _update_eflags_logic(result);
+            break;
+        case 4:
+            result = v1 & v2;
+            _update_eflags_logic(result);
+            break;
+        case 5:
+        case 7:
+            result = v1 - v2;
+            _update_eflags_sub(v1, v2, result);
+            break;
+        case 6:
+            result = v1 ^ v2;
+            _update_eflags_logic(result);
+            break;
+        default:
+            fprintf(stderr, "error : not implemted instruction. alu op=%d\n", op);
+            _stop(STOP_UNIMPLEMENTED);
+    }
+    return result;
+}
+
+//cmp(op == 7)は結果を書かない
+void emulator::_alu_rm32_r32(const Instruction &inst){
+    uint8_t op = inst.opecode >> 3;
+    uint32_t result = _alu32(op, _get_rm32(inst.modrm), _get_r32(inst.modrm));
+    if(op != 7) _set_rm32(inst.modrm, result);
+}
+
+void emulator::_alu_r32_rm32(const Instruction &inst){
+    uint8_t op = inst.opecode >> 3;
+    uint32_t result = _alu32(op, _get_r32(inst.modrm), _get_rm32(inst.modrm));
+    if(op != 7) _set_r32(inst.modrm, result);
+}
+
+void emulator::_alu_eax_imm32(const Instruction &inst){
+    uint8_t op = inst.opecode >> 3;
+    uint32_t result = _alu32(op, _get_register32(EAX), inst.imm);
+    if(op != 7) _set_register32(EAX, result);
+}
+
+//81, 83(imm8は符号拡張済み)
+void emulator::_alu_rm32_imm(const Instruction &inst){
+    uint8_t op = inst.modrm.opecode;
+    uint32_t result = _alu32(op, _get_rm32(inst.modrm), inst.imm);
+    if(op != 7) _set_rm32(inst.modrm, result);
+}
+
+void emulator::_sub_rm32_imm8(const Instruction &inst){
+    uint32_t rm32 = _get_rm32(inst.modrm);
+    uint32_t imm8 = inst.imm;
+    
+    uint32_t result = rm32 - imm8;
+    _set_rm32(inst.modrm, result);
+    
+    _update_eflags_sub(rm32, imm8, result);
+}
+
+void emulator::_code_83(const Instruction &inst){
+    switch(inst.modrm.opecode){
+        case 0:
+            _add_rm32_imm8(inst);
+            break;
+        case 1:
+        case 4:
+        case 6:
+            _alu_rm32_imm(inst);
+            break;
+        case 5:
+            _sub_rm32_imm8(inst);
+            break;
+        case 7:
+            _cmp_rm32_imm8(inst);
+            break;
+        default:
+            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", inst.modrm.mod, inst.modrm.rm);
+            _stop(STOP_UNIMPLEMENTED);
+    }
+}
+
+void emulator::_add_rm32_imm8(const Instruction &inst){
+    uint32_t rm32 = _get_rm32(inst.modrm);
+    uint32_t imm8 = inst.imm;
+    uint32_t result = rm32 + imm8;
+    
+    _set_rm32(inst.modrm, result);
+    
+    _update_eflags_add(rm32, imm8, result);
+}
+
+void emulator::_code_ff(const Instruction &inst){
+    switch(inst.modrm.opecode){
+        case 0:
+            _inc_rm32(inst);
+            break;
+        case 1:
+            _dec_rm32(inst);
+            break;
+        case 2:
+            _call_rm32(inst);
+            break;
+        case 4:
+            _jmp_rm32(inst);
+            break;
+        case 6:
+            _push_rm32(inst);
+            break;
+        default:
+            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", inst.modrm.mod, inst.modrm.rm);
+            _stop(STOP_UNIMPLEMENTED);
+    }
+}
+
+void emulator::_inc_rm32(const Instruction &inst){
+    uint32_t rm32 = _get_rm32(inst.modrm);
+    _set_rm32(inst.modrm, rm32 + 1);
+    
+    _update_eflags_inc(rm32, rm32 + 1);
 }
 
-uint32_t emulator::_get_r32(ModRM &modrm){
-    return(_get_register32(static_cast<Register>(modrm.reg_index)));
+void emulator::_dec_rm32(const Instruction &inst){
+    uint32_t rm32 = _get_rm32(inst.modrm);
+    _set_rm32(inst.modrm, rm32 - 1);
+    
+    _update_eflags_dec(rm32, rm32 - 1);
 }
 
-uint8_t emulator::_get_r8(ModRM &modrm){
-    return(_get_register8(static_cast<Register>(modrm.reg_index)));
+void emulator::_call_rm32(const Instruction &inst){
+    uint32_t target = _get_rm32(inst.modrm);
+    _push32(eip);
+    eip = target;
 }
 
-void emulator::_set_r32(ModRM &modrm, uint32_t value){
-    _set_register32(static_cast<Register>(modrm.reg_index), value);
+void emulator::_jmp_rm32(const Instruction &inst){
+    eip = _get_rm32(inst.modrm);
 }
 
-void emulator::_set_r8(ModRM &modrm, uint8_t value){
-    _set_register8(static_cast<Register>(modrm.reg_index), value);
+void emulator::_push_rm32(const Instruction &inst){
+    _push32(_get_rm32(inst.modrm));
 }
 
-uint32_t emulator::_get_rm32(ModRM &modrm){
-    if(modrm.mod == 3){
-        return(_get_register32(static_cast<Register>(modrm.rm)));
+//0F 01 /1: sidt m, /3: lidt m (2バイトのlimitと4バイトのbase)
+void emulator::_code_0f_01(const Instruction &inst){
+    if(inst.modrm.mod == 3 || (inst.modrm.opecode != 1 && inst.modrm.opecode != 3)){
+        fprintf(stderr, "error : not implemted instruction. 0F 01 ModRM(mod=%d, reg=%d)\n", inst.modrm.mod, inst.modrm.opecode);
+        _stop(STOP_UNIMPLEMENTED);
+    }
+    
+    uint32_t address = _calc_memory_address(inst.modrm);
+    if(inst.modrm.opecode == 1){
+        _set_memory16(address, idt_limit);
+        _set_memory32(address + 2, idt_base);
     }
     else{
-        uint32_t address = _calc_memory_address(modrm);
-        return(_get_memory32(address));
+        idt_limit = _get_memory16(address);
+        idt_base = _get_memory32(address + 2);
     }
 }
 
-uint8_t emulator::_get_rm8(ModRM &modrm){
-    if(modrm.mod == 3){
-        return(_get_register8(static_cast<Register>(modrm.rm)));
+//実行する前の状態で止める
+void emulator::_breakpoint(const Instruction &inst){
+    eip -= inst.length;
+    _stop(STOP_BREAKPOINT);
+}
+
+//仮想時間のサイクル数(hltで待った時間も含む)をedx:eaxに読む
+//ブロックの最後の命令なので、実行中のブロックの分を足せば自分までのサイクル数になる
+void emulator::_rdtsc(const Instruction &inst){
+    uint64_t pending = (current_block != NULL) ? current_block->cycles : _get_cycles(inst);
+    uint64_t tsc = clock->now() / NS_PER_CYCLE + pending;
+    registers[EAX] = (uint32_t)tsc;
+    registers[EDX] = (uint32_t)(tsc >> 32);
+}
+
+//0: 最大のリーフとベンダー名, 1: EBX[31:24]にvCPUの番号(APIC ID)。他のリーフは全部0
+void emulator::_cpuid(const Instruction &inst){
+    uint32_t leaf = registers[EAX];
+    registers[EAX] = 0;
+    registers[EBX] = 0;
+    registers[ECX] = 0;
+    registers[EDX] = 0;
+    if(leaf == 0){
+        registers[EAX] = 1;
+        memcpy(&registers[EBX], CPUID_VENDOR, 4);
+        memcpy(&registers[EDX], CPUID_VENDOR + 4, 4);
+        memcpy(&registers[ECX], CPUID_VENDOR + 8, 4);
     }
-    else{
-        uint32_t address = _calc_memory_address(modrm);
-        return(_get_memory8(address));
+    else if(leaf == 1){
+        registers[EAX] = CPUID_SIGNATURE;
+        registers[EBX] = cpu_index << 24;
+        registers[EDX] = CPUID_FEATURE_TSC;
     }
 }
 
-uint32_t emulator::_calc_memory_address(ModRM &modrm){
-    if(modrm.mod == 0){
-        if(modrm.rm == 4){
-            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", modrm.mod, modrm.rm);
-            exit(-1);
-        }
-        else if(modrm.rm == 5){
-            return modrm.disp32;
-        }
-        else{
-            return _get_register32(static_cast<Register>(modrm.rm));
-        }
-    }
-    else if(modrm.mod == 1){
-        if(modrm.rm == 4){
-            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", modrm.mod, modrm.rm);
-            exit(-1);
-        }
-        else{
-            return _get_register32(static_cast<Register>(modrm.rm)) + modrm.disp8;
-        }
-    }
-    else if(modrm.mod == 2){
-        if(modrm.rm == 4){
-            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", modrm.mod, modrm.rm);
-            exit(-1);
-        }
-        else{
-            return _get_register32(static_cast<Register>(modrm.rm)) + modrm.disp32;
-        }
-    }
-    else{
-        fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", modrm.mod, modrm.rm);
-        exit(-1);
+//0F AE /5, /6, /7(mod == 3): lfence, mfence, sfence。どれもホストの完全なフェンスにする
+void emulator::_fence(const Instruction &inst){
+    if(inst.modrm.mod != 3 || inst.modrm.opecode < 5){
+        fprintf(stderr, "error : not implemted instruction. 0F AE ModRM(mod=%d, reg=%d)\n", inst.modrm.mod, inst.modrm.opecode);
+        _stop(STOP_UNIMPLEMENTED);
     }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
 }
 
-void emulator::_mov_r32_imm32(){
-    uint8_t reg = _get_code8(0) - 0xB8;
-    registers[reg] = _get_code32(1);
-    eip += 5;
+void emulator::_code_f7(const Instruction &inst){
+    switch(inst.modrm.opecode){
+        case 0:
+            _test_rm32_imm32(inst);
+            break;
+        case 2:
+            _not_rm32(inst);
+            break;
+        case 3:
+            _neg_rm32(inst);
+            break;
+        case 4:
+            _mul_rm32(inst);
+            break;
+        case 5:
+            _imul_rm32(inst);
+            break;
+        case 6:
+            _div_rm32(inst);
+            break;
+        case 7:
+            _idiv_rm32(inst);
+            break;
+        default:
+            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", inst.modrm.mod, inst.modrm.rm);
+            _stop(STOP_UNIMPLEMENTED);
+    }
 }
-void emulator::_short_jump(){
-    int8_t diff = _get_sign_code8(1);
-    //opecode(1byte) + operand(1byte)
-    eip += 2;
-    eip += diff;
+
+void emulator::_test_rm32_imm32(const Instruction &inst){
+    _update_eflags_logic(_get_rm32(inst.modrm) & inst.imm);
 }
 
-void emulator::_near_jump(){
-    int32_t diff = _get_sign_code32(1);
-    //opecode(1byte) + operand(4byte)
-    eip += 5;
-    eip += diff;
+void emulator::_not_rm32(const Instruction &inst){
+    _set_rm32(inst.modrm, ~_get_rm32(inst.modrm));
 }
 
-void emulator::_mov_rm32_imm32(){
-    eip++;
-    ModRM modrm;
-    _parse_modrm(modrm);
+void emulator::_neg_rm32(const Instruction &inst){
+    uint32_t rm32 = _get_rm32(inst.modrm);
+    _set_rm32(inst.modrm, 0 - rm32);
     
-    uint32_t value = _get_code32(0);
-    eip += 4;
-    
-    _set_rm32(modrm, value);
+    _update_eflags_sub(0, rm32, 0 - rm32);
 }
 
-void emulator::_mov_rm32_r32(){
-    eip++;
-    ModRM modrm;
-    _parse_modrm(modrm);
+//EDX:EAX = EAX * rm32
+void emulator::_mul_rm32(const Instruction &inst){
+    uint64_t result = (uint64_t)_get_register32(EAX) * _get_rm32(inst.modrm);
+    _set_register32(EAX, result);
+    _set_register32(EDX, result >> 32);
     
-    uint32_t value = _get_r32(modrm);
-    _set_rm32(modrm, value);
+    _update_eflags_carry_overflow(result >> 32 != 0, result >> 32 != 0);
 }
 
-
-void emulator::_mov_r32_rm32(){
-    eip++;
-    ModRM modrm;
-    _parse_modrm(modrm);
+void emulator::_imul_rm32(const Instruction &inst){
+    int64_t result = (int64_t)(int32_t)_get_register32(EAX) * (int32_t)_get_rm32(inst.modrm);
+    _set_register32(EAX, result);
+    _set_register32(EDX, (uint64_t)result >> 32);
     
-    uint32_t value = _get_rm32(modrm);
-    _set_r32(modrm, value);
+    bool overflow = result != (int32_t)result;
+    _update_eflags_carry_overflow(overflow, overflow);
 }
 
-void emulator::_add_rm32_r32(){
-    eip++;
-    ModRM modrm;
-    _parse_modrm(modrm);
+//EAX = EDX:EAX / rm32, EDX = EDX:EAX % rm32
+//0除算と商が32bitに収まらない場合は止める(割り込みは未実装)
+void emulator::_div_rm32(const Instruction &inst){
+    uint32_t divisor = _get_rm32(inst.modrm);
+    uint64_t dividend = ((uint64_t)_get_register32(EDX) << 32) | _get_register32(EAX);
+    if(divisor == 0 || dividend / divisor > 0xFFFFFFFF) _divide_error(inst);
     
-    uint32_t rm32 = _get_rm32(modrm);
-    uint32_t r32 = _get_r32(modrm);
+    _set_register32(EAX, dividend / divisor);
+    _set_register32(EDX, dividend % divisor);
+}
+
+void emulator::_idiv_rm32(const Instruction &inst){
+    int64_t divisor = (int32_t)_get_rm32(inst.modrm);
+    int64_t dividend = (int64_t)(((uint64_t)_get_register32(EDX) << 32) | _get_register32(EAX));
+    if(divisor == 0 || (dividend == INT64_MIN && divisor == -1)) _divide_error(inst);
     
-    _set_rm32(modrm, rm32 + r32);
+    int64_t quotient = dividend / divisor;
+    if(quotient != (int32_t)quotient) _divide_error(inst);
     
-    //TODO: implement update eflags
+    _set_register32(EAX, quotient);
+    _set_register32(EDX, dividend % divisor);
 }
 
-void emulator::_sub_rm32_imm8(ModRM &modrm){
-    uint32_t rm32 = _get_rm32(modrm);
-    uint32_t imm8 = _get_sign_code8(0);
-    eip++;
+//#DEはフォールトなので、eipはdiv/idivを指したまま止める
+void emulator::_divide_error(const Instruction &inst){
+    eip -= inst.length;
+    _stop(STOP_DIVIDE_ERROR);
+}
+
+void emulator::_imul_r32_rm32(const Instruction &inst){
+    int64_t result = (int64_t)(int32_t)_get_r32(inst.modrm) * (int32_t)_get_rm32(inst.modrm);
+    _set_r32(inst.modrm, result);
     
-    uint64_t result = static_cast<uint64_t>(rm32) - imm8;
-    _set_rm32(modrm, result);
+    bool overflow = result != (int32_t)result;
+    _update_eflags_carry_overflow(overflow, overflow);
+}
+
+//69, 6B(imm8は符号拡張済み)
+void emulator::_imul_r32_rm32_imm(const Instruction &inst){
+    int64_t result = (int64_t)(int32_t)_get_rm32(inst.modrm) * (int32_t)inst.imm;
+    _set_r32(inst.modrm, result);
     
-    _update_eflags_sub(rm32, imm8, result);
+    bool overflow = result != (int32_t)result;
+    _update_eflags_carry_overflow(overflow, overflow);
 }
 
-void emulator::_code_83(){
-    eip++;
-    ModRM modrm;
-    _parse_modrm(modrm);
+//シフト回数はC0/C1が即値、D0/D1が1、D2/D3がCL。偶数のオペコードは8bit
+void emulator::_code_shift(const Instruction &inst){
+    uint32_t count;
+    if(inst.opecode <= 0xC1) count = inst.imm & 0x1F;
+    else if(inst.opecode <= 0xD1) count = 1;
+    else count = _get_register8(CL) & 0x1F;
+    
+    bool is_byte = !(inst.opecode & 1);
+    uint32_t bits = is_byte ? 8 : 32;
+    uint32_t mask = is_byte ? 0xFF : 0xFFFFFFFF;
+    uint32_t sign = 1 << (bits - 1);
+    uint32_t value = is_byte ? _get_rm8(inst.modrm) : _get_rm32(inst.modrm);
     
-    switch(modrm.opecode){
+    //回数が0ならフラグも変えない
+    if(count == 0) return;
+    
+    uint32_t result;
+    bool carry, overflow;
+    uint32_t n = count % bits;
+    switch(inst.modrm.opecode){
+        //rol, ror: CFとOFだけ変わる
         case 0:
-            _add_rm32_imm8(modrm);
+            result = n ? ((value << n) | (value >> (bits - n))) & mask : value;
+            carry = result & 1;
+            overflow = ((result & sign) != 0) != carry;
+            break;
+        case 1:
+            result = n ? ((value >> n) | (value << (bits - n))) & mask : value;
+            carry = (result & sign) != 0;
+            overflow = ((result ^ (result << 1)) & sign) != 0;
+            break;
+        //shl(sal)
+        case 4:
+        case 6:
+            result = (value << count) & mask;
+            carry = count <= bits && ((value >> (bits - count)) & 1);
+            overflow = ((result & sign) != 0) != carry;
             break;
         case 5:
-            _sub_rm32_imm8(modrm);
+            result = value >> count;
+            carry = (value >> (count - 1)) & 1;
+            overflow = (value & sign) != 0;
             break;
-        case 7:
-            _cmp_rm32_imm8(modrm);
+        case 7:{
+            int32_t signed_value = is_byte ? (int8_t)value : (int32_t)value;
+            result = (signed_value >> count) & mask;
+            carry = (signed_value >> (count - 1)) & 1;
+            overflow = false;
             break;
+        }
         default:
-            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", modrm.mod, modrm.rm);
-            exit(-1);
+            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", inst.modrm.mod, inst.modrm.rm);
+            _stop(STOP_UNIMPLEMENTED);
     }
-}
-
-void emulator::_add_rm32_imm8(ModRM &modrm){
-    uint32_t rm32 = _get_rm32(modrm);
-    uint32_t imm8 = _get_sign_code8(0);
-    eip++;
     
-    _set_rm32(modrm, rm32 + imm8);
-}
-
-void emulator::_code_ff(){
-    eip++;
-    ModRM modrm;
-    _parse_modrm(modrm);
+    if(is_byte) _set_rm8(inst.modrm, result);
+    else _set_rm32(inst.modrm, result);
     
-    switch(modrm.opecode){
-        case 0:
-            _inc_rm32(modrm);
-            break;
-        default:
-            fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", modrm.mod, modrm.rm);
-            exit(-1);
+    _update_eflags_carry_overflow(carry, overflow);
+    if(inst.modrm.opecode >= 4){
+        _set_zero(result == 0);
+        _set_sign((result & sign) != 0);
     }
 }
 
-void emulator::_inc_rm32(ModRM &modrm){
-    uint32_t rm32 = _get_rm32(modrm);
-    _set_rm32(modrm, ++rm32);
-}
-
 void emulator::_push32(uint32_t value){
     uint32_t address = _get_register32(ESP) - 4;
     _set_register32(ESP, address);
     _set_memory32(address, value);
 }
 
-void emulator::_push_r32(){
-    Register reg = static_cast<Register>(_get_code8(0) - 0x50);
-    eip++;
+void emulator::_push_r32(const Instruction &inst){
+    Register reg = static_cast<Register>(inst.opecode - 0x50);
     uint32_t value = _get_register32(reg);
     _push32(value);
 }
 
-void emulator::_push_imm8(){
-    uint8_t value = _get_code8(1);
+void emulator::_push_imm8(const Instruction &inst){
+    uint8_t value = inst.imm;
     _push32(value);
-    eip += 2;
 }
 
-void emulator::_push_imm32(){
-    uint32_t value = _get_code32(1);
-    _push32(value);
-    eip += 5;
+void emulator::_push_imm32(const Instruction &inst){
+    _push32(inst.imm);
 }
 
 uint32_t emulator::_pop32(){
@@ -530,184 +2374,691 @@ uint32_t emulator::_pop32(){
     return(value);
 }
 
-void emulator::_pop_r32(){
-    Register reg = static_cast<Register>(_get_code8(0) - 0x58);
-    eip++;
+void emulator::_pop_r32(const Instruction &inst){
+    Register reg = static_cast<Register>(inst.opecode - 0x58);
     _set_register32(reg, _pop32());
 }
 
-void emulator::_call_rel32(){
-    uint32_t diff = _get_sign_code32(1);
-    _push32(eip + 5);
-    eip += (diff + 5);
+void emulator::_call_rel32(const Instruction &inst){
+    _push32(eip);
+    eip += inst.imm;
 }
 
-void emulator::_ret(){
+void emulator::_ret(const Instruction &inst){
     eip = _pop32();
 }
 
-void emulator::_leave(){
+void emulator::_leave(const Instruction &inst){
     //ESPにEBPを格納
     //これでPOPすると保存しておいた、呼び出し元のEBPが取得できるのでEBPに格納
     _set_register32(ESP, _get_register32(EBP));
     _set_register32(EBP, _pop32());
-    
-    eip++;
 }
 
-void emulator::_cmp_r32_rm32(){
-    eip++;
-    ModRM modrm;
-    _parse_modrm(modrm);
+void emulator::_cmp_r32_rm32(const Instruction &inst){
+    uint32_t r32 = _get_r32(inst.modrm);
+    uint32_t rm32 = _get_rm32(inst.modrm);
     
-    uint32_t r32 = _get_r32(modrm);
-    uint32_t rm32 = _get_rm32(modrm);
-    
-    uint64_t result = static_cast<uint64_t>(r32) - static_cast<uint64_t>(rm32);
+    uint32_t result = r32 - rm32;
     
     _update_eflags_sub(r32, rm32, result);
 }
 
 //call from _code_83
-void emulator::_cmp_rm32_imm8(ModRM &modrm){
-    uint32_t rm32 = _get_rm32(modrm);
-    uint32_t imm8 = static_cast<uint32_t>(_get_sign_code8(0));
-    eip++;
+void emulator::_cmp_rm32_imm8(const Instruction &inst){
+    uint32_t rm32 = _get_rm32(inst.modrm);
+    uint32_t imm8 = inst.imm;
     
-    uint64_t result = static_cast<uint64_t>(rm32) - static_cast<uint64_t>(imm8);
+    uint32_t result = rm32 - imm8;
     
     _update_eflags_sub(rm32, imm8, result);
 }
 
-void emulator::_jc(){
-    int32_t diff = _is_sign() ? _get_sign_code8(1) : 0;
-    eip += diff + 2;
+void emulator::_cmp_rm8_r8(const Instruction &inst){
+    uint8_t rm8 = _get_rm8(inst.modrm);
+    uint8_t r8 = _get_r8(inst.modrm);
+    
+    uint8_t result = rm8 - r8;
+    _update_eflags_sub8(rm8, r8, result);
+}
+
+void emulator::_test_rm8_r8(const Instruction &inst){
+    _update_eflags_logic8(_get_rm8(inst.modrm) & _get_r8(inst.modrm));
+}
+
+void emulator::_test_rm32_r32(const Instruction &inst){
+    _update_eflags_logic(_get_rm32(inst.modrm) & _get_r32(inst.modrm));
+}
+
+void emulator::_test_al_imm8(const Instruction &inst){
+    _update_eflags_logic8(_get_register8(AL) & inst.imm);
+}
+
+void emulator::_test_eax_imm32(const Instruction &inst){
+    _update_eflags_logic(_get_register32(EAX) & inst.imm);
 }
-void emulator::_jz(){
-    int32_t diff = _is_zero() ? _get_sign_code8(1) : 0;
-    eip += diff + 2;
+
+void emulator::_jc(const Instruction &inst){
+    if(_is_carry()) eip += inst.imm;
+}
+void emulator::_jz(const Instruction &inst){
+    if(_is_zero()) eip += inst.imm;
 }
-void emulator::_js(){
-    int32_t diff = _is_sign() ? _get_sign_code8(1) : 0;
-    eip += diff + 2;
+void emulator::_js(const Instruction &inst){
+    if(_is_sign()) eip += inst.imm;
 }
-void emulator::_jo(){
-    int32_t diff = _is_overflow() ? _get_sign_code8(1) : 0;
-    eip += diff + 2;
+void emulator::_jo(const Instruction &inst){
+    if(_is_overflow()) eip += inst.imm;
 }
 
-void emulator::_jnc(){
-    int32_t diff = _is_sign() ? 0 : _get_sign_code8(1);
-    eip += diff + 2;
+void emulator::_jnc(const Instruction &inst){
+    if(!_is_carry()) eip += inst.imm;
+}
+void emulator::_jnz(const Instruction &inst){
+    if(!_is_zero()) eip += inst.imm;
+}
+void emulator::_jns(const Instruction &inst){
+    if(!_is_sign()) eip += inst.imm;
 }
-void emulator::_jnz(){
-    int32_t diff = _is_zero() ? 0 : _get_sign_code8(1);
-    eip += diff + 2;
+void emulator::_jno(const Instruction &inst){
+    if(!_is_overflow()) eip += inst.imm;
 }
-void emulator::_jns(){
-    int32_t diff = _is_sign() ? 0 : _get_sign_code8(1);
-    eip += diff + 2;
+
+void emulator::_jbe(const Instruction &inst){
+    if(_is_carry() || _is_zero()){
+        eip += inst.imm;
+    }
 }
-void emulator::_jno(){
-    int32_t diff = _is_overflow() ? 0 : _get_sign_code8(1);
-    eip += diff + 2;
+
+void emulator::_ja(const Instruction &inst){
+    if(!_is_carry() && !_is_zero()){
+        eip += inst.imm;
+    }
 }
 
-void emulator::_jl(){
-    int32_t diff = 0;
+void emulator::_jl(const Instruction &inst){
     if(_is_sign() != _is_overflow()){
-        diff = _get_sign_code8(1);
+        eip += inst.imm;
     }
-    eip += diff + 2;
 }
 
-void emulator::_jle(){
-    int32_t diff = 0;
+void emulator::_jge(const Instruction &inst){
+    if(_is_sign() == _is_overflow()){
+        eip += inst.imm;
+    }
+}
+
+void emulator::_jle(const Instruction &inst){
     if(_is_zero() || (_is_sign() != _is_overflow())){
-        diff = _get_sign_code8(1);
+        eip += inst.imm;
     }
-    eip += diff + 2;
 }
 
-void emulator::_in_al_dx(){
-    uint16_t address = _get_register32(EDX) & 0x0000FFFF;
-    uint8_t value = _io_in8(address);
-    _set_register8(AL, value);
-    eip++;
+void emulator::_jg(const Instruction &inst){
+    if(!_is_zero() && (_is_sign() == _is_overflow())){
+        eip += inst.imm;
+    }
 }
 
-void emulator::_out_dx_al(){
-    uint16_t address = _get_register32(EDX) & 0x0000FFFF;
-    uint8_t value = _get_register8(AL);
-    _io_out8(address, value);
-    eip++;
+//in al/ax/eax, imm8/dx
+//メモリとの交換はホストのxchg(常にLOCK付きと同じ)
+void emulator::_xchg_rm8_r8(const Instruction &inst){
+    uint8_t r8 = _get_r8(inst.modrm);
+    if(inst.modrm.mod == 3){
+        _set_r8(inst.modrm, _get_rm8(inst.modrm));
+        _set_rm8(inst.modrm, r8);
+        return;
+    }
+    
+    uint32_t address = _calc_memory_address(inst.modrm);
+    uint8_t old = __atomic_exchange_n(memory + address, r8, __ATOMIC_SEQ_CST);
+    _locked_write(address, r8, 1);
+    _set_r8(inst.modrm, old);
+}
+
+void emulator::_xchg_rm32_r32(const Instruction &inst){
+    uint32_t r32 = _get_r32(inst.modrm);
+    if(inst.modrm.mod == 3){
+        _set_r32(inst.modrm, _get_rm32(inst.modrm));
+        _set_rm32(inst.modrm, r32);
+        return;
+    }
+    
+    uint32_t address = _calc_memory_address(inst.modrm);
+    uint32_t old = __atomic_exchange_n(reinterpret_cast<uint32_t *>(memory + address), r32, __ATOMIC_SEQ_CST);
+    _locked_write(address, r32, 4);
+    _set_r32(inst.modrm, old);
+}
+
+//91〜97(90はnop)
+void emulator::_xchg_eax_r32(const Instruction &inst){
+    uint8_t reg = inst.opecode - 0x90;
+    uint32_t value = registers[reg];
+    registers[reg] = registers[EAX];
+    registers[EAX] = value;
+}
+
+//eaxとrm32が等しければrm32にr32を書く(ZF=1)。違えばrm32の値をeaxに読む
+//フラグはcmp eax, rm32と同じ
+void emulator::_cmpxchg_rm32_r32(const Instruction &inst){
+    uint32_t expected = registers[EAX];
+    uint32_t r32 = _get_r32(inst.modrm);
+    uint32_t current;
+    if(inst.modrm.mod == 3){
+        current = _get_rm32(inst.modrm);
+        if(current == expected) _set_rm32(inst.modrm, r32);
+    }
+    else{
+        //失敗するとcurrentに今の値が入る
+        uint32_t address = _calc_memory_address(inst.modrm);
+        current = expected;
+        if(__atomic_compare_exchange_n(reinterpret_cast<uint32_t *>(memory + address), &current, r32, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+            _locked_write(address, r32, 4);
+        }
+    }
+    
+    _update_eflags_sub(expected, current, expected - current);
+    if(current != expected) registers[EAX] = current;
+}
+
+//r32に元のrm32を、rm32に和を書く
+void emulator::_xadd_rm32_r32(const Instruction &inst){
+    uint32_t r32 = _get_r32(inst.modrm);
+    uint32_t old;
+    if(inst.modrm.mod == 3){
+        old = _get_rm32(inst.modrm);
+        _set_r32(inst.modrm, old);
+        _set_rm32(inst.modrm, old + r32);
+    }
+    else{
+        uint32_t address = _calc_memory_address(inst.modrm);
+        old = __atomic_fetch_add(reinterpret_cast<uint32_t *>(memory + address), r32, __ATOMIC_SEQ_CST);
+        _locked_write(address, old + r32, 4);
+        _set_r32(inst.modrm, old);
+    }
+    
+    _update_eflags_add(old, r32, old + r32);
+}
+
+//読んでから書くまでの間に他のvCPUが書き換えていたら、その値から計算し直す
+//フラグは最後に計算した(書いた)値で決まる
+void emulator::_lock_rm32(const Instruction &inst){
+    uint32_t address = _calc_memory_address(inst.modrm);
+    uint32_t *target = reinterpret_cast<uint32_t *>(memory + address);
+    uint32_t old = __atomic_load_n(target, __ATOMIC_RELAXED);
+    uint32_t result;
+    do{
+        switch(inst.opecode){
+            case 0x81:
+            case 0x83:
+                result = _alu32(inst.modrm.opecode, old, inst.imm);
+                break;
+            case 0xF7:
+                //notはフラグを変えない
+                if(inst.modrm.opecode == 2){
+                    result = ~old;
+                }
+                else{
+                    result = 0 - old;
+                    _update_eflags_sub(0, old, result);
+                }
+                break;
+            case 0xFF:
+                if(inst.modrm.opecode == 0){
+                    result = old + 1;
+                    _update_eflags_inc(old, result);
+                }
+                else{
+                    result = old - 1;
+                    _update_eflags_dec(old, result);
+                }
+                break;
+            default:
+                result = _alu32(inst.opecode >> 3, old, _get_r32(inst.modrm));
+                break;
+        }
+    }while(!__atomic_compare_exchange_n(target, &old, result, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    
+    _locked_write(address, result, 4);
 }
 
-uint8_t emulator::_io_in8(uint16_t address){
-    switch(address){
-        case 0x03F8:
-            return getchar();
-            break;
-        default:
-            return 0;
+void emulator::_in(const Instruction &inst){
+    uint16_t port = (inst.opecode & 0x08) ? _get_register32(EDX) & 0xFFFF : inst.imm & 0xFF;
+    
+    if(!(inst.opecode & 0x01)){
+        _set_register8(AL, bus->in8(port));
+    }
+    else if(inst.prefix & PREFIX_OPERAND_SIZE){
+        registers[EAX] = (registers[EAX] & 0xFFFF0000) | bus->in16(port);
+    }
+    else{
+        _set_register32(EAX, bus->in32(port));
     }
 }
 
-void emulator::_io_out8(uint16_t address, uint8_t value){
-    switch(address){
-        case 0x03F8:
-            putchar(value);
-            break;
+//out imm8/dx, al/ax/eax
+void emulator::_out(const Instruction &inst){
+    uint16_t port = (inst.opecode & 0x08) ? _get_register32(EDX) & 0xFFFF : inst.imm & 0xFF;
+    
+    if(!(inst.opecode & 0x01)){
+        bus->out8(port, _get_register8(AL));
+    }
+    else if(inst.prefix & PREFIX_OPERAND_SIZE){
+        bus->out16(port, _get_register32(EAX) & 0xFFFF);
+    }
+    else{
+        bus->out32(port, _get_register32(EAX));
+    }
+    //EOIやマスク、タイマーの設定で割り込みが変わりうる
+    _recheck_events();
+}
+
+//ストリング命令の要素のバイト数: 偶数のオペコードは1、奇数は4(0x66なら2)
+static uint32_t string_size(const Instruction &inst){
+    if(!(inst.opecode & 1)) return 1;
+    return (inst.prefix & PREFIX_OPERAND_SIZE) ? 2 : 4;
+}
+
+uint32_t emulator::_get_string(uint32_t address, uint32_t size){
+    if(size == 1) return _get_memory8(address);
+    if(size == 2) return _get_memory16(address);
+    return _get_memory32(address);
+}
+
+void emulator::_set_string(uint32_t address, uint32_t value, uint32_t size){
+    if(size == 1){
+        _set_memory8(address, value);
+    }
+    else if(size == 2){
+        _set_memory16(address, value);
+    }
+    else{
+        _set_memory32(address, value);
+    }
+}
+
+//addressから(DFが立っていれば後ろ向きに)count要素が占める範囲[start, start + length)を求める
+//アドレス空間の端で折り返すか、メモリの外に出るならfalse(1要素ずつ実行してフォールトさせる)
+bool emulator::_string_range(uint32_t address, uint32_t count, uint32_t size, int32_t step, uint64_t &start, uint64_t &length){
+    length = (uint64_t)count * size;
+    if(step > 0){
+        start = address;
+    }
+    else{
+        if((uint64_t)address + size < length) return false;
+        start = (uint64_t)address + size - length;
     }
+    return start + length <= memory_size;
+}
+
+//rep movs: 範囲が重なっていなければmemmove1回で済ませる
+bool emulator::_rep_movs_bulk(uint32_t size, int32_t step){
+    //トレース中は書き込みを1つずつ記録する
+    if(trace_writes != NULL) return false;
+    
+    uint32_t count = registers[ECX];
+    uint64_t source, destination, length;
+    if(!_string_range(registers[ESI], count, size, step, source, length)) return false;
+    if(!_string_range(registers[EDI], count, size, step, destination, length)) return false;
+    //前の要素で書いた値を後の要素で読む重なり方はmemmoveと結果が変わる
+    if(step > 0 && destination > source && destination < source + length) return false;
+    if(step < 0 && destination < source && destination + length > source) return false;
+    
+    _mark_dirty(destination, length);
+    memmove(memory + destination, memory + source, length);
+    if(_has_code(destination, length)) _invalidate_code(destination, length);
+    
+    registers[ESI] += (uint32_t)step * count;
+    registers[EDI] += (uint32_t)step * count;
+    registers[ECX] = 0;
+    return true;
 }
 
-void emulator::_mov_r8_imm8(){
-    uint8_t reg = _get_code8(0) - 0xB0;
-    uint8_t imm8 = _get_code8(1);
-    _set_register8(static_cast<Register>(reg), imm8);
+//rep stos: 埋める順番は結果に影響しない
+bool emulator::_rep_stos_bulk(uint32_t size, int32_t step){
+    if(trace_writes != NULL) return false;
+    
+    uint32_t count = registers[ECX];
+    uint64_t destination, length;
+    if(!_string_range(registers[EDI], count, size, step, destination, length)) return false;
+    
+    _mark_dirty(destination, length);
+    uint8_t *p = memory + destination;
+    uint32_t value = registers[EAX];
+    if(size == 1 || (size == 2 && (value & 0xFF) == ((value >> 8) & 0xFF)) || value == (value & 0xFF) * 0x01010101U){
+        memset(p, value & 0xFF, length);
+    }
+    else{
+        for(uint64_t i = 0; i < length; i += size) memcpy(p + i, &value, size);
+    }
+    if(_has_code(destination, length)) _invalidate_code(destination, length);
     
-    eip += 2;
+    registers[EDI] += (uint32_t)step * count;
+    registers[ECX] = 0;
+    return true;
 }
 
-void emulator::_cmp_al_imm8(){
-    uint8_t imm8 = _get_code8(1);
-    uint8_t al = _get_register8(AL);
+//repe cmps(memcmp): 前向きなら最初に違うバイトを8バイトずつ探す
+//違うところで止まるので、ECX回分がメモリに収まらなくても、収まる範囲で見つかれば良い
+bool emulator::_rep_cmps_bulk(const Instruction &inst, uint32_t size, int32_t step){
+    if(step < 0 || !(inst.prefix & PREFIX_REP)) return false;
+    if(registers[ESI] >= memory_size || registers[EDI] >= memory_size) return false;
+    
+    uint32_t count = registers[ECX];
+    uint64_t length = std::min((uint64_t)count * size, memory_size - std::max(registers[ESI], registers[EDI]));
+    const uint8_t *a = memory + registers[ESI];
+    const uint8_t *b = memory + registers[EDI];
+    uint64_t offset = 0;
+    while(offset + 8 <= length){
+        uint64_t x, y;
+        memcpy(&x, a + offset, 8);
+        memcpy(&y, b + offset, 8);
+        if(x != y) break;
+        offset += 8;
+    }
+    while(offset < length && a[offset] == b[offset]) offset++;
+    
+    //メモリの端まで同じなら、1要素ずつ実行してフォールトさせる
+    if(offset / size >= count) offset = (uint64_t)count * size - 1;
+    else if(offset == length) return false;
+    
+    //違う要素で止まる。最後に比べた要素でフラグを決める
+    uint32_t executed = offset / size + 1;
+    uint32_t last = (executed - 1) * size;
+    _compare_string(_get_string(registers[ESI] + last, size), _get_string(registers[EDI] + last, size), size);
     
-    uint64_t result = (uint64_t)al - (uint64_t)imm8;
-    _update_eflags_sub(al, imm8, result);
+    registers[ESI] += size * executed;
+    registers[EDI] += size * executed;
+    registers[ECX] -= executed;
+    return true;
+}
+
+//repne scasb(strlen, memchr)はmemchrで、repe scasbは違うバイトを探す
+bool emulator::_rep_scas_bulk(const Instruction &inst, uint32_t size, int32_t step){
+    if(step < 0 || size != 1 || registers[EDI] >= memory_size) return false;
+    
+    uint32_t count = registers[ECX];
+    uint64_t length = std::min((uint64_t)count, memory_size - registers[EDI]);
+    const uint8_t *p = memory + registers[EDI];
+    uint8_t al = registers[EAX] & 0xFF;
+    uint64_t offset;
+    if(inst.prefix & PREFIX_REPNE){
+        const void *found = memchr(p, al, length);
+        offset = found != NULL ? static_cast<const uint8_t *>(found) - p : length;
+    }
+    else{
+        offset = 0;
+        while(offset < length && p[offset] == al) offset++;
+    }
+    
+    if(offset >= count) offset = count - 1;
+    else if(offset == length) return false;
+    
+    uint32_t executed = offset + 1;
+    _compare_string(al, p[offset], 1);
+    
+    registers[EDI] += executed;
+    registers[ECX] -= executed;
+    return true;
+}
+
+//REPなら1命令でECX回繰り返す。DFが立っていればESI/EDIを減らしていく
+void emulator::_movs(const Instruction &inst){
+    uint32_t size = string_size(inst);
+    int32_t step = (eflags & DIRECTION_FLAG) ? -(int32_t)size : size;
+    
+    if(!(inst.prefix & (PREFIX_REP | PREFIX_REPNE))){
+        _set_string(registers[EDI], _get_string(registers[ESI], size), size);
+        registers[ESI] += step;
+        registers[EDI] += step;
+        return;
+    }
+    if(registers[ECX] == 0 || _rep_movs_bulk(size, step)) return;
+    
+    //途中でフォールトしても、そこまでの分のレジスタは進めておく
+    while(registers[ECX] != 0){
+        _set_string(registers[EDI], _get_string(registers[ESI], size), size);
+        registers[ESI] += step;
+        registers[EDI] += step;
+        registers[ECX]--;
+    }
+}
+
+//repeは違う要素で、repneは同じ要素で止まる
+void emulator::_cmps(const Instruction &inst){
+    uint32_t size = string_size(inst);
+    int32_t step = (eflags & DIRECTION_FLAG) ? -(int32_t)size : size;
+    bool repeat = (inst.prefix & (PREFIX_REP | PREFIX_REPNE)) != 0;
+    
+    if(repeat && (registers[ECX] == 0 || _rep_cmps_bulk(inst, size, step))) return;
+    
+    do{
+        _compare_string(_get_string(registers[ESI], size), _get_string(registers[EDI], size), size);
+        registers[ESI] += step;
+        registers[EDI] += step;
+        if(!repeat) return;
+        registers[ECX]--;
+    }while(registers[ECX] != 0 && _is_zero() == ((inst.prefix & PREFIX_REP) != 0));
+}
+
+void emulator::_stos(const Instruction &inst){
+    uint32_t size = string_size(inst);
+    int32_t step = (eflags & DIRECTION_FLAG) ? -(int32_t)size : size;
+    
+    if(!(inst.prefix & (PREFIX_REP | PREFIX_REPNE))){
+        _set_string(registers[EDI], registers[EAX], size);
+        registers[EDI] += step;
+        return;
+    }
+    if(registers[ECX] == 0 || _rep_stos_bulk(size, step)) return;
+    
+    while(registers[ECX] != 0){
+        _set_string(registers[EDI], registers[EAX], size);
+        registers[EDI] += step;
+        registers[ECX]--;
+    }
+}
+
+//rep lodsは最後の要素が残るだけなので、そのまま繰り返す
+void emulator::_lods(const Instruction &inst){
+    uint32_t size = string_size(inst);
+    int32_t step = (eflags & DIRECTION_FLAG) ? -(int32_t)size : size;
+    bool repeat = (inst.prefix & (PREFIX_REP | PREFIX_REPNE)) != 0;
     
-    eip += 2;
+    if(repeat && registers[ECX] == 0) return;
+    do{
+        uint32_t value = _get_string(registers[ESI], size);
+        if(size == 1){
+            _set_register8(AL, value);
+        }
+        else if(size == 2){
+            registers[EAX] = (registers[EAX] & 0xFFFF0000) | value;
+        }
+        else{
+            registers[EAX] = value;
+        }
+        registers[ESI] += step;
+        if(!repeat) return;
+    }while(--registers[ECX] != 0);
 }
 
-void emulator::_mov_rm8_r8(){
-    eip++;
+void emulator::_scas(const Instruction &inst){
+    uint32_t size = string_size(inst);
+    int32_t step = (eflags & DIRECTION_FLAG) ? -(int32_t)size : size;
+    bool repeat = (inst.prefix & (PREFIX_REP | PREFIX_REPNE)) != 0;
+    uint32_t mask = size == 4 ? 0xFFFFFFFF : (1U << (size * 8)) - 1;
+    
+    if(repeat && (registers[ECX] == 0 || _rep_scas_bulk(inst, size, step))) return;
     
-    ModRM modrm;
-    _parse_modrm(modrm);
+    do{
+        _compare_string(registers[EAX] & mask, _get_string(registers[EDI], size), size);
+        registers[EDI] += step;
+        if(!repeat) return;
+        registers[ECX]--;
+    }while(registers[ECX] != 0 && _is_zero() == ((inst.prefix & PREFIX_REP) != 0));
+}
+
+//DFは遅延評価するフラグに含まれないので、eflagsを直接変える
+void emulator::_cli(const Instruction &inst){
+    eflags &= ~INTERRUPT_FLAG;
+}
+
+//待っている割り込みは次のブロックの境目で受け付ける
+void emulator::_sti(const Instruction &inst){
+    eflags |= INTERRUPT_FLAG;
+    _recheck_events();
+}
+
+void emulator::_pushfd(const Instruction &inst){
+    _materialize_eflags();
+    _push32(eflags);
+}
+
+void emulator::_popfd(const Instruction &inst){
+    eflags = _pop32() & WRITABLE_FLAGS;
+    flags_op = FLAGS_NONE;
+    _recheck_events();
+}
+
+//積まれたcsは捨てる
+void emulator::_iret(const Instruction &inst){
+    eip = _pop32();
+    _pop32();
+    eflags = _pop32() & WRITABLE_FLAGS;
+    flags_op = FLAGS_NONE;
+    _recheck_events();
+}
+
+void emulator::_cld(const Instruction &inst){
+    eflags &= ~DIRECTION_FLAG;
+}
+
+void emulator::_std(const Instruction &inst){
+    eflags |= DIRECTION_FLAG;
+}
+
+void emulator::_mov_r8_imm8(const Instruction &inst){
+    uint8_t reg = inst.opecode - 0xB0;
+    _set_register8(static_cast<Register>(reg), inst.imm);
+}
+
+void emulator::_cmp_al_imm8(const Instruction &inst){
+    uint8_t imm8 = inst.imm;
+    uint8_t al = _get_register8(AL);
     
-    uint8_t r8 = _get_r8(modrm);
-    _set_rm8(modrm, r8);
+    uint8_t result = al - imm8;
+    _update_eflags_sub8(al, imm8, result);
+}
+
+void emulator::_mov_rm8_r8(const Instruction &inst){
+    uint8_t r8 = _get_r8(inst.modrm);
+    _set_rm8(inst.modrm, r8);
+}
+
+void emulator::_mov_r8_rm8(const Instruction &inst){
+    uint8_t rm8 = _get_rm8(inst.modrm);
+    _set_r8(inst.modrm, rm8);
+}
+
+void emulator::_mov_rm8_imm8(const Instruction &inst){
+    _set_rm8(inst.modrm, inst.imm);
+}
+
+//moffs: 即値のアドレス
+void emulator::_mov_al_moffs8(const Instruction &inst){
+    _set_register8(AL, _get_memory8(inst.imm));
+}
+
+void emulator::_mov_eax_moffs32(const Instruction &inst){
+    _set_register32(EAX, _get_memory32(inst.imm));
+}
+
+void emulator::_mov_moffs8_al(const Instruction &inst){
+    _set_memory8(inst.imm, _get_register8(AL));
 }
 
-void emulator::_mov_r8_rm8(){
-    eip++;
+void emulator::_mov_moffs32_eax(const Instruction &inst){
+    _set_memory32(inst.imm, _get_register32(EAX));
+}
+
+void emulator::_movzx_r32_rm8(const Instruction &inst){
+    _set_r32(inst.modrm, _get_rm8(inst.modrm));
+}
+
+void emulator::_movzx_r32_rm16(const Instruction &inst){
+    _set_r32(inst.modrm, _get_rm16(inst.modrm));
+}
+
+void emulator::_movsx_r32_rm8(const Instruction &inst){
+    _set_r32(inst.modrm, (int8_t)_get_rm8(inst.modrm));
+}
+
+void emulator::_movsx_r32_rm16(const Instruction &inst){
+    _set_r32(inst.modrm, (int16_t)_get_rm16(inst.modrm));
+}
+
+void emulator::_lea_r32_m32(const Instruction &inst){
+    if(inst.modrm.mod == 3){
+        fprintf(stderr, "error : not implemted instruction. ModRM(mod=%d, rm=%d)\n", inst.modrm.mod, inst.modrm.rm);
+        _stop(STOP_UNIMPLEMENTED);
+    }
+    _set_r32(inst.modrm, _calc_memory_address(inst.modrm));
+}
+
+void emulator::_inc_r32(const Instruction &inst){
+    Register reg = static_cast<Register>(inst.opecode - 0x40);
+    uint32_t r32 = _get_register32(reg);
+    _set_register32(reg, r32 + 1);
     
-    ModRM modrm;
-    _parse_modrm(modrm);
+    _update_eflags_inc(r32, r32 + 1);
+}
+
+void emulator::_dec_r32(const Instruction &inst){
+    Register reg = static_cast<Register>(inst.opecode - 0x48);
+    uint32_t r32 = _get_register32(reg);
+    _set_register32(reg, r32 - 1);
     
-    uint8_t rm8 = _get_rm8(modrm);
-    _set_r8(modrm, rm8);
+    _update_eflags_dec(r32, r32 - 1);
+}
+
+void emulator::_nop(const Instruction &inst){
+}
+
+//EAXを符号拡張してEDX:EAXにする
+void emulator::_cdq(const Instruction &inst){
+    _set_register32(EDX, (_get_register32(EAX) & 0x80000000) ? 0xFFFFFFFF : 0);
 }
 
-void emulator::_inc_r32(){
-    Register reg = static_cast<Register>(_get_code8(0) - 0x40);
-    _set_register32(reg, _get_register32(reg) + 1);
-    eip++;
+//IFが立っていれば割り込みが来るまで待つ。受け付けるのはブロックの境目(hltの次の命令の前)
+//IFが下りていれば割り込みは来ないので、デバイスの状態が変わったら次の命令に進む
+void emulator::_hlt(const Instruction &inst){
+    while(true){
+        if(eflags & INTERRUPT_FLAG){
+            _update_interrupts();
+            if(interrupt_controller->has_interrupt()) break;
+        }
+        if(!_wait_event()){
+            //もう一度run()したときはhltから待ち直す
+            eip -= inst.length;
+            _stop(STOP_IDLE);
+        }
+        //止める要求ならhltからやり直せるようにして、ブロックの境目で止まる
+        if(stop_requested){
+            eip -= inst.length;
+            break;
+        }
+        if(!(eflags & INTERRUPT_FLAG)) break;
+    }
+    _recheck_events();
 }
 
-void emulator::_swi(){
-    uint8_t int_index = _get_code8(1);
-    eip += 2;
+//IDTにゲートがあればゲストのハンドラを呼ぶ。無ければホスト側のBIOSの機能を使う
+void emulator::_swi(const Instruction &inst){
+    uint8_t int_index = inst.imm;
+    if(_has_gate(int_index)){
+        _interrupt(int_index);
+        return;
+    }
     
     switch(int_index){
         case 0x10:
@@ -715,31 +3066,18 @@ void emulator::_swi(){
             break;
         default:
             fprintf(stderr, "error : unknown interrupt. int_index=0x%02x\n", int_index);
-            exit(-1);
+            _stop(STOP_UNIMPLEMENTED);
     }
-    
+
 }
 
 
 //bios video functions
-void emulator::_put_string(const char *str, size_t n){
-    for(uint32_t i = 0; i < n; i++){
-        _io_out8(0x03F8, str[i]);
-    }
-}
-
 void emulator::_bios_video_teletype(){
     uint8_t color = _get_register8(BL) & 0x0F;
     uint8_t ch = _get_register8(AL);
     
-    char buf[32];
-    
-    //convert by table
-    uint8_t terminal_color = bios_to_terminal[color & 0x07];
-    uint8_t bright = (color & 0x08) >> 3;
-    
-    int len = sprintf(buf, "\x1b[%d;%dm%c\x1b[0m", bright, terminal_color, ch);
-    _put_string(buf, len);
+    console_device->write_color(ch, color);
 }
 
 void emulator::_bios_video(){
@@ -750,6 +3088,6 @@ void emulator::_bios_video(){
             break;
         default:
             fprintf(stderr, "error : not implemted bios video function. func=0x%02x\n", func);
-            exit(-1);
+            _stop(STOP_UNIMPLEMENTED);
     }
 }
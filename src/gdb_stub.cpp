@@ -0,0 +1,501 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "gdb_stub.hpp"
+
+//GDBのシグナル番号
+static const uint8_t GDB_SIGINT = 2;
+static const uint8_t GDB_SIGILL = 4;
+static const uint8_t GDB_SIGTRAP = 5;
+static const uint8_t GDB_SIGFPE = 8;
+static const uint8_t GDB_SIGSEGV = 11;
+static const uint8_t GDB_SIGSTOP = 17;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char c){
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//16進数を読んだところまでpを進める
+static uint32_t parse_hex(const char *&p){
+    uint32_t value = 0;
+    while(hex_value(*p) >= 0) value = (value << 4) | hex_value(*p++);
+    return value;
+}
+
+static void append_hex8(std::string &out, uint8_t value){
+    out += hex_digits[value >> 4];
+    out += hex_digits[value & 0x0F];
+}
+
+//レジスタはリトルエンディアンのバイト列
+static void append_hex32(std::string &out, uint32_t value){
+    for(int i = 0; i < 4; i++) append_hex8(out, (value >> (i * 8)) & 0xFF);
+}
+
+//2桁の16進数をcount個読む。足りなければfalse
+static bool decode_hex(const char *p, uint8_t *out, uint32_t count){
+    for(uint32_t i = 0; i < count; i++){
+        int high = hex_value(p[i * 2]);
+        int low = (high < 0) ? -1 : hex_value(p[i * 2 + 1]);
+        if(low < 0) return false;
+        out[i] = (high << 4) | low;
+    }
+    return true;
+}
+
+gdb_stub::gdb_stub(emulator *emu){
+    this->emu = emu;
+    listen_fd = -1;
+    fd = -1;
+    ack = true;
+    buffer_head = 0;
+    buffer_size = 0;
+    killed = false;
+    if(pipe2(watch_pipe, O_CLOEXEC) != 0){
+        watch_pipe[0] = -1;
+        watch_pipe[1] = -1;
+    }
+    last_stop = "S05";
+}
+
+gdb_stub::~gdb_stub(){
+    if(listen_fd >= 0) close(listen_fd);
+    if(watch_pipe[0] >= 0){
+        close(watch_pipe[0]);
+        close(watch_pipe[1]);
+    }
+}
+
+bool gdb_stub::listen(const char *address){
+    const char *colon = strrchr(address, ':');
+    bool tcp = (colon != NULL && strchr(address, '/') == NULL);
+    
+    if(tcp){
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(strtoul(colon + 1, NULL, 10));
+        std::string host(address, colon - address);
+        if(host.empty()) host = "127.0.0.1";
+        if(inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1){
+            fprintf(stderr, "error : invalid gdb address. address=%s\n", address);
+            return false;
+        }
+        
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        if(listen_fd >= 0) setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, 1) != 0){
+            fprintf(stderr, "error : failed to listen for gdb. address=%s\n", address);
+            return false;
+        }
+        return true;
+    }
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(address) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "error : gdb socket path is too long.\n");
+        return false;
+    }
+    strcpy(addr.sun_path, address);
+    
+    //前に使ったソケットが残っていれば消す(ソケット以外のファイルは消さない)
+    struct stat st;
+    if(stat(address, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(address);
+    
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, 1) != 0){
+        fprintf(stderr, "error : failed to listen for gdb. address=%s\n", address);
+        return false;
+    }
+    return true;
+}
+
+bool gdb_stub::serve(){
+    int connection;
+    while((connection = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0){
+        if(errno != EINTR){
+            fprintf(stderr, "error : failed to accept gdb connection.\n");
+            return false;
+        }
+    }
+    //1パケットずつやり取りするので、まとめて送るのを待たない(Unixドメインソケットでは失敗するだけ)
+    int nodelay = 1;
+    setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    
+    serve(connection);
+    close(connection);
+    return true;
+}
+
+void gdb_stub::serve(int fd){
+    this->fd = fd;
+    ack = true;
+    buffer_head = 0;
+    buffer_size = 0;
+    killed = false;
+    
+    std::string packet;
+    while(_receive(packet) && _handle(packet));
+    
+    //切断したら、ゲストはブレークポイント無しで続けられるようにしておく
+    for(std::set<uint32_t>::iterator it = breakpoints.begin(); it != breakpoints.end(); ++it){
+        emu->remove_breakpoint(*it);
+    }
+    breakpoints.clear();
+    this->fd = -1;
+}
+
+bool gdb_stub::is_killed(){
+    return killed;
+}
+
+bool gdb_stub::_read_byte(char &c){
+    if(buffer_head == buffer_size){
+        ssize_t n;
+        while((n = recv(fd, buffer, sizeof(buffer), 0)) < 0 && errno == EINTR);
+        if(n <= 0) return false;
+        buffer_head = 0;
+        buffer_size = n;
+    }
+    c = buffer[buffer_head++];
+    return true;
+}
+
+//$packet#checksum。パケットの外の0x03(Ctrl-C)はそれだけで1パケットとして返す
+bool gdb_stub::_receive(std::string &packet){
+    while(true){
+        char c;
+        if(!_read_byte(c)) return false;
+        if(c == 0x03){
+            packet = "\x03";
+            return true;
+        }
+        //ACK(+, -)は読み捨てる
+        if(c != '$') continue;
+        
+        packet.clear();
+        uint8_t sum = 0;
+        while(true){
+            if(!_read_byte(c)) return false;
+            if(c == '#') break;
+            packet += c;
+            sum += c;
+        }
+        
+        char checksum[2];
+        if(!_read_byte(checksum[0]) || !_read_byte(checksum[1])) return false;
+        uint8_t expected;
+        bool valid = decode_hex(checksum, &expected, 1) && expected == sum;
+        if(ack && send(fd, valid ? "+" : "-", 1, MSG_NOSIGNAL) != 1) return false;
+        if(valid) return true;
+    }
+}
+
+bool gdb_stub::_send(const std::string &packet){
+    std::string frame = "$" + packet + "#";
+    uint8_t sum = 0;
+    for(size_t i = 0; i < packet.size(); i++) sum += packet[i];
+    append_hex8(frame, sum);
+    
+    while(true){
+        size_t sent = 0;
+        while(sent < frame.size()){
+            ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) return false;
+            sent += n;
+        }
+        if(!ack) return true;
+        
+        //-なら送り直す
+        char c;
+        do{
+            if(!_read_byte(c)) return false;
+        }while(c != '+' && c != '-');
+        if(c == '+') return true;
+    }
+}
+
+std::string gdb_stub::_stop_reply(StopReason reason){
+    uint8_t signal;
+    switch(reason){
+        case STOP_HALT:
+            //eipが0になったのはプログラムの終了
+            return "W00";
+        case STOP_INTERRUPT:
+            signal = GDB_SIGINT;
+            break;
+        case STOP_UNIMPLEMENTED:
+            signal = GDB_SIGILL;
+            break;
+        case STOP_FAULT:
+        case STOP_SHUTDOWN:
+            signal = GDB_SIGSEGV;
+            break;
+        case STOP_DIVIDE_ERROR:
+            signal = GDB_SIGFPE;
+            break;
+        case STOP_IDLE:
+            signal = GDB_SIGSTOP;
+            break;
+        default:
+            signal = GDB_SIGTRAP;
+            break;
+    }
+    std::string reply = "S";
+    append_hex8(reply, signal);
+    return reply;
+}
+
+std::string gdb_stub::_read_register(uint32_t index){
+    uint32_t value;
+    if(index < REGISTERS_COUNT) value = emu->get_register32(static_cast<Register>(index));
+    else if(index == GDB_EIP) value = emu->get_eip();
+    else if(index == GDB_EFLAGS) value = emu->get_eflags();
+    else if(index == GDB_CS) value = INTERRUPT_CODE_SEGMENT;
+    else value = GDB_DATA_SEGMENT;
+    
+    std::string out;
+    append_hex32(out, value);
+    return out;
+}
+
+//セグメントレジスタへの書き込みは捨てる
+bool gdb_stub::_write_register(uint32_t index, uint32_t value){
+    if(index >= GDB_REGISTER_COUNT) return false;
+    if(index < REGISTERS_COUNT) emu->set_register32(static_cast<Register>(index), value);
+    else if(index == GDB_EIP) emu->set_eip(value);
+    else if(index == GDB_EFLAGS) emu->set_eflags(value);
+    return true;
+}
+
+std::string gdb_stub::_read_registers(){
+    std::string out;
+    for(uint32_t i = 0; i < GDB_REGISTER_COUNT; i++) out += _read_register(i);
+    return out;
+}
+
+bool gdb_stub::_write_registers(const char *hex){
+    for(uint32_t i = 0; i < GDB_REGISTER_COUNT; i++){
+        uint8_t bytes[4];
+        if(!decode_hex(hex + i * 8, bytes, 4)) return false;
+        _write_register(i, bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24));
+    }
+    return true;
+}
+
+//addr,length
+std::string gdb_stub::_read_memory(const char *args){
+    uint32_t address = parse_hex(args);
+    if(*args++ != ',') return "E01";
+    uint32_t length = parse_hex(args);
+    if(length > GDB_PACKET_SIZE / 2) length = GDB_PACKET_SIZE / 2;
+    
+    std::vector<uint8_t> data(length);
+    if(!emu->read_memory(address, data.data(), length)) return "E14";
+    std::string out;
+    for(uint32_t i = 0; i < length; i++) append_hex8(out, data[i]);
+    return out;
+}
+
+//addr,length:XX...
+std::string gdb_stub::_write_memory(const char *args){
+    uint32_t address = parse_hex(args);
+    if(*args++ != ',') return "E01";
+    uint32_t length = parse_hex(args);
+    if(*args++ != ':' || strlen(args) < (size_t)length * 2) return "E01";
+    
+    std::vector<uint8_t> data(length);
+    if(!decode_hex(args, data.data(), length)) return "E01";
+    if(!emu->write_memory(address, data.data(), length)) return "E14";
+    return "OK";
+}
+
+//type,addr,kind。ソフトウェア(0)もハードウェア(1)も同じ仕組みで止める
+std::string gdb_stub::_breakpoint(const char *args, bool insert){
+    uint32_t type = parse_hex(args);
+    if(type > 1) return "";
+    if(*args++ != ',') return "E01";
+    uint32_t address = parse_hex(args);
+    
+    if(insert){
+        breakpoints.insert(address);
+        emu->add_breakpoint(address);
+    }
+    else{
+        breakpoints.erase(address);
+        emu->remove_breakpoint(address);
+    }
+    return "OK";
+}
+
+//実行中はCtrl-Cを待って、request_stop()で止める
+void gdb_stub::_watch(){
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch_pipe[0];
+    fds[1].events = POLLIN;
+    
+    while(true){
+        //読んである分から探す
+        while(buffer_head < buffer_size){
+            if(buffer[buffer_head++] == 0x03) emu->request_stop();
+        }
+        
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        if(poll(fds, 2, -1) < 0){
+            if(errno == EINTR) continue;
+            return;
+        }
+        if(fds[1].revents) return;
+        
+        ssize_t n;
+        while((n = recv(fd, buffer, sizeof(buffer), 0)) < 0 && errno == EINTR);
+        if(n <= 0){
+            //切れたら止めて、次の受信で終わる
+            emu->request_stop();
+            return;
+        }
+        buffer_head = 0;
+        buffer_size = n;
+    }
+}
+
+//[addr]。今のeipにブレークポイントがあれば、外して1命令進めてから続ける
+std::string gdb_stub::_resume(const char *args, bool step){
+    if(*args != '\0') emu->set_eip(parse_hex(args));
+    
+    std::thread watcher(&gdb_stub::_watch, this);
+    
+    uint32_t address = emu->get_eip();
+    bool over = breakpoints.count(address) != 0;
+    if(over) emu->remove_breakpoint(address);
+    StopReason reason = emu->run(1);
+    if(over) emu->add_breakpoint(address);
+    if(!step && reason == STOP_BUDGET) reason = emu->run();
+    
+    ssize_t written = write(watch_pipe[1], "", 1);
+    (void)written;
+    watcher.join();
+    char c;
+    while(read(watch_pipe[0], &c, 1) != 1);
+    
+    last_stop = _stop_reply(reason);
+    return last_stop;
+}
+
+bool gdb_stub::_handle(const std::string &packet){
+    const char *args = packet.c_str() + 1;
+    std::string reply;
+    
+    switch(packet[0]){
+        case '\x03':
+            reply = _stop_reply(STOP_INTERRUPT);
+            break;
+        case '?':
+            reply = last_stop;
+            break;
+        case 'g':
+            reply = _read_registers();
+            break;
+        case 'G':
+            reply = _write_registers(args) ? "OK" : "E01";
+            break;
+        case 'p':{
+            uint32_t index = parse_hex(args);
+            //x87などのレジスタは無い
+            if(index < GDB_REGISTER_COUNT) reply = _read_register(index);
+            break;
+        }
+        case 'P':{
+            uint32_t index = parse_hex(args);
+            uint8_t bytes[4];
+            if(*args++ != '=' || !decode_hex(args, bytes, 4)){
+                reply = "E01";
+                break;
+            }
+            uint32_t value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+            reply = _write_register(index, value) ? "OK" : "E01";
+            break;
+        }
+        case 'm':
+            reply = _read_memory(args);
+            break;
+        case 'M':
+            reply = _write_memory(args);
+            break;
+        case 'c':
+            reply = _resume(args, false);
+            break;
+        case 's':
+            reply = _resume(args, true);
+            break;
+        case 'Z':
+            reply = _breakpoint(args, true);
+            break;
+        case 'z':
+            reply = _breakpoint(args, false);
+            break;
+        case 'H':
+        case 'T':
+            reply = "OK";
+            break;
+        case 'D':
+            _send("OK");
+            return false;
+        case 'k':
+            killed = true;
+            return false;
+        case 'q':
+            if(packet.compare(0, 11, "qSupported:") == 0 || packet == "qSupported"){
+                char supported[64];
+                snprintf(supported, sizeof(supported), "PacketSize=%x;QStartNoAckMode+", GDB_PACKET_SIZE);
+                reply = supported;
+            }
+            else if(packet == "qAttached") reply = "1";
+            else if(packet == "qC") reply = "QC1";
+            else if(packet == "qfThreadInfo") reply = "m1";
+            else if(packet == "qsThreadInfo") reply = "l";
+            break;
+        case 'Q':
+            if(packet == "QStartNoAckMode"){
+                _send("OK");
+                ack = false;
+                return true;
+            }
+            break;
+        case 'v':
+            if(packet.compare(0, 5, "vKill") == 0){
+                _send("OK");
+                return false;
+            }
+            break;
+        default:
+            //知らないパケットには空で応える(X, vContなどはGDBが別の方法に切り替える)
+            break;
+    }
+    
+    return _send(reply);
+}
@@ -0,0 +1,256 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "guest_memory.hpp"
+
+//ページ境界に切り上げる
+static size_t page_round(size_t size){
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    return(size + page_size - 1) & ~(page_size - 1);
+}
+
+memory_image::memory_image(uint32_t size){
+    this->size = size;
+    mapped_size = page_round(size);
+    
+    fd = memfd_create("guest_memory_image", MFD_CLOEXEC);
+    if(fd < 0 || ftruncate(fd, mapped_size) != 0){
+        fprintf(stderr, "error : failed to create memory image.\n");
+        exit(-1);
+    }
+    
+    data = NULL;
+    if(mapped_size > 0){
+        void *mem = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mem == MAP_FAILED){
+            fprintf(stderr, "error : failed to map memory image.\n");
+            exit(-1);
+        }
+        data = static_cast<uint8_t *>(mem);
+    }
+}
+
+memory_image::~memory_image(){
+    if(data != NULL) munmap(data, mapped_size);
+    close(fd);
+}
+
+bool memory_image::load(const char *filename, uint32_t address, uint32_t size){
+    FILE *binary;
+    
+    binary = fopen(filename, "rb");
+    if(binary == NULL){
+        fprintf(stderr, "error : failed to read program file.\n");
+        return false;
+    }
+    if(address > this->size) size = 0;
+    if(size > this->size - address) size = this->size - address;
+    fread(data + address, 1, size, binary);
+    fclose(binary);
+    return true;
+}
+
+uint8_t *memory_image::get_data(){
+    return data;
+}
+
+uint32_t memory_image::get_size() const{
+    return size;
+}
+
+int memory_image::get_fd() const{
+    return fd;
+}
+
+guest_memory::guest_memory(uint64_t size){
+    this->size = size;
+    _reserve();
+    
+    //ページ単位でしか保護できないので、sizeの端数はページ境界まで読み書きできる
+    size_t accessible = page_round(size);
+    if(accessible > 0 && mprotect(base, accessible, PROT_READ | PROT_WRITE) != 0){
+        fprintf(stderr, "error : failed to allocate guest memory.\n");
+        exit(-1);
+    }
+}
+
+guest_memory::guest_memory(const memory_image &image){
+    this->size = image.get_size();
+    _reserve();
+    
+    //予約した範囲の先頭に重ねてマップする。ページはホストのページキャッシュを共有する
+    size_t accessible = page_round(size);
+    if(accessible > 0){
+        void *mem = mmap(base, accessible, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image.get_fd(), 0);
+        if(mem == MAP_FAILED){
+            fprintf(stderr, "error : failed to map memory image.\n");
+            exit(-1);
+        }
+        file_ranges.push_back(std::make_pair(0, accessible));
+    }
+}
+
+void guest_memory::_reserve(){
+    reserved_size = GUEST_ADDRESS_SPACE + GUEST_GUARD_SIZE;
+    base = static_cast<uint8_t *>(reserve(reserved_size, PROT_NONE));
+    written_map = static_cast<uint8_t *>(reserve(page_round(_page_map_size()), PROT_READ | PROT_WRITE));
+    dirty_map = NULL;
+}
+
+guest_memory::~guest_memory(){
+    release(written_map, page_round(_page_map_size()));
+    release(base, reserved_size);
+}
+
+uint64_t guest_memory::_page_map_size(){
+    return (size >> GUEST_PAGE_SHIFT) + 1;
+}
+
+uint8_t *guest_memory::get_base(){
+    return base;
+}
+
+uint64_t guest_memory::get_size(){
+    return size;
+}
+
+bool guest_memory::contains(const void *host_address){
+    const uint8_t *p = static_cast<const uint8_t *>(host_address);
+    return(p >= base && p < base + reserved_size);
+}
+
+bool guest_memory::map_file(uint64_t address, uint64_t size, int fd, uint64_t offset){
+    void *mem = mmap(base + address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if(mem == MAP_FAILED) return false;
+    file_ranges.push_back(std::make_pair(address, size));
+    return true;
+}
+
+void guest_memory::track_writes(uint8_t *dirty_map){
+    this->dirty_map = dirty_map;
+}
+
+void guest_memory::reset_dirty(){
+    if(dirty_map == NULL) return;
+    
+    std::vector<uint32_t> pages;
+    marked_pages(dirty_map, _page_map_size(), pages);
+    for(size_t i = 0; i < pages.size(); i++) written_map[pages[i]] = 1;
+    memset(dirty_map, 0, _page_map_size());
+}
+
+void guest_memory::touched_pages(std::vector<uint32_t> &pages){
+    pages.clear();
+    //メモリの末尾より後ろのページの印は見ない
+    uint64_t page_count = (size + GUEST_PAGE_SIZE - 1) >> GUEST_PAGE_SHIFT;
+    marked_pages(written_map, page_count, pages);
+    if(dirty_map != NULL) marked_pages(dirty_map, page_count, pages);
+    for(size_t i = 0; i < file_ranges.size(); i++){
+        uint64_t end = (file_ranges[i].first + file_ranges[i].second + GUEST_PAGE_SIZE - 1) >> GUEST_PAGE_SHIFT;
+        for(uint64_t page = file_ranges[i].first >> GUEST_PAGE_SHIFT; page < end; page++) pages.push_back(page);
+    }
+    
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+}
+
+void *guest_memory::reserve(size_t size, int prot){
+    void *mem = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED){
+        fprintf(stderr, "error : failed to reserve %zu bytes of address space.\n", size);
+        exit(-1);
+    }
+    return mem;
+}
+
+void guest_memory::release(void *address, size_t size){
+    munmap(address, size);
+}
+
+//書き込みの無いところは8ページまとめて飛ばす
+void guest_memory::marked_pages(const uint8_t *map, uint64_t count, std::vector<uint32_t> &pages){
+    uint64_t page = 0;
+    while(page < count){
+        if((page & 7) == 0 && page + 8 <= count){
+            uint64_t marks;
+            memcpy(&marks, map + page, sizeof(marks));
+            if(marks == 0){
+                page += 8;
+                continue;
+            }
+        }
+        if(map[page]) pages.push_back(page);
+        page++;
+    }
+}
+
+sparse_buffer::sparse_buffer(){
+    base = NULL;
+    length = 0;
+    written_map = NULL;
+}
+
+sparse_buffer::sparse_buffer(const sparse_buffer &other){
+    base = NULL;
+    length = 0;
+    written_map = NULL;
+    *this = other;
+}
+
+sparse_buffer &sparse_buffer::operator=(const sparse_buffer &other){
+    if(this == &other) return *this;
+    assign(other.length);
+    
+    std::vector<uint32_t> pages;
+    other.touched_pages(pages);
+    for(size_t i = 0; i < pages.size(); i++){
+        uint64_t address = (uint64_t)pages[i] << GUEST_PAGE_SHIFT;
+        write(address, other.base + address, std::min((uint64_t)GUEST_PAGE_SIZE, length - address));
+    }
+    return *this;
+}
+
+sparse_buffer::~sparse_buffer(){
+    assign(0);
+}
+
+uint64_t sparse_buffer::_page_count() const{
+    return (length + GUEST_PAGE_SIZE - 1) >> GUEST_PAGE_SHIFT;
+}
+
+void sparse_buffer::assign(uint64_t size){
+    if(base != NULL){
+        guest_memory::release(base, page_round(length));
+        guest_memory::release(written_map, page_round(_page_count()));
+    }
+    base = NULL;
+    written_map = NULL;
+    length = size;
+    if(size > 0){
+        base = static_cast<uint8_t *>(guest_memory::reserve(page_round(size), PROT_READ | PROT_WRITE));
+        written_map = static_cast<uint8_t *>(guest_memory::reserve(page_round(_page_count()), PROT_READ | PROT_WRITE));
+    }
+}
+
+uint64_t sparse_buffer::size() const{
+    return length;
+}
+
+const uint8_t *sparse_buffer::data() const{
+    return base;
+}
+
+void sparse_buffer::write(uint64_t address, const void *data, uint64_t size){
+    if(size == 0) return;
+    memcpy(base + address, data, size);
+    uint64_t last = (address + size - 1) >> GUEST_PAGE_SHIFT;
+    for(uint64_t page = address >> GUEST_PAGE_SHIFT; page <= last; page++) written_map[page] = 1;
+}
+
+void sparse_buffer::touched_pages(std::vector<uint32_t> &pages) const{
+    pages.clear();
+    if(base != NULL) guest_memory::marked_pages(written_map, _page_count(), pages);
+}
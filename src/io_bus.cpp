@@ -0,0 +1,148 @@
+#include <cerrno>
+#include <cstdio>
+#include <vector>
+#include <poll.h>
+#include "io_bus.hpp"
+
+//何もつながっていないポートは読むと0、書き込みは捨てる
+class unmapped_device : public io_device{
+public:
+    uint8_t in8(uint16_t port){
+        return 0;
+    }
+    void out8(uint16_t port, uint8_t value){
+    }
+    uint16_t in16(uint16_t port){
+        return 0;
+    }
+    uint32_t in32(uint16_t port){
+        return 0;
+    }
+    void out16(uint16_t port, uint16_t value){
+    }
+    void out32(uint16_t port, uint32_t value){
+    }
+};
+
+static unmapped_device unmapped;
+
+uint16_t io_device::in16(uint16_t port){
+    return in8(port) | (in8(port + 1) << 8);
+}
+
+uint32_t io_device::in32(uint16_t port){
+    return in16(port) | ((uint32_t)in16(port + 2) << 16);
+}
+
+void io_device::out16(uint16_t port, uint16_t value){
+    out8(port, value & 0xFF);
+    out8(port + 1, value >> 8);
+}
+
+void io_device::out32(uint16_t port, uint32_t value){
+    out16(port, value & 0xFFFF);
+    out16(port + 2, value >> 16);
+}
+
+io_bus::io_bus(){
+    for(uint32_t i = 0; i < IO_MAX_DEVICES; i++) devices[i] = &unmapped;
+    device_count = 1;
+    port_map = new uint8_t[IO_PORT_COUNT]();
+    wake_fd = -1;
+}
+
+io_bus::~io_bus(){
+    delete[] port_map;
+}
+
+bool io_bus::attach(io_device *device, uint16_t first, uint32_t count){
+    if(first + count > IO_PORT_COUNT) return false;
+    for(uint32_t port = first; port < first + count; port++){
+        if(port_map[port] != 0) return false;
+    }
+    
+    //同じデバイスを複数の範囲につなぐときは番号を使い回す
+    uint32_t index = 0;
+    for(uint32_t i = 1; i < device_count; i++){
+        if(devices[i] == device) index = i;
+    }
+    if(index == 0){
+        if(device_count == IO_MAX_DEVICES){
+            fprintf(stderr, "error : too many io devices.\n");
+            return false;
+        }
+        index = device_count++;
+        devices[index] = device;
+    }
+    
+    for(uint32_t port = first; port < first + count; port++){
+        port_map[port] = index;
+    }
+    return true;
+}
+
+void io_bus::detach(io_device *device){
+    for(uint32_t i = 1; i < device_count; i++){
+        if(devices[i] != device) continue;
+        
+        for(uint32_t port = 0; port < IO_PORT_COUNT; port++){
+            if(port_map[port] == i) port_map[port] = 0;
+        }
+        //番号は空けたままにしておく(他のポートの表を書き換えずに済む)
+        devices[i] = &unmapped;
+    }
+}
+
+io_device *io_bus::get_device(uint16_t port){
+    if(port_map[port] == 0) return NULL;
+    return devices[port_map[port]];
+}
+
+uint64_t io_bus::get_version(){
+    uint64_t version = 0;
+    for(uint32_t i = 1; i < device_count; i++) version += devices[i]->get_version();
+    return version;
+}
+
+void io_bus::set_wake_fd(int fd){
+    wake_fd = fd;
+}
+
+bool io_bus::wait(bool ignore_ready, int64_t timeout){
+    std::vector<struct pollfd> fds;
+    for(uint32_t i = 1; i < device_count; i++){
+        int fd = devices[i]->get_event_fd();
+        if(fd < 0) continue;
+        
+        struct pollfd entry;
+        entry.fd = fd;
+        entry.events = POLLIN;
+        entry.revents = 0;
+        fds.push_back(entry);
+    }
+    
+    if(ignore_ready && !fds.empty()){
+        while(poll(fds.data(), fds.size(), 0) < 0 && errno == EINTR);
+        std::vector<struct pollfd> waiting;
+        for(size_t i = 0; i < fds.size(); i++){
+            if(fds[i].revents == 0) waiting.push_back(fds[i]);
+        }
+        fds.swap(waiting);
+    }
+    if(fds.empty() && timeout < 0) return false;
+    if(wake_fd >= 0){
+        struct pollfd entry;
+        entry.fd = wake_fd;
+        entry.events = POLLIN;
+        entry.revents = 0;
+        fds.push_back(entry);
+    }
+    
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000000000;
+    ts.tv_nsec = timeout % 1000000000;
+    while(ppoll(fds.data(), fds.size(), timeout >= 0 ? &ts : NULL, NULL) < 0){
+        if(errno != EINTR) return false;
+    }
+    return true;
+}
@@ -0,0 +1,857 @@
+#include <sys/mman.h>
+#include "jit.hpp"
+
+//ホストのレジスタ番号
+const uint8_t HOST_RAX = 0;
+const uint8_t HOST_RCX = 1;
+const uint8_t HOST_RDX = 2;
+const uint8_t HOST_RDI = 7;
+//ゲストのレジスタはr8d..r15dに割り当てる
+const uint8_t HOST_GUEST_BASE = 8;
+const uint8_t HOST_ESP = HOST_GUEST_BASE + ESP;
+const uint8_t HOST_EBP = HOST_GUEST_BASE + EBP;
+
+const uint32_t ARITHMETIC_FLAGS = CARRY_FLAG | ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG;
+
+//1命令あたりに出力する最大バイト数の目安
+const size_t JIT_MAX_INSTRUCTION_CODE = 128;
+const size_t JIT_MAX_FRAME_CODE = 256;
+
+static uint8_t host_register(uint8_t reg){
+    return HOST_GUEST_BASE + reg;
+}
+
+jit::jit(size_t cache_size){
+    this->cache_size = cache_size;
+    used = 0;
+    compiled_count = 0;
+    flush_count = 0;
+    overflow = false;
+    
+    void *mem = mmap(NULL, cache_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED){
+        fprintf(stderr, "error : failed to allocate jit code cache.\n");
+        exit(-1);
+    }
+    cache = static_cast<uint8_t *>(mem);
+}
+
+jit::~jit(){
+    munmap(cache, cache_size);
+}
+
+bool jit::full(){
+    return overflow;
+}
+
+void jit::flush(){
+    used = 0;
+    overflow = false;
+    flush_count++;
+}
+
+JitFunction jit::compile(const Block &block){
+    p = cache + used;
+    limit = cache + cache_size;
+    overflow = false;
+    
+    //大きすぎてキャッシュに入らない場合は、空にしても無駄なので諦める
+    if(JIT_MAX_FRAME_CODE + block.length * JIT_MAX_INSTRUCTION_CODE > cache_size) return NULL;
+    
+    //エピローグを先に置いておくと、出口のジャンプは全部後ろ向きになる
+    epilogue = p;
+    _emit_epilogue();
+    
+    uint8_t *entry = p;
+    _emit_prologue();
+    
+    uint32_t eip = block.address;
+    for(uint32_t i = 0; i < block.length; i++){
+        const Instruction &inst = block.instructions[i];
+        current_index = i;
+        index_stored = false;
+        if(!_emit_instruction(inst, eip)) return NULL;
+        eip += inst.length;
+    }
+    
+    //分岐で終わっていなければ次の命令へ
+    //翻訳できる分岐(jmp, call, ret, Jcc)は自分で抜けるので、ここに来るのはそれ以外
+    const Instruction &last = block.instructions[block.length - 1];
+    if(!(last.format & FORMAT_BRANCH)) _emit_exit(eip);
+    
+    if(overflow) return NULL;
+    
+    used = p - cache;
+    compiled_count++;
+    return reinterpret_cast<JitFunction>(entry);
+}
+
+void jit::_emit8(uint8_t value){
+    if(p >= limit){
+        overflow = true;
+        return;
+    }
+    *p++ = value;
+}
+
+void jit::_emit32(uint32_t value){
+    for(int i = 0; i < 4; i++){
+        _emit8((value >> (i * 8)) & 0xFF);
+    }
+}
+
+void jit::_emit_rex(bool w, uint8_t reg, uint8_t rm){
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if(rex != 0x40) _emit8(rex);
+}
+
+void jit::_emit_modrm(uint8_t mod, uint8_t reg, uint8_t rm){
+    _emit8((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+void jit::_emit_prologue(){
+    //push rbx, rbp, r12-r15
+    _emit8(0x53);
+    _emit8(0x55);
+    for(int i = 4; i < 8; i++){
+        _emit8(0x41);
+        _emit8(0x50 + i);
+    }
+    //mov rbp, rdi
+    _emit8(0x48); _emit8(0x89); _emit8(0xFD);
+    //mov rsi, [rbp + memory]
+    _emit8(0x48); _emit8(0x8B); _emit8(0x75); _emit8(offsetof(JitContext, memory));
+    //mov rbx, [rbp + code_map]
+    _emit8(0x48); _emit8(0x8B); _emit8(0x5D); _emit8(offsetof(JitContext, code_map));
+    
+    //mov rax, [rbp + registers]
+    _emit8(0x48); _emit8(0x8B); _emit8(0x45); _emit8(offsetof(JitContext, registers));
+    for(int i = 0; i < REGISTERS_COUNT; i++){
+        //mov r8d+i, [rax + i * 4]
+        _emit8(0x44); _emit8(0x8B);
+        _emit_modrm(1, i, HOST_RAX);
+        _emit8(i * 4);
+    }
+    
+    //mov rax, [rbp + eflags]; mov edi, [rax]
+    _emit8(0x48); _emit8(0x8B); _emit8(0x45); _emit8(offsetof(JitContext, eflags));
+    _emit8(0x8B); _emit8(0x38);
+}
+
+void jit::_emit_epilogue(){
+    //mov rcx, [rbp + registers]
+    _emit8(0x48); _emit8(0x8B); _emit8(0x4D); _emit8(offsetof(JitContext, registers));
+    for(int i = 0; i < REGISTERS_COUNT; i++){
+        //mov [rcx + i * 4], r8d+i
+        _emit8(0x44); _emit8(0x89);
+        _emit_modrm(1, i, HOST_RCX);
+        _emit8(i * 4);
+    }
+    
+    //mov rcx, [rbp + eflags]; mov [rcx], edi
+    _emit8(0x48); _emit8(0x8B); _emit8(0x4D); _emit8(offsetof(JitContext, eflags));
+    _emit8(0x89); _emit8(0x39);
+    
+    //pop r15-r12, rbp, rbx
+    for(int i = 7; i >= 4; i--){
+        _emit8(0x41);
+        _emit8(0x58 + i);
+    }
+    _emit8(0x5D);
+    _emit8(0x5B);
+    _emit8(0xC3);
+}
+
+//eaxに次のeipを入れてエピローグへ
+void jit::_emit_exit(uint32_t next_eip){
+    _emit_mov_imm(HOST_RAX, next_eip);
+    _emit8(0xE9);
+    _emit32(epilogue - (p + 4));
+}
+
+void jit::_emit_mov_imm(uint8_t host, uint32_t imm){
+    _emit_rex(false, 0, host);
+    _emit8(0xB8 + (host & 7));
+    _emit32(imm);
+}
+
+//op dst, src (32bit)
+void jit::_emit_op_reg(uint8_t opecode, uint8_t dst, uint8_t src){
+    _emit_rex(false, src, dst);
+    _emit8(opecode);
+    _emit_modrm(3, src, dst);
+}
+
+//op dst, imm32 (81 /ext)
+void jit::_emit_op_imm(uint8_t ext, uint8_t dst, uint32_t imm){
+    _emit_rex(false, 0, dst);
+    _emit8(0x81);
+    _emit_modrm(3, ext, dst);
+    _emit32(imm);
+}
+
+//ゲストのメモリを触る前に、今の命令の番号をJitContextへ書く(1命令に1回)
+//フォールトしたらemulatorはこの番号とシグナルのときのレジスタから、インタプリタと同じ状態を作る
+//フォールトはその命令が何も書き換える前に起きるので、ホストのレジスタはその命令の直前の状態になっている
+void jit::_emit_store_index(){
+    if(index_stored) return;
+    //mov dword [rbp + instruction], current_index
+    _emit8(0xC7); _emit8(0x45); _emit8(offsetof(JitContext, instruction));
+    _emit32(current_index);
+    index_stored = true;
+}
+
+//mov host, [rsi + rcx]
+void jit::_emit_load(uint8_t host){
+    _emit_store_index();
+    _emit_rex(false, host, 0);
+    _emit8(0x8B);
+    _emit_modrm(0, host, 4);
+    _emit8(0x0E);
+}
+
+//mov [rsi + rcx], host
+void jit::_emit_store(uint8_t host){
+    _emit_store_index();
+    _emit_rex(false, host, 0);
+    _emit8(0x89);
+    _emit_modrm(0, host, 4);
+    _emit8(0x0E);
+}
+
+//mov dword [rsi + rcx], imm32
+void jit::_emit_store_imm(uint32_t imm){
+    _emit_store_index();
+    _emit8(0xC7);
+    _emit_modrm(0, 0, 4);
+    _emit8(0x0E);
+    _emit32(imm);
+}
+
+//mov host8, [rsi + rcx] (host8はAL..BLかr8b..r11b)
+void jit::_emit_load8(uint8_t host){
+    _emit_store_index();
+    _emit_rex(false, host, 0);
+    _emit8(0x8A);
+    _emit_modrm(0, host, 4);
+    _emit8(0x0E);
+}
+
+//mov [rsi + rcx], host8
+void jit::_emit_store8(uint8_t host){
+    _emit_store_index();
+    _emit_rex(false, host, 0);
+    _emit8(0x88);
+    _emit_modrm(0, host, 4);
+    _emit8(0x0E);
+}
+
+//mov byte [rsi + rcx], imm8
+void jit::_emit_store8_imm(uint8_t imm){
+    _emit_store_index();
+    _emit8(0xC6);
+    _emit_modrm(0, 0, 4);
+    _emit8(0x0E);
+    _emit8(imm);
+}
+
+//ModRMのメモリアドレスをecxに求める
+void jit::_emit_address(const ModRM &modrm){
+    bool has_base = modrm.base != MODRM_ZERO_REGISTER;
+    bool has_index = modrm.index != MODRM_ZERO_REGISTER;
+    if(!has_base && !has_index){
+        _emit_mov_imm(HOST_RCX, modrm.disp32);
+        return;
+    }
+    
+    //lea ecx, [base + index * scale + disp32]
+    //SIBのbase=101(mod=00)はベース無し、index=100(REX.X=0)はインデックス無し
+    uint8_t base = has_base ? host_register(modrm.base) : 5;
+    uint8_t index = has_index ? host_register(modrm.index) : 4;
+    _emit8(0x40 | ((index >> 3) << 1) | (base >> 3));
+    _emit8(0x8D);
+    _emit_modrm(has_base ? 2 : 0, HOST_RCX, 4);
+    _emit8((modrm.scale << 6) | ((index & 7) << 3) | (base & 7));
+    _emit32(modrm.disp32);
+}
+
+//書き込み先(ecx)が翻訳済みのコードなら、書き込む前にこの命令のeipで抜ける
+//続きはインタプリタで実行してキャッシュを無効化させる
+//sizeは書き込むバイト数(1か4)
+void jit::_emit_check_code(uint32_t eip, uint32_t size){
+    //bt [rbx], rcx
+    _emit8(0x48); _emit8(0x0F); _emit8(0xA3); _emit8(0x0B);
+    //jnc skip
+    _emit8(0x73);
+    _emit8(17);
+    //mov dword [rbp + side_exit], 1
+    _emit8(0xC7); _emit8(0x45); _emit8(offsetof(JitContext, side_exit));
+    _emit32(1);
+    _emit_exit(eip);
+    
+    //書き込み先のページをdirty_map(code_mapの直後)に記録する
+    //4バイトの書き込みは、はみ出す次のページも記録する
+    for(uint32_t i = 0; i < (size > 1 ? 2 : 1); i++){
+        //lea rax, [rcx + (size - 1) * i]
+        _emit8(0x48); _emit8(0x8D); _emit8(0x41); _emit8((size - 1) * i);
+        //shr rax, DIRTY_PAGE_SHIFT
+        _emit8(0x48); _emit8(0xC1); _emit8(0xE8); _emit8(DIRTY_PAGE_SHIFT);
+        //mov byte [rbx + rax + CODE_MAP_SIZE], 1
+        _emit8(0xC6); _emit8(0x84); _emit8(0x03);
+        _emit32(CODE_MAP_SIZE);
+        _emit8(1);
+    }
+}
+
+//直前の演算のフラグのうちmaskの分をeflags(edi)へ反映する
+//ビットの位置はホストとゲストで同じ
+void jit::_emit_update_eflags(uint32_t mask){
+    //pushfq; pop rdx
+    _emit8(0x9C);
+    _emit8(0x5A);
+    _emit_op_imm(4, HOST_RDX, mask);
+    _emit_op_imm(4, HOST_RDI, ~mask);
+    _emit_op_reg(0x09, HOST_RDI, HOST_RDX);
+}
+
+//shl(4), shr(5), sar(7) dst, count
+void jit::_emit_shift_imm(uint8_t ext, uint8_t dst, uint8_t count){
+    _emit_rex(false, 0, dst);
+    _emit8(0xC1);
+    _emit_modrm(3, ext, dst);
+    _emit8(count);
+}
+
+//op /ext dst (inc, decはFF、not, negはF7)
+void jit::_emit_unary(uint8_t opecode, uint8_t ext, uint8_t dst){
+    _emit_rex(false, 0, dst);
+    _emit8(opecode);
+    _emit_modrm(3, ext, dst);
+}
+
+//メモリのオペランドのアドレスをecxに、値をeaxに読む
+//書き戻す命令は、読む前にコードへの書き込みを調べる
+void jit::_emit_load_operand(const ModRM &modrm, uint32_t eip, bool write){
+    _emit_address(modrm);
+    if(write) _emit_check_code(eip, 4);
+    _emit_load(HOST_RAX);
+}
+
+//add, or, and, sub, xor, cmpとtest
+//ホストの同じ命令で計算すれば、フラグもインタプリタと同じになる(論理演算はCF=OF=0)
+void jit::_emit_alu(const Instruction &inst, uint32_t eip){
+    const ModRM &modrm = inst.modrm;
+    uint8_t reg = host_register(modrm.reg_index);
+    uint8_t rm = host_register(modrm.rm);
+    bool is_register = modrm.mod == 3;
+    
+    if(inst.opecode == 0x81 || inst.opecode == 0x83){
+        uint8_t op = modrm.opecode;
+        if(is_register){
+            _emit_op_imm(op, rm, inst.imm);
+            _emit_update_eflags(ARITHMETIC_FLAGS);
+        }
+        else{
+            _emit_load_operand(modrm, eip, op != 7);
+            _emit_op_imm(op, HOST_RAX, inst.imm);
+            _emit_update_eflags(ARITHMETIC_FLAGS);
+            if(op != 7) _emit_store(HOST_RAX);
+        }
+        return;
+    }
+    
+    //op eax, imm32
+    uint8_t op = inst.opecode >> 3;
+    bool is_test = inst.opecode == 0x85;
+    if(!is_test && (inst.opecode & 7) == 5){
+        _emit_op_imm(op, host_register(EAX), inst.imm);
+        _emit_update_eflags(ARITHMETIC_FLAGS);
+        return;
+    }
+    
+    //op rm32, r32(op * 8 + 1)とtest(85)はrmが左、op r32, rm32(op * 8 + 3)はregが左
+    //ホストではどちらもop rm32, r32の形で出す
+    uint8_t opecode = is_test ? 0x85 : op * 8 + 1;
+    bool to_rm = is_test || (inst.opecode & 7) == 1;
+    bool write = !is_test && op != 7;
+    if(is_register){
+        if(to_rm) _emit_op_reg(opecode, rm, reg);
+        else _emit_op_reg(opecode, reg, rm);
+        _emit_update_eflags(ARITHMETIC_FLAGS);
+    }
+    else if(to_rm){
+        _emit_load_operand(modrm, eip, write);
+        _emit_op_reg(opecode, HOST_RAX, reg);
+        _emit_update_eflags(ARITHMETIC_FLAGS);
+        if(write) _emit_store(HOST_RAX);
+    }
+    else{
+        _emit_load_operand(modrm, eip, false);
+        _emit_op_reg(opecode, reg, HOST_RAX);
+        _emit_update_eflags(ARITHMETIC_FLAGS);
+    }
+}
+
+//shl, shr, sar rm32 (回数が決まっているC1, D1)
+//CF, ZF, SFはホストと同じ。OFは回数が2以上だとホストでは不定なので、インタプリタと同じ値にする
+//  shl : 結果の最上位 ^ CF、shr : 元の値の最上位、sar : 0
+bool jit::_emit_shift(const Instruction &inst, uint32_t eip){
+    const ModRM &modrm = inst.modrm;
+    uint8_t ext = modrm.opecode == 6 ? 4 : modrm.opecode;
+    uint32_t count = inst.opecode == 0xC1 ? inst.imm & 0x1F : 1;
+    //回数が0ならフラグも変えない(滅多に無いのでインタプリタで)。rol, ror, rcl, rcrは未対応
+    if(ext < 4 || count == 0) return false;
+    
+    bool is_register = modrm.mod == 3;
+    uint8_t dst = is_register ? host_register(modrm.rm) : HOST_RAX;
+    if(!is_register) _emit_load_operand(modrm, eip, true);
+    
+    //shr, sarのOFはシフトの前に決まる(_emit_update_eflagsはOFを残す)
+    if(ext != 4){
+        _emit_op_imm(4, HOST_RDI, ~OVERFLOW_FLAG);
+    }
+    if(ext == 5){
+        //OF(bit11) = 元の値のbit31
+        _emit_op_reg(0x89, HOST_RDX, dst);
+        _emit_shift_imm(5, HOST_RDX, 31);
+        _emit_shift_imm(4, HOST_RDX, 11);
+        _emit_op_reg(0x09, HOST_RDI, HOST_RDX);
+    }
+    
+    _emit_shift_imm(ext, dst, count);
+    _emit_update_eflags(CARRY_FLAG | ZERO_FLAG | SIGN_FLAG);
+    if(!is_register) _emit_store(HOST_RAX);
+    
+    if(ext == 4){
+        //OF(bit11) = 結果のbit31 ^ CF(bit0)
+        _emit_op_reg(0x89, HOST_RDX, dst);
+        _emit_shift_imm(5, HOST_RDX, 31);
+        _emit_op_reg(0x31, HOST_RDX, HOST_RDI);
+        _emit_op_imm(4, HOST_RDX, 1);
+        _emit_shift_imm(4, HOST_RDX, 11);
+        _emit_op_imm(4, HOST_RDI, ~OVERFLOW_FLAG);
+        _emit_op_reg(0x09, HOST_RDI, HOST_RDX);
+    }
+    return true;
+}
+
+//imul r32, rm32, imm (69, 6B)とimul r32, rm32 (0F AF)
+//CF, OFは結果が32bitに収まらないか。ZF, SFはインタプリタと同じく変えない
+void jit::_emit_imul(const Instruction &inst){
+    const ModRM &modrm = inst.modrm;
+    uint8_t reg = host_register(modrm.reg_index);
+    uint8_t src = host_register(modrm.rm);
+    if(modrm.mod != 3){
+        _emit_address(modrm);
+        _emit_load(HOST_RAX);
+        src = HOST_RAX;
+    }
+    
+    _emit_rex(false, reg, src);
+    if(inst.prefix == PREFIX_TWO_BYTE){
+        _emit8(0x0F);
+        _emit8(0xAF);
+        _emit_modrm(3, reg, src);
+    }
+    else{
+        _emit8(0x69);
+        _emit_modrm(3, reg, src);
+        _emit32(inst.imm);
+    }
+    _emit_update_eflags(CARRY_FLAG | OVERFLOW_FLAG);
+}
+
+void jit::_emit_push_imm(uint32_t imm, uint32_t eip){
+    //[esp-4]
+    ModRM modrm;
+    memset(&modrm, 0, sizeof(ModRM));
+    modrm.mod = 1;
+    modrm.rm = ESP;
+    modrm.base = ESP;
+    modrm.index = MODRM_ZERO_REGISTER;
+    modrm.disp32 = -4;
+    
+    _emit_address(modrm);
+    _emit_check_code(eip, 4);
+    _emit_store_imm(imm);
+    _emit_op_reg(0x89, HOST_ESP, HOST_RCX);
+}
+
+void jit::_emit_push(uint8_t host, uint32_t eip){
+    //[esp-4]
+    ModRM modrm;
+    memset(&modrm, 0, sizeof(ModRM));
+    modrm.mod = 1;
+    modrm.rm = ESP;
+    modrm.base = ESP;
+    modrm.index = MODRM_ZERO_REGISTER;
+    modrm.disp32 = -4;
+    
+    _emit_address(modrm);
+    _emit_check_code(eip, 4);
+    _emit_store(host);
+    _emit_op_reg(0x89, HOST_ESP, HOST_RCX);
+}
+
+void jit::_emit_pop(uint8_t host){
+    _emit_op_reg(0x89, HOST_RCX, HOST_ESP);
+    _emit_load(HOST_RAX);
+    _emit_op_imm(0, HOST_ESP, 4);
+    _emit_op_reg(0x89, host, HOST_RAX);
+}
+
+//分岐するならedxを非0にして、eaxに行き先を入れる
+//見るフラグはインタプリタの各ハンドラと同じにする
+//ccは70+cc, 0F 80+ccの下位4bit。奇数は偶数の条件の否定なので、行き先を入れ替える
+void jit::_emit_jcc(uint8_t cc, uint32_t target, uint32_t next){
+    uint32_t mask = 0;
+    if(cc & 1){
+        uint32_t temp = target;
+        target = next;
+        next = temp;
+    }
+    
+    _emit_op_reg(0x89, HOST_RDX, HOST_RDI);
+    switch(cc & ~1){
+        case 0x0: mask = OVERFLOW_FLAG; break;
+        case 0x2: mask = CARRY_FLAG; break;
+        case 0x4: mask = ZERO_FLAG; break;
+        case 0x6: mask = CARRY_FLAG | ZERO_FLAG; break;
+        case 0x8: mask = SIGN_FLAG; break;
+        case 0xC:
+        case 0xE:
+            //SF != OF : OFをSFの位置までずらしてxor
+            _emit8(0xC1); _emit8(0xEA); _emit8(4);
+            _emit_op_reg(0x31, HOST_RDX, HOST_RDI);
+            mask = SIGN_FLAG;
+            break;
+    }
+    _emit_op_imm(4, HOST_RDX, mask);
+    
+    if((cc & ~1) == 0xE){
+        _emit_op_reg(0x89, HOST_RCX, HOST_RDI);
+        _emit_op_imm(4, HOST_RCX, ZERO_FLAG);
+        _emit_op_reg(0x09, HOST_RDX, HOST_RCX);
+    }
+    
+    _emit_mov_imm(HOST_RAX, next);
+    //test edx, edx; jz +5
+    _emit8(0x85); _emit8(0xD2);
+    _emit8(0x74); _emit8(5);
+    _emit_mov_imm(HOST_RAX, target);
+    _emit8(0xE9);
+    _emit32(epilogue - (p + 4));
+}
+
+bool jit::_emit_instruction(const Instruction &inst, uint32_t eip){
+    const ModRM &modrm = inst.modrm;
+    uint32_t next = eip + inst.length;
+    uint8_t reg = host_register(modrm.reg_index);
+    uint8_t rm = host_register(modrm.rm);
+    bool is_register = modrm.mod == 3;
+    
+    //プレフィックスは0x0Fだけ対応
+    if(inst.prefix == PREFIX_TWO_BYTE) return _emit_instruction_0f(inst, eip);
+    if(inst.prefix != 0) return false;
+    
+    switch(inst.opecode){
+        case 0xB8: case 0xB9: case 0xBA: case 0xBB:
+        case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+            _emit_mov_imm(host_register(inst.opecode - 0xB8), inst.imm);
+            return true;
+        
+        case 0x89:
+            if(is_register){
+                _emit_op_reg(0x89, rm, reg);
+            }
+            else{
+                _emit_address(modrm);
+                _emit_check_code(eip, 4);
+                _emit_store(reg);
+            }
+            return true;
+        
+        case 0x8B:
+            if(is_register){
+                _emit_op_reg(0x89, reg, rm);
+            }
+            else{
+                _emit_address(modrm);
+                _emit_load(reg);
+            }
+            return true;
+        
+        case 0xC7:
+            if(is_register){
+                _emit_mov_imm(rm, inst.imm);
+            }
+            else{
+                _emit_address(modrm);
+                _emit_check_code(eip, 4);
+                _emit_store_imm(inst.imm);
+            }
+            return true;
+        
+        //adc(2), sbb(3)はインタプリタも未実装
+        case 0x01: case 0x09: case 0x21: case 0x29: case 0x31: case 0x39:
+        case 0x03: case 0x0B: case 0x23: case 0x2B: case 0x33: case 0x3B:
+        case 0x05: case 0x0D: case 0x25: case 0x2D: case 0x35: case 0x3D:
+        case 0x85:
+            _emit_alu(inst, eip);
+            return true;
+        
+        case 0x81:
+        case 0x83:
+            if(modrm.opecode == 2 || modrm.opecode == 3) return false;
+            _emit_alu(inst, eip);
+            return true;
+        
+        case 0x8D:
+            if(is_register) return false;
+            _emit_address(modrm);
+            _emit_op_reg(0x89, reg, HOST_RCX);
+            return true;
+        
+        //inc, dec (CFは変わらない), push rm32
+        case 0xFF:
+            if(modrm.opecode == 6){
+                if(is_register){
+                    _emit_push(rm, eip);
+                }
+                else{
+                    _emit_address(modrm);
+                    _emit_load(HOST_RDX);
+                    _emit_push(HOST_RDX, eip);
+                }
+                return true;
+            }
+            if(modrm.opecode > 1) return false;
+            if(is_register){
+                _emit_unary(0xFF, modrm.opecode, rm);
+            }
+            else{
+                _emit_load_operand(modrm, eip, true);
+                _emit_unary(0xFF, modrm.opecode, HOST_RAX);
+            }
+            _emit_update_eflags(ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG);
+            if(!is_register) _emit_store(HOST_RAX);
+            return true;
+        
+        case 0x40: case 0x41: case 0x42: case 0x43:
+        case 0x44: case 0x45: case 0x46: case 0x47:
+        case 0x48: case 0x49: case 0x4A: case 0x4B:
+        case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+            _emit_unary(0xFF, (inst.opecode >> 3) & 1, host_register(inst.opecode & 7));
+            _emit_update_eflags(ZERO_FLAG | SIGN_FLAG | OVERFLOW_FLAG);
+            return true;
+        
+        //not(フラグは変わらない), neg
+        case 0xF7:
+            if(modrm.opecode != 2 && modrm.opecode != 3) return false;
+            if(is_register){
+                _emit_unary(0xF7, modrm.opecode, rm);
+            }
+            else{
+                _emit_load_operand(modrm, eip, true);
+                _emit_unary(0xF7, modrm.opecode, HOST_RAX);
+            }
+            if(modrm.opecode == 3) _emit_update_eflags(ARITHMETIC_FLAGS);
+            if(!is_register) _emit_store(HOST_RAX);
+            return true;
+        
+        case 0x50: case 0x51: case 0x52: case 0x53:
+        case 0x54: case 0x55: case 0x56: case 0x57:
+            _emit_push(host_register(inst.opecode - 0x50), eip);
+            return true;
+        
+        case 0x58: case 0x59: case 0x5A: case 0x5B:
+        case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+            _emit_pop(host_register(inst.opecode - 0x58));
+            return true;
+        
+        case 0x6A:
+            _emit_push_imm(inst.imm & 0xFF, eip);
+            return true;
+        
+        case 0x68:
+            _emit_push_imm(inst.imm, eip);
+            return true;
+        
+        case 0xC9:
+            _emit_op_reg(0x89, HOST_ESP, HOST_EBP);
+            _emit_pop(HOST_EBP);
+            return true;
+        
+        case 0xEB:
+        case 0xE9:
+            _emit_exit(next + inst.imm);
+            return true;
+        
+        case 0xE8:
+            _emit_push_imm(next, eip);
+            _emit_exit(next + inst.imm);
+            return true;
+        
+        case 0xC3:
+            _emit_op_reg(0x89, HOST_RCX, HOST_ESP);
+            _emit_load(HOST_RAX);
+            _emit_op_imm(0, HOST_ESP, 4);
+            _emit8(0xE9);
+            _emit32(epilogue - (p + 4));
+            return true;
+        
+        case 0x90:
+            return true;
+        
+        case 0xA1:
+            _emit_mov_imm(HOST_RCX, inst.imm);
+            _emit_load(host_register(EAX));
+            return true;
+        
+        case 0xA3:
+            _emit_mov_imm(HOST_RCX, inst.imm);
+            _emit_check_code(eip, 4);
+            _emit_store(host_register(EAX));
+            return true;
+        
+        case 0x69:
+        case 0x6B:
+            _emit_imul(inst);
+            return true;
+        
+        case 0xC1:
+        case 0xD1:
+            return _emit_shift(inst, eip);
+        
+        //8bitのレジスタはAL..BLだけ(ホストでREXを付けるとAH..BHは指せない)
+        case 0x38:
+        case 0x84:
+            if(modrm.reg_index >= 4) return false;
+            if(is_register){
+                if(modrm.rm >= 4) return false;
+                _emit_op_reg(inst.opecode, rm, reg);
+            }
+            else{
+                _emit_address(modrm);
+                _emit_load8(HOST_RAX);
+                _emit_op_reg(inst.opecode, HOST_RAX, reg);
+            }
+            _emit_update_eflags(ARITHMETIC_FLAGS);
+            return true;
+        
+        //cmp al, imm8
+        case 0x3C:
+            _emit_rex(false, 0, host_register(EAX));
+            _emit8(0x80);
+            _emit_modrm(3, 7, host_register(EAX));
+            _emit8(inst.imm);
+            _emit_update_eflags(ARITHMETIC_FLAGS);
+            return true;
+        
+        case 0x88:
+            if(modrm.reg_index >= 4) return false;
+            if(is_register){
+                if(modrm.rm >= 4) return false;
+                _emit_op_reg(0x88, rm, reg);
+            }
+            else{
+                _emit_address(modrm);
+                _emit_check_code(eip, 1);
+                _emit_store8(reg);
+            }
+            return true;
+        
+        case 0x8A:
+            if(modrm.reg_index >= 4) return false;
+            if(is_register){
+                if(modrm.rm >= 4) return false;
+                _emit_op_reg(0x88, reg, rm);
+            }
+            else{
+                _emit_address(modrm);
+                _emit_load8(reg);
+            }
+            return true;
+        
+        case 0xB0: case 0xB1: case 0xB2: case 0xB3:{
+            //mov r8b, imm8
+            uint8_t dst = host_register(inst.opecode - 0xB0);
+            _emit_rex(false, 0, dst);
+            _emit8(0xB0 + (dst & 7));
+            _emit8(inst.imm);
+            return true;
+        }
+        
+        case 0xC6:
+            if(is_register){
+                if(modrm.rm >= 4) return false;
+                _emit_rex(false, 0, rm);
+                _emit8(0xB0 + (rm & 7));
+                _emit8(inst.imm);
+            }
+            else{
+                _emit_address(modrm);
+                _emit_check_code(eip, 1);
+                _emit_store8_imm(inst.imm);
+            }
+            return true;
+        
+        //パリティ(7A, 7B)はインタプリタも未実装
+        case 0x70: case 0x71: case 0x72: case 0x73:
+        case 0x74: case 0x75: case 0x76: case 0x77:
+        case 0x78: case 0x79: case 0x7C: case 0x7D:
+        case 0x7E: case 0x7F:
+            _emit_jcc(inst.opecode & 0xF, next + inst.imm, next);
+            return true;
+        
+        default:
+            return false;
+    }
+}
+
+bool jit::_emit_instruction_0f(const Instruction &inst, uint32_t eip){
+    const ModRM &modrm = inst.modrm;
+    uint32_t next = eip + inst.length;
+    uint8_t reg = host_register(modrm.reg_index);
+    bool is_register = modrm.mod == 3;
+    
+    switch(inst.opecode){
+        case 0x80: case 0x81: case 0x82: case 0x83:
+        case 0x84: case 0x85: case 0x86: case 0x87:
+        case 0x88: case 0x89: case 0x8C: case 0x8D:
+        case 0x8E: case 0x8F:
+            _emit_jcc(inst.opecode & 0xF, next + inst.imm, next);
+            return true;
+        
+        case 0xAF:
+            _emit_imul(inst);
+            return true;
+        
+        //movzx(B6, B7), movsx(BE, BF)
+        //ホストでREXを付けるとAH..BHは指せないので、8bitのレジスタはAL..BLだけ
+        case 0xB6: case 0xB7: case 0xBE: case 0xBF:
+            if(is_register){
+                bool is_byte = (inst.opecode & 1) == 0;
+                if(is_byte && modrm.rm >= 4) return false;
+                uint8_t rm = host_register(modrm.rm);
+                _emit_rex(false, reg, rm);
+                _emit8(0x0F);
+                _emit8(inst.opecode);
+                _emit_modrm(3, reg, rm);
+            }
+            else{
+                //movzx/movsx reg, [rsi + rcx]
+                _emit_address(modrm);
+                _emit_store_index();
+                _emit_rex(false, reg, 0);
+                _emit8(0x0F);
+                _emit8(inst.opecode);
+                _emit_modrm(0, reg, 4);
+                _emit8(0x0E);
+            }
+            return true;
+        
+        default:
+            return false;
+    }
+}
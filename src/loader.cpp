@@ -0,0 +1,203 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "loader.hpp"
+#include "guest_memory.hpp"
+
+program_image::program_image(){
+    fd = -1;
+    data = NULL;
+    file_size = 0;
+    elf = false;
+    entry = 0;
+}
+
+program_image::~program_image(){
+    _close();
+}
+
+void program_image::_close(){
+    if(data != NULL) munmap(data, file_size);
+    if(fd >= 0) close(fd);
+    fd = -1;
+    data = NULL;
+    file_size = 0;
+    segments.clear();
+}
+
+bool program_image::open(const char *filename, uint32_t load_address){
+    _close();
+    
+    fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0){
+        fprintf(stderr, "error : failed to read program file.\n");
+        _close();
+        return false;
+    }
+    file_size = st.st_size;
+    if(file_size > 0xFFFFFFFFULL){
+        fprintf(stderr, "error : program file is too large.\n");
+        _close();
+        return false;
+    }
+    
+    if(file_size > 0){
+        void *mem = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mem == MAP_FAILED){
+            fprintf(stderr, "error : failed to map program file.\n");
+            file_size = 0;
+            _close();
+            return false;
+        }
+        data = static_cast<uint8_t *>(mem);
+    }
+    
+    elf = (file_size >= SELFMAG && memcmp(data, ELFMAG, SELFMAG) == 0);
+    if(elf){
+        if(!_parse_elf()){
+            _close();
+            return false;
+        }
+        return true;
+    }
+    
+    //フラットバイナリはファイル全体を1つのセグメントとして置く
+    if(load_address + (uint64_t)file_size > 0x100000000ULL){
+        fprintf(stderr, "error : program does not fit in the address space.\n");
+        _close();
+        return false;
+    }
+    ProgramSegment segment;
+    segment.address = load_address;
+    segment.offset = 0;
+    segment.file_size = file_size;
+    segment.memory_size = file_size;
+    segments.push_back(segment);
+    entry = load_address;
+    return true;
+}
+
+bool program_image::_parse_elf(){
+    if(file_size < sizeof(Elf32_Ehdr)){
+        fprintf(stderr, "error : invalid ELF header.\n");
+        return false;
+    }
+    const Elf32_Ehdr *header = reinterpret_cast<const Elf32_Ehdr *>(data);
+    if(header->e_ident[EI_CLASS] != ELFCLASS32 || header->e_ident[EI_DATA] != ELFDATA2LSB || header->e_machine != EM_386){
+        fprintf(stderr, "error : not a 32bit x86 ELF file.\n");
+        return false;
+    }
+    if(header->e_type != ET_EXEC){
+        fprintf(stderr, "error : ELF file is not an executable.\n");
+        return false;
+    }
+    if(header->e_phentsize != sizeof(Elf32_Phdr) || header->e_phoff + (uint64_t)header->e_phnum * sizeof(Elf32_Phdr) > file_size){
+        fprintf(stderr, "error : invalid ELF program headers.\n");
+        return false;
+    }
+    
+    const Elf32_Phdr *phdrs = reinterpret_cast<const Elf32_Phdr *>(data + header->e_phoff);
+    for(int i = 0; i < header->e_phnum; i++){
+        const Elf32_Phdr &phdr = phdrs[i];
+        if(phdr.p_type != PT_LOAD || phdr.p_memsz == 0) continue;
+        
+        if(phdr.p_filesz > phdr.p_memsz || phdr.p_offset + (uint64_t)phdr.p_filesz > file_size
+            || phdr.p_vaddr + (uint64_t)phdr.p_memsz > 0x100000000ULL){
+            fprintf(stderr, "error : invalid ELF segment. vaddr=0x%08x\n", phdr.p_vaddr);
+            return false;
+        }
+        
+        ProgramSegment segment;
+        segment.address = phdr.p_vaddr;
+        segment.offset = phdr.p_offset;
+        segment.file_size = phdr.p_filesz;
+        segment.memory_size = phdr.p_memsz;
+        segments.push_back(segment);
+    }
+    
+    entry = header->e_entry;
+    return true;
+}
+
+bool program_image::is_elf() const{
+    return elf;
+}
+
+uint32_t program_image::get_entry() const{
+    return entry;
+}
+
+uint64_t program_image::get_end() const{
+    uint64_t end = 0;
+    for(size_t i = 0; i < segments.size(); i++){
+        uint64_t segment_end = (uint64_t)segments[i].address + segments[i].memory_size;
+        if(segment_end > end) end = segment_end;
+    }
+    return end;
+}
+
+const std::vector<ProgramSegment> &program_image::get_segments() const{
+    return segments;
+}
+
+bool program_image::map(guest_memory &guest) const{
+    uint8_t *memory = guest.get_base();
+    if(get_end() > guest.get_size()){
+        fprintf(stderr, "error : program does not fit in memory. size=0x%08llx, required=0x%08llx\n",
+            (unsigned long long)guest.get_size(), (unsigned long long)get_end());
+        return false;
+    }
+    
+    //前のプログラムが書いたページなら、bssを0に戻す(書いていないページは0のまま)
+    std::vector<uint32_t> touched;
+    guest.touched_pages(touched);
+    for(size_t i = 0; i < segments.size(); i++){
+        uint64_t start = (uint64_t)segments[i].address + segments[i].file_size;
+        uint64_t end = (uint64_t)segments[i].address + segments[i].memory_size;
+        if(start >= end) continue;
+        std::vector<uint32_t>::iterator it = std::lower_bound(touched.begin(), touched.end(), start >> GUEST_PAGE_SHIFT);
+        for(; it != touched.end() && ((uint64_t)*it << GUEST_PAGE_SHIFT) < end; ++it){
+            uint64_t page_start = std::max(start, (uint64_t)*it << GUEST_PAGE_SHIFT);
+            uint64_t page_end = std::min(end, ((uint64_t)*it + 1) << GUEST_PAGE_SHIFT);
+            memset(memory + page_start, 0, page_end - page_start);
+        }
+    }
+    
+    uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    for(size_t i = 0; i < segments.size(); i++){
+        const ProgramSegment &segment = segments[i];
+        if(segment.file_size == 0) continue;
+        uint64_t start = segment.address;
+        uint64_t end = start + segment.file_size;
+        
+        //ファイルとアドレスのページ内の位置が同じなら、中の丸ごとのページはファイルをそのままマップする
+        uint64_t first = end;
+        uint64_t last = end;
+        if(((segment.address - segment.offset) & page_mask) == 0){
+            first = (start + page_mask) & ~page_mask;
+            last = end & ~page_mask;
+            if(first >= last){
+                first = end;
+                last = end;
+            }
+        }
+        
+        if(first < last){
+            if(!guest.map_file(first, last - first, fd, segment.offset + (first - start))){
+                fprintf(stderr, "error : failed to map program segment. address=0x%08x\n", segment.address);
+                return false;
+            }
+        }
+        
+        //前後の端数のページはコピーする
+        memcpy(memory + start, data + segment.offset, first - start);
+        memcpy(memory + last, data + segment.offset + (last - start), end - last);
+    }
+    return true;
+}
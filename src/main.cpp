@@ -1,23 +1,244 @@
 #include <cstdio>
 #include <cstdlib>
+#include <unistd.h>
+#include <thread>
+#include <vector>
 #include "emulator.hpp"
+#include "batch.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "loader.hpp"
+#include "uart.hpp"
+#include "gdb_stub.hpp"
 
-#define BINARY_SIZE 0x200
+//-mを付けないときのメモリサイズ(プログラムが大きければ広げる)
+static const uint32_t DEFAULT_MEMORY_SIZE = 1024 * 1024;
+static const uint32_t DEFAULT_ESP = 0x7c00;
+//-Cで増やすvCPUのスタック: i番目のvCPUのESPはesp - i * CPU_STACK_SIZE
+static const uint32_t CPU_STACK_SIZE = 0x1000;
+
+static const char *stop_reason_names[] = {
+    "halt",
+    "instruction budget exhausted",
+    "breakpoint",
+    "not implemented instruction",
+    "fault",
+    "divide error",
+    "idle with nothing to wake it",
+    "shutdown (no interrupt handler)",
+    "interrupted"
+};
+
+//マニフェストのプログラムをまとめて実行し、結果をoutputに書く
+static int run_batch(const char *manifest, const char *output, unsigned threads, uint64_t max_instructions, bool use_jit, const CycleTable *cycles){
+    batch_runner runner;
+    runner.set_cycle_table(cycles);
+    if(!runner.load_manifest(manifest)) return -1;
+    
+    FILE *out = stdout;
+    if(output != NULL){
+        out = fopen(output, "w");
+        if(out == NULL){
+            fprintf(stderr, "error : failed to open result file.\n");
+            return -1;
+        }
+    }
+    
+    runner.run(threads, max_instructions, use_jit);
+    runner.write_results(out);
+    
+    if(out != stdout) fclose(out);
+    return 0;
+}
 
 int main(int argc, char *argv[]){
+    bool use_jit = false;
+    uint64_t max_instructions = UINT64_MAX;
+    const char *manifest = NULL;
+    const char *output = NULL;
+    unsigned threads = 0;
+    const char *profile_output = NULL;
+    const char *symbol_file = NULL;
+    const char *trace_output = NULL;
+    tracer trace;
+    //0なら読み込んだプログラムから決める。0x100000000で4GiB全体
+    uint64_t memory_size = 0;
+    bool has_entry = false;
+    uint32_t entry = 0;
+    uint32_t esp = DEFAULT_ESP;
+    uint32_t load_address = PROGRAM_LOAD_ADDRESS;
+    const char *cycle_file = NULL;
+    const char *gdb_address = NULL;
+    unsigned cpu_count = 1;
     
-    emulator emu(1024*1024, 0x7c00, 0x7c00);
-    if(argc != 2){
+    int opt;
+    while((opt = getopt(argc, argv, "jn:b:o:t:p:s:T:A:m:e:S:l:c:g:C:")) != -1){
+        switch(opt){
+            case 'j':
+                use_jit = true;
+                break;
+            case 'n':
+                max_instructions = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                manifest = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 't':
+                threads = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                profile_output = optarg;
+                break;
+            case 's':
+                symbol_file = optarg;
+                break;
+            case 'T':
+                trace_output = optarg;
+                break;
+            case 'A':{
+                char *end;
+                uint32_t first = strtoul(optarg, &end, 0);
+                trace.add_range(first, (*end == '-') ? strtoul(end + 1, NULL, 0) : first);
+                break;
+            }
+            case 'm':
+                memory_size = strtoull(optarg, NULL, 0);
+                break;
+            case 'e':
+                has_entry = true;
+                entry = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                esp = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                load_address = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                cycle_file = optarg;
+                break;
+            case 'g':
+                gdb_address = optarg;
+                break;
+            case 'C':
+                cpu_count = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "usage : %s [-j] [-n max_instructions] [-c cycle_table] [-C cpus] [-m memory_size] [-e entry] [-S esp] [-l load_address]\n"
+                    "           [-p folded_output [-s symbol_file]] [-T trace [-A first-last]] [-g [host]:port|socket_path] program\n", argv[0]);
+                fprintf(stderr, "        %s [-j] [-n max_instructions] [-c cycle_table] [-t threads] [-o result] -b manifest\n", argv[0]);
+                exit(-1);
+        }
+    }
+    
+    //書かなかった命令は1サイクル
+    CycleTable cycles;
+    if(cycle_file != NULL && !load_cycle_table(cycle_file, cycles)) exit(-1);
+    
+    if(manifest != NULL){
+        return run_batch(manifest, output, threads, max_instructions, use_jit, cycle_file != NULL ? &cycles : NULL);
+    }
+    
+    if(optind + 1 != argc){
         fprintf(stderr, "error : you must specify program filename.\n");
         exit(-1);
     }
+    if(cpu_count == 0 || (uint64_t)(cpu_count - 1) * CPU_STACK_SIZE >= esp){
+        fprintf(stderr, "error : invalid number of cpus.\n");
+        exit(-1);
+    }
+    if(cpu_count > 1 && (profile_output != NULL || trace_output != NULL || gdb_address != NULL)){
+        fprintf(stderr, "error : -p, -T and -g cannot be used with several cpus.\n");
+        exit(-1);
+    }
     
-    emu.load_program(argv[1], BINARY_SIZE);
+    //フラットバイナリはload_addressから実行する。ELFはヘッダのエントリポイントから
+    program_image image;
+    if(!image.open(argv[optind], load_address)) exit(-1);
+    if(!has_entry) entry = image.get_entry();
+    if(memory_size == 0){
+        uint64_t end = (image.get_end() + GUEST_PAGE_SIZE - 1) & ~(uint64_t)(GUEST_PAGE_SIZE - 1);
+        memory_size = (end > DEFAULT_MEMORY_SIZE) ? end : DEFAULT_MEMORY_SIZE;
+    }
+    if(memory_size > GUEST_ADDRESS_SPACE){
+        fprintf(stderr, "error : memory size must be 0x100000000 or less.\n");
+        exit(-1);
+    }
+    
+    emulator emu(memory_size, entry, esp);
+    emu.set_jit(use_jit);
+    if(cycle_file != NULL) emu.set_cycle_table(&cycles);
+    //シリアルポートの入力は標準入力から読む
+    emu.get_uart()->set_input_fd(STDIN_FILENO);
+    if(!emu.load_image(image)) exit(-1);
+    
+    //プロファイル中はJITを使わない
+    if(profile_output != NULL){
+        emu.set_profile(true);
+        if(symbol_file != NULL && !emu.get_profiler()->load_symbols(symbol_file)) exit(-1);
+    }
+    if(trace_output != NULL && !emu.start_trace(&trace, trace_output)) exit(-1);
+    
+    //GDBがつないでいる間は、実行もGDBの指示で行う。デタッチしたら、そこから続けて実行する
+    if(gdb_address != NULL){
+        gdb_stub stub(&emu);
+        if(!stub.listen(gdb_address)) exit(-1);
+        fprintf(stderr, "waiting for gdb on %s\n", gdb_address);
+        if(!stub.serve()) exit(-1);
+        if(stub.is_killed()){
+            emu.dump_registers();
+            emu.dump_statistics();
+            return 0;
+        }
+    }
+    
+    //2つ目からのvCPUは同じメモリで、同じエントリポイントから別々のスタックで動く(cpuidで見分ける)
+    std::vector<emulator *> cpus(1, &emu);
+    for(unsigned i = 1; i < cpu_count; i++){
+        emulator *cpu = new emulator(emu, entry, esp - i * CPU_STACK_SIZE);
+        cpu->set_jit(use_jit);
+        if(cycle_file != NULL) cpu->set_cycle_table(&cycles);
+        cpus.push_back(cpu);
+    }
     
     emu.dump_registers();
-    while(emu.exec()){}
-    emu.dump_registers();
+    std::vector<StopReason> reasons(cpu_count);
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < cpu_count; i++){
+        workers.push_back(std::thread([&cpus, &reasons, i, max_instructions](){
+            reasons[i] = cpus[i]->run(max_instructions);
+        }));
+    }
+    reasons[0] = emu.run(max_instructions);
+    for(size_t i = 0; i < workers.size(); i++) workers[i].join();
+    emu.stop_trace();
+    
+    for(unsigned i = 0; i < cpu_count; i++){
+        if(cpu_count > 1) fprintf(stderr, "cpu %u\n", i);
+        if(reasons[i] != STOP_HALT){
+            fprintf(stderr, "stop : %s\n", stop_reason_names[reasons[i]]);
+            if(reasons[i] == STOP_FAULT){
+                fprintf(stderr, "fault address : 0x%08x\n", cpus[i]->get_fault_address());
+            }
+        }
+        cpus[i]->dump_registers();
+        cpus[i]->dump_statistics();
+        if(i > 0) delete cpus[i];
+    }
+    
+    if(profile_output != NULL){
+        FILE *out = fopen(profile_output, "w");
+        if(out == NULL){
+            fprintf(stderr, "error : failed to open profile file.\n");
+            exit(-1);
+        }
+        emu.get_profiler()->write_folded(out);
+        fclose(out);
+        emu.get_profiler()->write_report(stderr, 20);
+    }
     
     return 0;
 }
-
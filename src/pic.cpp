@@ -0,0 +1,155 @@
+#include <cstring>
+#include "pic.hpp"
+
+pic::pic(){
+    for(int i = 0; i < 2; i++){
+        PicChip &chip = chips[i];
+        chip.irr = 0;
+        chip.levels = 0;
+        chip.isr = 0;
+        chip.imr = 0;
+        chip.init_step = 0;
+        chip.need_icw4 = false;
+        chip.single = false;
+        chip.auto_eoi = false;
+        chip.read_isr = false;
+    }
+    chips[0].vector_base = 0x08;
+    chips[1].vector_base = 0x70;
+}
+
+//一番優先度の高い(小さい)ビット。無ければ-1
+int pic::_highest(uint8_t bits){
+    if(bits == 0) return -1;
+    return __builtin_ctz(bits);
+}
+
+//マスタのカスケードのIRQは、スレーブが割り込みを出しているかで決まる
+uint8_t pic::_requests(int index){
+    uint8_t requests = chips[index].irr | chips[index].levels;
+    if(index == 0 && !chips[0].single && _pending(1) >= 0) requests |= (1 << PIC_CASCADE_IRQ);
+    return requests;
+}
+
+int pic::_pending(int index){
+    const PicChip &chip = chips[index];
+    int irq = _highest(_requests(index) & ~chip.imr);
+    if(irq < 0) return -1;
+    
+    int in_service = _highest(chip.isr);
+    if(in_service >= 0 && in_service <= irq) return -1;
+    return irq;
+}
+
+void pic::raise(uint8_t irq){
+    chips[irq >> 3].irr |= (1 << (irq & 7));
+}
+
+void pic::set_level(uint8_t irq, bool level){
+    uint8_t bit = (1 << (irq & 7));
+    PicChip &chip = chips[irq >> 3];
+    chip.levels = level ? (chip.levels | bit) : (chip.levels & ~bit);
+}
+
+bool pic::has_interrupt(){
+    return _pending(0) >= 0;
+}
+
+uint8_t pic::acknowledge(){
+    int index = 0;
+    int irq = _pending(0);
+    //その間に要求が消えていたらスプリアス割り込み(IRQ7)
+    if(irq < 0) return chips[0].vector_base + 7;
+    
+    if(irq == PIC_CASCADE_IRQ && !chips[0].single){
+        if(!chips[0].auto_eoi) chips[0].isr |= (1 << PIC_CASCADE_IRQ);
+        index = 1;
+        irq = _pending(1);
+        if(irq < 0) return chips[1].vector_base + 7;
+    }
+    
+    PicChip &chip = chips[index];
+    chip.irr &= ~(1 << irq);
+    if(!chip.auto_eoi) chip.isr |= (1 << irq);
+    return chip.vector_base + irq;
+}
+
+void pic::save_state(PicChip *state){
+    memcpy(state, chips, sizeof(chips));
+}
+
+void pic::restore_state(const PicChip *state){
+    memcpy(chips, state, sizeof(chips));
+}
+
+//ICW1, OCW2, OCW3
+void pic::_command(PicChip &chip, uint8_t value){
+    if(value & PIC_ICW1_INIT){
+        chip.init_step = 2;
+        chip.need_icw4 = (value & PIC_ICW1_ICW4) != 0;
+        chip.single = (value & PIC_ICW1_SINGLE) != 0;
+        chip.irr = 0;
+        chip.isr = 0;
+        chip.imr = 0;
+        chip.auto_eoi = false;
+        chip.read_isr = false;
+        return;
+    }
+    
+    if((value & 0x18) == PIC_OCW3){
+        if((value & 0x03) == 0x02) chip.read_isr = false;
+        if((value & 0x03) == 0x03) chip.read_isr = true;
+        return;
+    }
+    
+    switch(value & 0xE0){
+        case PIC_EOI:
+        {
+            int irq = _highest(chip.isr);
+            if(irq >= 0) chip.isr &= ~(1 << irq);
+            break;
+        }
+        case PIC_SPECIFIC_EOI:
+            chip.isr &= ~(1 << (value & 7));
+            break;
+        default:
+            //優先度の回転は無い
+            break;
+    }
+}
+
+//ICW2〜4の後はIMR(OCW1)
+void pic::_data(PicChip &chip, uint8_t value){
+    switch(chip.init_step){
+        case 2:
+            chip.vector_base = value & 0xF8;
+            chip.init_step = !chip.single ? 3 : chip.need_icw4 ? 4 : 0;
+            break;
+        case 3:
+            //カスケードの接続は固定
+            chip.init_step = chip.need_icw4 ? 4 : 0;
+            break;
+        case 4:
+            chip.auto_eoi = (value & PIC_ICW4_AUTO_EOI) != 0;
+            chip.init_step = 0;
+            break;
+        default:
+            chip.imr = value;
+            break;
+    }
+}
+
+uint8_t pic::in8(uint16_t port){
+    int index = (port >= PIC_SLAVE_PORT) ? 1 : 0;
+    PicChip &chip = chips[index];
+    
+    if(port & 1) return chip.imr;
+    return chip.read_isr ? chip.isr : _requests(index);
+}
+
+void pic::out8(uint16_t port, uint8_t value){
+    PicChip &chip = chips[(port >= PIC_SLAVE_PORT) ? 1 : 0];
+    
+    if(port & 1) _data(chip, value);
+    else _command(chip, value);
+}
@@ -0,0 +1,154 @@
+#include <cstring>
+#include "pit.hpp"
+#include "clock.hpp"
+
+//仮想時間(ナノ秒)とPITのtickの変換。掛け算があふれないように秒で分ける
+static uint64_t ns_to_ticks(uint64_t ns){
+    return (ns / NS_PER_SECOND) * PIT_FREQUENCY + (ns % NS_PER_SECOND) * PIT_FREQUENCY / NS_PER_SECOND;
+}
+
+//切り上げる(この時刻にはtickに達している)
+static uint64_t ticks_to_ns(uint64_t ticks){
+    return (ticks / PIT_FREQUENCY) * NS_PER_SECOND + ((ticks % PIT_FREQUENCY) * NS_PER_SECOND + PIT_FREQUENCY - 1) / PIT_FREQUENCY;
+}
+
+pit::pit(virtual_clock *clock){
+    this->clock = clock;
+    for(uint32_t i = 0; i < PIT_CHANNELS; i++){
+        PitChannel &channel = channels[i];
+        channel.mode = 0;
+        channel.access = 3;
+        channel.reload = 0x10000;
+        channel.low = 0;
+        channel.write_high = false;
+        channel.read_high = false;
+        channel.latched = false;
+        channel.latch = 0;
+        channel.armed = false;
+        channel.start = 0;
+        channel.next_fire = PIT_NO_DEADLINE;
+    }
+}
+
+uint64_t pit::_ticks(){
+    return ns_to_ticks(clock->now());
+}
+
+uint16_t pit::_count(const PitChannel &channel, uint64_t now){
+    if(!channel.armed) return channel.reload & 0xFFFF;
+    
+    uint64_t elapsed = now - channel.start;
+    if(channel.mode == 2 || channel.mode == 3){
+        return (channel.reload - elapsed % channel.reload) & 0xFFFF;
+    }
+    //0を過ぎても0xFFFFから数え続ける
+    return (channel.reload - elapsed) & 0xFFFF;
+}
+
+//bit7-6: チャネル, bit5-4: アクセス(0ならラッチ), bit3-1: モード
+void pit::_command(uint8_t value){
+    uint8_t index = value >> 6;
+    //リードバックは無い
+    if(index == 3) return;
+    PitChannel &channel = channels[index];
+    
+    uint8_t access = (value >> 4) & 3;
+    if(access == 0){
+        channel.latch = _count(channel, _ticks());
+        channel.latched = true;
+        channel.read_high = false;
+        return;
+    }
+    
+    uint8_t mode = (value >> 1) & 7;
+    //6, 7は2, 3と同じ
+    channel.mode = mode > 5 ? mode - 4 : mode;
+    channel.access = access;
+    channel.write_high = false;
+    channel.read_high = false;
+    channel.latched = false;
+    //カウント値が書かれるまで止める
+    channel.armed = false;
+    channel.next_fire = PIT_NO_DEADLINE;
+}
+
+bool pit::update(){
+    PitChannel &channel = channels[0];
+    if(channel.next_fire == PIT_NO_DEADLINE) return false;
+    
+    uint64_t now = _ticks();
+    if(now < channel.next_fire) return false;
+    
+    if(channel.mode == 2 || channel.mode == 3){
+        //遅れた分の周期はまとめて飛ばす
+        channel.next_fire += channel.reload * ((now - channel.next_fire) / channel.reload + 1);
+    }
+    else{
+        channel.next_fire = PIT_NO_DEADLINE;
+    }
+    return true;
+}
+
+uint64_t pit::get_deadline(){
+    uint64_t next_fire = channels[0].next_fire;
+    if(next_fire == PIT_NO_DEADLINE) return PIT_NO_DEADLINE;
+    return ticks_to_ns(next_fire);
+}
+
+void pit::save_state(PitChannel *state){
+    memcpy(state, channels, sizeof(channels));
+}
+
+void pit::restore_state(const PitChannel *state){
+    memcpy(channels, state, sizeof(channels));
+}
+
+uint8_t pit::in8(uint16_t port){
+    uint16_t index = port - PIT_PORT;
+    if(index == PIT_COMMAND) return 0;
+    PitChannel &channel = channels[index];
+    
+    uint16_t value = channel.latched ? channel.latch : _count(channel, _ticks());
+    bool high = (channel.access == 2) || (channel.access == 3 && channel.read_high);
+    if(channel.access == 3) channel.read_high = !channel.read_high;
+    //ラッチした値は全部読んだら離す
+    if(channel.latched && (channel.access != 3 || !channel.read_high)) channel.latched = false;
+    
+    return high ? (value >> 8) : (value & 0xFF);
+}
+
+void pit::out8(uint16_t port, uint8_t value){
+    uint16_t index = port - PIT_PORT;
+    if(index == PIT_COMMAND){
+        _command(value);
+        return;
+    }
+    PitChannel &channel = channels[index];
+    
+    uint32_t reload;
+    switch(channel.access){
+        case 1:
+            reload = value;
+            break;
+        case 2:
+            reload = value << 8;
+            break;
+        default:
+            if(!channel.write_high){
+                channel.low = value;
+                channel.write_high = true;
+                return;
+            }
+            channel.write_high = false;
+            reload = channel.low | (value << 8);
+            break;
+    }
+    
+    //カウント値を書いたところから数え始める
+    channel.reload = (reload == 0) ? 0x10000 : reload;
+    channel.armed = true;
+    channel.start = _ticks();
+    //モード1, 5はゲートの立ち上がりで始まるが、ゲートは変わらないので出力しない
+    bool fires = (channel.mode == 0 || channel.mode == 2 || channel.mode == 3 || channel.mode == 4);
+    channel.next_fire = fires ? channel.start + channel.reload : PIT_NO_DEADLINE;
+}
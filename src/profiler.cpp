@@ -0,0 +1,216 @@
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <elf.h>
+#include <sys/mman.h>
+#include "profiler.hpp"
+
+profiler::profiler(uint64_t memory_size, uint32_t entry){
+    this->memory_size = memory_size;
+    //触ったページだけ実メモリが割り当てられる
+    address_counts = static_cast<uint64_t *>(guest_memory::reserve((size_t)memory_size * sizeof(uint64_t) + 1, PROT_READ | PROT_WRITE));
+    counted_pages = static_cast<uint8_t *>(guest_memory::reserve((memory_size >> GUEST_PAGE_SHIFT) + 1, PROT_READ | PROT_WRITE));
+    memset(opcode_counts, 0, sizeof(opcode_counts));
+    
+    root = new ProfileNode();
+    root->address = entry;
+    root->parent = NULL;
+    root->self_count = 0;
+    current = root;
+}
+
+profiler::~profiler(){
+    guest_memory::release(address_counts, (size_t)memory_size * sizeof(uint64_t) + 1);
+    guest_memory::release(counted_pages, (memory_size >> GUEST_PAGE_SHIFT) + 1);
+    _delete_node(root);
+}
+
+void profiler::_delete_node(ProfileNode *node){
+    std::map<uint32_t, ProfileNode *>::iterator it;
+    for(it = node->children.begin(); it != node->children.end(); it++){
+        _delete_node(it->second);
+    }
+    delete node;
+}
+
+void profiler::call(uint32_t target){
+    ProfileNode *&child = current->children[target];
+    if(child == NULL){
+        child = new ProfileNode();
+        child->address = target;
+        child->parent = current;
+        child->self_count = 0;
+    }
+    current = child;
+}
+
+//対応するcallの無いretは一番外側に留まる
+void profiler::ret(){
+    if(current->parent != NULL) current = current->parent;
+}
+
+bool profiler::load_symbols(const char *filename){
+    FILE *file = fopen(filename, "rb");
+    if(file == NULL){
+        fprintf(stderr, "error : failed to read symbol file.\n");
+        return false;
+    }
+    
+    unsigned char magic[SELFMAG];
+    bool is_elf = fread(magic, 1, SELFMAG, file) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+    rewind(file);
+    
+    bool ok = is_elf ? _load_elf_symbols(file) : _load_map_symbols(file);
+    fclose(file);
+    
+    if(!ok) fprintf(stderr, "error : failed to read symbols from %s.\n", filename);
+    return ok;
+}
+
+//関数とラベル(アセンブラのNOTYPEのシンボル)を読む
+bool profiler::_load_elf_symbols(FILE *file){
+    Elf32_Ehdr header;
+    if(fread(&header, sizeof(header), 1, file) != 1) return false;
+    if(header.e_ident[EI_CLASS] != ELFCLASS32 || header.e_shentsize != sizeof(Elf32_Shdr)) return false;
+    
+    std::vector<Elf32_Shdr> sections(header.e_shnum);
+    if(fseek(file, header.e_shoff, SEEK_SET) != 0) return false;
+    if(fread(sections.data(), sizeof(Elf32_Shdr), header.e_shnum, file) != header.e_shnum) return false;
+    
+    for(uint32_t i = 0; i < sections.size(); i++){
+        if(sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= sections.size()) continue;
+        
+        const Elf32_Shdr &strtab = sections[sections[i].sh_link];
+        std::vector<char> names(strtab.sh_size + 1, '\0');
+        fseek(file, strtab.sh_offset, SEEK_SET);
+        if(fread(names.data(), 1, strtab.sh_size, file) != strtab.sh_size) return false;
+        
+        uint32_t count = sections[i].sh_size / sizeof(Elf32_Sym);
+        std::vector<Elf32_Sym> syms(count);
+        fseek(file, sections[i].sh_offset, SEEK_SET);
+        if(fread(syms.data(), sizeof(Elf32_Sym), count, file) != count) return false;
+        
+        for(uint32_t j = 0; j < count; j++){
+            const Elf32_Sym &sym = syms[j];
+            uint8_t type = ELF32_ST_TYPE(sym.st_info);
+            if(type != STT_FUNC && type != STT_NOTYPE) continue;
+            if(sym.st_shndx == SHN_UNDEF || sym.st_shndx >= SHN_LORESERVE) continue;
+            if(sym.st_name == 0 || sym.st_name >= strtab.sh_size) continue;
+            
+            //同じアドレスなら関数の方を優先する
+            if(type == STT_NOTYPE && symbols.count(sym.st_value)) continue;
+            symbols[sym.st_value] = &names[sym.st_name];
+        }
+    }
+    return true;
+}
+
+bool profiler::_load_map_symbols(FILE *file){
+    char line[512];
+    while(fgets(line, sizeof(line), file) != NULL){
+        unsigned int address;
+        char first[256], second[256];
+        int n = sscanf(line, "%x %255s %255s", &address, first, second);
+        if(n == 2){
+            symbols[address] = first;
+        }
+        else if(n == 3){
+            symbols[address] = second;
+        }
+    }
+    return true;
+}
+
+std::string profiler::symbol_name(uint32_t address){
+    char buf[32];
+    
+    std::map<uint32_t, std::string>::iterator it = symbols.upper_bound(address);
+    if(it != symbols.begin()){
+        it--;
+        if(it->first == address) return it->second;
+        
+        sprintf(buf, "+0x%x", address - it->first);
+        return it->second + buf;
+    }
+    
+    sprintf(buf, "0x%08x", address);
+    return buf;
+}
+
+uint64_t profiler::get_address_count(uint32_t address){
+    if(address >= memory_size) return 0;
+    return address_counts[address];
+}
+
+uint64_t profiler::get_opcode_count(uint8_t opecode){
+    return opcode_counts[opecode];
+}
+
+void profiler::write_folded(FILE *out){
+    std::string stack;
+    _write_folded(out, root, stack);
+}
+
+void profiler::_write_folded(FILE *out, ProfileNode *node, std::string &stack){
+    size_t length = stack.size();
+    if(length > 0) stack += ';';
+    stack += symbol_name(node->address);
+    
+    if(node->self_count > 0){
+        fprintf(out, "%s %llu\n", stack.c_str(), (unsigned long long)node->self_count);
+    }
+    
+    std::map<uint32_t, ProfileNode *>::iterator it;
+    for(it = node->children.begin(); it != node->children.end(); it++){
+        _write_folded(out, it->second, stack);
+    }
+    stack.resize(length);
+}
+
+static bool count_greater(const std::pair<uint64_t, uint32_t> &a, const std::pair<uint64_t, uint32_t> &b){
+    return a.first > b.first;
+}
+
+void profiler::write_report(FILE *out, uint32_t top){
+    std::vector<std::pair<uint64_t, uint32_t> > addresses;
+    uint64_t total = 0;
+    //数えたことのあるアドレスのページだけ見る
+    std::vector<uint32_t> pages;
+    guest_memory::marked_pages(counted_pages, (memory_size + GUEST_PAGE_SIZE - 1) >> GUEST_PAGE_SHIFT, pages);
+    for(size_t p = 0; p < pages.size(); p++){
+        uint64_t first = (uint64_t)pages[p] << GUEST_PAGE_SHIFT;
+        uint64_t last = std::min(first + GUEST_PAGE_SIZE, memory_size);
+        for(uint64_t i = first; i < last; i++){
+            if(address_counts[i] == 0) continue;
+            addresses.push_back(std::make_pair(address_counts[i], (uint32_t)i));
+            total += address_counts[i];
+        }
+    }
+    
+    std::vector<std::pair<uint64_t, uint32_t> > opcodes;
+    for(uint32_t i = 0; i < 256; i++){
+        if(opcode_counts[i] != 0) opcodes.push_back(std::make_pair(opcode_counts[i], i));
+    }
+    
+    if(addresses.size() > top){
+        std::partial_sort(addresses.begin(), addresses.begin() + top, addresses.end(), count_greater);
+        addresses.resize(top);
+    }
+    else{
+        std::sort(addresses.begin(), addresses.end(), count_greater);
+    }
+    std::sort(opcodes.begin(), opcodes.end(), count_greater);
+    
+    fprintf(out, "-------[profile]-------\n");
+    for(uint32_t i = 0; i < addresses.size(); i++){
+        fprintf(out, "%08x %12llu %6.2f%% %s\n", addresses[i].second, (unsigned long long)addresses[i].first,
+            (double)addresses[i].first * 100 / total, symbol_name(addresses[i].second).c_str());
+    }
+    fprintf(out, "-----------------------\n");
+    for(uint32_t i = 0; i < opcodes.size(); i++){
+        fprintf(out, "[opecode %02x] %12llu %6.2f%%\n", opcodes[i].second, (unsigned long long)opcodes[i].first,
+            (double)opcodes[i].first * 100 / total);
+    }
+    fprintf(out, "-----------------------\n");
+    fprintf(out, "\n");
+}
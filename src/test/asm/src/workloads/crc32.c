@@ -0,0 +1,37 @@
+/* bitwise CRC-32 (IEEE 802.3) over a pseudo-random buffer */
+#define BUFFER_SIZE 4096
+#define ROUNDS 40
+
+static unsigned char buffer[BUFFER_SIZE];
+
+static unsigned int crc32(const unsigned char *data, int size, unsigned int crc)
+{
+    int i, bit;
+
+    crc = ~crc;
+    for (i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (bit = 0; bit < 8; bit++) {
+            if (crc & 1)
+                crc = (crc >> 1) ^ 0xEDB88320;
+            else
+                crc >>= 1;
+        }
+    }
+    return ~crc;
+}
+
+int main(void)
+{
+    unsigned int seed = 12345;
+    unsigned int crc = 0;
+    int i;
+
+    for (i = 0; i < BUFFER_SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = seed >> 16;
+    }
+    for (i = 0; i < ROUNDS; i++)
+        crc = crc32(buffer, BUFFER_SIZE, crc);
+    return crc;
+}
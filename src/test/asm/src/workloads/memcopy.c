@@ -0,0 +1,66 @@
+/* memory-copy heavy code: byte and word copies, fills and compares */
+#define BUFFER_SIZE 16384
+#define ROUNDS 30
+
+static unsigned char source[BUFFER_SIZE];
+static unsigned char destination[BUFFER_SIZE];
+
+static void copy_bytes(unsigned char *dst, const unsigned char *src, int size)
+{
+    while (size-- > 0)
+        *dst++ = *src++;
+}
+
+static void copy_words(unsigned int *dst, const unsigned int *src, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        dst[i] = src[i];
+}
+
+static void fill(unsigned char *dst, unsigned char value, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        dst[i] = value + i;
+}
+
+static int compare(const unsigned char *a, const unsigned char *b, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++) {
+        if (a[i] != b[i])
+            return a[i] - b[i];
+    }
+    return 0;
+}
+
+static unsigned int sum_words(const unsigned int *data, int count)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        sum = (sum << 1 | sum >> 31) + data[i];
+    return sum;
+}
+
+int main(void)
+{
+    unsigned int result = 0;
+    int round;
+
+    for (round = 0; round < ROUNDS; round++) {
+        fill(source, round * 17, BUFFER_SIZE);
+        copy_bytes(destination, source, BUFFER_SIZE);
+        result += compare(source, destination, BUFFER_SIZE);
+        /* overlapping shift by one word */
+        copy_words((unsigned int *)destination, (unsigned int *)(source + 4), BUFFER_SIZE / 4 - 1);
+        result = result * 31 + sum_words((unsigned int *)destination, BUFFER_SIZE / 4);
+        result += compare(source + 4, destination, BUFFER_SIZE - 4);
+    }
+    return result;
+}
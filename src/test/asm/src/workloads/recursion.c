@@ -0,0 +1,36 @@
+/* deep call chains: fibonacci, ackermann and the tower of hanoi */
+static int fib(int n)
+{
+    if (n < 2)
+        return n;
+    return fib(n - 1) + fib(n - 2);
+}
+
+static int ackermann(int m, int n)
+{
+    if (m == 0)
+        return n + 1;
+    if (n == 0)
+        return ackermann(m - 1, 1);
+    return ackermann(m - 1, ackermann(m, n - 1));
+}
+
+static int moves;
+
+static void hanoi(int n, int from, int to, int via)
+{
+    if (n == 0)
+        return;
+    hanoi(n - 1, from, via, to);
+    moves += from * 3 + to;
+    hanoi(n - 1, via, to, from);
+}
+
+int main(void)
+{
+    int result = fib(25);
+
+    result = result * 31 + ackermann(2, 300);
+    hanoi(16, 1, 3, 2);
+    return result * 31 + moves;
+}
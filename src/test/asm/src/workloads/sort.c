@@ -0,0 +1,85 @@
+/* quicksort and insertion sort of pseudo-random integers */
+#define COUNT 8000
+
+static int values[COUNT];
+static int copy[COUNT];
+
+static void fill(int *array, int count, unsigned int seed)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        seed = seed * 1664525 + 1013904223;
+        array[i] = (int)(seed >> 8) - (1 << 23);
+    }
+}
+
+static void quicksort(int *array, int left, int right)
+{
+    int i, j, pivot, tmp;
+
+    while (left < right) {
+        pivot = array[(left + right) / 2];
+        i = left;
+        j = right;
+        while (i <= j) {
+            while (array[i] < pivot)
+                i++;
+            while (array[j] > pivot)
+                j--;
+            if (i <= j) {
+                tmp = array[i];
+                array[i] = array[j];
+                array[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+        /* recurse into the smaller half */
+        if (j - left < right - i) {
+            quicksort(array, left, j);
+            left = i;
+        } else {
+            quicksort(array, i, right);
+            right = j;
+        }
+    }
+}
+
+static void insertion_sort(int *array, int count)
+{
+    int i, j, value;
+
+    for (i = 1; i < count; i++) {
+        value = array[i];
+        for (j = i - 1; j >= 0 && array[j] > value; j--)
+            array[j + 1] = array[j];
+        array[j + 1] = value;
+    }
+}
+
+static unsigned int checksum(const int *array, int count)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (i > 0 && array[i - 1] > array[i])
+            return 0;
+        sum = sum * 31 + array[i];
+    }
+    return sum;
+}
+
+int main(void)
+{
+    unsigned int result;
+
+    fill(values, COUNT, 1);
+    quicksort(values, 0, COUNT - 1);
+    result = checksum(values, COUNT);
+
+    fill(copy, COUNT / 4, 2);
+    insertion_sort(copy, COUNT / 4);
+    return result ^ checksum(copy, COUNT / 4);
+}
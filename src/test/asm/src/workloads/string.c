@@ -0,0 +1,97 @@
+/* string processing: length, compare, reverse, word count and a tiny hash table */
+#define TEXT_SIZE 8192
+#define ROUNDS 20
+
+static char text[TEXT_SIZE + 1];
+static char reversed[TEXT_SIZE + 1];
+
+static const char *words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+    "emulator", "instruction", "register", "memory"
+};
+
+static int string_length(const char *s)
+{
+    int n = 0;
+
+    while (s[n] != '\0')
+        n++;
+    return n;
+}
+
+static int string_compare(const char *a, const char *b)
+{
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+static void reverse(char *dst, const char *src, int size)
+{
+    int i;
+
+    for (i = 0; i < size; i++)
+        dst[i] = src[size - 1 - i];
+    dst[size] = '\0';
+}
+
+static int count_words(const char *s)
+{
+    int count = 0;
+    int in_word = 0;
+
+    for (; *s != '\0'; s++) {
+        if (*s == ' ') {
+            in_word = 0;
+        } else if (!in_word) {
+            in_word = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+/* djb2 */
+static unsigned int hash(const char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s != '\0')
+        h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+int main(void)
+{
+    unsigned int seed = 7;
+    unsigned int result = 0;
+    int size = 0;
+    int i, round;
+
+    /* build text from random words */
+    while (1) {
+        const char *word;
+        int length;
+
+        seed = seed * 1103515245 + 12345;
+        word = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        length = string_length(word);
+        if (size + length + 1 > TEXT_SIZE)
+            break;
+        for (i = 0; i < length; i++)
+            text[size++] = word[i];
+        text[size++] = ' ';
+    }
+    text[size] = '\0';
+
+    for (round = 0; round < ROUNDS; round++) {
+        reverse(reversed, text, string_length(text));
+        result = result * 31 + count_words(text);
+        result = result * 31 + string_compare(text, reversed);
+        result = result * 31 + hash(reversed);
+        reverse(text, reversed, string_length(reversed));
+    }
+    return result;
+}
@@ -1,5 +1,25 @@
 #include <cppunit/extensions/HelperMacros.h>
+#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/socket.h>
 #include "emulator.hpp"
+#include "jit.hpp"
+#include "guest_memory.hpp"
+#include "batch.hpp"
+#include "console.hpp"
+#include "io_bus.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "loader.hpp"
+#include "uart.hpp"
+#include "pic.hpp"
+#include "pit.hpp"
+#include "clock.hpp"
+#include "gdb_stub.hpp"
 
 #ifdef FIXTURE_NAME
 #undef FIXTURE_NAME
@@ -16,6 +36,40 @@ class FIXTURE_NAME : public CPPUNIT_NS::TestFixture {
     CPPUNIT_TEST(test_arg);
     CPPUNIT_TEST(test_if);
     CPPUNIT_TEST(test_while);
+    CPPUNIT_TEST(test_decode_cache);
+    CPPUNIT_TEST(test_decode_cache_invalidate);
+    CPPUNIT_TEST(test_run_block);
+    CPPUNIT_TEST(test_run_block_invalidate);
+    CPPUNIT_TEST(test_jit);
+    CPPUNIT_TEST(test_jit_invalidate);
+    CPPUNIT_TEST(test_jit_instructions);
+    CPPUNIT_TEST(test_lazy_eflags);
+    CPPUNIT_TEST(test_run_budget);
+    CPPUNIT_TEST(test_run_until);
+    CPPUNIT_TEST(test_memory_fault);
+    CPPUNIT_TEST(test_memory_image);
+    CPPUNIT_TEST(test_snapshot);
+    CPPUNIT_TEST(test_unimplemented_stop);
+    CPPUNIT_TEST(test_batch);
+    CPPUNIT_TEST(test_console);
+    CPPUNIT_TEST(test_io_bus);
+    CPPUNIT_TEST(test_profiler);
+    CPPUNIT_TEST(test_trace);
+    CPPUNIT_TEST(test_sib);
+    CPPUNIT_TEST(test_alu);
+    CPPUNIT_TEST(test_shift);
+    CPPUNIT_TEST(test_mul_div);
+    CPPUNIT_TEST(test_two_byte_opcode);
+    CPPUNIT_TEST(test_workloads);
+    CPPUNIT_TEST(test_loader);
+    CPPUNIT_TEST(test_sparse_memory);
+    CPPUNIT_TEST(test_string);
+    CPPUNIT_TEST(test_idle);
+    CPPUNIT_TEST(test_uart);
+    CPPUNIT_TEST(test_interrupts);
+    CPPUNIT_TEST(test_cycles);
+    CPPUNIT_TEST(test_gdb_stub);
+    CPPUNIT_TEST(test_vcpus);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -30,10 +84,166 @@ protected:
     void test_arg();
     void test_if();
     void test_while();
+    void test_decode_cache();
+    void test_decode_cache_invalidate();
+    void test_run_block();
+    void test_run_block_invalidate();
+    void test_jit();
+    void test_jit_invalidate();
+    void test_jit_instructions();
+    void test_lazy_eflags();
+    void test_run_budget();
+    void test_run_until();
+    void test_memory_fault();
+    void test_memory_image();
+    void test_snapshot();
+    void test_unimplemented_stop();
+    void test_batch();
+    void test_console();
+    void test_io_bus();
+    void test_profiler();
+    void test_trace();
+    void test_sib();
+    void test_alu();
+    void test_shift();
+    void test_mul_div();
+    void test_two_byte_opcode();
+    void test_workloads();
+    void test_loader();
+    void test_sparse_memory();
+    void test_string();
+    void test_idle();
+    void test_uart();
+    void test_interrupts();
+    void test_cycles();
+    void test_gdb_stub();
+    void test_vcpus();
+    
+    void _write_code(emulator &emu, uint32_t address, const uint8_t *code, uint32_t size);
+    //codeの後にjmp 0(run()がSTOP_HALTで止まる)を足して書き込む
+    void _load_code(emulator &emu, const uint8_t *code, uint32_t size, uint32_t address = 0x7c00);
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(FIXTURE_NAME);
 
+//test_io_bus用: 書かれた値を覚えておき、読むとポート番号を返す
+class test_device : public io_device{
+public:
+    uint16_t last_port;
+    uint32_t last_value;
+    int last_size;
+    
+    uint8_t in8(uint16_t port){
+        return port & 0xFF;
+    }
+    void out8(uint16_t port, uint8_t value){
+        last_port = port;
+        last_value = value;
+        last_size = 1;
+    }
+    uint32_t in32(uint16_t port){
+        return 0x12340000 | port;
+    }
+    void out32(uint16_t port, uint32_t value){
+        last_port = port;
+        last_value = value;
+        last_size = 4;
+    }
+};
+
+//test_idle用: パイプに書かれた文字を1文字ずつ返す。空なら0
+class pipe_device : public io_device{
+public:
+    int fds[2];
+    uint64_t version;
+    
+    pipe_device(){
+        if(pipe(fds) != 0) fds[0] = fds[1] = -1;
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        version = 0;
+    }
+    ~pipe_device(){
+        close(fds[0]);
+        close(fds[1]);
+    }
+    uint8_t in8(uint16_t port){
+        uint8_t ch;
+        if(read(fds[0], &ch, 1) != 1) return 0;
+        version++;
+        return ch;
+    }
+    void out8(uint16_t port, uint8_t value){
+    }
+    uint64_t get_version(){
+        return version;
+    }
+    int get_event_fd(){
+        return fds[0];
+    }
+};
+
+//test_batch, test_loader用: 1つのセグメント(ファイルの0x1000から)だけのELFを書く
+static bool write_elf(const char *filename, uint32_t address, uint32_t entry, const uint8_t *code, uint32_t size, uint32_t memory_size){
+    Elf32_Ehdr header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS32;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_386;
+    header.e_version = EV_CURRENT;
+    header.e_phoff = sizeof(Elf32_Ehdr);
+    header.e_ehsize = sizeof(Elf32_Ehdr);
+    header.e_phentsize = sizeof(Elf32_Phdr);
+    header.e_phnum = 1;
+    header.e_entry = entry;
+    Elf32_Phdr segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.p_type = PT_LOAD;
+    segment.p_offset = 0x1000;
+    segment.p_vaddr = address;
+    segment.p_filesz = size;
+    segment.p_memsz = memory_size;
+    segment.p_flags = PF_R | PF_W | PF_X;
+    
+    FILE *file = fopen(filename, "wb");
+    if(file == NULL) return false;
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(&segment, sizeof(segment), 1, file);
+    fseek(file, segment.p_offset, SEEK_SET);
+    fwrite(code, size, 1, file);
+    fclose(file);
+    return true;
+}
+
+//test_gdb_stub用: GDB側としてパケットを送り、応答を受け取る
+static void gdb_send(int fd, const std::string &packet){
+    uint8_t sum = 0;
+    for(size_t i = 0; i < packet.size(); i++) sum += packet[i];
+    char checksum[4];
+    snprintf(checksum, sizeof(checksum), "%02x", sum);
+    std::string frame = "$" + packet + "#" + checksum;
+    if(write(fd, frame.data(), frame.size()) < 0) return;
+}
+
+static std::string gdb_receive(int fd){
+    std::string packet;
+    char c;
+    do{
+        if(read(fd, &c, 1) != 1) return "(closed)";
+    }while(c != '$');
+    while(read(fd, &c, 1) == 1 && c != '#') packet += c;
+    char checksum[2];
+    if(read(fd, checksum, 2) != 2) return "(closed)";
+    return packet;
+}
+
+static std::string gdb_request(int fd, const std::string &packet){
+    gdb_send(fd, packet);
+    return gdb_receive(fd);
+}
+
 void FIXTURE_NAME::setUp() {}
 
 void FIXTURE_NAME::tearDown() {}
@@ -53,7 +263,7 @@ void FIXTURE_NAME::test_init(){
 
 void FIXTURE_NAME::test_near_jump(){
     emulator emu(1024 * 1024, 0x7c00, 0x7c00);
-    emu.load_program("bin/data/near_jump.bin", 0x0200);
+    emu.load_program("bin/data/near_jump.bin");
     while(emu.exec());
     
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x000029, emu.registers[EAX]);
@@ -68,7 +278,7 @@ void FIXTURE_NAME::test_near_jump(){
 
 void FIXTURE_NAME::test_modrm(){
     emulator emu(1024 * 1024, 0x7c00, 0x7c00);
-    emu.load_program("bin/data/modrm-test.bin", 0x0200);
+    emu.load_program("bin/data/modrm-test.bin");
     while(emu.exec());
     
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x000002, emu.registers[EAX]);
@@ -83,7 +293,7 @@ void FIXTURE_NAME::test_modrm(){
 
 void FIXTURE_NAME::test_call(){
     emulator emu(1024 * 1024, 0x7c00, 0x7c00);
-    emu.load_program("bin/data/call-test.bin", 0x0200);
+    emu.load_program("bin/data/call-test.bin");
     while(emu.exec());
     
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x0000f1, emu.registers[EAX]);
@@ -98,7 +308,7 @@ void FIXTURE_NAME::test_call(){
 
 void FIXTURE_NAME::test_c(){
     emulator emu(1024 * 1024, 0x7c00, 0x7c00);
-    emu.load_program("bin/data/c-test.bin", 0x0200);
+    emu.load_program("bin/data/c-test.bin");
     while(emu.exec());
     
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x000029, emu.registers[EAX]);
@@ -113,7 +323,7 @@ void FIXTURE_NAME::test_c(){
 
 void FIXTURE_NAME::test_arg(){
     emulator emu(1024 * 1024, 0x7c00, 0x7c00);
-    emu.load_program("bin/data/arg-test.bin", 0x0200);
+    emu.load_program("bin/data/arg-test.bin");
     while(emu.exec());
     
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x000007, emu.registers[EAX]);
@@ -128,7 +338,7 @@ void FIXTURE_NAME::test_arg(){
 
 void FIXTURE_NAME::test_if(){
     emulator emu(1024 * 1024, 0x7c00, 0x7c00);
-    emu.load_program("bin/data/if-test.bin", 0x0200);
+    emu.load_program("bin/data/if-test.bin");
     while(emu.exec());
     
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x000003, emu.registers[EAX]);
@@ -143,7 +353,7 @@ void FIXTURE_NAME::test_if(){
 
 void FIXTURE_NAME::test_while(){
     emulator emu(1024 * 1024, 0x7c00, 0x7c00);
-    emu.load_program("bin/data/while-test.bin", 0x0200);
+    emu.load_program("bin/data/while-test.bin");
     while(emu.exec());
     
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, emu.registers[EAX]);
@@ -156,3 +366,1787 @@ void FIXTURE_NAME::test_while(){
     CPPUNIT_ASSERT_EQUAL((uint32_t)0x000000, emu.registers[EDI]);
 }
 
+
+void FIXTURE_NAME::test_decode_cache(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    emu.load_program("bin/data/while-test.bin");
+    while(emu.exec());
+    
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, emu.registers[EAX]);
+    //ループ部分は2回目以降キャッシュから実行される
+    CPPUNIT_ASSERT(emu.decode_cache_misses < emu.decode_cache_hits);
+}
+
+void FIXTURE_NAME::test_decode_cache_invalidate(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    //mov eax, 1
+    emu._set_memory8(0x7c00, 0xB8);
+    emu._set_memory32(0x7c01, 1);
+    
+    emu.exec();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000001, emu.registers[EAX]);
+    
+    //キャッシュ済みの命令の即値を書き換える
+    emu._set_memory32(0x7c01, 2);
+    emu.eip = 0x7c00;
+    emu.exec();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000002, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)2, emu.decode_cache_misses);
+}
+
+void FIXTURE_NAME::test_run_block(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    emu.load_program("bin/data/while-test.bin");
+    emu.run();
+    
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x007c00, emu.registers[ESP]);
+    CPPUNIT_ASSERT(emu.block_chain_hits > 0);
+}
+
+void FIXTURE_NAME::test_run_block_invalidate(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    //mov dword [0x7c0b], 2
+    emu._set_memory8(0x7c00, 0xC7);
+    emu._set_memory8(0x7c01, 0x05);
+    emu._set_memory32(0x7c02, 0x7c0b);
+    emu._set_memory32(0x7c06, 2);
+    //mov eax, 1 (即値が上の命令で書き換わる)
+    emu._set_memory8(0x7c0a, 0xB8);
+    emu._set_memory32(0x7c0b, 1);
+    //jmp 0
+    emu._set_memory8(0x7c0f, 0xE9);
+    emu._set_memory32(0x7c10, 0 - 0x7c14);
+    
+    emu.run();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000002, emu.registers[EAX]);
+}
+
+void FIXTURE_NAME::test_jit(){
+    const char *programs[] = {
+        "bin/data/near_jump.bin",
+        "bin/data/modrm-test.bin",
+        "bin/data/call-test.bin",
+        "bin/data/c-test.bin",
+        "bin/data/arg-test.bin",
+        "bin/data/if-test.bin",
+        "bin/data/while-test.bin",
+    };
+    
+    for(size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++){
+        emulator interp(1024 * 1024, 0x7c00, 0x7c00);
+        interp.load_program(programs[i]);
+        interp.run();
+        
+        //閾値1で全ブロックを翻訳させる
+        emulator native(1024 * 1024, 0x7c00, 0x7c00);
+        native.set_jit(true, 1);
+        native.load_program(programs[i]);
+        native.run();
+        
+        for(int r = 0; r < REGISTERS_COUNT; r++){
+            CPPUNIT_ASSERT_EQUAL(interp.registers[r], native.registers[r]);
+        }
+        CPPUNIT_ASSERT_EQUAL(interp.eflags, native.eflags);
+        CPPUNIT_ASSERT(memcmp(interp.memory, native.memory, 1024 * 1024) == 0);
+    }
+}
+
+void FIXTURE_NAME::test_jit_invalidate(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    emu.set_jit(true, 1);
+    //mov dword [0x7c0b], 2
+    emu._set_memory8(0x7c00, 0xC7);
+    emu._set_memory8(0x7c01, 0x05);
+    emu._set_memory32(0x7c02, 0x7c0b);
+    emu._set_memory32(0x7c06, 2);
+    //mov eax, 1 (即値が上の命令で書き換わる)
+    emu._set_memory8(0x7c0a, 0xB8);
+    emu._set_memory32(0x7c0b, 1);
+    //jmp 0
+    emu._set_memory8(0x7c0f, 0xE9);
+    emu._set_memory32(0x7c10, 0 - 0x7c14);
+    
+    emu.run();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000002, emu.registers[EAX]);
+}
+
+//翻訳できる命令を1つずつ、インタプリタとJITで実行して結果を比べる
+void FIXTURE_NAME::test_jit_instructions(){
+    struct{
+        uint8_t code[12];
+        uint32_t size;
+    } cases[] = {
+        {{0x01, 0xC1}, 2},                          //add ecx, eax
+        {{0x09, 0x02}, 2},                          //or [edx], eax
+        {{0x23, 0x02}, 2},                          //and eax, [edx]
+        {{0x2D, 0x02, 0x00, 0x00, 0x80}, 5},        //sub eax, 0x80000002
+        {{0x31, 0xFB}, 2},                          //xor ebx, edi
+        {{0x39, 0x4A, 0x04}, 3},                    //cmp [edx+4], ecx
+        {{0x85, 0xC8}, 2},                          //test eax, ecx
+        {{0x81, 0xCE, 0x00, 0x01, 0x00, 0x00}, 6},  //or esi, 0x100
+        {{0x81, 0x22, 0xFF, 0x00, 0xFF, 0x00}, 6},  //and dword [edx], 0xff00ff
+        {{0x83, 0xF1, 0xFF}, 3},                    //xor ecx, -1
+        {{0x48}, 1},                                //dec eax (CFは残る)
+        {{0xFF, 0x0A}, 2},                          //dec dword [edx]
+        {{0x8D, 0x44, 0xB2, 0x08}, 4},              //lea eax, [edx+esi*4+8]
+        {{0xF7, 0xD1}, 2},                          //not ecx
+        {{0xF7, 0xDB}, 2},                          //neg ebx
+        {{0xF7, 0x1A}, 2},                          //neg dword [edx]
+        {{0xD1, 0xE0}, 2},                          //shl eax, 1
+        {{0xC1, 0xE1, 0x05}, 3},                    //shl ecx, 5
+        {{0xC1, 0xE3, 0x1F}, 3},                    //shl ebx, 31
+        {{0xC1, 0xE8, 0x04}, 3},                    //shr eax, 4
+        {{0xD1, 0x2A}, 2},                          //shr dword [edx], 1
+        {{0xC1, 0xF8, 0x03}, 3},                    //sar eax, 3
+        {{0x6B, 0xC1, 0x03}, 3},                    //imul eax, ecx, 3
+        {{0x69, 0x3A, 0x00, 0x00, 0x01, 0x00}, 6},  //imul edi, [edx], 0x10000
+        {{0x0F, 0xAF, 0xC1}, 3},                    //imul eax, ecx
+        {{0x0F, 0xB6, 0x42, 0x01}, 4},              //movzx eax, byte [edx+1]
+        {{0x0F, 0xBF, 0x4A, 0x02}, 4},              //movsx ecx, word [edx+2]
+        {{0x0F, 0xBE, 0xD8}, 3},                    //movsx ebx, al
+        {{0x0F, 0xB7, 0xF9}, 3},                    //movzx edi, cx
+        {{0x38, 0x02}, 2},                          //cmp [edx], al
+        {{0x84, 0xCB}, 2},                          //test bl, cl
+        {{0x3C, 0x80}, 2},                          //cmp al, 0x80
+        {{0x88, 0x4A, 0x03}, 3},                    //mov [edx+3], cl
+        {{0x88, 0xD9}, 2},                          //mov cl, bl
+        {{0x8A, 0x1A}, 2},                          //mov bl, [edx]
+        {{0xB0, 0x7F}, 2},                          //mov al, 0x7f
+        {{0xC6, 0x42, 0x05, 0xAA}, 4},              //mov byte [edx+5], 0xaa
+        {{0xA1, 0x00, 0x10, 0x00, 0x00}, 5},        //mov eax, [0x1000]
+        {{0xA3, 0x04, 0x10, 0x00, 0x00}, 5},        //mov [0x1004], eax
+        {{0xFF, 0x32, 0x59}, 3},                    //push dword [edx]; pop ecx
+        {{0x90}, 1},                                //nop
+    };
+    
+    //Jccは条件ごとに、cmp eax, ecxとcmp ecx, eaxの後で短い形と長い形を試す(分岐すればinc ebxを飛ばす)
+    struct{
+        uint8_t code[12];
+        uint32_t size;
+    } branches[16 * 4];
+    size_t branch_count = 0;
+    for(int cc = 0; cc < 16; cc++){
+        //パリティは未実装
+        if(cc == 0xA || cc == 0xB) continue;
+        for(int order = 0; order < 2; order++){
+            uint8_t cmp = order ? 0xC1 : 0xC8;
+            uint8_t short_form[] = {0x39, cmp, (uint8_t)(0x70 + cc), 0x01, 0x43};
+            uint8_t long_form[] = {0x39, cmp, 0x0F, (uint8_t)(0x80 + cc), 0x01, 0x00, 0x00, 0x00, 0x43};
+            memcpy(branches[branch_count].code, short_form, sizeof(short_form));
+            branches[branch_count++].size = sizeof(short_form);
+            memcpy(branches[branch_count].code, long_form, sizeof(long_form));
+            branches[branch_count++].size = sizeof(long_form);
+        }
+    }
+    
+    size_t case_count = sizeof(cases) / sizeof(cases[0]);
+    for(size_t i = 0; i < case_count + branch_count; i++){
+        const uint8_t *code = i < case_count ? cases[i].code : branches[i - case_count].code;
+        uint32_t size = i < case_count ? cases[i].size : branches[i - case_count].size;
+        
+        emulator interp(1024 * 1024, 0x7c00, 0x7c00);
+        emulator native(1024 * 1024, 0x7c00, 0x7c00);
+        native.set_jit(true, 1);
+        emulator *emus[] = {&interp, &native};
+        for(int e = 0; e < 2; e++){
+            emulator &emu = *emus[e];
+            _load_code(emu, code, size);
+            emu.registers[EAX] = 0x80000001;
+            emu.registers[ECX] = 0x7FFFFFFF;
+            emu.registers[EDX] = 0x1000;
+            emu.registers[EBX] = 0xFFFFFFFF;
+            emu.registers[ESI] = 3;
+            emu.registers[EDI] = 0x12345678;
+            emu.eflags = CARRY_FLAG;
+            emu._set_memory32(0x1000, 0x80FF7F01);
+            emu._set_memory32(0x1004, 0x7FFFFFFF);
+            CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+            emu._materialize_eflags();
+        }
+        
+        //全部のブロックが翻訳されている
+        CPPUNIT_ASSERT_EQUAL(native.block_count, native.jit_compiler->compiled_count);
+        for(int r = 0; r < REGISTERS_COUNT; r++){
+            CPPUNIT_ASSERT_EQUAL(interp.registers[r], native.registers[r]);
+        }
+        CPPUNIT_ASSERT_EQUAL(interp.eflags, native.eflags);
+        CPPUNIT_ASSERT_EQUAL(interp.eip, native.eip);
+        CPPUNIT_ASSERT_EQUAL(interp.get_instruction_count(), native.get_instruction_count());
+        CPPUNIT_ASSERT(memcmp(interp.memory, native.memory, 1024 * 1024) == 0);
+    }
+}
+
+void FIXTURE_NAME::test_lazy_eflags(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    //mov eax, 0x7fffffff
+    emu._set_memory8(0x7c00, 0xB8);
+    emu._set_memory32(0x7c01, 0x7fffffff);
+    //add eax, 1
+    emu._set_memory8(0x7c05, 0x83);
+    emu._set_memory8(0x7c06, 0xC0);
+    emu._set_memory8(0x7c07, 0x01);
+    //mov al, 1
+    emu._set_memory8(0x7c08, 0xB0);
+    emu._set_memory8(0x7c09, 0x01);
+    //cmp al, 2
+    emu._set_memory8(0x7c0a, 0x3C);
+    emu._set_memory8(0x7c0b, 0x02);
+    //inc eax
+    emu._set_memory8(0x7c0c, 0x40);
+    
+    emu.exec();
+    emu.exec();
+    CPPUNIT_ASSERT(!emu._is_carry());
+    CPPUNIT_ASSERT(!emu._is_zero());
+    CPPUNIT_ASSERT(emu._is_sign());
+    CPPUNIT_ASSERT(emu._is_overflow());
+    
+    emu.exec();
+    emu.exec();
+    CPPUNIT_ASSERT(emu._is_carry());
+    CPPUNIT_ASSERT(!emu._is_zero());
+    CPPUNIT_ASSERT(emu._is_sign());
+    CPPUNIT_ASSERT(!emu._is_overflow());
+    
+    //incはCFを残す
+    emu.exec();
+    emu._materialize_eflags();
+    CPPUNIT_ASSERT_EQUAL(CARRY_FLAG | SIGN_FLAG, emu.eflags);
+}
+
+void FIXTURE_NAME::test_run_budget(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    emu.load_program("bin/data/while-test.bin");
+    
+    CPPUNIT_ASSERT_EQUAL(STOP_BUDGET, emu.run(10));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)10, emu.get_instruction_count());
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, emu.registers[EAX]);
+    
+    //JITで実行しても命令数は同じ
+    emulator native(1024 * 1024, 0x7c00, 0x7c00);
+    native.set_jit(true, 1);
+    native.load_program("bin/data/while-test.bin");
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, native.run());
+    CPPUNIT_ASSERT_EQUAL(emu.get_instruction_count(), native.get_instruction_count());
+}
+
+void FIXTURE_NAME::test_run_until(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    emu.load_program("bin/data/call-test.bin");
+    
+    //add_routineのadd ecx, ebxの手前
+    CPPUNIT_ASSERT_EQUAL(STOP_BREAKPOINT, emu.run_until(0x7c16));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x007c16, emu.eip);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x0000f1, emu.registers[ECX]);
+    
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x00011a, emu.registers[ECX]);
+}
+
+void FIXTURE_NAME::test_memory_fault(){
+    for(int use_jit = 0; use_jit < 2; use_jit++){
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        emu.set_jit(use_jit, 1);
+        //mov eax, 0x80000000
+        emu._set_memory8(0x7c00, 0xB8);
+        emu._set_memory32(0x7c01, 0x80000000);
+        //mov [eax], eax
+        emu._set_memory8(0x7c05, 0x89);
+        emu._set_memory8(0x7c06, 0x00);
+        //jmp 0
+        emu._set_memory8(0x7c07, 0xE9);
+        emu._set_memory32(0x7c08, 0 - 0x7c0c);
+        
+        CPPUNIT_ASSERT_EQUAL(STOP_FAULT, emu.run());
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x80000000, emu.get_fault_address());
+        //ブロックの途中で止まっても、フォールトした命令の手前までは数える
+        CPPUNIT_ASSERT_EQUAL((uint64_t)1, emu.get_instruction_count());
+        CPPUNIT_ASSERT_EQUAL((uint64_t)1, emu.get_cycle_count());
+    }
+    
+    //翻訳したコードの途中でフォールトしても、インタプリタと同じ状態で止まる
+    const uint8_t loop[] = {
+        0x41,                               //inc ecx
+        0x89, 0x0D, 0x00, 0x10, 0x00, 0x00, //mov [0x1000], ecx
+        0x8B, 0x15, 0x00, 0x20, 0x00, 0x00, //mov edx, [0x2000]
+        0x8B, 0x02,                         //mov eax, [edx]
+        0xEB, 0xEF                          //jmp 0x7c00
+    };
+    emulator interpreted(1024 * 1024, 0x7c00, 0x7c00);
+    emulator compiled(1024 * 1024, 0x7c00, 0x7c00);
+    compiled.set_jit(true, 1);
+    emulator *emus[] = {&interpreted, &compiled};
+    for(int i = 0; i < 2; i++){
+        _write_code(*emus[i], 0x7c00, loop, sizeof(loop));
+        emus[i]->_set_memory32(0x2000, 0x3000);
+        CPPUNIT_ASSERT_EQUAL(STOP_BUDGET, emus[i]->run(200));
+        emus[i]->_set_memory32(0x2000, 0x200000);
+        CPPUNIT_ASSERT_EQUAL(STOP_FAULT, emus[i]->run());
+    }
+    CPPUNIT_ASSERT(compiled.jit_compiler->compiled_count > 0);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)41, interpreted.registers[ECX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x200000, interpreted.registers[EDX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c0f, interpreted.get_eip());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)203, interpreted.get_instruction_count());
+    for(int r = 0; r < REGISTERS_COUNT; r++){
+        CPPUNIT_ASSERT_EQUAL(interpreted.registers[r], compiled.registers[r]);
+    }
+    CPPUNIT_ASSERT_EQUAL(interpreted.get_eip(), compiled.get_eip());
+    CPPUNIT_ASSERT_EQUAL(interpreted.get_instruction_count(), compiled.get_instruction_count());
+    CPPUNIT_ASSERT_EQUAL(interpreted.get_cycle_count(), compiled.get_cycle_count());
+    CPPUNIT_ASSERT_EQUAL(interpreted._get_memory32(0x1000), compiled._get_memory32(0x1000));
+    //続きから実行しても同じになる
+    for(int i = 0; i < 2; i++){
+        emus[i]->_set_memory32(0x2000, 0x3000);
+        emus[i]->set_eip(0x7c00);
+        CPPUNIT_ASSERT_EQUAL(STOP_BUDGET, emus[i]->run(10));
+    }
+    CPPUNIT_ASSERT_EQUAL((uint32_t)43, compiled.registers[ECX]);
+    CPPUNIT_ASSERT_EQUAL(interpreted._get_memory32(0x1000), compiled._get_memory32(0x1000));
+    CPPUNIT_ASSERT_EQUAL(interpreted.get_instruction_count(), compiled.get_instruction_count());
+    
+    //メモリの外の命令は実行できない
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    //jmp 0x200000
+    emu._set_memory8(0x7c00, 0xE9);
+    emu._set_memory32(0x7c01, 0x200000 - 0x7c05);
+    CPPUNIT_ASSERT_EQUAL(STOP_FAULT, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x200000, emu.get_fault_address());
+    
+    //アドレス空間の末尾をまたぐスタック
+    //push eax
+    emu._set_memory8(0x7c00, 0x50);
+    emu.eip = 0x7c00;
+    emu.registers[ESP] = 2;
+    CPPUNIT_ASSERT_EQUAL(false, emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xfffffffe, emu.get_fault_address());
+}
+
+void FIXTURE_NAME::test_memory_image(){
+    memory_image image(1024 * 1024);
+    image.load("bin/data/while-test.bin", 0x7c00, 0x0200);
+    
+    emulator first(image, 0x7c00, 0x7c00);
+    emulator second(image, 0x7c00, 0x7c00);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, first.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, first.registers[EAX]);
+    
+    //書き込みは他のゲストとイメージに見えない
+    first._set_memory32(0x7c00, 0);
+    CPPUNIT_ASSERT(first._get_memory32(0x7c00) != second._get_memory32(0x7c00));
+    CPPUNIT_ASSERT_EQUAL(second._get_memory32(0x7c00), *(uint32_t *)(image.get_data() + 0x7c00));
+    
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, second.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, second.registers[EAX]);
+}
+
+void FIXTURE_NAME::test_snapshot(){
+    for(int use_jit = 0; use_jit < 2; use_jit++){
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        emu.set_jit(use_jit, 1);
+        emu.load_program("bin/data/modrm-test.bin");
+        
+        Snapshot *start = emu.snapshot();
+        for(int i = 0; i < 3; i++){
+            CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+            CPPUNIT_ASSERT_EQUAL((uint32_t)0x000002, emu.registers[EAX]);
+            CPPUNIT_ASSERT_EQUAL((uint32_t)0x007bf0, emu.registers[ESP]);
+            //スタックのページだけが書き込まれている
+            CPPUNIT_ASSERT_EQUAL((uint8_t)1, emu.dirty_map[0x7bf0 >> DIRTY_PAGE_SHIFT]);
+            CPPUNIT_ASSERT_EQUAL((uint8_t)0, emu.dirty_map[0x8000 >> DIRTY_PAGE_SHIFT]);
+            
+            CPPUNIT_ASSERT(emu.restore(start));
+            CPPUNIT_ASSERT_EQUAL((uint32_t)0x007c00, emu.eip);
+            CPPUNIT_ASSERT_EQUAL((uint32_t)0x000000, emu.registers[EAX]);
+            CPPUNIT_ASSERT_EQUAL((uint64_t)0, emu.get_instruction_count());
+            CPPUNIT_ASSERT(memcmp(emu.memory, &start->memory[0], 1024 * 1024) == 0);
+        }
+        delete start;
+    }
+    
+    //書き換えられたコードは戻したあとデコードし直す
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    //mov dword [0x7c0b], 2
+    emu._set_memory8(0x7c00, 0xC7);
+    emu._set_memory8(0x7c01, 0x05);
+    emu._set_memory32(0x7c02, 0x7c0b);
+    emu._set_memory32(0x7c06, 2);
+    //mov eax, 1
+    emu._set_memory8(0x7c0a, 0xB8);
+    emu._set_memory32(0x7c0b, 1);
+    //jmp 0
+    emu._set_memory8(0x7c0f, 0xE9);
+    emu._set_memory32(0x7c10, 0 - 0x7c14);
+    
+    Snapshot *start = emu.snapshot();
+    emu.run();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)2, emu._fetch_instruction(0x7c0a)->imm);
+    emu.restore(start);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)1, emu._fetch_instruction(0x7c0a)->imm);
+    delete start;
+    
+    //ページをまたぐ書き込みは、はみ出した先のページも保存して戻す
+    const uint8_t straddle[] = {
+        0xC7, 0x05, 0xFE, 0x1F, 0x00, 0x00, 0xDD, 0xCC, 0xBB, 0xAA     //mov dword [0x1FFE], 0xAABBCCDD
+    };
+    for(int use_jit = 0; use_jit < 2; use_jit++){
+        emulator paged(1024 * 1024, 0x7c00, 0x7c00);
+        paged.set_jit(use_jit, 1);
+        _load_code(paged, straddle, sizeof(straddle));
+        //1回目でJITが翻訳して、2回目は翻訳したコードで書く
+        Snapshot *empty = paged.snapshot();
+        for(int i = 0; i < 2; i++){
+            CPPUNIT_ASSERT(paged.restore(empty));
+            CPPUNIT_ASSERT_EQUAL(STOP_HALT, paged.run());
+        }
+        delete empty;
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0xAABBCCDD, paged._get_memory32(0x1FFE));
+        
+        Snapshot *written = paged.snapshot();
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0xBB, written->memory[0x2000]);
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0xAA, written->memory[0x2001]);
+        paged._set_memory32(0x1FFE, 0);
+        CPPUNIT_ASSERT(paged.restore(written));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0xAABBCCDD, paged._get_memory32(0x1FFE));
+        delete written;
+    }
+    
+    //仮想時間も戻るので、戻したあとのrdtscは同じ値を読む
+    const uint8_t program[] = {
+        0x90,                           //nop
+        0x0F, 0x31                      //rdtsc
+    };
+    emulator timed(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(timed, program, sizeof(program));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, timed.run());
+    timed.eip = 0x7c00;
+    start = timed.snapshot();
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, timed.run());
+    uint32_t tsc = timed.registers[EAX];
+    uint64_t cycles = timed.get_cycle_count();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)5, tsc);
+    for(int i = 0; i < 2; i++){
+        CPPUNIT_ASSERT(timed.restore(start));
+        CPPUNIT_ASSERT_EQUAL((uint64_t)3, timed.get_cycle_count());
+        CPPUNIT_ASSERT_EQUAL((uint64_t)3 * NS_PER_CYCLE, timed.clock->now());
+        CPPUNIT_ASSERT_EQUAL(STOP_HALT, timed.run());
+        CPPUNIT_ASSERT_EQUAL(tsc, timed.registers[EAX]);
+        CPPUNIT_ASSERT_EQUAL(cycles, timed.get_cycle_count());
+    }
+    delete start;
+}
+
+void FIXTURE_NAME::test_unimplemented_stop(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    //int 0x21
+    emu._set_memory8(0x7c00, 0xCD);
+    emu._set_memory8(0x7c01, 0x21);
+    CPPUNIT_ASSERT_EQUAL(STOP_UNIMPLEMENTED, emu.run());
+    
+    //止まったあとも同じインスタンスで実行を続けられる
+    emu.eip = 0x7c00;
+    //adc eax, 1 (83 /2は未実装)
+    emu._set_memory8(0x7c00, 0x83);
+    emu._set_memory8(0x7c01, 0xD0);
+    emu._set_memory8(0x7c02, 0x01);
+    CPPUNIT_ASSERT_EQUAL(false, emu.exec());
+}
+
+void FIXTURE_NAME::test_batch(){
+    const char *programs[] = {
+        "bin/data/while-test.bin",
+        "bin/data/call-test.bin",
+        "bin/data/no-such-program.bin",
+        "bin/data/modrm-test.bin"
+    };
+    
+    batch_runner runner;
+    for(int i = 0; i < 16; i++){
+        BatchJob job;
+        job.program = programs[i % 4];
+        job.memory_size = 1024 * 1024;
+        job.entry = 0x7c00;
+        job.esp = 0x7c00;
+        runner.add(job);
+    }
+    runner.run(4);
+    
+    const std::vector<BatchResult> &results = runner.get_results();
+    CPPUNIT_ASSERT_EQUAL((size_t)16, results.size());
+    for(int i = 0; i < 16; i += 4){
+        CPPUNIT_ASSERT_EQUAL(STOP_HALT, results[i].reason);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, results[i].registers[EAX]);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x00011a, results[i + 1].registers[ECX]);
+        CPPUNIT_ASSERT_EQUAL(false, results[i + 2].loaded);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x000008, results[i + 3].registers[EDI]);
+    }
+    
+    //マニフェストに無ければ、エントリポイントとメモリの大きさはELFから決める
+    const char *filename = "bin/data/tmp/batch-entry.elf";
+    const uint32_t address = 0x200000;
+    const uint8_t code[] = {
+        0xB8, 0x34, 0x12, 0x00, 0x00,   //mov eax, 0x1234
+        0xE9, 0xF6, 0xFF, 0xDF, 0xFF    //jmp 0
+    };
+    //先頭のmovを飛ばすエントリポイント
+    CPPUNIT_ASSERT(write_elf(filename, address, address + 5, code, sizeof(code), 0x1000));
+    
+    batch_runner elf_runner;
+    BatchJob from_image;
+    from_image.program = filename;
+    from_image.memory_size = 0;
+    from_image.entry = 0;
+    from_image.esp = BATCH_DEFAULT_ESP;
+    elf_runner.add(from_image);
+    BatchJob overridden = from_image;
+    overridden.entry = address;
+    elf_runner.add(overridden);
+    elf_runner.run(1);
+    remove(filename);
+    
+    const std::vector<BatchResult> &elf_results = elf_runner.get_results();
+    CPPUNIT_ASSERT(elf_results[0].loaded);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, elf_results[0].reason);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, elf_results[0].instruction_count);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, elf_results[0].registers[EAX]);
+    CPPUNIT_ASSERT(elf_results[1].loaded);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x1234, elf_results[1].registers[EAX]);
+}
+
+void FIXTURE_NAME::test_console(){
+    const uint8_t program[] = {
+        0xB4, 0x0E,                     //mov ah, 0x0e
+        0xB3, 0x0F,                     //mov bl, 0x0f
+        0xB0, 0x41,                     //mov al, 'A'
+        0xCD, 0x10,                     //int 0x10
+        0xB0, 0x42,                     //mov al, 'B'
+        0xCD, 0x10,                     //int 0x10
+        0xBA, 0xF8, 0x03, 0x00, 0x00,   //mov edx, 0x3f8
+        0xB0, 0x0A,                     //mov al, '\n'
+        0xEE                            //out dx, al
+    };
+    
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(emu, program, sizeof(program));
+    
+    console *output = emu.get_console();
+    output->set_sink(CONSOLE_MEMORY);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    
+    //同じ色の文字が続く間はエスケープシーケンスを出さない
+    const char expected[] = "\x1b[1;37mAB\x1b[0m\n";
+    CPPUNIT_ASSERT_EQUAL(sizeof(expected) - 1, output->get_output_size());
+    CPPUNIT_ASSERT(memcmp(expected, output->get_output(), sizeof(expected) - 1) == 0);
+}
+
+void FIXTURE_NAME::test_io_bus(){
+    const uint8_t program[] = {
+        0xB8, 0x78, 0x56, 0x34, 0x12,   //mov eax, 0x12345678
+        0xE7, 0x60,                     //out 0x60, eax
+        0xBA, 0x62, 0x00, 0x00, 0x00,   //mov edx, 0x62
+        0xED,                           //in eax, dx
+        0x89, 0xC3,                     //mov ebx, eax
+        0x66, 0xE5, 0x61,               //in ax, 0x61
+        0x89, 0xC1,                     //mov ecx, eax
+        0xE4, 0x70,                     //in al, 0x70 (つながっていない)
+        0xEE                            //out dx, al
+    };
+    
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(emu, program, sizeof(program));
+    
+    test_device device;
+    CPPUNIT_ASSERT(emu.get_io_bus()->attach(&device, 0x60, 4));
+    CPPUNIT_ASSERT(!emu.get_io_bus()->attach(&device, 0x63, 2));
+    
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x12340062, emu.registers[EBX]);
+    //16bitは8bitのアクセス2回に分けられる
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x12346261, emu.registers[ECX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x12346200, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint16_t)0x62, device.last_port);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x00, device.last_value);
+    CPPUNIT_ASSERT_EQUAL(1, device.last_size);
+}
+
+void FIXTURE_NAME::test_profiler(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    emu.load_program("bin/data/arg-test.bin");
+    emu.set_jit(true);
+    emu.set_profile(true);
+    
+    profiler *profile = emu.get_profiler();
+    CPPUNIT_ASSERT(profile->load_symbols("bin/data/arg-test.elf"));
+    
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)7, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)17, emu.instruction_count);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)2, profile->get_opcode_count(0xE8));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, profile->get_address_count(0x7c0a));
+    CPPUNIT_ASSERT_EQUAL(std::string("main+0x7"), profile->symbol_name(0x7c1e));
+    
+    //呼び出し元ごとに自分の命令数だけ数える
+    FILE *out = tmpfile();
+    profile->write_folded(out);
+    rewind(out);
+    char folded[256] = {0};
+    fread(folded, 1, sizeof(folded) - 1, out);
+    fclose(out);
+    CPPUNIT_ASSERT_EQUAL(std::string("start 2\nstart;main 8\nstart;main;add 7\n"), std::string(folded));
+}
+
+void FIXTURE_NAME::test_trace(){
+    const char *filename = "bin/test_trace.gz";
+    
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    emu.load_program("bin/data/arg-test.bin");
+    emu.set_jit(true, 1);
+    
+    //add()の中だけ記録する
+    tracer trace(16);
+    trace.add_range(0x7c0a, 0x7c16);
+    CPPUNIT_ASSERT(emu.start_trace(&trace, filename));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    emu.stop_trace();
+    
+    trace_reader reader;
+    CPPUNIT_ASSERT(reader.open(filename));
+    TraceEvent event;
+    uint64_t count = 0;
+    while(reader.next(event)){
+        CPPUNIT_ASSERT(0x7c0a <= event.eip && event.eip <= 0x7c16);
+        count++;
+    }
+    CPPUNIT_ASSERT_EQUAL((uint64_t)7, count);
+    
+    //全部記録して、途中の状態を再生する
+    emulator full(1024 * 1024, 0x7c00, 0x7c00);
+    full.load_program("bin/data/arg-test.bin");
+    tracer all;
+    CPPUNIT_ASSERT(full.start_trace(&all, filename));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, full.run());
+    full.stop_trace();
+    
+    CPPUNIT_ASSERT(reader.open(filename));
+    CPPUNIT_ASSERT(reader.next(event));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c00, event.eip);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)5, event.length);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0xE8, event.code[0]);
+    //callで戻り先を積む
+    CPPUNIT_ASSERT_EQUAL((size_t)1, event.writes.size());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7bfc, event.writes[0].address);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c05, event.writes[0].value);
+    
+    //add eax, edxの直前
+    Snapshot state;
+    CPPUNIT_ASSERT(reader.replay(10, state));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c13, state.eip);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)5, state.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)2, state.registers[EDX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c23, *(uint32_t *)&state.memory[0x7bec]);
+    CPPUNIT_ASSERT(!reader.replay(100, state));
+    
+    //再生した状態から続きを実行できる
+    CPPUNIT_ASSERT(reader.replay(10, state));
+    emulator resumed(1024 * 1024, 0x7c00, 0x7c00);
+    CPPUNIT_ASSERT(resumed.restore(&state));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, resumed.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)7, resumed.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)17, resumed.instruction_count);
+    
+    remove(filename);
+}
+
+void FIXTURE_NAME::_write_code(emulator &emu, uint32_t address, const uint8_t *code, uint32_t size){
+    for(uint32_t i = 0; i < size; i++){
+        emu._set_memory8(address + i, code[i]);
+    }
+}
+
+void FIXTURE_NAME::_load_code(emulator &emu, const uint8_t *code, uint32_t size, uint32_t address){
+    _write_code(emu, address, code, size);
+    uint32_t end = address + size;
+    emu._set_memory8(end, 0xE9);
+    emu._set_memory32(end + 1, 0 - (end + 5));
+}
+
+void FIXTURE_NAME::test_sib(){
+    const uint8_t code[] = {
+        0xBB, 0x00, 0x90, 0x00, 0x00,                           //mov ebx, 0x9000
+        0xBE, 0x02, 0x00, 0x00, 0x00,                           //mov esi, 2
+        0xC7, 0x44, 0xB3, 0x08, 0x34, 0x12, 0x00, 0x00,         //mov dword [ebx+esi*4+8], 0x1234
+        0x8D, 0x44, 0xB3, 0x08,                                 //lea eax, [ebx+esi*4+8]
+        0x8B, 0x0C, 0xB5, 0x08, 0x90, 0x00, 0x00,               //mov ecx, [esi*4+0x9008]
+        0x8B, 0x14, 0x33,                                       //mov edx, [ebx+esi]
+        0xFF, 0x34, 0x24,                                       //push dword [esp]
+        0x8B, 0x7C, 0x24, 0xFC,                                 //mov edi, [esp-4]
+        0x8B, 0x2C, 0x25, 0x00, 0x90, 0x00, 0x00,               //mov ebp, [0x9000] (index無し)
+    };
+    //JITでも同じアドレスになること
+    for(int use_jit = 0; use_jit < 2; use_jit++){
+        emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+        emu.set_jit(use_jit, 1);
+        _load_code(emu, code, sizeof(code));
+        emu._set_memory32(0x9000, 0x9999);
+        emu._set_memory32(0x9002, 0xabcd);
+        emu._set_memory32(0x7c00 - 12, 0x4444);
+        emu.registers[ESP] = 0x7c00 - 4;
+        emu._set_memory32(0x7c00 - 4, 0x5678);
+        
+        CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x1234, emu._get_memory32(0x9010));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x9010, emu.registers[EAX]);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x1234, emu.registers[ECX]);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0xabcd, emu.registers[EDX]);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c00 - 8, emu.registers[ESP]);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x5678, emu._get_memory32(0x7c00 - 8));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x4444, emu.registers[EDI]);
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0xabcd9999, emu.registers[EBP]);
+    }
+}
+
+void FIXTURE_NAME::test_alu(){
+    const uint8_t code[] = {
+        0xB8, 0xF0, 0x00, 0x00, 0x00,   //mov eax, 0xf0
+        0xB9, 0x0F, 0x00, 0x00, 0x00,   //mov ecx, 0x0f
+        0x09, 0xC8,                     //or eax, ecx
+        0x25, 0x3C, 0x00, 0x00, 0x00,   //and eax, 0x3c
+        0x83, 0xF0, 0xFF,               //xor eax, -1
+        0x29, 0xC8,                     //sub eax, ecx
+        0x85, 0xC0,                     //test eax, eax
+        0x3D, 0xB4, 0xFF, 0xFF, 0xFF,   //cmp eax, 0xffffffb4
+        0xBA, 0x00, 0x00, 0x00, 0x80,   //mov edx, 0x80000000
+        0x4A,                           //dec edx
+    };
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(emu, 0x7c00, code, sizeof(code));
+    
+    for(int i = 0; i < 5; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xffffffc3, emu.registers[EAX]);
+    
+    //論理演算はCFとOFを落とす
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xffffffb4, emu.registers[EAX]);
+    CPPUNIT_ASSERT(!emu._is_carry());
+    CPPUNIT_ASSERT(!emu._is_overflow());
+    CPPUNIT_ASSERT(emu._is_sign());
+    CPPUNIT_ASSERT(!emu._is_zero());
+    
+    //cmpは結果を書かない
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xffffffb4, emu.registers[EAX]);
+    CPPUNIT_ASSERT(emu._is_zero());
+    
+    //decはCFを残し、0x80000000から引くとOF
+    emu._set_carry(1);
+    emu.flags_op = FLAGS_NONE;
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7fffffff, emu.registers[EDX]);
+    emu._materialize_eflags();
+    CPPUNIT_ASSERT_EQUAL(CARRY_FLAG | OVERFLOW_FLAG, emu.eflags);
+}
+
+void FIXTURE_NAME::test_shift(){
+    const uint8_t code[] = {
+        0xB8, 0x01, 0x00, 0x00, 0x80,   //mov eax, 0x80000001
+        0xD1, 0xE0,                     //shl eax, 1
+        0xB9, 0xF0, 0xFF, 0xFF, 0xFF,   //mov ecx, 0xfffffff0
+        0xC1, 0xF9, 0x04,               //sar ecx, 4
+        0xBA, 0x00, 0x01, 0x00, 0x00,   //mov edx, 0x100
+        0xB1, 0x05,                     //mov cl, 5
+        0xD3, 0xEA,                     //shr edx, cl
+        0xBB, 0x00, 0x00, 0x00, 0x80,   //mov ebx, 0x80000000
+        0xD1, 0xC3,                     //rol ebx, 1
+    };
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(emu, 0x7c00, code, sizeof(code));
+    
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x00000002, emu.registers[EAX]);
+    CPPUNIT_ASSERT(emu._is_carry());
+    CPPUNIT_ASSERT(emu._is_overflow());
+    CPPUNIT_ASSERT(!emu._is_zero());
+    
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xffffffff, emu.registers[ECX]);
+    CPPUNIT_ASSERT(!emu._is_carry());
+    CPPUNIT_ASSERT(emu._is_sign());
+    
+    for(int i = 0; i < 3; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x00000008, emu.registers[EDX]);
+    
+    //rolはZFとSFを変えない
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x00000001, emu.registers[EBX]);
+    CPPUNIT_ASSERT(emu._is_carry());
+    CPPUNIT_ASSERT(!emu._is_sign());
+}
+
+void FIXTURE_NAME::test_mul_div(){
+    const uint8_t code[] = {
+        0xB8, 0x00, 0x00, 0x01, 0x00,   //mov eax, 0x10000
+        0xB9, 0x00, 0x00, 0x01, 0x00,   //mov ecx, 0x10000
+        0xF7, 0xE1,                     //mul ecx
+        0xB9, 0x03, 0x00, 0x00, 0x00,   //mov ecx, 3
+        0xF7, 0xF1,                     //div ecx
+        0xB8, 0xF9, 0xFF, 0xFF, 0xFF,   //mov eax, -7
+        0x99,                           //cdq
+        0xB9, 0x02, 0x00, 0x00, 0x00,   //mov ecx, 2
+        0xF7, 0xF9,                     //idiv ecx
+        0x6B, 0xC0, 0xFB,               //imul eax, eax, -5
+        0x31, 0xC9,                     //xor ecx, ecx
+        0xF7, 0xF1,                     //div ecx
+    };
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(emu, 0x7c00, code, sizeof(code));
+    
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)1, emu.registers[EDX]);
+    CPPUNIT_ASSERT(emu._is_carry());
+    CPPUNIT_ASSERT(emu._is_overflow());
+    
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x55555555, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)1, emu.registers[EDX]);
+    
+    for(int i = 0; i < 4; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)-3, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)-1, emu.registers[EDX]);
+    
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)15, emu.registers[EAX]);
+    CPPUNIT_ASSERT(!emu._is_carry());
+    
+    //0除算で止まる。eipはフォールトしたdivを指す
+    CPPUNIT_ASSERT_EQUAL(STOP_DIVIDE_ERROR, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)15, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)(0x7c00 + sizeof(code) - 2), emu.get_eip());
+    
+    //idivの商のオーバーフローも同じ
+    const uint8_t overflow[] = {
+        0xB8, 0x00, 0x00, 0x00, 0x80,   //mov eax, 0x80000000
+        0x99,                           //cdq
+        0xB9, 0xFF, 0xFF, 0xFF, 0xFF,   //mov ecx, -1
+        0xF7, 0xF9,                     //idiv ecx
+    };
+    emulator signed_emu(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(signed_emu, 0x7c00, overflow, sizeof(overflow));
+    CPPUNIT_ASSERT_EQUAL(STOP_DIVIDE_ERROR, signed_emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)(0x7c00 + sizeof(overflow) - 2), signed_emu.get_eip());
+}
+
+void FIXTURE_NAME::test_two_byte_opcode(){
+    const uint8_t code[] = {
+        0xBB, 0x00, 0x90, 0x00, 0x00,               //mov ebx, 0x9000
+        0x0F, 0xB6, 0x03,                           //movzx eax, byte [ebx]
+        0x0F, 0xBE, 0x0B,                           //movsx ecx, byte [ebx]
+        0x0F, 0xB7, 0x13,                           //movzx edx, word [ebx]
+        0x0F, 0xBF, 0x33,                           //movsx esi, word [ebx]
+        0x0F, 0xAF, 0xC1,                           //imul eax, ecx
+        0x39, 0xC8,                                 //cmp eax, ecx
+        0x0F, 0x8C, 0x05, 0x00, 0x00, 0x00,         //jl +5
+        0xBF, 0x01, 0x00, 0x00, 0x00,               //mov edi, 1
+        0xE9, 0x00, 0x00, 0x00, 0x00,               //jmp +0
+    };
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(emu, 0x7c00, code, sizeof(code));
+    emu._set_memory16(0x9000, 0x80F0);
+    
+    for(int i = 0; i < 5; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000000f0, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xfffffff0, emu.registers[ECX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x000080f0, emu.registers[EDX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xffff80f0, emu.registers[ESI]);
+    
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)-0xf00, emu.registers[EAX]);
+    
+    //-0xf00 < -0x10 なので分岐してmov edi, 1を飛ばす
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c00 + 33, emu.eip);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu.registers[EDI]);
+}
+
+//ワークロードのプログラム(make test_asm)をインタプリタとJITで実行する
+void FIXTURE_NAME::test_workloads(){
+    const char *programs[] = {
+        "bin/data/workloads/crc32.bin",
+        "bin/data/workloads/sort.bin",
+    };
+    const uint32_t results[] = {0x07c85076, 0xe2705d43};
+    
+    for(size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++){
+        for(int jit = 0; jit < 2; jit++){
+            emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+            CPPUNIT_ASSERT(emu.load_program(programs[i]));
+            if(jit) emu.set_jit(true, 1);
+            
+            CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+            CPPUNIT_ASSERT_EQUAL(results[i], emu.registers[EAX]);
+        }
+    }
+}
+
+void FIXTURE_NAME::test_loader(){
+    //ELFはセグメントのアドレスに置かれ、フラットバイナリと同じように動く
+    program_image elf;
+    CPPUNIT_ASSERT(elf.open("bin/data/c-test.elf"));
+    CPPUNIT_ASSERT(elf.is_elf());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c00, elf.get_entry());
+    
+    emulator from_elf(1024 * 1024, elf.get_entry(), 0x7c00);
+    CPPUNIT_ASSERT(from_elf.load_image(elf));
+    emulator from_flat(1024 * 1024, 0x7c00, 0x7c00);
+    CPPUNIT_ASSERT(from_flat.load_program("bin/data/c-test.bin"));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, from_elf.run());
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, from_flat.run());
+    for(int r = 0; r < REGISTERS_COUNT; r++){
+        CPPUNIT_ASSERT_EQUAL(from_flat.registers[r], from_elf.registers[r]);
+    }
+    
+    //実行した後に別のプログラムを読み込んでも、前のプログラムのデコード結果は使わない
+    for(int use_jit = 0; use_jit < 2; use_jit++){
+        emulator reloaded(1024 * 1024, 0x7c00, 0x7c00);
+        reloaded.set_jit(use_jit, 1);
+        CPPUNIT_ASSERT(reloaded.load_program("bin/data/while-test.bin"));
+        CPPUNIT_ASSERT_EQUAL(STOP_HALT, reloaded.run());
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x000037, reloaded.registers[EAX]);
+        
+        CPPUNIT_ASSERT(reloaded.load_program("bin/data/if-test.bin"));
+        reloaded.set_eip(0x7c00);
+        reloaded.set_register32(ESP, 0x7c00);
+        CPPUNIT_ASSERT_EQUAL(STOP_HALT, reloaded.run());
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x000003, reloaded.registers[EAX]);
+    }
+    
+    //使ったメモリに読み込み直しても、bssは0になる
+    const char *elf_filename = "bin/data/tmp/loader-bss.elf";
+    const uint8_t code[] = {
+        0xA1, 0x04, 0x18, 0x20, 0x00,   //mov eax, [0x201804]
+        0xE9, 0xF6, 0xFF, 0xDF, 0xFF    //jmp 0
+    };
+    CPPUNIT_ASSERT(write_elf(elf_filename, 0x200000, 0x200000, code, sizeof(code), 0x2000));
+    program_image bss;
+    CPPUNIT_ASSERT(bss.open(elf_filename));
+    remove(elf_filename);
+    emulator used(4 * 1024 * 1024, 0x200000, 0x7c00);
+    CPPUNIT_ASSERT(used.load_image(bss));
+    used._set_memory32(0x200000 + sizeof(code), 0xFFFFFFFF);
+    used._set_memory32(0x201804, 0xFFFFFFFF);
+    CPPUNIT_ASSERT(used.load_image(bss));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, used._get_memory32(0x200000 + sizeof(code)));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, used._get_memory32(0x201804));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, used.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, used.registers[EAX]);
+    
+    //512バイトより大きいフラットバイナリ。ページ境界に置くと中のページはファイルをマップする
+    const char *filename = "bin/data/tmp/loader-test.bin";
+    const uint32_t size = 3 * 4096 + 100;
+    FILE *file = fopen(filename, "wb");
+    CPPUNIT_ASSERT(file != NULL);
+    for(uint32_t i = 0; i < size; i++) fputc((i * 7) & 0xFF, file);
+    fclose(file);
+    
+    const uint32_t load_addresses[] = {0x20000, 0x20123};
+    for(int i = 0; i < 2; i++){
+        program_image flat;
+        CPPUNIT_ASSERT(flat.open(filename, load_addresses[i]));
+        CPPUNIT_ASSERT(!flat.is_elf());
+        CPPUNIT_ASSERT_EQUAL(load_addresses[i], flat.get_entry());
+        CPPUNIT_ASSERT_EQUAL((uint64_t)load_addresses[i] + size, flat.get_end());
+        
+        emulator emu(1024 * 1024, flat.get_entry(), 0x7c00);
+        CPPUNIT_ASSERT(emu.load_image(flat));
+        bool same = true;
+        for(uint32_t a = 0; a < size; a++){
+            if(emu._get_memory8(load_addresses[i] + a) != ((a * 7) & 0xFF)) same = false;
+        }
+        CPPUNIT_ASSERT(same);
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0, emu._get_memory8(load_addresses[i] - 1));
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0, emu._get_memory8(load_addresses[i] + size));
+        
+        //ゲストの書き込みはファイルに反映されない
+        emu._set_memory8(load_addresses[i] + 0x1000, 0xAA);
+        program_image reopened;
+        CPPUNIT_ASSERT(reopened.open(filename, load_addresses[i]));
+        emulator other(1024 * 1024, 0x7c00, 0x7c00);
+        CPPUNIT_ASSERT(other.load_image(reopened));
+        CPPUNIT_ASSERT_EQUAL((uint8_t)((0x1000 * 7) & 0xFF), other._get_memory8(load_addresses[i] + 0x1000));
+    }
+    
+    //メモリに収まらないプログラムは読み込まない
+    program_image large;
+    CPPUNIT_ASSERT(large.open(filename, 0x7c00));
+    emulator small(0x8000, 0x7c00, 0x7c00);
+    CPPUNIT_ASSERT(!small.load_image(large));
+    CPPUNIT_ASSERT(!small.load_program("bin/data/not-exist.bin"));
+    remove(filename);
+}
+
+void FIXTURE_NAME::test_sparse_memory(){
+    const uint8_t code[] = {
+        0xC7, 0x05, 0x00, 0xF0, 0xFF, 0xFF, 0x78, 0x56, 0x34, 0x12, //mov dword [0xfffff000], 0x12345678
+        0xA1, 0x00, 0x00, 0x00, 0x80,                               //mov eax, [0x80000000]
+        0x50,                                                       //push eax
+    };
+    //4GiB全体を使えるが、実メモリは触ったページの分だけ
+    for(int use_jit = 0; use_jit < 2; use_jit++){
+        emulator emu(GUEST_ADDRESS_SPACE, 0x7c00, 0xF0000000);
+        emu.set_jit(use_jit, 1);
+        _load_code(emu, code, sizeof(code));
+        emu._set_memory32(0x80000000, 0xabcd);
+        
+        CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x12345678, emu._get_memory32(0xFFFFF000));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0xabcd, emu._get_memory32(0xEFFFFFFC));
+        
+        std::vector<uint32_t> pages;
+        emu.guest->touched_pages(pages);
+        CPPUNIT_ASSERT(pages.size() < 64);
+        //読んだだけのページは入らない
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu._get_memory32(0x50000000));
+        emu.guest->touched_pages(pages);
+        CPPUNIT_ASSERT(!std::binary_search(pages.begin(), pages.end(), 0x50000000 >> GUEST_PAGE_SHIFT));
+        CPPUNIT_ASSERT(std::binary_search(pages.begin(), pages.end(), 0xFFFFF000 >> GUEST_PAGE_SHIFT));
+        
+        //スナップショットも触ったページだけ持つ
+        Snapshot *start = emu.snapshot();
+        CPPUNIT_ASSERT_EQUAL(GUEST_ADDRESS_SPACE, start->memory.size());
+        start->memory.touched_pages(pages);
+        CPPUNIT_ASSERT(pages.size() < 64);
+        CPPUNIT_ASSERT(std::binary_search(pages.begin(), pages.end(), 0xFFFFF000 >> GUEST_PAGE_SHIFT));
+        CPPUNIT_ASSERT(!std::binary_search(pages.begin(), pages.end(), 0x50000000 >> GUEST_PAGE_SHIFT));
+        //dirty_mapを消した後も、前に書き込んだページは覚えている
+        emu.guest->touched_pages(pages);
+        CPPUNIT_ASSERT(std::binary_search(pages.begin(), pages.end(), 0xFFFFF000 >> GUEST_PAGE_SHIFT));
+        
+        emu._set_memory32(0xFFFFF000, 0);
+        emu._set_memory32(0x40000000, 1);
+        CPPUNIT_ASSERT(emu.restore(start));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x12345678, emu._get_memory32(0xFFFFF000));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu._get_memory32(0x40000000));
+        
+        //id 0の状態からは、どちらかで触ったページを全部戻す
+        Snapshot copy = *start;
+        copy.id = 0;
+        emu._set_memory32(0x40000000, 1);
+        emu._set_memory32(0xEFFFFFFC, 0);
+        CPPUNIT_ASSERT(emu.restore(&copy));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu._get_memory32(0x40000000));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0xabcd, emu._get_memory32(0xEFFFFFFC));
+        delete start;
+    }
+    
+    //アドレス空間の最後のバイトで終わる命令も、書き換えればデコードし直す
+    emulator emu(GUEST_ADDRESS_SPACE, 0xFFFFFFFE, 0xF0000000);
+    //mov al, 0x11
+    emu._set_memory8(0xFFFFFFFE, 0xB0);
+    emu._set_memory8(0xFFFFFFFF, 0x11);
+    emu.exec();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x11, emu.registers[EAX]);
+    CPPUNIT_ASSERT(emu._has_code(0xFFFFFFFF, 1));
+    
+    uint8_t imm = 0x22;
+    CPPUNIT_ASSERT(emu.write_memory(0xFFFFFFFF, &imm, 1));
+    emu.eip = 0xFFFFFFFE;
+    emu.exec();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x22, emu.registers[EAX]);
+}
+
+void FIXTURE_NAME::test_string(){
+    const uint8_t code[] = {
+        0xBE, 0x00, 0x90, 0x00, 0x00,   //mov esi, 0x9000
+        0xBF, 0x00, 0xA0, 0x00, 0x00,   //mov edi, 0xa000
+        0xB9, 0x0D, 0x00, 0x00, 0x00,   //mov ecx, 13
+        0xF3, 0xA4,                     //rep movsb
+        0xBF, 0x00, 0xB0, 0x00, 0x00,   //mov edi, 0xb000
+        0xB8, 0x78, 0x56, 0x34, 0x12,   //mov eax, 0x12345678
+        0xB9, 0x04, 0x00, 0x00, 0x00,   //mov ecx, 4
+        0xF3, 0xAB,                     //rep stosd
+        0xB9, 0x02, 0x00, 0x00, 0x00,   //mov ecx, 2
+        0x66, 0xF3, 0xAB,               //rep stosw
+        0xBE, 0x00, 0x90, 0x00, 0x00,   //mov esi, 0x9000
+        0xBF, 0x00, 0xA0, 0x00, 0x00,   //mov edi, 0xa000
+        0xB9, 0x0D, 0x00, 0x00, 0x00,   //mov ecx, 13
+        0xF3, 0xA6,                     //repe cmpsb
+        0xBF, 0x00, 0x90, 0x00, 0x00,   //mov edi, 0x9000
+        0x31, 0xC0,                     //xor eax, eax
+        0xB9, 0xFF, 0xFF, 0xFF, 0xFF,   //mov ecx, -1
+        0xF2, 0xAE,                     //repne scasb
+        0xFD,                           //std
+        0xBE, 0x0C, 0x90, 0x00, 0x00,   //mov esi, 0x900c
+        0xBF, 0x0C, 0xC0, 0x00, 0x00,   //mov edi, 0xc00c
+        0xB9, 0x04, 0x00, 0x00, 0x00,   //mov ecx, 4
+        0xF3, 0xA5,                     //rep movsd
+        0xFC,                           //cld
+        0xBE, 0x00, 0x90, 0x00, 0x00,   //mov esi, 0x9000
+        0xBF, 0x01, 0x90, 0x00, 0x00,   //mov edi, 0x9001
+        0xB9, 0x08, 0x00, 0x00, 0x00,   //mov ecx, 8
+        0xF3, 0xA4,                     //rep movsb (重なっているので1バイトずつ)
+        0xBE, 0x00, 0xB0, 0x00, 0x00,   //mov esi, 0xb000
+        0xAD,                           //lodsd
+        0xF3, 0xC3,                     //rep ret (repは無視する)
+    };
+    const char text[] = "hello, world";
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(emu, 0x7c00, code, sizeof(code));
+    for(uint32_t i = 0; i < sizeof(text); i++) emu._set_memory8(0x9000 + i, text[i]);
+    
+    for(int i = 0; i < 4; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(memcmp(emu.memory + 0xA000, text, sizeof(text)) == 0);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x900D, emu.registers[ESI]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xA00D, emu.registers[EDI]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu.registers[ECX]);
+    
+    for(int i = 0; i < 6; i++) CPPUNIT_ASSERT(emu.exec());
+    for(int i = 0; i < 4; i++) CPPUNIT_ASSERT_EQUAL((uint32_t)0x12345678, emu._get_memory32(0xB000 + i * 4));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x56785678, emu._get_memory32(0xB010));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xB014, emu.registers[EDI]);
+    
+    //違うバイトの次で止まる
+    emu._set_memory8(0xA005, 'X');
+    for(int i = 0; i < 4; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)7, emu.registers[ECX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x9006, emu.registers[ESI]);
+    CPPUNIT_ASSERT(!emu._is_zero());
+    CPPUNIT_ASSERT(emu._is_carry());
+    
+    //strlen: not ecxが長さ+1
+    for(int i = 0; i < 4; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)sizeof(text), ~emu.registers[ECX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x900D, emu.registers[EDI]);
+    CPPUNIT_ASSERT(emu._is_zero());
+    
+    //DF=1なら後ろから
+    for(int i = 0; i < 5; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(memcmp(emu.memory + 0xC000, text, 12) == 0);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x8FFC, emu.registers[ESI]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xBFFC, emu.registers[EDI]);
+    
+    for(int i = 0; i < 5; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT(memcmp(emu.memory + 0x9000, "hhhhhhhhhr", 10) == 0);
+    
+    for(int i = 0; i < 2; i++) CPPUNIT_ASSERT(emu.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x12345678, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xB004, emu.registers[ESI]);
+    Instruction inst;
+    CPPUNIT_ASSERT(emu._decode(emu.eip, inst));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0xC3, inst.opecode);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0, inst.prefix);
+    
+    //ECXがメモリの外まで届くrep movsは、1要素ずつ実行して外に出たところでフォールトする
+    emulator fault(0x10000, 0x7c00, 0x7c00);
+    const uint8_t copy[] = {0xF3, 0xA4};
+    _write_code(fault, 0x7c00, copy, sizeof(copy));
+    fault.registers[ESI] = 0x8000;
+    fault.registers[EDI] = 0xF000;
+    fault.registers[ECX] = 0x2000;
+    CPPUNIT_ASSERT(!fault.exec());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x10000, fault.get_fault_address());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x1000, fault.registers[ECX]);
+}
+
+void FIXTURE_NAME::test_idle(){
+    //起こすデバイスが無ければjmp $もhltもすぐに止まる(シリアルポートは既定では入力を読まない)
+    const uint8_t spin[] = {0xEB, 0xFE};   //jmp $
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(emu, 0x7c00, spin, sizeof(spin));
+    CPPUNIT_ASSERT_EQUAL(STOP_IDLE, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c00, emu.get_eip());
+    CPPUNIT_ASSERT(emu.get_instruction_count() < 100);
+    
+    const uint8_t halt[] = {0x90, 0xF4};   //nop; hlt
+    emulator halted(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(halted, 0x7c00, halt, sizeof(halt));
+    CPPUNIT_ASSERT_EQUAL(STOP_IDLE, halted.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c01, halted.get_eip());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, halted.get_instruction_count());
+    CPPUNIT_ASSERT_EQUAL(STOP_IDLE, halted.run());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, halted.get_instruction_count());
+    
+    //入力が来るまでポーリングするループは、入力が届くまで待ってから進む
+    const uint8_t poll_loop[] = {
+        0xE4, 0x10,         //in al, 0x10
+        0x84, 0xC0,         //test al, al
+        0x74, 0xFA,         //jz 0x7c00
+        0x3C, 0x71,         //cmp al, 'q'
+        0x75, 0xF6          //jne 0x7c00
+    };
+    emulator polling(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(polling, poll_loop, sizeof(poll_loop));
+    
+    pipe_device device;
+    CPPUNIT_ASSERT(polling.get_io_bus()->attach(&device, 0x10, 1));
+    std::thread writer([&device](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        //同じ文字を読み続けるループも、読むたびにデバイスが変わるので待たない
+        std::string input(100, 'x');
+        input += 'q';
+        if(write(device.fds[1], input.data(), input.size()) < 0) return;
+    });
+    StopReason reason = polling.run(1000 * 1000 * 1000);
+    writer.join();
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, reason);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)'q', polling.registers[EAX] & 0xFF);
+    CPPUNIT_ASSERT(polling.idle_waits >= 1);
+    CPPUNIT_ASSERT(polling.get_instruction_count() < 10000);
+    
+    //読まれていない入力があればhltはすぐに起きる
+    const uint8_t wait_input[] = {
+        0xF4,               //hlt
+        0xE4, 0x10          //in al, 0x10
+    };
+    emulator waiting(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(waiting, wait_input, sizeof(wait_input));
+    pipe_device ready;
+    CPPUNIT_ASSERT(waiting.get_io_bus()->attach(&ready, 0x10, 1));
+    CPPUNIT_ASSERT_EQUAL((ssize_t)1, write(ready.fds[1], "a", 1));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, waiting.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)'a', waiting.registers[EAX] & 0xFF);
+}
+
+void FIXTURE_NAME::test_uart(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    uart *serial = emu.get_uart();
+    
+    //空ならLSRは送信側の空きだけ、データは0(待たない)
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x60, serial->in8(UART_PORT + UART_LSR));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0, serial->in8(UART_PORT + UART_DATA));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)UART_IIR_NONE, serial->in8(UART_PORT + UART_IIR));
+    
+    serial->push_input("ab", 2);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x61, serial->in8(UART_PORT + UART_LSR));
+    CPPUNIT_ASSERT(!serial->get_interrupt());
+    serial->out8(UART_PORT + UART_IER, UART_IER_RECEIVE);
+    CPPUNIT_ASSERT(serial->get_interrupt());
+    CPPUNIT_ASSERT_EQUAL((uint8_t)UART_IIR_RECEIVE, serial->in8(UART_PORT + UART_IIR));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)'a', serial->in8(UART_PORT + UART_DATA));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)'b', serial->in8(UART_PORT + UART_DATA));
+    CPPUNIT_ASSERT(!serial->get_interrupt());
+    
+    //送信の割り込みはIIRを読むと下りる
+    serial->out8(UART_PORT + UART_IER, UART_IER_RECEIVE | UART_IER_TRANSMIT);
+    CPPUNIT_ASSERT(serial->get_interrupt());
+    CPPUNIT_ASSERT_EQUAL((uint8_t)UART_IIR_TRANSMIT, serial->in8(UART_PORT + UART_IIR));
+    CPPUNIT_ASSERT(!serial->get_interrupt());
+    serial->out8(UART_PORT + UART_IER, 0);
+    
+    //DLABの間は分周値が読み書きされる
+    serial->out8(UART_PORT + UART_LCR, UART_LCR_DLAB | 0x03);
+    serial->out8(UART_PORT + UART_DATA, 0x0C);
+    serial->out8(UART_PORT + UART_IER, 0x00);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x0C, serial->in8(UART_PORT + UART_DATA));
+    serial->out8(UART_PORT + UART_LCR, 0x03);
+    
+    //LSRをポーリングして'q'までエコーする
+    const uint8_t program[] = {
+        0xBA, 0xFD, 0x03, 0x00, 0x00,   //mov edx, 0x3fd
+        0xEC,                           //in al, dx
+        0xA8, 0x01,                     //test al, 1
+        0x74, 0xFB,                     //jz 0x7c05
+        0xB2, 0xF8,                     //mov dl, 0xf8
+        0xEC,                           //in al, dx
+        0xEE,                           //out dx, al
+        0x3C, 0x71,                     //cmp al, 'q'
+        0x75, 0xEE                      //jne 0x7c00
+    };
+    _load_code(emu, program, sizeof(program));
+    emu.get_console()->set_sink(CONSOLE_MEMORY);
+    
+    //入力が尽きたら、起こすものが無いので止まる。入力を足せば続きから進む
+    serial->push_input("hi", 2);
+    CPPUNIT_ASSERT_EQUAL(STOP_IDLE, emu.run(1000 * 1000));
+    CPPUNIT_ASSERT_EQUAL((size_t)2, emu.get_console()->get_output_size());
+    serial->push_input("q", 1);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run(1000 * 1000));
+    CPPUNIT_ASSERT(memcmp("hiq", emu.get_console()->get_output(), 3) == 0);
+    
+    //fdからは読めるだけ読み、EOFの後は起こさない
+    int fds[2];
+    CPPUNIT_ASSERT_EQUAL(0, pipe(fds));
+    uart piped(emu.get_console());
+    piped.set_input_fd(fds[0]);
+    CPPUNIT_ASSERT_EQUAL(fds[0], piped.get_event_fd());
+    CPPUNIT_ASSERT_EQUAL((ssize_t)2, write(fds[1], "xy", 2));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)'x', piped.in8(UART_PORT + UART_DATA));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)'y', piped.in8(UART_PORT + UART_DATA));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0, piped.in8(UART_PORT + UART_DATA));
+    close(fds[1]);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x60, piped.in8(UART_PORT + UART_LSR));
+    CPPUNIT_ASSERT_EQUAL(-1, piped.get_event_fd());
+    close(fds[0]);
+}
+
+void FIXTURE_NAME::test_interrupts(){
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    pic *controller = emu.get_pic();
+    
+    //IRQ0をベクタ0x20に、IRQ0以外をマスク
+    controller->out8(PIC_MASTER_PORT, 0x11);
+    controller->out8(PIC_MASTER_PORT + 1, 0x20);
+    controller->out8(PIC_MASTER_PORT + 1, 0x04);
+    controller->out8(PIC_MASTER_PORT + 1, 0x01);
+    controller->out8(PIC_MASTER_PORT + 1, 0xFE);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0xFE, controller->in8(PIC_MASTER_PORT + 1));
+    controller->raise(3);
+    CPPUNIT_ASSERT(!controller->has_interrupt());
+    controller->raise(0);
+    CPPUNIT_ASSERT(controller->has_interrupt());
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x20, controller->acknowledge());
+    //EOIまでは同じ優先度を出さない
+    controller->raise(0);
+    CPPUNIT_ASSERT(!controller->has_interrupt());
+    controller->out8(PIC_MASTER_PORT, PIC_READ_ISR);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x01, controller->in8(PIC_MASTER_PORT));
+    controller->out8(PIC_MASTER_PORT, PIC_EOI);
+    CPPUNIT_ASSERT(controller->has_interrupt());
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x20, controller->acknowledge());
+    controller->out8(PIC_MASTER_PORT, PIC_EOI);
+    
+    //スレーブはマスタのIRQ2を通る(ベクタは0x70のまま)
+    controller->out8(PIC_MASTER_PORT + 1, 0xFB);
+    controller->raise(12);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x74, controller->acknowledge());
+    controller->out8(PIC_SLAVE_PORT, PIC_EOI);
+    controller->out8(PIC_MASTER_PORT, PIC_EOI);
+    CPPUNIT_ASSERT(!controller->has_interrupt());
+    controller->out8(PIC_MASTER_PORT + 1, 0xFE);
+    
+    //PITは仮想時間で数えるので、命令を実行しなければ減らない
+    pit *timer = emu.timer;
+    timer->out8(PIT_PORT + PIT_COMMAND, 0x34);
+    timer->out8(PIT_PORT, 0xA9);
+    timer->out8(PIT_PORT, 0x04);
+    timer->out8(PIT_PORT + PIT_COMMAND, 0x00);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0xA9, timer->in8(PIT_PORT));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)0x04, timer->in8(PIT_PORT));
+    CPPUNIT_ASSERT(!timer->update());
+    //1193 tick = 約1ms
+    CPPUNIT_ASSERT(timer->get_deadline() > 999 * 1000 && timer->get_deadline() <= 1000 * 1000);
+    timer->out8(PIT_PORT + PIT_COMMAND, 0x30);
+    
+    //IDT: 0x20はタイマー、0x80はソフトウェア割り込み
+    const uint32_t idt = 0x1000;
+    const uint32_t counter = 0x3000;
+    emu._set_memory16(0x2000, 256 * 8 - 1);
+    emu._set_memory32(0x2002, idt);
+    emu._set_memory32(idt + 0x20 * 8, (INTERRUPT_CODE_SEGMENT << 16) | 0x7e00);
+    emu._set_memory32(idt + 0x20 * 8 + 4, GATE_PRESENT | (GATE_INTERRUPT32 << 8));
+    emu._set_memory32(idt + 0x80 * 8, (INTERRUPT_CODE_SEGMENT << 16) | 0x7e20);
+    emu._set_memory32(idt + 0x80 * 8 + 4, GATE_PRESENT | (GATE_TRAP32 << 8));
+    
+    const uint8_t handler[] = {
+        0xFF, 0x05, 0x00, 0x30, 0x00, 0x00, //inc dword [0x3000]
+        0x50,                               //push eax
+        0xB0, 0x20,                         //mov al, 0x20
+        0xE6, 0x20,                         //out 0x20, al
+        0x58,                               //pop eax
+        0xCF                                //iret
+    };
+    const uint8_t syscall[] = {
+        0xBB, 0x34, 0x12, 0x00, 0x00,       //mov ebx, 0x1234
+        0xCF                                //iret
+    };
+    //タイマーを1msにして、5回数えるまで待ち、hltでもう1回待つ
+    const uint8_t program[] = {
+        0x0F, 0x01, 0x1D, 0x00, 0x20, 0x00, 0x00,   //lidt [0x2000]
+        0xCD, 0x80,                                 //int 0x80
+        0xB0, 0x34,                                 //mov al, 0x34
+        0xE6, 0x43,                                 //out 0x43, al
+        0xB0, 0xA9,                                 //mov al, 0xa9
+        0xE6, 0x40,                                 //out 0x40, al
+        0xB0, 0x04,                                 //mov al, 0x04
+        0xE6, 0x40,                                 //out 0x40, al
+        0xFB,                                       //sti
+        0x83, 0x3D, 0x00, 0x30, 0x00, 0x00, 0x05,   //cmp dword [0x3000], 5
+        0x72, 0xF7,                                 //jb 0x7c16
+        0xF4,                                       //hlt
+        0xFA,                                       //cli
+        0xA1, 0x00, 0x30, 0x00, 0x00                //mov eax, [0x3000]
+    };
+    _write_code(emu, 0x7e00, handler, sizeof(handler));
+    _write_code(emu, 0x7e20, syscall, sizeof(syscall));
+    _load_code(emu, program, sizeof(program));
+    
+    //タイマーが動いている途中でスナップショットを取る
+    CPPUNIT_ASSERT_EQUAL(STOP_BUDGET, emu.run(60));
+    uint32_t taken = emu._get_memory32(counter);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)2, taken);
+    uart *serial = emu.get_uart();
+    serial->out8(UART_PORT + UART_SCR, 0x5A);
+    serial->push_input("xy", 2);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)UART_LSR_DATA_READY, (uint8_t)(serial->in8(UART_PORT + UART_LSR) & UART_LSR_DATA_READY));
+    Snapshot *armed = emu.snapshot();
+    
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run(100 * 1000 * 1000));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x1234, emu.registers[EBX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)6, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)6, emu._get_memory32(counter));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)7, emu.interrupt_count);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c00, emu.registers[ESP]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu.eflags & INTERRUPT_FLAG);
+    //待った分も含めて、仮想時間は割り込みごとに約1ms進んでいる
+    CPPUNIT_ASSERT(emu.clock->now() >= 5990 * 1000 && emu.clock->now() < 7 * 1000 * 1000);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)'x', serial->in8(UART_PORT + UART_DATA));
+    
+    //IDT, PIC, PIT, UARTも戻るので、同じ命令で同じ割り込みが入る
+    uint64_t instructions = emu.get_instruction_count();
+    uint64_t now = emu.clock->now();
+    for(int i = 0; i < 2; i++){
+        emu.idt_limit = 0;
+        controller->out8(PIC_MASTER_PORT + 1, 0xFF);
+        timer->out8(PIT_PORT + PIT_COMMAND, 0x30);
+        serial->out8(UART_PORT + UART_SCR, 0);
+        
+        CPPUNIT_ASSERT(emu.restore(armed));
+        CPPUNIT_ASSERT_EQUAL(taken, emu._get_memory32(counter));
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0xFE, controller->in8(PIC_MASTER_PORT + 1));
+        CPPUNIT_ASSERT_EQUAL((uint8_t)0x5A, serial->in8(UART_PORT + UART_SCR));
+        CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run(100 * 1000 * 1000));
+        CPPUNIT_ASSERT_EQUAL((uint32_t)6, emu.registers[EAX]);
+        CPPUNIT_ASSERT_EQUAL((uint64_t)7, emu.interrupt_count);
+        CPPUNIT_ASSERT_EQUAL(instructions, emu.get_instruction_count());
+        CPPUNIT_ASSERT_EQUAL(now, emu.clock->now());
+        CPPUNIT_ASSERT_EQUAL((uint8_t)'x', serial->in8(UART_PORT + UART_DATA));
+    }
+    delete armed;
+    
+    //ゲートが無ければ止める
+    emulator bare(1024 * 1024, 0x7c00, 0x7c00);
+    const uint8_t unhandled[] = {
+        0xB0, 0x30,                                 //mov al, 0x30
+        0xE6, 0x43,                                 //out 0x43, al
+        0xB0, 0x10,                                 //mov al, 0x10
+        0xE6, 0x40,                                 //out 0x40, al
+        0xE6, 0x40,                                 //out 0x40, al
+        0xFB,                                       //sti
+        0xEB, 0xFE                                  //jmp $
+    };
+    _write_code(bare, 0x7c00, unhandled, sizeof(unhandled));
+    CPPUNIT_ASSERT_EQUAL(STOP_SHUTDOWN, bare.run(100 * 1000 * 1000));
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c0b, bare.eip);
+}
+
+void FIXTURE_NAME::test_cycles(){
+    //rdtscの差でmov, nop, nop, rdtscの分を測る。rep stosbは繰り返した回数分
+    const uint8_t program[] = {
+        0x0F, 0x31,                     //rdtsc
+        0x89, 0xC3,                     //mov ebx, eax
+        0x90,                           //nop
+        0x90,                           //nop
+        0x0F, 0x31,                     //rdtsc
+        0x29, 0xD8,                     //sub eax, ebx
+        0xB9, 0x64, 0x00, 0x00, 0x00,   //mov ecx, 100
+        0xBF, 0x00, 0x10, 0x00, 0x00,   //mov edi, 0x1000
+        0xF3, 0xAA                      //rep stosb
+    };
+    
+    //既定は全部1サイクルで、命令数と同じ
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(emu, program, sizeof(program));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)4, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)10, emu.get_instruction_count());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)10 + 99, emu.get_cycle_count());
+    
+    const char *filename = "bin/data/tmp/cycles.txt";
+    FILE *file = fopen(filename, "w");
+    CPPUNIT_ASSERT(file != NULL);
+    fputs("# opcode cycles\n89 2\n90 3\naa 5\n0f 31 20  # rdtsc\n", file);
+    fclose(file);
+    CycleTable table;
+    CPPUNIT_ASSERT(load_cycle_table(filename, table));
+    CPPUNIT_ASSERT_EQUAL((uint8_t)20, table.two_byte[0x31]);
+    CPPUNIT_ASSERT_EQUAL((uint8_t)1, table.one_byte[0x29]);
+    
+    //表を変えても、run()でもexec()でも同じサイクル数になる
+    uint64_t expected = 20 + (2 + 3 + 3 + 20) + 1 + 1 + 1 + 100 * 5 + 1;
+    for(int i = 0; i < 2; i++){
+        emulator timed(1024 * 1024, 0x7c00, 0x7c00);
+        timed.set_cycle_table(&table);
+        _load_code(timed, program, sizeof(program));
+        if(i == 0) CPPUNIT_ASSERT_EQUAL(STOP_HALT, timed.run());
+        else while(timed.exec());
+        CPPUNIT_ASSERT_EQUAL((uint32_t)28, timed.registers[EAX]);
+        CPPUNIT_ASSERT_EQUAL(expected, timed.get_cycle_count());
+        CPPUNIT_ASSERT_EQUAL(expected * NS_PER_CYCLE, timed.clock->now());
+    }
+    
+    //ブロックの途中で止まっても、止まった命令の手前までは数える
+    //hltとdivはもう一度実行するので数えず、eipはその命令を指す
+    const uint8_t halt[] = {
+        0x89, 0xC3,                     //mov ebx, eax
+        0x90,                           //nop
+        0x90,                           //nop
+        0xF4                            //hlt
+    };
+    emulator halted(1024 * 1024, 0x7c00, 0x7c00);
+    halted.set_cycle_table(&table);
+    _write_code(halted, 0x7c00, halt, sizeof(halt));
+    for(int i = 0; i < 2; i++){
+        CPPUNIT_ASSERT_EQUAL(STOP_IDLE, halted.run());
+        CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c04, halted.get_eip());
+        CPPUNIT_ASSERT_EQUAL((uint64_t)3, halted.get_instruction_count());
+        CPPUNIT_ASSERT_EQUAL((uint64_t)(2 + 3 + 3), halted.get_cycle_count());
+        CPPUNIT_ASSERT_EQUAL((uint64_t)(2 + 3 + 3) * NS_PER_CYCLE, halted.clock->now());
+    }
+    
+    const uint8_t divide[] = {
+        0x89, 0xC3,                     //mov ebx, eax
+        0x90,                           //nop
+        0x31, 0xC9,                     //xor ecx, ecx
+        0xF7, 0xF1                      //div ecx
+    };
+    emulator divided(1024 * 1024, 0x7c00, 0x7c00);
+    divided.set_cycle_table(&table);
+    _write_code(divided, 0x7c00, divide, sizeof(divide));
+    CPPUNIT_ASSERT_EQUAL(STOP_DIVIDE_ERROR, divided.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c05, divided.get_eip());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)3, divided.get_instruction_count());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)(2 + 3 + 1), divided.get_cycle_count());
+    
+    file = fopen(filename, "w");
+    CPPUNIT_ASSERT(file != NULL);
+    fputs("90 0\n", file);
+    fclose(file);
+    CPPUNIT_ASSERT(!load_cycle_table(filename, table));
+}
+
+void FIXTURE_NAME::test_gdb_stub(){
+    const uint8_t program[] = {
+        0xB8, 0x01, 0x00, 0x00, 0x00,   //mov eax, 1
+        0x83, 0xC0, 0x02,               //add eax, 2
+        0xA3, 0x00, 0x10, 0x00, 0x00,   //mov [0x1000], eax
+        0x40                            //inc eax
+    };
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(emu, program, sizeof(program));
+    
+    int fds[2];
+    CPPUNIT_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    gdb_stub stub(&emu);
+    std::thread server([&stub, &fds](){
+        stub.serve(fds[1]);
+    });
+    
+    //最初のパケットはACKを返す
+    gdb_send(fds[0], "qSupported:multiprocess+");
+    char ack;
+    CPPUNIT_ASSERT_EQUAL((ssize_t)1, read(fds[0], &ack, 1));
+    CPPUNIT_ASSERT_EQUAL('+', ack);
+    CPPUNIT_ASSERT_EQUAL(std::string("PacketSize=4000;QStartNoAckMode+"), gdb_receive(fds[0]));
+    CPPUNIT_ASSERT_EQUAL((ssize_t)1, write(fds[0], "+", 1));
+    gdb_send(fds[0], "QStartNoAckMode");
+    CPPUNIT_ASSERT_EQUAL((ssize_t)1, read(fds[0], &ack, 1));
+    CPPUNIT_ASSERT_EQUAL(std::string("OK"), gdb_receive(fds[0]));
+    CPPUNIT_ASSERT_EQUAL((ssize_t)1, write(fds[0], "+", 1));
+    
+    CPPUNIT_ASSERT_EQUAL(std::string("S05"), gdb_request(fds[0], "?"));
+    std::string registers = gdb_request(fds[0], "g");
+    CPPUNIT_ASSERT_EQUAL((size_t)GDB_REGISTER_COUNT * 8, registers.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("007c0000"), registers.substr(ESP * 8, 8));
+    CPPUNIT_ASSERT_EQUAL(std::string("007c0000"), registers.substr(GDB_EIP * 8, 8));
+    CPPUNIT_ASSERT_EQUAL(std::string("08000000"), registers.substr(GDB_CS * 8, 8));
+    CPPUNIT_ASSERT_EQUAL(std::string("b801000000"), gdb_request(fds[0], "m7c00,5"));
+    CPPUNIT_ASSERT_EQUAL(std::string("E14"), gdb_request(fds[0], "mfffffff0,4"));
+    CPPUNIT_ASSERT_EQUAL(std::string(""), gdb_request(fds[0], "vMustReplyEmpty"));
+    
+    //ブレークポイントで止まり、そこから続けると飛ばして進む
+    CPPUNIT_ASSERT_EQUAL(std::string("OK"), gdb_request(fds[0], "Z0,7c0d,1"));
+    CPPUNIT_ASSERT_EQUAL(std::string("S05"), gdb_request(fds[0], "c"));
+    CPPUNIT_ASSERT_EQUAL(std::string("0d7c0000"), gdb_request(fds[0], "p8"));
+    CPPUNIT_ASSERT_EQUAL(std::string("03000000"), gdb_request(fds[0], "p0"));
+    CPPUNIT_ASSERT_EQUAL(std::string("03000000"), gdb_request(fds[0], "m1000,4"));
+    CPPUNIT_ASSERT_EQUAL(std::string("OK"), gdb_request(fds[0], "M1000,4:78563412"));
+    CPPUNIT_ASSERT_EQUAL(std::string("78563412"), gdb_request(fds[0], "m1000,4"));
+    CPPUNIT_ASSERT_EQUAL(std::string("OK"), gdb_request(fds[0], "P0=ffffffff"));
+    CPPUNIT_ASSERT_EQUAL(std::string("S05"), gdb_request(fds[0], "s"));
+    CPPUNIT_ASSERT_EQUAL(std::string("0e7c0000"), gdb_request(fds[0], "p8"));
+    CPPUNIT_ASSERT_EQUAL(std::string("00000000"), gdb_request(fds[0], "p0"));
+    CPPUNIT_ASSERT_EQUAL(std::string("W00"), gdb_request(fds[0], "c"));
+    
+    //Ctrl-Cで止める
+    const uint8_t busy[] = {0x40, 0xEB, 0xFD};   //inc eax; jmp 0x7d00
+    CPPUNIT_ASSERT_EQUAL(std::string("OK"), gdb_request(fds[0], "M7d00,3:40ebfd"));
+    gdb_send(fds[0], "c7d00");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CPPUNIT_ASSERT_EQUAL((ssize_t)1, write(fds[0], "\x03", 1));
+    CPPUNIT_ASSERT_EQUAL(std::string("S02"), gdb_receive(fds[0]));
+    registers = gdb_request(fds[0], "g");
+    CPPUNIT_ASSERT_EQUAL(std::string("007d"), registers.substr(GDB_EIP * 8, 4));
+    
+    CPPUNIT_ASSERT_EQUAL(std::string("OK"), gdb_request(fds[0], "D"));
+    server.join();
+    close(fds[0]);
+    close(fds[1]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x12345678, emu._get_memory32(0x1000));
+    CPPUNIT_ASSERT(emu.breakpoints.empty());
+    //デタッチならゲストは続け、kなら終える
+    CPPUNIT_ASSERT(!stub.is_killed());
+    CPPUNIT_ASSERT_EQUAL(STOP_BUDGET, emu.run(10));
+    CPPUNIT_ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    std::thread killed([&stub, &fds](){
+        stub.serve(fds[1]);
+    });
+    gdb_send(fds[0], "k");
+    killed.join();
+    close(fds[0]);
+    close(fds[1]);
+    CPPUNIT_ASSERT(stub.is_killed());
+    
+    //ブレークポイントはemulatorだけでも使える
+    emulator direct(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(direct, program, sizeof(program));
+    //ブレークポイントで止まった分は命令数に入らない
+    direct.add_breakpoint(0x7c08);
+    CPPUNIT_ASSERT_EQUAL(STOP_BREAKPOINT, direct.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c08, direct.get_eip());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)2, direct.get_instruction_count());
+    direct.remove_breakpoint(0x7c08);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, direct.run());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)5, direct.get_instruction_count());
+    
+    //hltで待っているゲストもrequest_stop()で起きる
+    const uint8_t halt[] = {0xF4, 0xEB, 0xFD};   //hlt; jmp 0x7c00
+    emulator parked(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(parked, 0x7c00, halt, sizeof(halt));
+    pipe_device device;
+    CPPUNIT_ASSERT(parked.get_io_bus()->attach(&device, 0x10, 1));
+    std::thread stopper([&parked](){
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        parked.request_stop();
+    });
+    CPPUNIT_ASSERT_EQUAL(STOP_INTERRUPT, parked.run());
+    stopper.join();
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0x7c00, parked.get_eip());
+    
+    //止める要求は1回だけ効く
+    _write_code(parked, 0x7d00, busy, sizeof(busy));
+    parked.set_eip(0x7d00);
+    CPPUNIT_ASSERT_EQUAL(STOP_BUDGET, parked.run(1000));
+}
+
+void FIXTURE_NAME::test_vcpus(){
+    //アトミックな命令の結果とフラグ
+    const uint8_t atomics[] = {
+        0xC7, 0x05, 0x00, 0x10, 0x00, 0x00, 0x05, 0x00, 0x00, 0x00,    //mov dword [0x1000], 5
+        0xB8, 0x07, 0x00, 0x00, 0x00,                                  //mov eax, 7
+        0xB9, 0x09, 0x00, 0x00, 0x00,                                  //mov ecx, 9
+        0x0F, 0xB1, 0x0D, 0x00, 0x10, 0x00, 0x00,                      //cmpxchg [0x1000], ecx (失敗してeax = 5)
+        0x9C,                                                          //pushfd
+        0x5E,                                                          //pop esi
+        0x0F, 0xB1, 0x0D, 0x00, 0x10, 0x00, 0x00,                      //cmpxchg [0x1000], ecx
+        0x9C,                                                          //pushfd
+        0x5F,                                                          //pop edi
+        0xBA, 0x03, 0x00, 0x00, 0x00,                                  //mov edx, 3
+        0x0F, 0xC1, 0x15, 0x00, 0x10, 0x00, 0x00,                      //xadd [0x1000], edx
+        0xBB, 0x11, 0x00, 0x00, 0x00,                                  //mov ebx, 0x11
+        0x87, 0x1D, 0x00, 0x10, 0x00, 0x00,                            //xchg [0x1000], ebx
+        0xF0, 0x83, 0x2D, 0x00, 0x10, 0x00, 0x00, 0x12,                //lock sub dword [0x1000], 0x12
+        0x91,                                                          //xchg ecx, eax
+        0x0F, 0xAE, 0xF0                                               //mfence
+    };
+    emulator emu(1024 * 1024, 0x7c00, 0x7c00);
+    _load_code(emu, atomics, sizeof(atomics));
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, emu.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0, emu.registers[ESI] & ZERO_FLAG);
+    CPPUNIT_ASSERT_EQUAL(ZERO_FLAG, emu.registers[EDI] & ZERO_FLAG);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)9, emu.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)5, emu.registers[ECX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)9, emu.registers[EDX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)12, emu.registers[EBX]);
+    CPPUNIT_ASSERT_EQUAL((uint32_t)0xFFFFFFFF, emu._get_memory32(0x1000));
+    CPPUNIT_ASSERT(emu._is_carry());
+    
+    //LOCKはメモリへの演算にしか付けられない
+    const uint8_t lock_register[] = {0xF0, 0x01, 0xC0};    //lock add eax, eax
+    emulator invalid(1024 * 1024, 0x7c00, 0x7c00);
+    _write_code(invalid, 0x7c00, lock_register, sizeof(lock_register));
+    CPPUNIT_ASSERT_EQUAL(STOP_UNIMPLEMENTED, invalid.run());
+    
+    //4つのvCPUがcpuidで自分の番号を書き、1つ目が旗を立てるまで待ってから、共有のカウンタを1万回ずつ増やす
+    //[0x1000]はlock inc、[0x1004]はlock xadd、[0x100c]はlock cmpxchgのスピンロックの中で普通に増やす
+    const uint8_t counters[] = {
+        0xB8, 0x01, 0x00, 0x00, 0x00,                                  //mov eax, 1
+        0x0F, 0xA2,                                                    //cpuid
+        0xC1, 0xEB, 0x18,                                              //shr ebx, 24
+        0x89, 0x1C, 0x9D, 0x00, 0x20, 0x00, 0x00,                      //mov [0x2000 + ebx * 4], ebx
+        0x85, 0xDB,                                                    //test ebx, ebx
+        0x75, 0x0A,                                                    //jnz wait
+        0xC7, 0x05, 0x00, 0x11, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00,    //mov dword [0x1100], 1
+        //wait:
+        0x83, 0x3D, 0x00, 0x11, 0x00, 0x00, 0x00,                      //cmp dword [0x1100], 0
+        0x74, 0xF7,                                                    //je wait
+        0xB9, 0x10, 0x27, 0x00, 0x00,                                  //mov ecx, 10000
+        //loop:
+        0xF0, 0xFF, 0x05, 0x00, 0x10, 0x00, 0x00,                      //lock inc dword [0x1000]
+        0xB8, 0x01, 0x00, 0x00, 0x00,                                  //mov eax, 1
+        0xF0, 0x0F, 0xC1, 0x05, 0x04, 0x10, 0x00, 0x00,                //lock xadd [0x1004], eax
+        //acquire:
+        0x31, 0xC0,                                                    //xor eax, eax
+        0xBA, 0x01, 0x00, 0x00, 0x00,                                  //mov edx, 1
+        0xF0, 0x0F, 0xB1, 0x15, 0x08, 0x10, 0x00, 0x00,                //lock cmpxchg [0x1008], edx
+        0x75, 0xEF,                                                    //jnz acquire
+        0xA1, 0x0C, 0x10, 0x00, 0x00,                                  //mov eax, [0x100c]
+        0x40,                                                          //inc eax
+        0xA3, 0x0C, 0x10, 0x00, 0x00,                                  //mov [0x100c], eax
+        0xC7, 0x05, 0x08, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,    //mov dword [0x1008], 0
+        0x49,                                                          //dec ecx
+        0x75, 0xC3                                                     //jnz loop
+    };
+    const uint32_t cpu_count = 4;
+    for(int use_jit = 0; use_jit < 2; use_jit++){
+        emulator boot(1024 * 1024, 0x7c00, 0x7c00);
+        _load_code(boot, counters, sizeof(counters));
+        
+        std::vector<emulator *> cpus(1, &boot);
+        for(uint32_t i = 1; i < cpu_count; i++) cpus.push_back(new emulator(boot, 0x7c00, 0x7c00 - i * 0x1000));
+        std::vector<StopReason> reasons(cpu_count);
+        std::vector<std::thread> threads;
+        for(uint32_t i = 0; i < cpu_count; i++){
+            cpus[i]->set_jit(use_jit != 0, 2);
+            threads.push_back(std::thread([&cpus, &reasons, i](){
+                reasons[i] = cpus[i]->run(100 * 1000 * 1000);
+            }));
+        }
+        for(uint32_t i = 0; i < cpu_count; i++) threads[i].join();
+        
+        for(uint32_t i = 0; i < cpu_count; i++){
+            CPPUNIT_ASSERT_EQUAL(STOP_HALT, reasons[i]);
+            CPPUNIT_ASSERT_EQUAL(i, cpus[i]->get_cpu_index());
+            CPPUNIT_ASSERT_EQUAL(i, boot._get_memory32(0x2000 + i * 4));
+        }
+        CPPUNIT_ASSERT_EQUAL(cpu_count * 10000, boot._get_memory32(0x1000));
+        CPPUNIT_ASSERT_EQUAL(cpu_count * 10000, boot._get_memory32(0x1004));
+        CPPUNIT_ASSERT_EQUAL(cpu_count * 10000, boot._get_memory32(0x100c));
+        //共有している間はスナップショットを取れない
+        CPPUNIT_ASSERT(boot.snapshot() == NULL);
+        for(uint32_t i = 1; i < cpu_count; i++) delete cpus[i];
+    }
+    
+    //他のvCPUが書き換えた命令は、次に実行するときにデコードし直す
+    const uint8_t original[] = {0xB8, 0x01, 0x00, 0x00, 0x00};                 //mov eax, 1
+    const uint8_t patch[] = {0xC6, 0x05, 0x01, 0x7C, 0x00, 0x00, 0x02};       //mov byte [0x7c01], 2
+    emulator first(1024 * 1024, 0x7c00, 0x7c00);
+    emulator second(first, 0x7d00, 0x7b00);
+    _load_code(first, original, sizeof(original));
+    _load_code(first, patch, sizeof(patch), 0x7d00);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, first.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)1, first.registers[EAX]);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, second.run());
+    first.set_eip(0x7c00);
+    CPPUNIT_ASSERT_EQUAL(STOP_HALT, first.run());
+    CPPUNIT_ASSERT_EQUAL((uint32_t)2, first.registers[EAX]);
+}
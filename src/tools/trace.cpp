@@ -0,0 +1,138 @@
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
+#include "trace.hpp"
+
+//emu-trace : トレースファイルを読む
+//  emu-trace [-a first-last] [-f first_index] [-l last_index] trace   命令を一覧する
+//  emu-trace -r index [-m memory_output] trace                        index番目の命令の直前まで再生する
+
+static const char *register_names[] = {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi"};
+
+static void usage(const char *name){
+    fprintf(stderr, "usage : %s [-a first-last] [-f first_index] [-l last_index] trace\n", name);
+    fprintf(stderr, "        %s -r index [-m memory_output] trace\n", name);
+    exit(-1);
+}
+
+static void print_event(const TraceEvent &event, const uint32_t *previous, uint32_t previous_eflags){
+    printf("%12llu %08x  ", (unsigned long long)event.index, event.eip);
+    for(uint32_t i = 0; i < MAX_INSTRUCTION_LENGTH; i++){
+        if(i < event.length) printf("%02x", event.code[i]);
+        else printf("  ");
+    }
+    
+    //変わったものだけ出す
+    for(int i = 0; i < REGISTERS_COUNT; i++){
+        if(event.registers[i] != previous[i]) printf(" %s=%08x", register_names[i], event.registers[i]);
+    }
+    if(event.eflags != previous_eflags) printf(" eflags=%08x", event.eflags);
+    for(uint32_t i = 0; i < event.writes.size(); i++){
+        const TraceWrite &write = event.writes[i];
+        printf(" [%08x]=%0*x", write.address, write.size * 2, write.value);
+    }
+    printf("\n");
+}
+
+static int list(trace_reader &reader, uint32_t first, uint32_t last, uint64_t first_index, uint64_t last_index){
+    const Snapshot *initial = reader.get_initial();
+    uint32_t previous[REGISTERS_COUNT];
+    uint32_t previous_eflags = initial->eflags;
+    memcpy(previous, initial->registers, sizeof(previous));
+    
+    TraceEvent event;
+    while(reader.next(event)){
+        if(event.index > last_index) break;
+        
+        if(event.index >= first_index && first <= event.eip && event.eip <= last){
+            print_event(event, previous, previous_eflags);
+        }
+        memcpy(previous, event.registers, sizeof(previous));
+        previous_eflags = event.eflags;
+    }
+    return 0;
+}
+
+static int replay(trace_reader &reader, uint64_t index, const char *memory_output){
+    Snapshot state;
+    if(!reader.replay(index, state)){
+        fprintf(stderr, "error : trace ends before instruction %llu.\n", (unsigned long long)index);
+        return -1;
+    }
+    
+    printf("index  %llu\n", (unsigned long long)state.instruction_count);
+    printf("eip    %08x\n", state.eip);
+    for(int i = 0; i < REGISTERS_COUNT; i++){
+        printf("%-6s %08x\n", register_names[i], state.registers[i]);
+    }
+    printf("eflags %08x\n", state.eflags);
+    
+    if(memory_output != NULL){
+        FILE *out = fopen(memory_output, "wb");
+        if(out == NULL){
+            fprintf(stderr, "error : failed to open memory file.\n");
+            return -1;
+        }
+        //触っていないページは書かずに穴にする
+        std::vector<uint32_t> pages;
+        state.memory.touched_pages(pages);
+        for(size_t i = 0; i < pages.size(); i++){
+            uint64_t address = (uint64_t)pages[i] << GUEST_PAGE_SHIFT;
+            uint64_t size = std::min((uint64_t)GUEST_PAGE_SIZE, state.memory.size() - address);
+            fseeko(out, address, SEEK_SET);
+            fwrite(&state.memory[address], 1, size, out);
+        }
+        fflush(out);
+        if(ftruncate(fileno(out), state.memory.size()) != 0){
+            fprintf(stderr, "error : failed to write memory file.\n");
+            fclose(out);
+            return -1;
+        }
+        fclose(out);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    uint32_t first = 0;
+    uint32_t last = UINT32_MAX;
+    uint64_t first_index = 0;
+    uint64_t last_index = UINT64_MAX;
+    bool do_replay = false;
+    uint64_t replay_index = 0;
+    const char *memory_output = NULL;
+    
+    int opt;
+    char *end;
+    while((opt = getopt(argc, argv, "a:f:l:r:m:")) != -1){
+        switch(opt){
+            case 'a':
+                first = strtoul(optarg, &end, 0);
+                last = (*end == '-') ? strtoul(end + 1, NULL, 0) : first;
+                break;
+            case 'f':
+                first_index = strtoull(optarg, NULL, 0);
+                break;
+            case 'l':
+                last_index = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                do_replay = true;
+                replay_index = strtoull(optarg, NULL, 0);
+                break;
+            case 'm':
+                memory_output = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(optind + 1 != argc) usage(argv[0]);
+    
+    trace_reader reader;
+    if(!reader.open(argv[optind])) return -1;
+    
+    if(do_replay) return replay(reader, replay_index, memory_output);
+    return list(reader, first, last, first_index, last_index);
+}
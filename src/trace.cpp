@@ -0,0 +1,375 @@
+#include <cstring>
+#include <chrono>
+#include "trace.hpp"
+
+//書き出し側で溜める量。これを超えたらgzwriteする
+static const size_t TRACE_FLUSH_SIZE = 64 * 1024;
+//初期状態のメモリはゼロでないページだけ書く。ページ番号がこの値なら終わり
+//touched_pages()と同じ大きさ
+static const uint32_t TRACE_PAGE_SHIFT = GUEST_PAGE_SHIFT;
+static const uint32_t TRACE_PAGE_SIZE = (1 << TRACE_PAGE_SHIFT);
+static const uint32_t TRACE_PAGE_END = 0xFFFFFFFF;
+
+static void append(std::vector<uint8_t> &buffer, const void *data, size_t size){
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+//書き込みのバイト数(1, 2, 4)をタグの2bitに詰める
+static uint8_t write_size_code(uint8_t size){
+    return (size == 1) ? 0 : (size == 2) ? 1 : 2;
+}
+
+tracer::tracer(uint32_t ring_size) : head(0), tail(0), running(false), enabled(true){
+    this->ring_size = 1;
+    while(this->ring_size < ring_size) this->ring_size <<= 1;
+    ring = new TraceEntry[this->ring_size];
+    file = NULL;
+}
+
+tracer::~tracer(){
+    close();
+    delete[] ring;
+}
+
+void tracer::add_range(uint32_t first, uint32_t last){
+    ranges.push_back(std::make_pair(first, last));
+}
+
+bool tracer::covers(uint32_t address, uint32_t size){
+    if(!is_enabled()) return false;
+    if(ranges.empty()) return true;
+    
+    uint32_t last = address + size - 1;
+    for(uint32_t i = 0; i < ranges.size(); i++){
+        if(address <= ranges[i].second && ranges[i].first <= last) return true;
+    }
+    return false;
+}
+
+bool tracer::open(const char *filename, const Snapshot *initial){
+    if(file != NULL){
+        fprintf(stderr, "error : trace is already open.\n");
+        return false;
+    }
+    
+    //圧縮率より速さを取る
+    file = gzopen(filename, "wb1");
+    if(file == NULL){
+        fprintf(stderr, "error : failed to open trace file.\n");
+        return false;
+    }
+    
+    uint64_t memory_size = initial->memory.size();
+    std::vector<uint8_t> header;
+    append(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    append(header, &TRACE_VERSION, 4);
+    append(header, &initial->eip, 4);
+    append(header, &initial->eflags, 4);
+    append(header, initial->registers, sizeof(initial->registers));
+    append(header, &initial->instruction_count, 8);
+    append(header, &memory_size, 8);
+    
+    //触っていないページは0なので見ない
+    std::vector<uint32_t> pages;
+    initial->memory.touched_pages(pages);
+    for(size_t p = 0; p < pages.size(); p++){
+        uint64_t address = (uint64_t)pages[p] << TRACE_PAGE_SHIFT;
+        uint32_t size = TRACE_PAGE_SIZE;
+        if(memory_size - address < size) size = memory_size - address;
+        
+        const uint8_t *page = &initial->memory[address];
+        bool zero = true;
+        for(uint32_t i = 0; i < size && zero; i++) zero = page[i] == 0;
+        if(zero) continue;
+        
+        uint32_t index = address >> TRACE_PAGE_SHIFT;
+        append(header, &index, 4);
+        append(header, page, size);
+    }
+    append(header, &TRACE_PAGE_END, 4);
+    
+    if(gzwrite(file, header.data(), header.size()) != (int)header.size()){
+        fprintf(stderr, "error : failed to write trace file.\n");
+        gzclose(file);
+        file = NULL;
+        return false;
+    }
+    
+    last_eip = initial->eip;
+    last_index = initial->instruction_count - 1;
+    last_eflags = initial->eflags;
+    memcpy(last_registers, initial->registers, sizeof(last_registers));
+    
+    head.store(0);
+    tail.store(0);
+    running.store(true);
+    writer = std::thread(&tracer::_write_loop, this);
+    return true;
+}
+
+void tracer::close(){
+    if(file == NULL) return;
+    
+    running.store(false, std::memory_order_release);
+    writer.join();
+    gzclose(file);
+    file = NULL;
+}
+
+bool tracer::is_open(){
+    return file != NULL;
+}
+
+//書き出しが追いつかないときは待つ(記録は捨てない)
+TraceEntry *tracer::_reserve(){
+    uint64_t index = head.load(std::memory_order_relaxed);
+    while(index - tail.load(std::memory_order_acquire) >= ring_size){
+        std::this_thread::yield();
+    }
+    return &ring[index & (ring_size - 1)];
+}
+
+void tracer::_commit(){
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void tracer::begin(uint64_t index, uint32_t eip, const uint8_t *code, uint8_t length){
+    pending.type = TRACE_TAG_INSTRUCTION;
+    pending.index = index;
+    pending.address = eip;
+    pending.size = length;
+    memcpy(pending.code, code, length);
+}
+
+void tracer::write(uint32_t address, uint32_t value, uint8_t size){
+    TraceEntry *entry = _reserve();
+    entry->type = TRACE_TAG_WRITE;
+    entry->address = address;
+    entry->value = value;
+    entry->size = size;
+    _commit();
+}
+
+void tracer::end(const uint32_t *registers, uint32_t eflags){
+    TraceEntry *entry = _reserve();
+    *entry = pending;
+    entry->eflags = eflags;
+    memcpy(entry->registers, registers, sizeof(entry->registers));
+    _commit();
+}
+
+void tracer::_write_loop(){
+    while(true){
+        //止める前に記録されたものは全部書き出す
+        bool stopping = !running.load(std::memory_order_acquire);
+        uint64_t index = tail.load(std::memory_order_relaxed);
+        uint64_t end = head.load(std::memory_order_acquire);
+        
+        for(; index != end; index++){
+            _encode(ring[index & (ring_size - 1)]);
+            if(encoded.size() >= TRACE_FLUSH_SIZE){
+                tail.store(index + 1, std::memory_order_release);
+                _flush_encoded();
+            }
+        }
+        tail.store(index, std::memory_order_release);
+        _flush_encoded();
+        
+        if(stopping) break;
+        if(index == head.load(std::memory_order_acquire)){
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+}
+
+//命令の記録は直前の命令からの差分だけを書く
+void tracer::_encode(const TraceEntry &entry){
+    if(entry.type == TRACE_TAG_WRITE){
+        encoded.push_back(TRACE_TAG_WRITE | (write_size_code(entry.size) << 2));
+        append(encoded, &entry.address, 4);
+        append(encoded, &entry.value, entry.size);
+        return;
+    }
+    
+    uint8_t tag = TRACE_TAG_INSTRUCTION;
+    if(entry.address != last_eip) tag |= TRACE_TAG_EIP;
+    if(entry.index != last_index + 1) tag |= TRACE_TAG_INDEX;
+    if(entry.eflags != last_eflags) tag |= TRACE_TAG_EFLAGS;
+    
+    uint8_t changed = 0;
+    for(int i = 0; i < REGISTERS_COUNT; i++){
+        if(entry.registers[i] != last_registers[i]) changed |= (1 << i);
+    }
+    
+    encoded.push_back(tag);
+    if(tag & TRACE_TAG_EIP) append(encoded, &entry.address, 4);
+    if(tag & TRACE_TAG_INDEX) append(encoded, &entry.index, 8);
+    encoded.push_back(entry.size);
+    append(encoded, entry.code, entry.size);
+    encoded.push_back(changed);
+    for(int i = 0; i < REGISTERS_COUNT; i++){
+        if(changed & (1 << i)) append(encoded, &entry.registers[i], 4);
+    }
+    if(tag & TRACE_TAG_EFLAGS) append(encoded, &entry.eflags, 4);
+    
+    last_eip = entry.address + entry.size;
+    last_index = entry.index;
+    last_eflags = entry.eflags;
+    memcpy(last_registers, entry.registers, sizeof(last_registers));
+}
+
+bool tracer::_flush_encoded(){
+    if(encoded.empty()) return true;
+    
+    bool ok = gzwrite(file, encoded.data(), encoded.size()) == (int)encoded.size();
+    if(!ok) fprintf(stderr, "error : failed to write trace file.\n");
+    encoded.clear();
+    return ok;
+}
+
+trace_reader::trace_reader(){
+    file = NULL;
+}
+
+trace_reader::~trace_reader(){
+    close();
+}
+
+bool trace_reader::_read(void *buffer, uint32_t size){
+    return gzread(file, buffer, size) == (int)size;
+}
+
+bool trace_reader::open(const char *filename){
+    close();
+    
+    file = gzopen(filename, "rb");
+    if(file == NULL){
+        fprintf(stderr, "error : failed to open trace file.\n");
+        return false;
+    }
+    
+    if(!_read_header()){
+        fprintf(stderr, "error : %s is not a trace file.\n", filename);
+        close();
+        return false;
+    }
+    return true;
+}
+
+//ヘッダと初期状態を読み、最初の命令から読める状態にする
+bool trace_reader::_read_header(){
+    char magic[sizeof(TRACE_MAGIC)];
+    uint32_t version;
+    uint64_t memory_size;
+    bool ok = _read(magic, sizeof(magic)) && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0
+        && _read(&version, 4) && version == TRACE_VERSION
+        && _read(&initial.eip, 4) && _read(&initial.eflags, 4)
+        && _read(initial.registers, sizeof(initial.registers))
+        && _read(&initial.instruction_count, 8) && _read(&memory_size, 8);
+    if(!ok) return false;
+    
+    initial.id = 0;
+    //トレースには仮想時間もデバイスの状態も記録しない
+    initial.has_devices = false;
+    initial.cycle_count = 0;
+    initial.skipped_time = 0;
+    initial.interrupt_count = 0;
+    initial.memory.assign(memory_size);
+    
+    uint32_t index;
+    uint8_t page[TRACE_PAGE_SIZE];
+    while(true){
+        if(!_read(&index, 4)) return false;
+        if(index == TRACE_PAGE_END) break;
+        
+        uint64_t address = (uint64_t)index << TRACE_PAGE_SHIFT;
+        if(address >= memory_size) return false;
+        uint32_t size = TRACE_PAGE_SIZE;
+        if(memory_size - address < size) size = memory_size - address;
+        if(!_read(page, size)) return false;
+        initial.memory.write(address, page, size);
+    }
+    
+    next_eip = initial.eip;
+    next_index = initial.instruction_count;
+    eflags = initial.eflags;
+    memcpy(registers, initial.registers, sizeof(registers));
+    return true;
+}
+
+void trace_reader::close(){
+    if(file == NULL) return;
+    gzclose(file);
+    file = NULL;
+}
+
+const Snapshot *trace_reader::get_initial(){
+    return &initial;
+}
+
+bool trace_reader::next(TraceEvent &event){
+    event.writes.clear();
+    
+    uint8_t tag;
+    while(_read(&tag, 1)){
+        if((tag & 3) == TRACE_TAG_WRITE){
+            TraceWrite write;
+            write.size = 1 << ((tag >> 2) & 3);
+            write.value = 0;
+            if(!_read(&write.address, 4) || !_read(&write.value, write.size)) return false;
+            event.writes.push_back(write);
+            continue;
+        }
+        
+        event.eip = next_eip;
+        event.index = next_index;
+        if((tag & TRACE_TAG_EIP) && !_read(&event.eip, 4)) return false;
+        if((tag & TRACE_TAG_INDEX) && !_read(&event.index, 8)) return false;
+        
+        uint8_t changed;
+        if(!_read(&event.length, 1) || event.length > MAX_INSTRUCTION_LENGTH) return false;
+        if(!_read(event.code, event.length) || !_read(&changed, 1)) return false;
+        for(int i = 0; i < REGISTERS_COUNT; i++){
+            if((changed & (1 << i)) && !_read(&registers[i], 4)) return false;
+        }
+        if((tag & TRACE_TAG_EFLAGS) && !_read(&eflags, 4)) return false;
+        
+        event.eflags = eflags;
+        memcpy(event.registers, registers, sizeof(registers));
+        next_eip = event.eip + event.length;
+        next_index = event.index + 1;
+        return true;
+    }
+    return false;
+}
+
+bool trace_reader::replay(uint64_t index, Snapshot &state){
+    if(file == NULL) return false;
+    
+    //最初から読み直す
+    if(gzrewind(file) != 0 || !_read_header()) return false;
+    
+    state = initial;
+    if(index <= initial.instruction_count) return index == initial.instruction_count;
+    
+    TraceEvent event;
+    while(next(event)){
+        if(event.index >= index){
+            state.eip = event.eip;
+            state.instruction_count = event.index;
+            return true;
+        }
+        
+        for(uint32_t i = 0; i < event.writes.size(); i++){
+            const TraceWrite &write = event.writes[i];
+            if((uint64_t)write.address + write.size > state.memory.size()) continue;
+            state.memory.write(write.address, &write.value, write.size);
+        }
+        state.eip = event.eip + event.length;
+        state.eflags = event.eflags;
+        memcpy(state.registers, event.registers, sizeof(state.registers));
+        state.instruction_count = event.index + 1;
+    }
+    return false;
+}
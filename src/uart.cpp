@@ -0,0 +1,202 @@
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include "uart.hpp"
+#include "console.hpp"
+
+uart::uart(console *output){
+    this->output = output;
+    input_fd = -1;
+    input_closed = false;
+    version = 0;
+    
+    ier = 0;
+    fcr = 0;
+    lcr = 0;
+    mcr = 0;
+    scr = 0;
+    divisor = 1;
+    transmit_interrupt = false;
+}
+
+void uart::set_input_fd(int fd){
+    input_fd = fd;
+    input_closed = false;
+}
+
+void uart::push_input(const void *data, size_t size){
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    pending.insert(pending.end(), p, p + size);
+}
+
+size_t uart::get_input_size(){
+    return fifo.size() + pending.size();
+}
+
+//FIFOに空きがあれば、push_input()の残り、input_fdの順に補充する
+//input_fdは読めるときだけ読むので、ゲストのスレッドは止まらない
+void uart::_fill(){
+    size_t before = fifo.size();
+    while(fifo.size() < UART_FIFO_SIZE && !pending.empty()){
+        fifo.push_back(pending.front());
+        pending.pop_front();
+    }
+    
+    if(fifo.size() < UART_FIFO_SIZE && input_fd >= 0 && !input_closed){
+        struct pollfd entry;
+        entry.fd = input_fd;
+        entry.events = POLLIN;
+        entry.revents = 0;
+        if(poll(&entry, 1, 0) > 0){
+            uint8_t buf[UART_FIFO_SIZE];
+            ssize_t n = read(input_fd, buf, UART_FIFO_SIZE - fifo.size());
+            if(n > 0){
+                fifo.insert(fifo.end(), buf, buf + n);
+            }
+            else if(n == 0 || (errno != EINTR && errno != EAGAIN)){
+                //EOFの後は入力で起きることは無い
+                input_closed = true;
+                version++;
+            }
+        }
+    }
+    
+    if(fifo.size() != before) version++;
+}
+
+//受信FIFOが空なら0を返す(待たない)
+uint8_t uart::_read_data(){
+    _fill();
+    if(fifo.empty()) return 0;
+    
+    uint8_t value = fifo.front();
+    fifo.pop_front();
+    version++;
+    return value;
+}
+
+//受信データが送信の空きより優先
+uint8_t uart::_read_iir(){
+    uint8_t fifo_bits = (fcr & UART_FCR_ENABLE) ? UART_IIR_FIFO_ENABLED : 0;
+    if(ier & UART_IER_RECEIVE){
+        _fill();
+        if(!fifo.empty()) return UART_IIR_RECEIVE | fifo_bits;
+    }
+    //送信の割り込みはIIRで読まれたら下ろす
+    if((ier & UART_IER_TRANSMIT) && transmit_interrupt){
+        transmit_interrupt = false;
+        return UART_IIR_TRANSMIT | fifo_bits;
+    }
+    return UART_IIR_NONE | fifo_bits;
+}
+
+bool uart::get_interrupt(){
+    if(ier & UART_IER_RECEIVE){
+        _fill();
+        if(!fifo.empty()) return true;
+    }
+    return (ier & UART_IER_TRANSMIT) && transmit_interrupt;
+}
+
+bool uart::needs_polling(){
+    return (ier & UART_IER_RECEIVE) && input_fd >= 0 && !input_closed;
+}
+
+void uart::save_state(UartState &state){
+    state.fifo = fifo;
+    state.ier = ier;
+    state.fcr = fcr;
+    state.lcr = lcr;
+    state.mcr = mcr;
+    state.scr = scr;
+    state.divisor = divisor;
+    state.transmit_interrupt = transmit_interrupt;
+}
+
+void uart::restore_state(const UartState &state){
+    fifo = state.fifo;
+    ier = state.ier;
+    fcr = state.fcr;
+    lcr = state.lcr;
+    mcr = state.mcr;
+    scr = state.scr;
+    divisor = state.divisor;
+    transmit_interrupt = state.transmit_interrupt;
+    //FIFOの中身が変わったので、待っているところに見直させる
+    version++;
+}
+
+uint8_t uart::in8(uint16_t port){
+    switch(port - UART_PORT){
+        case UART_DATA:
+            if(lcr & UART_LCR_DLAB) return divisor & 0xFF;
+            return _read_data();
+        case UART_IER:
+            if(lcr & UART_LCR_DLAB) return divisor >> 8;
+            return ier;
+        case UART_IIR:
+            return _read_iir();
+        case UART_LCR:
+            return lcr;
+        case UART_MCR:
+            return mcr;
+        case UART_LSR:
+            _fill();
+            return (fifo.empty() ? 0 : UART_LSR_DATA_READY) | UART_LSR_THR_EMPTY | UART_LSR_TRANSMITTER_EMPTY;
+        case UART_MSR:
+            return UART_MSR_CONNECTED;
+        default:
+            return scr;
+    }
+}
+
+void uart::out8(uint16_t port, uint8_t value){
+    switch(port - UART_PORT){
+        case UART_DATA:
+            if(lcr & UART_LCR_DLAB){
+                divisor = (divisor & 0xFF00) | value;
+                return;
+            }
+            output->write(value);
+            //送信はすぐ終わるので、THRはまた空く
+            transmit_interrupt = true;
+            return;
+        case UART_IER:
+            if(lcr & UART_LCR_DLAB){
+                divisor = (divisor & 0x00FF) | (value << 8);
+                return;
+            }
+            //送信の割り込みを許可した時点でTHRは空いている
+            if((value & UART_IER_TRANSMIT) && !(ier & UART_IER_TRANSMIT)) transmit_interrupt = true;
+            ier = value & 0x0F;
+            return;
+        case UART_IIR:
+            fcr = value;
+            if((value & UART_FCR_CLEAR_RECEIVE) && !fifo.empty()){
+                fifo.clear();
+                version++;
+            }
+            return;
+        case UART_LCR:
+            lcr = value;
+            return;
+        case UART_MCR:
+            mcr = value;
+            return;
+        case UART_SCR:
+            scr = value;
+            return;
+        default:
+            //LSR, MSRへの書き込みは無視する
+            return;
+    }
+}
+
+uint64_t uart::get_version(){
+    return version;
+}
+
+int uart::get_event_fd(){
+    if(input_closed || fifo.size() >= UART_FIFO_SIZE) return -1;
+    return input_fd;
+}